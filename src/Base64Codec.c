@@ -0,0 +1,570 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <MI.h>
+#include "Base64Codec.h"
+#include "CpuFeatures.h"
+
+/* Base64 encoding and decoding for the Send/Receive data path.
+ * Both directions work on whole blocks with SSSE3 (12 bytes <-> 16 characters),
+ * AVX2 (24 bytes <-> 32 characters) or AVX-512 VBMI (48 bytes <-> 64 characters)
+ * when the CPU has them, using the lookups described by Wojciech Mula and Daniel
+ * Lemire. Decoding only takes the vector path for blocks of plain alphabet
+ * characters; padding, whitespace and invalid characters are all handled by the
+ * scalar loop, which is also the fallback for other CPUs. CpuFeatures_Init picks
+ * the block kernels once.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#include <immintrin.h>
+#define BASE64_SIMD
+#endif
+
+#if defined(BASE64_SIMD) && (defined(__clang__) || (__GNUC__ >= 8))
+#define BASE64_AVX512
+#endif
+
+static const char s_encodeTable[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define XX 0x80 /* not part of the alphabet */
+#define WS 0x81 /* whitespace, skipped */
+#define PD 0x82 /* padding */
+
+static const MI_Uint8 s_decodeTable[256] =
+{
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   WS,   WS,   XX,   XX,   WS,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      WS,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX, 0x3E,   XX,   XX,   XX, 0x3F,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D,   XX,   XX,   XX,   PD,   XX,   XX,
+      XX, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+    0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,   XX,   XX,   XX,   XX,   XX,
+      XX, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+      XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,   XX,
+};
+
+/* Block kernels encode or decode as much of the input as they can in whole vectors
+ * and return how much they consumed; the scalar code finishes the rest.
+ */
+typedef size_t (*EncodeBlocksProc)(const MI_Uint8 *from, size_t length, char *to);
+typedef size_t (*DecodeBlocksProc)(const char *from, size_t length, MI_Uint8 *to, size_t toLength);
+
+static EncodeBlocksProc s_encodeBlocks = NULL;
+static DecodeBlocksProc s_decodeBlocks = NULL;
+
+static size_t EncodeBlocksNone(const MI_Uint8 *from, size_t length, char *to)
+{
+    (void)from;
+    (void)length;
+    (void)to;
+    return 0;
+}
+
+static size_t DecodeBlocksNone(const char *from, size_t length, MI_Uint8 *to, size_t toLength)
+{
+    (void)from;
+    (void)length;
+    (void)to;
+    (void)toLength;
+    return 0;
+}
+
+#if defined(BASE64_SIMD)
+
+/* EncodeIndicesSsse3
+ * Spreads 12 input bytes (already shuffled into place) to sixteen 6-bit indices
+ * and maps each index to its alphabet character.
+ */
+__attribute__((target("ssse3")))
+static __m128i EncodeIndicesSsse3(__m128i in)
+{
+    const __m128i shiftLut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shiftLut, result), indices);
+}
+
+__attribute__((target("ssse3")))
+static size_t EncodeSsse3(const MI_Uint8 *from, size_t length, char *to)
+{
+    const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    size_t done = 0;
+
+    /* Each block reads 16 bytes but only consumes 12 */
+    while ((length - done) >= 16)
+    {
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(from + done)), shuffle);
+        _mm_storeu_si128((__m128i*)to, EncodeIndicesSsse3(in));
+        to += 16;
+        done += 12;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t EncodeAvx2(const MI_Uint8 *from, size_t length, char *to)
+{
+    const __m256i shuffle = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shiftLut = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    size_t done = 0;
+
+    /* Each block reads 28 bytes but only consumes 24, 12 per 128-bit lane */
+    while ((length - done) >= 28)
+    {
+        __m256i in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(from + done))),
+            _mm_loadu_si128((const __m128i*)(from + done + 12)), 1);
+        __m256i t0, t1, t2, t3, indices, result, less;
+
+        in = _mm256_shuffle_epi8(in, shuffle);
+        t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        indices = _mm256_or_si256(t1, t3);
+        result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_add_epi8(_mm256_shuffle_epi8(shiftLut, result), indices);
+
+        _mm256_storeu_si256((__m256i*)to, result);
+        to += 32;
+        done += 24;
+    }
+    return done;
+}
+
+/* DecodeSsse3
+ * Decodes 16 characters at a time into 12 bytes. Stops at the first block holding
+ * anything other than alphabet characters. Each store writes 16 bytes so the
+ * destination needs 4 bytes of slack beyond the decoded data.
+ */
+__attribute__((target("ssse3")))
+static size_t DecodeSsse3(const char *from, size_t length, MI_Uint8 *to, size_t toLength)
+{
+    const __m128i lutLo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask2F = _mm_set1_epi8(0x2F);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i zero = _mm_setzero_si128();
+    size_t done = 0;
+    size_t written = 0;
+
+    while ((length - done) >= 16 && (toLength - written) >= 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i*)(from + done));
+        __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask2F);
+        __m128i loNibbles = _mm_and_si128(in, mask2F);
+        __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+        __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+        __m128i roll;
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), zero)) != 0xFFFF)
+            break;
+
+        roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask2F), hiNibbles));
+        in = _mm_add_epi8(in, roll);
+        in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+        in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)(to + written), _mm_shuffle_epi8(in, pack));
+
+        done += 16;
+        written += 12;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t DecodeAvx2(const char *from, size_t length, MI_Uint8 *to, size_t toLength)
+{
+    const __m256i lutLo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i gather = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t done = 0;
+    size_t written = 0;
+
+    while ((length - done) >= 32 && (toLength - written) >= 32)
+    {
+        __m256i in = _mm256_loadu_si256((const __m256i*)(from + done));
+        __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+        __m256i loNibbles = _mm256_and_si256(in, mask2F);
+        __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+        __m256i roll;
+
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+
+        roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask2F), hiNibbles));
+        in = _mm256_add_epi8(in, roll);
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+        in = _mm256_shuffle_epi8(in, pack);
+        _mm256_storeu_si256((__m256i*)(to + written), _mm256_permutevar8x32_epi32(in, gather));
+
+        done += 32;
+        written += 24;
+    }
+    return done;
+}
+
+#if defined(BASE64_AVX512)
+
+/* Input bytes for each 4 character group, in the order the multishift wants them */
+static const MI_Uint8 s_encodeShuffleAvx512[64] =
+{
+     1,  0,  2,  1,  4,  3,  5,  4,  7,  6,  8,  7, 10,  9, 11, 10,
+    13, 12, 14, 13, 16, 15, 17, 16, 19, 18, 20, 19, 22, 21, 23, 22,
+    25, 24, 26, 25, 28, 27, 29, 28, 31, 30, 32, 31, 34, 33, 35, 34,
+    37, 36, 38, 37, 40, 39, 41, 40, 43, 42, 44, 43, 46, 45, 47, 46,
+};
+
+/* The three data bytes of each 32-bit group, most significant first */
+static const MI_Uint8 s_decodePackAvx512[64] =
+{
+     2,  1,  0,  6,  5,  4, 10,  9,  8, 14, 13, 12, 18, 17, 16, 22,
+    21, 20, 26, 25, 24, 30, 29, 28, 34, 33, 32, 38, 37, 36, 42, 41,
+    40, 46, 45, 44, 50, 49, 48, 54, 53, 52, 58, 57, 56, 62, 61, 60,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+/* EncodeAvx512
+ * Encodes 48 bytes at a time into 64 characters. vpmultishiftqb pulls each 6-bit
+ * index straight out of the shuffled input and vpermb maps it to its character.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static size_t EncodeAvx512(const MI_Uint8 *from, size_t length, char *to)
+{
+    const __m512i shuffle = _mm512_loadu_si512((const void*)s_encodeShuffleAvx512);
+    const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040aLL);
+    const __m512i lookup = _mm512_loadu_si512((const void*)s_encodeTable);
+    size_t done = 0;
+
+    /* Each block reads 64 bytes but only consumes 48 */
+    while ((length - done) >= 64)
+    {
+        __m512i in = _mm512_permutexvar_epi8(shuffle, _mm512_loadu_si512((const void*)(from + done)));
+        __m512i indices = _mm512_multishift_epi64_epi8(shifts, in);
+
+        _mm512_storeu_si512((void*)to, _mm512_permutexvar_epi8(indices, lookup));
+        to += 64;
+        done += 48;
+    }
+    return done;
+}
+
+/* DecodeAvx512
+ * Decodes 64 characters at a time into 48 bytes, looking every character up in the
+ * low half of the scalar decode table with vpermi2b. Stops at the first block
+ * holding anything other than alphabet characters. Each store writes 64 bytes so
+ * the destination needs 16 bytes of slack beyond the decoded data.
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static size_t DecodeAvx512(const char *from, size_t length, MI_Uint8 *to, size_t toLength)
+{
+    const __m512i lookupLo = _mm512_loadu_si512((const void*)s_decodeTable);
+    const __m512i lookupHi = _mm512_loadu_si512((const void*)(s_decodeTable + 64));
+    const __m512i pack = _mm512_loadu_si512((const void*)s_decodePackAvx512);
+    size_t done = 0;
+    size_t written = 0;
+
+    while ((length - done) >= 64 && (toLength - written) >= 64)
+    {
+        __m512i in = _mm512_loadu_si512((const void*)(from + done));
+        __m512i values = _mm512_permutex2var_epi8(lookupLo, in, lookupHi);
+
+        /* Anything outside the alphabet, including characters above 0x7F, has the top bit set */
+        if (_mm512_movepi8_mask(_mm512_or_si512(values, in)) != 0)
+            break;
+
+        values = _mm512_maddubs_epi16(values, _mm512_set1_epi32(0x01400140));
+        values = _mm512_madd_epi16(values, _mm512_set1_epi32(0x00011000));
+        _mm512_storeu_si512((void*)(to + written), _mm512_permutexvar_epi8(pack, values));
+
+        done += 64;
+        written += 48;
+    }
+    return done;
+}
+
+#endif /* BASE64_AVX512 */
+
+/* Wider kernels leave blocks that are too short for them to the narrower ones */
+static size_t EncodeBlocksSsse3(const MI_Uint8 *from, size_t length, char *to)
+{
+    return EncodeSsse3(from, length, to);
+}
+
+static size_t EncodeBlocksAvx2(const MI_Uint8 *from, size_t length, char *to)
+{
+    size_t done = EncodeAvx2(from, length, to);
+
+    return done + EncodeBlocksSsse3(from + done, length - done, to + (done / 3) * 4);
+}
+
+static size_t DecodeBlocksSsse3(const char *from, size_t length, MI_Uint8 *to, size_t toLength)
+{
+    return DecodeSsse3(from, length, to, toLength);
+}
+
+static size_t DecodeBlocksAvx2(const char *from, size_t length, MI_Uint8 *to, size_t toLength)
+{
+    size_t done = DecodeAvx2(from, length, to, toLength);
+
+    return done + DecodeBlocksSsse3(from + done, length - done, to + (done / 4) * 3, toLength - (done / 4) * 3);
+}
+
+#if defined(BASE64_AVX512)
+
+static size_t EncodeBlocksAvx512(const MI_Uint8 *from, size_t length, char *to)
+{
+    size_t done = EncodeAvx512(from, length, to);
+
+    return done + EncodeBlocksAvx2(from + done, length - done, to + (done / 3) * 4);
+}
+
+static size_t DecodeBlocksAvx512(const char *from, size_t length, MI_Uint8 *to, size_t toLength)
+{
+    size_t done = DecodeAvx512(from, length, to, toLength);
+
+    return done + DecodeBlocksAvx2(from + done, length - done, to + (done / 4) * 3, toLength - (done / 4) * 3);
+}
+
+#endif /* BASE64_AVX512 */
+
+#endif /* BASE64_SIMD */
+
+void Base64Codec_SelectKernels(MI_Uint32 features)
+{
+    s_encodeBlocks = EncodeBlocksNone;
+    s_decodeBlocks = DecodeBlocksNone;
+#if defined(BASE64_AVX512)
+    if (features & CPU_FEATURE_AVX512VBMI)
+    {
+        s_encodeBlocks = EncodeBlocksAvx512;
+        s_decodeBlocks = DecodeBlocksAvx512;
+        return;
+    }
+#endif
+#if defined(BASE64_SIMD)
+    if (features & CPU_FEATURE_AVX2)
+    {
+        s_encodeBlocks = EncodeBlocksAvx2;
+        s_decodeBlocks = DecodeBlocksAvx2;
+    }
+    else if (features & CPU_FEATURE_SSSE3)
+    {
+        s_encodeBlocks = EncodeBlocksSsse3;
+        s_decodeBlocks = DecodeBlocksSsse3;
+    }
+#endif
+    (void)features;
+}
+
+size_t Base64EncodedLength(size_t length)
+{
+    return ((length + 2) / 3) * 4;
+}
+
+void Base64EncodeBytes(const MI_Uint8 *from, size_t length, char *to)
+{
+    size_t done;
+
+    CpuFeatures_Init();
+
+    done = s_encodeBlocks(from, length, to);
+    to += (done / 3) * 4;
+
+    while ((length - done) >= 3)
+    {
+        MI_Uint32 triple = (from[done] << 16) | (from[done + 1] << 8) | from[done + 2];
+
+        to[0] = s_encodeTable[(triple >> 18) & 0x3F];
+        to[1] = s_encodeTable[(triple >> 12) & 0x3F];
+        to[2] = s_encodeTable[(triple >> 6) & 0x3F];
+        to[3] = s_encodeTable[triple & 0x3F];
+        to += 4;
+        done += 3;
+    }
+
+    if ((length - done) == 1)
+    {
+        to[0] = s_encodeTable[from[done] >> 2];
+        to[1] = s_encodeTable[(from[done] & 0x03) << 4];
+        to[2] = '=';
+        to[3] = '=';
+    }
+    else if ((length - done) == 2)
+    {
+        to[0] = s_encodeTable[from[done] >> 2];
+        to[1] = s_encodeTable[((from[done] & 0x03) << 4) | (from[done + 1] >> 4)];
+        to[2] = s_encodeTable[(from[done + 1] & 0x0F) << 2];
+        to[3] = '=';
+    }
+}
+
+size_t Base64DecodedLength(const char *from, size_t length)
+{
+    size_t decodedLength = ((length + 3) / 4) * 3;
+
+    /* Trailing padding (and any whitespace around it) does not produce data */
+    while (length && s_decodeTable[(MI_Uint8)from[length - 1]] == WS)
+        length--;
+    if (length && from[length - 1] == '=')
+    {
+        decodedLength--;
+        length--;
+        while (length && s_decodeTable[(MI_Uint8)from[length - 1]] == WS)
+            length--;
+        if (length && from[length - 1] == '=')
+            decodedLength--;
+    }
+    return decodedLength;
+}
+
+MI_Boolean Base64DecodeBytes(const char *from, size_t length, MI_Uint8 *to, size_t toLength, size_t *toUsed)
+{
+    const MI_Uint8 *in = (const MI_Uint8*)from;
+    const MI_Uint8 *inEnd = in + length;
+    MI_Uint8 *out = to;
+    MI_Uint8 *outEnd = to + toLength;
+    MI_Uint32 quantum = 0;
+    int count = 0;
+    int padding = 0;
+    MI_Boolean finished = MI_FALSE;
+    size_t done;
+
+    CpuFeatures_Init();
+
+    done = s_decodeBlocks(from, length, to, toLength);
+    in += done;
+    out += (done / 4) * 3;
+
+    /* Whole quanta of alphabet characters */
+    while ((inEnd - in) >= 4 && (outEnd - out) >= 3)
+    {
+        MI_Uint32 a = s_decodeTable[in[0]];
+        MI_Uint32 b = s_decodeTable[in[1]];
+        MI_Uint32 c = s_decodeTable[in[2]];
+        MI_Uint32 d = s_decodeTable[in[3]];
+
+        if ((a | b | c | d) & 0x80)
+            break;
+
+        quantum = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = (MI_Uint8)(quantum >> 16);
+        out[1] = (MI_Uint8)(quantum >> 8);
+        out[2] = (MI_Uint8)quantum;
+        out += 3;
+        in += 4;
+    }
+
+    /* Whatever is left one character at a time, dealing with whitespace and padding */
+    quantum = 0;
+    while (in < inEnd)
+    {
+        MI_Uint8 value = s_decodeTable[*in++];
+
+        if (value == WS)
+            continue;
+
+        if (finished || value == XX)
+            return MI_FALSE;
+
+        if (value == PD)
+        {
+            /* Padding can only replace the last one or two characters of a quantum */
+            if (count < 2)
+                return MI_FALSE;
+            padding++;
+            quantum <<= 6;
+        }
+        else
+        {
+            if (padding)
+                return MI_FALSE;
+            quantum = (quantum << 6) | value;
+        }
+
+        if (++count == 4)
+        {
+            if ((outEnd - out) < (3 - padding))
+                return MI_FALSE;
+
+            out[0] = (MI_Uint8)(quantum >> 16);
+            if (padding < 2)
+                out[1] = (MI_Uint8)(quantum >> 8);
+            if (padding < 1)
+                out[2] = (MI_Uint8)quantum;
+            out += 3 - padding;
+
+            finished = (padding != 0);
+            quantum = 0;
+            count = 0;
+        }
+    }
+
+    if (count != 0)
+        return MI_FALSE;
+
+    if (toUsed)
+        *toUsed = out - to;
+    return MI_TRUE;
+}
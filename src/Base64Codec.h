@@ -0,0 +1,40 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _Base64Codec_h_
+#define _Base64Codec_h_
+#include <MI.h>
+
+/* Base64EncodedLength
+ * Exact number of characters Base64EncodeBytes produces for length bytes, not
+ * including any null terminator.
+ */
+size_t Base64EncodedLength(size_t length);
+
+/* Base64EncodeBytes
+ * Encodes length bytes into Base64EncodedLength(length) characters at to, with
+ * padding. No null terminator is written.
+ */
+void Base64EncodeBytes(const MI_Uint8 *from, size_t length, char *to);
+
+/* Base64DecodedLength
+ * Number of bytes Base64DecodeBytes produces for the encoded text. This is exact
+ * for text without embedded whitespace and an upper bound otherwise.
+ */
+size_t Base64DecodedLength(const char *from, size_t length);
+
+/* Base64DecodeBytes
+ * Decodes length characters of padded base64 text into to, which has room for
+ * toLength bytes. Whitespace between characters is skipped. Returns MI_FALSE if
+ * the text is malformed or the destination is too small. On success toUsed (if
+ * not NULL) receives the number of bytes written.
+ */
+MI_Boolean Base64DecodeBytes(const char *from, size_t length, MI_Uint8 *to, size_t toLength, size_t *toUsed);
+
+#endif /* _Base64Codec_h_ */
@@ -8,323 +8,1747 @@
 */
 
 #include <MI.h>
-#include <iconv.h>
+#include <unistd.h>
+#include <strings.h>
+#include <pal/atomic.h>
+#include <pthread.h>
 #include "xpress.h"
-#include <base/base64.h>
+#include "Transcode.h"
+#include "Base64Codec.h"
 #include "BufferManipulation.h"
+#include "Utilities.h"
+#include "WorkerPool.h"
 
 #define GOTO_ERROR(result) { miResult = result; goto error; }
 
-static MI_Boolean ConvertString(Batch *batch,
-                         char *fromFormat,
-                         char *toFormat,
-                         const char *from,
-                         size_t fromBuffLen,
-                         char **to,
-                         size_t toBuffLen)
+MI_Boolean Utf8ToUtf16Le(Batch *batch, const char *from, MI_Char16 **to)
+{
+    /* Every UTF-8 byte produces at most one UTF-16 code unit */
+    size_t fromBuffLen = strlen(from)+1;
+
+    *to = Batch_Get(batch, fromBuffLen*sizeof(MI_Char16));
+    if (*to == NULL)
+        return MI_FALSE;
+
+    return Utf8ToUtf16LeBuffer(from, fromBuffLen, *to, fromBuffLen, NULL);
+}
+
+size_t Utf16LeStrLenBytes(const MI_Char16* str)
+{
+    size_t len = 0;
+
+    while (str[len] != 0 )
+    {
+        len++;
+    }
+
+    return (len+1)*2; /* Return null terminator length as well */
+}
+MI_Boolean Utf16LeToUtf8(Batch *batch, const MI_Char16 *from, char **to)
+{
+    size_t fromBuffLen = Utf16LeStrLenBytes(from)/sizeof(MI_Char16);
+
+    /* Non-ASCII characters take more than one byte so size for the worst case */
+    *to = Batch_Get(batch, fromBuffLen*UTF8_BYTES_PER_UTF16_UNIT);
+    if (*to == NULL)
+        return MI_FALSE;
+
+    return Utf16LeToUtf8Buffer(from, fromBuffLen, *to, fromBuffLen*UTF8_BYTES_PER_UTF16_UNIT, NULL);
+}
+
+/* Base64DecodeBuffer
+* Decodes the base64 text into a newly allocated buffer sized exactly for the
+* decoded data. The caller needs to free the buffer.
+*/
+MI_Result Base64DecodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
+{
+    size_t decodedLength;
+
+    toBuffer->bufferLength = Base64DecodedLength(fromBuffer->buffer, fromBuffer->bufferLength);
+    toBuffer->bufferUsed = 0;
+    toBuffer->buffer = malloc(toBuffer->bufferLength ? toBuffer->bufferLength : 1);
+
+    if (toBuffer->buffer == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    if (!Base64DecodeBytes(fromBuffer->buffer,
+        fromBuffer->bufferLength,
+        (MI_Uint8*)toBuffer->buffer,
+        toBuffer->bufferLength,
+        &decodedLength))
+    {
+        free(toBuffer->buffer);
+        toBuffer->buffer = NULL;
+        return MI_RESULT_FAILED;
+    }
+    toBuffer->bufferUsed = decodedLength;
+    return MI_RESULT_OK;
+}
+
+/* Base64EncodeBuffer
+* Encodes the buffer into a newly allocated, null terminated base64 string. The
+* terminator is not included in bufferUsed. The caller needs to free the buffer.
+*/
+MI_Result Base64EncodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
+{
+    size_t encodedLength = Base64EncodedLength(fromBuffer->bufferUsed);
+
+    toBuffer->bufferLength = encodedLength + sizeof(MI_Char);
+    toBuffer->bufferUsed = 0;
+    toBuffer->buffer = malloc(toBuffer->bufferLength);
+
+    if (toBuffer->buffer == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    Base64EncodeBytes((const MI_Uint8*)fromBuffer->buffer, fromBuffer->bufferUsed, toBuffer->buffer);
+    toBuffer->buffer[encodedLength] = MI_T('\0');
+    toBuffer->bufferUsed = encodedLength;
+
+    return MI_RESULT_OK;
+}
+
+/* DecodeBufferChain_Init
+* Sets up an empty chain. Nothing is allocated until data is added.
+*/
+void DecodeBufferChain_Init(DecodeBufferChain *chain, MI_Uint32 segmentLength)
+{
+    memset(chain, 0, sizeof(*chain));
+    chain->segmentLength = segmentLength;
+}
+
+void DecodeBufferChain_Free(DecodeBufferChain *chain)
+{
+    DecodeBufferSegment *segment = chain->first;
+
+    while (segment)
+    {
+        DecodeBufferSegment *next = segment->next;
+        free(segment);
+        segment = next;
+    }
+    chain->first = NULL;
+    chain->last = NULL;
+    chain->bufferUsed = 0;
+}
+
+/* Adds a new empty segment with room for at least length bytes to the end of the chain */
+static DecodeBufferSegment *DecodeBufferChain_AddSegment(DecodeBufferChain *chain, MI_Uint32 length)
+{
+    DecodeBufferSegment *segment;
+
+    if (length < chain->segmentLength)
+        length = chain->segmentLength;
+
+    segment = malloc(sizeof(DecodeBufferSegment) + length);
+    if (segment == NULL)
+        return NULL;
+
+    segment->next = NULL;
+    segment->data = (MI_Uint8*)(segment + 1);
+    segment->segmentLength = length;
+    segment->segmentUsed = 0;
+
+    if (chain->last)
+        chain->last->next = segment;
+    else
+        chain->first = segment;
+    chain->last = segment;
+    return segment;
+}
+
+/* DecodeBufferChain_Reserve
+* Returns space for length contiguous bytes at the end of the chain, starting a new
+* segment if the last one does not have enough room left. Nothing is counted as
+* used until DecodeBufferChain_Commit is called. Returns NULL if out of memory.
+*/
+MI_Uint8 *DecodeBufferChain_Reserve(DecodeBufferChain *chain, MI_Uint32 length)
+{
+    DecodeBufferSegment *segment = chain->last;
+
+    if (segment == NULL || (segment->segmentLength - segment->segmentUsed) < length)
+    {
+        segment = DecodeBufferChain_AddSegment(chain, length);
+        if (segment == NULL)
+            return NULL;
+    }
+    return segment->data + segment->segmentUsed;
+}
+
+void DecodeBufferChain_Commit(DecodeBufferChain *chain, MI_Uint32 length)
+{
+    chain->last->segmentUsed += length;
+    chain->bufferUsed += length;
+}
+
+/* DecodeBufferChain_Append
+* Copies data onto the end of the chain, filling up the last segment before starting
+* new ones.
+*/
+MI_Result DecodeBufferChain_Append(DecodeBufferChain *chain, const MI_Uint8 *data, MI_Uint32 length)
+{
+    while (length)
+    {
+        DecodeBufferSegment *segment = chain->last;
+        MI_Uint32 count;
+
+        if (segment == NULL || segment->segmentUsed == segment->segmentLength)
+        {
+            segment = DecodeBufferChain_AddSegment(chain, 0);
+            if (segment == NULL)
+                return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+
+        count = segment->segmentLength - segment->segmentUsed;
+        if (count > length)
+            count = length;
+
+        memcpy(segment->data + segment->segmentUsed, data, count);
+        segment->segmentUsed += count;
+        chain->bufferUsed += count;
+        data += count;
+        length -= count;
+    }
+    return MI_RESULT_OK;
+}
+
+/* Base64EncodeChain
+* Same as Base64EncodeBuffer but for data held in a chain. The result is a single
+* null terminated string of exactly the encoded size. The terminator is not included
+* in bufferUsed. The caller needs to free the buffer.
+*/
+MI_Result Base64EncodeChain(DecodeBufferChain *fromChain, DecodeBuffer *toBuffer)
+{
+    DecodeBufferSegment *segment;
+    MI_Uint8 carry[3];
+    size_t carryUsed = 0;
+    size_t encodedLength = Base64EncodedLength(fromChain->bufferUsed);
+    char *toBufferCursor;
+
+    toBuffer->bufferLength = encodedLength + sizeof(MI_Char);
+    toBuffer->bufferUsed = 0;
+    toBuffer->buffer = malloc(toBuffer->bufferLength);
+
+    if (toBuffer->buffer == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    toBufferCursor = toBuffer->buffer;
+
+    /* Each segment is encoded in whole 3 byte quanta. Bytes that do not make up a full
+    * quantum at the end of a segment are carried over to the start of the next one.
+    */
+    DecodeBufferChain_ForEach(fromChain, segment)
+    {
+        const MI_Uint8 *data = segment->data;
+        size_t length = segment->segmentUsed;
+        size_t wholeLength;
+
+        while (carryUsed && (carryUsed < 3) && length)
+        {
+            carry[carryUsed++] = *data++;
+            length--;
+        }
+        if (carryUsed == 3)
+        {
+            Base64EncodeBytes(carry, 3, toBufferCursor);
+            toBufferCursor += 4;
+            carryUsed = 0;
+        }
+
+        wholeLength = length - (length % 3);
+        Base64EncodeBytes(data, wholeLength, toBufferCursor);
+        toBufferCursor += Base64EncodedLength(wholeLength);
+
+        while (wholeLength < length)
+            carry[carryUsed++] = data[wholeLength++];
+    }
+
+    if (carryUsed)
+    {
+        Base64EncodeBytes(carry, carryUsed, toBufferCursor);
+        toBufferCursor += 4;
+    }
+
+    *toBufferCursor = MI_T('\0');
+    toBuffer->bufferUsed = encodedLength;
+
+    return MI_RESULT_OK;
+}
+
+/* Compression of buffers splits the data into chunks. The code compressed 64K at a time and
+* prepends the CompressionHeader structure to hold the original uncompressed size and the
+* compressed size.
+* NOTE: The original protocol has a bug in it such that the two sizes are encoded incorrectly.
+*       The sizes in the protocol are 1 less than they actually are so the sizes need to be
+*       adjusted accordingly.
+*/
+typedef struct _CompressionHeader
+{
+    USHORT originalSize;
+    USHORT compressedSize;
+} CompressionHeader;
+
+/* Maximum concompressed buffer size is 64K */
+#define MAX_COMPRESS_BUFFER_BLOCK (64*1024)
+
+/* A staging buffer holds one chunk with its header plus up to two bytes carried over
+* from the previous chunk by CompressBase64EncodeBuffer.
+*/
+#define STAGING_BUFFER_SIZE (2 + sizeof(CompressionHeader) + MAX_COMPRESS_BUFFER_BLOCK)
+
+/* Every cached buffer starts with a header holding its size, so a buffer that is too
+* small for the caller, such as a workspace sized for another compression level, is
+* never handed out. The header keeps the buffer itself aligned the way malloc does.
+*/
+#define CACHE_BUFFER_HEADER_SIZE 16
+
+/* CompressionCache_Get
+* Checks a buffer of at least size bytes out of a cache slot, or allocates a new one
+* if the slot is empty or holds one that is too small.
+*/
+static void *CompressionCache_Get(ptrdiff_t *slot, size_t size)
+{
+    MI_Uint8 *block = (MI_Uint8*) Atomic_Swap(slot, (ptrdiff_t) NULL);
+
+    if (block && (*(size_t*)block < size))
+    {
+        free(block);
+        block = NULL;
+    }
+    if (block == NULL)
+    {
+        block = malloc(CACHE_BUFFER_HEADER_SIZE + size);
+        if (block == NULL)
+            return NULL;
+        *(size_t*)block = size;
+    }
+    return block + CACHE_BUFFER_HEADER_SIZE;
+}
+
+/* CompressionCache_Put
+* Returns a buffer to its cache slot. If another caller has already refilled the
+* slot the buffer is freed instead.
+*/
+static void CompressionCache_Put(ptrdiff_t *slot, void *buffer)
+{
+    MI_Uint8 *block;
+
+    if (buffer == NULL)
+        return;
+
+    block = (MI_Uint8*) buffer - CACHE_BUFFER_HEADER_SIZE;
+    if (Atomic_CompareAndSwap(slot, (ptrdiff_t) NULL, (ptrdiff_t) block) != (ptrdiff_t) NULL)
+        free(block);
+}
+
+void CompressionCache_Free(CompressionCache *cache)
+{
+    free((void*) Atomic_Swap(&cache->compressWorkspace, (ptrdiff_t) NULL));
+    free((void*) Atomic_Swap(&cache->decompressWorkspace, (ptrdiff_t) NULL));
+    free((void*) Atomic_Swap(&cache->staging, (ptrdiff_t) NULL));
+}
+
+/* CompressionLevelFromMode
+* Picks the compression level for a shell from the CompressionMode it was created with.
+* Clients normally just ask for XpressCompression, which gets the site wide level from
+* PSRP_COMPRESSION_LEVEL (0 default, 1 fast, 2 high). A client can ask for a level
+* itself with XpressCompressionFast or XpressCompressionHigh.
+*/
+MI_Uint32 CompressionLevelFromMode(const MI_Char *compressionMode)
+{
+    if (compressionMode && (strcasecmp(compressionMode, "XpressCompressionFast") == 0))
+        return XPRESS_LEVEL_FAST;
+    if (compressionMode && (strcasecmp(compressionMode, "XpressCompressionHigh") == 0))
+        return XPRESS_LEVEL_HIGH;
+    return _GetTunableFromEnvironment("PSRP_COMPRESSION_LEVEL", XPRESS_LEVEL_DEFAULT, XPRESS_LEVEL_DEFAULT, XPRESS_LEVEL_HIGH);
+}
+
+static size_t min(size_t a, size_t b)
+{
+    if (a < b)
+        return a;
+    else
+        return b;
+}
+
+/* Chunks are independent of each other so big buffers can be worked on by several
+* threads at once. Each thread takes the next unclaimed chunk until there are none
+* left. The calling thread takes part as well, using the workspace it already has;
+* the other threads allocate their own.
+*/
+
+/* Upper limit on the number of threads working on one buffer */
+#define MAX_CHUNK_THREADS 16
+
+typedef MI_Result (*ChunkProc)(void *context, MI_Uint32 chunk, void *workspace, MI_Uint8 *staging);
+
+typedef struct _ChunkJob
+{
+    ChunkProc proc;
+    void *context;
+    MI_Uint32 numChunks;
+    size_t workspaceSize;
+    size_t stagingSize;
+
+    /* Next chunk to hand out, and the first failure if any */
+    ptrdiff_t nextChunk;
+    ptrdiff_t result;
+
+    /* Posted once by each task as it finishes */
+    Sem finished;
+} ChunkJob;
+
+/* Helps a ChunkJob on a thread from the chunk pool */
+typedef struct _ChunkTask
+{
+    WorkItem item;
+    ChunkJob *job;
+} ChunkTask;
+
+/* Threads shared by every compress and decompress in the process, and the number of
+ * ChunkPool_Start calls not yet matched by a ChunkPool_Stop.
+ */
+static WorkerPool g_chunkPool;
+static MI_Uint32 g_chunkPoolUsers;
+static ptrdiff_t g_chunkPoolRunning;
+static pthread_mutex_t g_chunkPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ChunkJob_Work(ChunkJob *job, void *workspace, MI_Uint8 *staging)
+{
+    for (;;)
+    {
+        ptrdiff_t chunk = Atomic_Inc(&job->nextChunk) - 1;
+        MI_Result miResult;
+
+        if ((chunk >= (ptrdiff_t)job->numChunks) || (Atomic_Read(&job->result) != MI_RESULT_OK))
+            break;
+
+        miResult = job->proc(job->context, (MI_Uint32)chunk, workspace, staging);
+        if (miResult != MI_RESULT_OK)
+        {
+            Atomic_CompareAndSwap(&job->result, MI_RESULT_OK, miResult);
+            break;
+        }
+    }
+}
+
+static void ChunkTask_Run(WorkItem *item)
+{
+    ChunkJob *job = ((ChunkTask*) item)->job;
+    void *workspace = malloc(job->workspaceSize + job->stagingSize);
+
+    /* If we cannot get a workspace the other threads will pick up the chunks */
+    if (workspace)
+    {
+        ChunkJob_Work(job, workspace, (MI_Uint8*)workspace + job->workspaceSize);
+        free(workspace);
+    }
+}
+
+/* The task and the job go away once the caller has seen every task finish, so this is
+ * only done from release, the last thing the pool does with the item.
+ */
+static void ChunkTask_Release(WorkItem *item)
+{
+    Sem_Post(&((ChunkTask*) item)->job->finished, 1);
+}
+
+/* ChunkJob_Run
+* Runs proc over every chunk using up to maxThreads threads including the caller. The
+* extra threads come from the chunk pool, and only the ones that are free right now, so
+* when other buffers are keeping the pool busy the caller does the chunks on its own.
+* Each pool thread gets a workspace of workspaceSize bytes and a staging buffer of
+* stagingSize bytes; the caller passes in its own.
+*/
+static MI_Result ChunkJob_Run(ChunkJob *job, void *workspace, MI_Uint8 *staging, MI_Uint32 maxThreads)
+{
+    ChunkTask tasks[MAX_CHUNK_THREADS];
+    MI_Uint32 numTasks = 0;
+    MI_Uint32 i;
+
+    job->nextChunk = 0;
+    job->result = MI_RESULT_OK;
+
+    if (maxThreads > job->numChunks)
+        maxThreads = job->numChunks;
+
+    if ((maxThreads > 1) && Atomic_Read(&g_chunkPoolRunning) && (Sem_Init(&job->finished, 0, 0) == 0))
+    {
+        while ((numTasks + 1) < maxThreads)
+        {
+            tasks[numTasks].item.run = ChunkTask_Run;
+            tasks[numTasks].item.release = ChunkTask_Release;
+            tasks[numTasks].job = job;
+            if (!WorkerPool_PostIfIdle(&g_chunkPool, &tasks[numTasks].item))
+                break;
+            numTasks++;
+        }
+        if (numTasks == 0)
+            Sem_Destroy(&job->finished);
+    }
+
+    ChunkJob_Work(job, workspace, staging);
+
+    if (numTasks)
+    {
+        for (i = 0; i < numTasks; i++)
+        {
+            Sem_Wait(&job->finished);
+        }
+        Sem_Destroy(&job->finished);
+    }
+
+    /* A worker may have stopped early without a workspace, so make sure every chunk was done */
+    if (job->result == MI_RESULT_OK)
+        ChunkJob_Work(job, workspace, staging);
+
+    return (MI_Result) job->result;
+}
+
+/* Number of threads to compress or decompress a buffer with. Defaults to the number of
+* processors, and can be overridden with PSRP_CHUNK_THREADS. One means no extra threads.
+*/
+static MI_Uint32 GetChunkThreads()
+{
+    static MI_Uint32 chunkThreads = 0;
+
+    if (chunkThreads == 0)
+    {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        MI_Uint32 defaultThreads = 1;
+
+        if (processors > 1)
+            defaultThreads = (MI_Uint32) min((size_t)processors, MAX_CHUNK_THREADS);
+        chunkThreads = _GetTunableFromEnvironment("PSRP_CHUNK_THREADS", defaultThreads, 1, MAX_CHUNK_THREADS);
+    }
+    return chunkThreads;
+}
+
+MI_Result ChunkPool_Start()
+{
+    MI_Result miResult = MI_RESULT_OK;
+
+    pthread_mutex_lock(&g_chunkPoolLock);
+    if (g_chunkPoolUsers == 0)
+    {
+        /* The caller does a share of every buffer itself, so the pool has one less */
+        MI_Uint32 threadCount = GetChunkThreads() - 1;
+
+        if (threadCount)
+        {
+            miResult = WorkerPool_Start(&g_chunkPool, "chunk", threadCount, threadCount, 0 /* idleMilliseconds */);
+            if (miResult == MI_RESULT_OK)
+                Atomic_Swap(&g_chunkPoolRunning, 1);
+        }
+    }
+    /* Counted even if the threads did not start, so Stop always pairs with Start */
+    g_chunkPoolUsers++;
+    pthread_mutex_unlock(&g_chunkPoolLock);
+
+    return miResult;
+}
+
+void ChunkPool_Stop()
+{
+    pthread_mutex_lock(&g_chunkPoolLock);
+    if (g_chunkPoolUsers && (--g_chunkPoolUsers == 0) && Atomic_Read(&g_chunkPoolRunning))
+    {
+        Atomic_Swap(&g_chunkPoolRunning, 0);
+        WorkerPool_Stop(&g_chunkPool);
+    }
+    pthread_mutex_unlock(&g_chunkPoolLock);
+}
+
+/* Smallest buffer in bytes that is worth compressing on more than one thread. Smaller
+* buffers are not worth the cost of handing chunks to other threads. Can be overridden with
+* PSRP_PARALLEL_COMPRESS_THRESHOLD.
+*/
+static MI_Uint32 GetParallelCompressThreshold()
+{
+    static MI_Uint32 threshold = 0;
+
+    if (threshold == 0)
+    {
+        threshold = _GetTunableFromEnvironment("PSRP_PARALLEL_COMPRESS_THRESHOLD", 4 * MAX_COMPRESS_BUFFER_BLOCK, MAX_COMPRESS_BUFFER_BLOCK + 1, 0xFFFFFFFF);
+    }
+    return threshold;
+}
+
+/* Smallest number of chunks that is worth decompressing on more than one thread. Can be
+* overridden with PSRP_PARALLEL_DECOMPRESS_CHUNKS.
+*/
+static MI_Uint32 GetParallelDecompressChunks()
+{
+    static MI_Uint32 chunks = 0;
+
+    if (chunks == 0)
+    {
+        chunks = _GetTunableFromEnvironment("PSRP_PARALLEL_DECOMPRESS_CHUNKS", 4, 2, 0xFFFFFFFF);
+    }
+    return chunks;
+}
+
+static MI_Boolean UseParallelDecompression(MI_Uint32 numChunks)
+{
+    return (numChunks >= GetParallelDecompressChunks()) && (GetChunkThreads() > 1);
+}
+
+/* CalculateTotalUncompressedSize
+* This function enumerates the compressed buffer chunks to calculate the total
+* uncompressed size. It is used to allocate a buffer big enough for the full
+* uncompressed buffer. The number of chunks is returned through numChunks.
+* NOTE: The CompressionHeader sizes are adjusted to accomodate the protocol bug.
+*/
+static MI_Uint32 CalculateTotalUncompressedSize(DecodeBuffer *compressedBuffer, MI_Uint32 *numChunks)
+{
+    CompressionHeader *header;
+    const MI_Uint8* bufferCursor = (const MI_Uint8*)compressedBuffer->buffer;
+    const MI_Uint8* endOfBuffer = bufferCursor + compressedBuffer->bufferUsed;
+    MI_Uint32 currentSize = 0;
+
+    *numChunks = 0;
+    while ((bufferCursor + sizeof(CompressionHeader)) <= endOfBuffer)
+    {
+        header = (CompressionHeader*)bufferCursor;
+        (*numChunks)++;
+        currentSize += (header->originalSize + 1); /* On the wire size is off-by-one */
+
+                                                   /* Move to next block */
+        bufferCursor += (header->compressedSize + 1); /* On the wire size is off-by-one */
+        bufferCursor += sizeof(CompressionHeader);
+    }
+
+    return currentSize;
+}
+
+/* DecompressChunk
+* Decompresses a single chunk whose CompressionHeader has already been read. The
+* destination needs room for the full original size of the chunk, and the chunk has to
+* fill it. One that comes out short is corrupt, whichever path the buffer takes.
+* NOTE: The CompressionHeader sizes are adjusted to accomodate the protocol bug.
+*/
+static MI_Result DecompressChunk(const CompressionHeader *compressionHeader,
+    const MI_Uint8 *compressed,
+    MI_Uint8 *toBuffer,
+    void *workspace,
+    MI_Uint32 *bufferUsed)
+{
+    MI_Uint32 status;
+
+    if (compressionHeader->originalSize == compressionHeader->compressedSize)
+    {
+        /* When sizes are the same it means that the compression algorithm could not do any compression
+        * so the original buffer was used
+        */
+        memcpy(toBuffer, compressed, compressionHeader->originalSize + 1);
+        *bufferUsed = compressionHeader->originalSize + 1;
+        return MI_RESULT_OK;
+    }
+
+    /* Need to actually decompress now */
+    status = DecompressBufferProgress(
+        toBuffer,
+        compressionHeader->originalSize + 1,    /* Adjusting for incorrect compression header */
+        (MI_Uint8*)compressed,
+        compressionHeader->compressedSize + 1, /* Adjusting for incorrect compression header */
+        bufferUsed,
+        workspace,
+        NULL,
+        NULL,
+        0
+        );
+    if ((status != STATUS_SUCCESS) || (*bufferUsed != (MI_Uint32)(compressionHeader->originalSize + 1)))
+    {
+        return MI_RESULT_FAILED;
+    }
+    return MI_RESULT_OK;
+}
+
+/* The header pre-scan gives the position of every chunk in both the input and the
+* result, so for big buffers each chunk is decompressed straight into its final
+* place by whichever thread picks it up.
+*/
+typedef struct _DecompressSlot
+{
+    CompressionHeader header;
+    size_t fromOffset;  /* Start of the chunk data, after its header */
+    size_t toOffset;
+} DecompressSlot;
+
+typedef struct _DecompressSlots
+{
+    const DecodeBuffer *from;
+    MI_Uint8 *to;
+    DecompressSlot *slots;
+} DecompressSlots;
+
+static MI_Result DecompressSlotChunk(void *context, MI_Uint32 chunk, void *workspace, MI_Uint8 *staging)
+{
+    DecompressSlots *slots = (DecompressSlots*) context;
+    DecompressSlot *slot = &slots->slots[chunk];
+    MI_Uint32 bufferUsed = 0;
+
+    return DecompressChunk(&slot->header, (const MI_Uint8*)slots->from->buffer + slot->fromOffset, slots->to + slot->toOffset, workspace, &bufferUsed);
+}
+
+/* DecompressBufferParallel
+* Decompresses numChunks chunks on several threads. toBuffer must already be allocated
+* with the total uncompressed size.
+*/
+static MI_Result DecompressBufferParallel(DecodeBuffer *fromBuffer,
+    DecodeBuffer *toBuffer,
+    MI_Uint32 numChunks,
+    void *workspace,
+    MI_Uint32 wsDecompressSize)
+{
+    DecompressSlots slots;
+    ChunkJob job;
+    size_t fromOffset = 0;
+    size_t toOffset = 0;
+    MI_Uint32 chunk;
+    MI_Result miResult;
+
+    slots.from = fromBuffer;
+    slots.to = (MI_Uint8*) toBuffer->buffer;
+    slots.slots = malloc(numChunks * sizeof(DecompressSlot));
+    if (slots.slots == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    for (chunk = 0; chunk < numChunks; chunk++)
+    {
+        DecompressSlot *slot = &slots.slots[chunk];
+
+        /* Shouldn't fail but to be same make sure the chunk is all there and that
+        * we have enough buffer */
+        if ((fromBuffer->bufferUsed - fromOffset) < sizeof(CompressionHeader))
+        {
+            free(slots.slots);
+            return MI_RESULT_FAILED;
+        }
+        memcpy(&slot->header, fromBuffer->buffer + fromOffset, sizeof(CompressionHeader));
+        if ((fromBuffer->bufferUsed - fromOffset) < (sizeof(CompressionHeader) + slot->header.compressedSize + 1) ||
+            (toOffset + slot->header.originalSize + 1) > toBuffer->bufferLength)
+        {
+            free(slots.slots);
+            return MI_RESULT_FAILED;
+        }
+
+        slot->fromOffset = fromOffset + sizeof(CompressionHeader);
+        slot->toOffset = toOffset;
+        fromOffset = slot->fromOffset + slot->header.compressedSize + 1; /* Adjusting for incorrect compression header */
+        toOffset += slot->header.originalSize + 1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.proc = DecompressSlotChunk;
+    job.context = &slots;
+    job.numChunks = numChunks;
+    job.workspaceSize = wsDecompressSize;
+
+    miResult = ChunkJob_Run(&job, workspace, NULL, GetChunkThreads());
+    if (miResult == MI_RESULT_OK)
+        toBuffer->bufferUsed = toOffset;
+
+    free(slots.slots);
+    return miResult;
+}
+
+/* DecompressBuffer
+* Decompress the appended compressed chunks into a single buffer. This function
+* allocates the destination buffer and the caller needs to free the buffer.
+* NOTE: This code compensates for the protocol bug where the CompressionHeader values
+*       are encoded incorrectly.
+*/
+MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, CompressionCache *cache)
+{
+    MI_Uint32 wsCompressSize, wsDecompressSize;
+    void * workspace = NULL;
+    CompressionCache localCache;
+    MI_Uint8* fromBufferCursor;
+    MI_Uint8* fromBufferEnd;
+    MI_Uint8* toBufferCursor;
+    MI_Uint32 numChunks;
+    MI_Result miResult = MI_RESULT_OK;
+
+    memset(toBuffer, 0, sizeof(*toBuffer));
+
+    /* Without a cache the buffers only live for this call */
+    memset(&localCache, 0, sizeof(localCache));
+    if (cache == NULL)
+        cache = &localCache;
+
+
+    /* Decompression code needs a working buffer. It comes from the cache if there is one */
+    if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
+    {
+        GOTO_ERROR(MI_RESULT_FAILED);
+    }
+
+    workspace = CompressionCache_Get(&cache->decompressWorkspace, wsDecompressSize);
+    if (workspace == NULL)
+    {
+        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    /* Allocate the result buffer for decompression */
+    toBuffer->bufferUsed = 0;
+    toBuffer->bufferLength = CalculateTotalUncompressedSize(fromBuffer, &numChunks);
+    toBuffer->buffer = malloc(toBuffer->bufferLength);
+    if (toBuffer->buffer == NULL)
+    {
+        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    if (UseParallelDecompression(numChunks))
+    {
+        miResult = DecompressBufferParallel(fromBuffer, toBuffer, numChunks, workspace, wsDecompressSize);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR(miResult);
+        }
+    }
+    else
+    {
+        toBufferCursor = (MI_Uint8*)toBuffer->buffer;
+
+        fromBufferCursor = (MI_Uint8*)fromBuffer->buffer;
+        fromBufferEnd = fromBufferCursor + fromBuffer->bufferUsed;
+
+        /* We decompress one chunk of data at a time */
+        while (fromBufferCursor < fromBufferEnd)
+        {
+            MI_Uint32 bufferUsed = 0;
+            CompressionHeader *compressionHeader = (CompressionHeader*)fromBufferCursor;
+
+            /* Shouldn't fail but to be same make sure the chunk is all there and that
+            * we have enough buffer */
+            if ((size_t)(fromBufferEnd - fromBufferCursor) < sizeof(CompressionHeader) ||
+                (size_t)(fromBufferEnd - fromBufferCursor) < (sizeof(CompressionHeader) + compressionHeader->compressedSize + 1) ||
+                (toBuffer->bufferUsed + compressionHeader->originalSize + 1) > toBuffer->bufferLength)
+            {
+                GOTO_ERROR(MI_RESULT_FAILED);
+            }
+
+            fromBufferCursor += sizeof(CompressionHeader);
+
+            miResult = DecompressChunk(compressionHeader, fromBufferCursor, toBufferCursor, workspace, &bufferUsed);
+            if (miResult != MI_RESULT_OK)
+            {
+                GOTO_ERROR(miResult);
+            }
+
+            /* Update lengths and cursors ready for next iteration */
+            toBuffer->bufferUsed += bufferUsed;
+            toBufferCursor += bufferUsed;
+            fromBufferCursor += (compressionHeader->compressedSize + 1); /* Adjusting for incorrect compression header */
+        }
+    }
+
+error:
+    CompressionCache_Put(&cache->decompressWorkspace, workspace);
+    CompressionCache_Free(&localCache);
+
+    if (miResult != MI_RESULT_OK)
+    {
+        free(toBuffer->buffer);
+        toBuffer->buffer = NULL;
+    }
+    return miResult;
+}
+
+/* DecodeBase64Range
+* Decodes bytes [offset, offset + length) of the data held in base64 text without
+* decoding anything before it. Each 4 characters of unwrapped base64 hold 3 bytes
+* so any byte can be found directly. Partial quanta at either end are decoded into
+* a small local buffer and only the needed bytes copied out.
+*/
+static MI_Boolean DecodeBase64Range(const DecodeBuffer *text, size_t offset, size_t length, MI_Uint8 *to)
+{
+    size_t quantum = offset / 3;
+    size_t skip = offset % 3;
+    size_t wholeQuanta;
+    size_t used;
+    MI_Uint8 edge[3];
+
+    if (skip)
+    {
+        size_t count = min(3 - skip, length);
+
+        if (((quantum + 1) * 4) > text->bufferUsed ||
+            !Base64DecodeBytes(text->buffer + (quantum * 4), 4, edge, sizeof(edge), &used) ||
+            used < (skip + count))
+        {
+            return MI_FALSE;
+        }
+        memcpy(to, edge + skip, count);
+        to += count;
+        length -= count;
+        quantum++;
+    }
+
+    wholeQuanta = length / 3;
+    if (wholeQuanta)
+    {
+        if (((quantum + wholeQuanta) * 4) > text->bufferUsed ||
+            !Base64DecodeBytes(text->buffer + (quantum * 4), wholeQuanta * 4, to, wholeQuanta * 3, &used) ||
+            used != (wholeQuanta * 3))
+        {
+            return MI_FALSE;
+        }
+        to += used;
+        length -= used;
+        quantum += wholeQuanta;
+    }
+
+    if (length)
+    {
+        if (((quantum + 1) * 4) > text->bufferUsed ||
+            !Base64DecodeBytes(text->buffer + (quantum * 4), 4, edge, sizeof(edge), &used) ||
+            used < length)
+        {
+            return MI_FALSE;
+        }
+        memcpy(to, edge, length);
+    }
+
+    return MI_TRUE;
+}
+
+/* CalculateTotalUncompressedSizeBase64
+* Same as CalculateTotalUncompressedSize but walks the chunk headers while the
+* data is still base64 encoded, decoding only the headers themselves. Fails if
+* the text is not in a form that can be randomly accessed or the chunks do not
+* exactly cover the data.
+*/
+static MI_Boolean CalculateTotalUncompressedSizeBase64(const DecodeBuffer *text, MI_Uint32 *totalSize, MI_Uint32 *numChunks)
+{
+    size_t decodedLength;
+    size_t offset = 0;
+    MI_Uint32 currentSize = 0;
+    MI_Uint32 currentChunks = 0;
+
+    if (text->bufferUsed % 4)
+        return MI_FALSE;
+
+    decodedLength = Base64DecodedLength(text->buffer, text->bufferUsed);
+
+    while (offset < decodedLength)
+    {
+        CompressionHeader header;
+
+        if ((decodedLength - offset) < sizeof(header) ||
+            !DecodeBase64Range(text, offset, sizeof(header), (MI_Uint8*)&header))
+        {
+            return MI_FALSE;
+        }
+
+        offset += sizeof(header) + header.compressedSize + 1; /* On the wire size is off-by-one */
+        currentSize += (header.originalSize + 1); /* On the wire size is off-by-one */
+        currentChunks++;
+    }
+
+    if (offset != decodedLength)
+        return MI_FALSE;
+
+    *totalSize = currentSize;
+    *numChunks = currentChunks;
+    return MI_TRUE;
+}
+
+static MI_Result DecodeDecompressSlotChunk(void *context, MI_Uint32 chunk, void *workspace, MI_Uint8 *staging)
+{
+    DecompressSlots *slots = (DecompressSlots*) context;
+    DecompressSlot *slot = &slots->slots[chunk];
+    MI_Uint32 bufferUsed = 0;
+
+    if (slot->header.originalSize == slot->header.compressedSize)
+    {
+        /* Stored chunk, decode it straight into place */
+        if (!DecodeBase64Range(slots->from, slot->fromOffset, slot->header.originalSize + 1, slots->to + slot->toOffset))
+            return MI_RESULT_FAILED;
+        return MI_RESULT_OK;
+    }
+
+    if (!DecodeBase64Range(slots->from, slot->fromOffset, slot->header.compressedSize + 1, staging))
+        return MI_RESULT_FAILED;
+
+    return DecompressChunk(&slot->header, staging, slots->to + slot->toOffset, workspace, &bufferUsed);
+}
+
+/* Base64DecodeDecompressBufferParallel
+* Same as DecompressBufferParallel but for chunks that are still base64 encoded.
+* The text has already been checked by CalculateTotalUncompressedSizeBase64.
+*/
+static MI_Result Base64DecodeDecompressBufferParallel(DecodeBuffer *fromBuffer,
+    DecodeBuffer *toBuffer,
+    MI_Uint32 numChunks,
+    void *workspace,
+    MI_Uint8 *staging,
+    MI_Uint32 wsDecompressSize)
+{
+    DecompressSlots slots;
+    ChunkJob job;
+    size_t fromOffset = 0;
+    size_t toOffset = 0;
+    MI_Uint32 chunk;
+    MI_Result miResult;
+
+    slots.from = fromBuffer;
+    slots.to = (MI_Uint8*) toBuffer->buffer;
+    slots.slots = malloc(numChunks * sizeof(DecompressSlot));
+    if (slots.slots == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    for (chunk = 0; chunk < numChunks; chunk++)
+    {
+        DecompressSlot *slot = &slots.slots[chunk];
+
+        if (!DecodeBase64Range(fromBuffer, fromOffset, sizeof(CompressionHeader), (MI_Uint8*)&slot->header) ||
+            (toOffset + slot->header.originalSize + 1) > toBuffer->bufferLength)
+        {
+            free(slots.slots);
+            return MI_RESULT_FAILED;
+        }
+
+        slot->fromOffset = fromOffset + sizeof(CompressionHeader);
+        slot->toOffset = toOffset;
+        fromOffset = slot->fromOffset + slot->header.compressedSize + 1; /* Adjusting for incorrect compression header */
+        toOffset += slot->header.originalSize + 1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.proc = DecodeDecompressSlotChunk;
+    job.context = &slots;
+    job.numChunks = numChunks;
+    job.workspaceSize = wsDecompressSize;
+    job.stagingSize = MAX_COMPRESS_BUFFER_BLOCK;
+
+    miResult = ChunkJob_Run(&job, workspace, staging, GetChunkThreads());
+    if (miResult == MI_RESULT_OK)
+        toBuffer->bufferUsed = toOffset;
+
+    free(slots.slots);
+    return miResult;
+}
+
+/* Base64DecodeDecompressBuffer
+* Base64 decodes and decompresses in one pass. The chunk headers are read
+* straight out of the base64 text to size the result, then each chunk is decoded
+* and decompressed as soon as it is available. Stored chunks are decoded directly
+* into the result and compressed chunks go through a single 64K staging buffer,
+* so the result buffer is the only allocation that scales with the payload. The
+* caller needs to free the result buffer.
+* Text that cannot be walked this way (wrapped with whitespace, for example) is
+* decoded in full first and then decompressed.
+* NOTE: This code compensates for the protocol bug where the CompressionHeader values
+*       are encoded incorrectly.
+*/
+MI_Result Base64DecodeDecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, CompressionCache *cache)
+{
+    MI_Uint32 wsCompressSize, wsDecompressSize;
+    MI_Uint32 totalSize;
+    MI_Uint32 numChunks;
+    void * workspace = NULL;
+    MI_Uint8 *staging = NULL;
+    CompressionCache localCache;
+    MI_Uint8* toBufferCursor;
+    size_t offset = 0;
+    MI_Result miResult = MI_RESULT_OK;
+
+    memset(toBuffer, 0, sizeof(*toBuffer));
+
+    if (!CalculateTotalUncompressedSizeBase64(fromBuffer, &totalSize, &numChunks))
+    {
+        DecodeBuffer decodedBuffer;
+
+        miResult = Base64DecodeBuffer(fromBuffer, &decodedBuffer);
+        if (miResult != MI_RESULT_OK)
+            return miResult;
+
+        miResult = DecompressBuffer(&decodedBuffer, toBuffer, cache);
+        free(decodedBuffer.buffer);
+        return miResult;
+    }
+
+    /* Without a cache the buffers only live for this call */
+    memset(&localCache, 0, sizeof(localCache));
+    if (cache == NULL)
+        cache = &localCache;
+
+    if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
+    {
+        GOTO_ERROR(MI_RESULT_FAILED);
+    }
+
+    workspace = CompressionCache_Get(&cache->decompressWorkspace, wsDecompressSize);
+    staging = CompressionCache_Get(&cache->staging, STAGING_BUFFER_SIZE);
+    toBuffer->bufferLength = totalSize;
+    toBuffer->buffer = malloc(totalSize ? totalSize : 1);
+    if (workspace == NULL || staging == NULL || toBuffer->buffer == NULL)
+    {
+        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    if (UseParallelDecompression(numChunks))
+    {
+        miResult = Base64DecodeDecompressBufferParallel(fromBuffer, toBuffer, numChunks, workspace, staging, wsDecompressSize);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR(miResult);
+        }
+    }
+    else
+    {
+        toBufferCursor = (MI_Uint8*)toBuffer->buffer;
+
+        /* We decode and decompress one chunk of data at a time */
+        while (toBuffer->bufferUsed < totalSize)
+        {
+            MI_Uint32 bufferUsed = 0;
+            CompressionHeader compressionHeader;
+
+            if (!DecodeBase64Range(fromBuffer, offset, sizeof(compressionHeader), (MI_Uint8*)&compressionHeader))
+            {
+                GOTO_ERROR(MI_RESULT_FAILED);
+            }
+            offset += sizeof(compressionHeader);
+
+            /* Shouldn't fail but to be same make sure we have enough buffer */
+            if ((toBuffer->bufferUsed + compressionHeader.originalSize + 1) > toBuffer->bufferLength)
+            {
+                GOTO_ERROR(MI_RESULT_FAILED);
+            }
+
+            if (compressionHeader.originalSize == compressionHeader.compressedSize)
+            {
+                /* Stored chunk, decode it straight into place */
+                if (!DecodeBase64Range(fromBuffer, offset, compressionHeader.originalSize + 1, toBufferCursor))
+                {
+                    GOTO_ERROR(MI_RESULT_FAILED);
+                }
+                bufferUsed = compressionHeader.originalSize + 1;
+            }
+            else
+            {
+                if (!DecodeBase64Range(fromBuffer, offset, compressionHeader.compressedSize + 1, staging))
+                {
+                    GOTO_ERROR(MI_RESULT_FAILED);
+                }
+
+                miResult = DecompressChunk(&compressionHeader, staging, toBufferCursor, workspace, &bufferUsed);
+                if (miResult != MI_RESULT_OK)
+                {
+                    GOTO_ERROR(miResult);
+                }
+            }
+
+            /* Update lengths and cursors ready for next iteration */
+            toBuffer->bufferUsed += bufferUsed;
+            toBufferCursor += bufferUsed;
+            offset += (compressionHeader.compressedSize + 1); /* Adjusting for incorrect compression header */
+        }
+    }
+
+error:
+    CompressionCache_Put(&cache->decompressWorkspace, workspace);
+    CompressionCache_Put(&cache->staging, staging);
+    CompressionCache_Free(&localCache);
+
+    if (miResult != MI_RESULT_OK)
+    {
+        free(toBuffer->buffer);
+        toBuffer->buffer = NULL;
+    }
+    return miResult;
+}
+
+/* Chunks smaller than this are always stored. A compressed chunk starts with a 256 byte
+* Huffman table so small chunks rarely get any smaller, and short messages such as prompt
+* responses and empty polls are not worth the compressor's time. Can be overridden with
+* PSRP_COMPRESS_MIN_CHUNK_SIZE.
+*/
+static MI_Uint32 GetCompressMinChunkSize()
+{
+    static MI_Uint32 minChunkSize = 0;
+
+    if (minChunkSize == 0)
+    {
+        minChunkSize = _GetTunableFromEnvironment("PSRP_COMPRESS_MIN_CHUNK_SIZE", 512, 1, 0xFFFFFFFF);
+    }
+    return minChunkSize;
+}
+
+/* The estimator looks at up to ESTIMATE_WINDOWS windows of ESTIMATE_WINDOW_SIZE bytes
+* spread evenly over the chunk.
+*/
+#define ESTIMATE_WINDOWS 16
+#define ESTIMATE_WINDOW_SIZE 256
+#define ESTIMATE_HASH_BITS 10
+
+/* Once this many chunks in a row have been stored the stream is assumed to be
+* incompressible and later chunks are stored without looking at them, except for every
+* STORED_RUN_REPROBE'th chunk which is checked again in case the data has changed.
+*/
+#define STORED_RUN_SKIP 8
+#define STORED_RUN_REPROBE 16
+
+/* Log2Q8
+* Base 2 logarithm of x, which must be at least 1, in 1/256ths.
+*/
+static MI_Uint32 Log2Q8(MI_Uint32 x)
+{
+    MI_Uint32 result = 0;
+    MI_Uint64 mantissa;
+    int i;
+
+    while ((x >> result) > 1)
+        result++;
+
+    /* Square the mantissa in [1, 2) once for each fraction bit */
+    mantissa = ((MI_Uint64)x << 16) >> result;
+    result <<= 8;
+    for (i = 7; i >= 0; i--)
+    {
+        mantissa = (mantissa * mantissa) >> 16;
+        if (mantissa >= (2 << 16))
+        {
+            mantissa >>= 1;
+            result |= 1 << i;
+        }
+    }
+    return result;
+}
+
+/* LooksIncompressible
+* Cheap estimate of whether a chunk is worth compressing, from a sample of the data. The
+* chunk is assumed to be incompressible if the byte histogram of the sample is close to
+* flat (more than 7.8 bits a byte) and hardly any 4 byte sequences in it repeat, as with
+* data that is already compressed or encrypted. Anything in doubt is left to the
+* compressor.
+*/
+static MI_Boolean LooksIncompressible(const MI_Uint8 *fromBuffer, size_t chunkSize)
+{
+    MI_Uint32 histogram[256];
+    MI_Uint32 hashTable[1 << ESTIMATE_HASH_BITS];
+    size_t windowSize = ESTIMATE_WINDOW_SIZE;
+    size_t stride = chunkSize / ESTIMATE_WINDOWS;
+    MI_Uint32 numWindows = ESTIMATE_WINDOWS;
+    MI_Uint32 sampled = 0;
+    MI_Uint32 matches = 0;
+    MI_Uint64 entropy;
+    MI_Uint32 window;
+    size_t i;
+
+    /* Small chunks are sampled whole */
+    if (chunkSize <= (ESTIMATE_WINDOWS * ESTIMATE_WINDOW_SIZE))
+    {
+        windowSize = chunkSize;
+        stride = 0;
+        numWindows = 1;
+    }
+    if (windowSize < 4)
+        return MI_FALSE;
+
+    memset(histogram, 0, sizeof(histogram));
+    memset(hashTable, 0, sizeof(hashTable));
+
+    for (window = 0; window < numWindows; window++)
+    {
+        const MI_Uint8 *sample = fromBuffer + (window * stride);
+
+        for (i = 0; i < windowSize; i++)
+        {
+            histogram[sample[i]]++;
+        }
+        for (i = 0; i + 4 <= windowSize; i++)
+        {
+            MI_Uint32 sequence;
+            MI_Uint32 hash;
+
+            memcpy(&sequence, sample + i, sizeof(sequence));
+            hash = (sequence * 2654435761U) >> (32 - ESTIMATE_HASH_BITS);
+            if (hashTable[hash] == sequence)
+                matches++;
+            hashTable[hash] = sequence;
+        }
+        sampled += windowSize;
+    }
+
+    /* More than one in sixteen positions repeating is enough for the compressor to find matches */
+    if ((matches * 16) >= sampled)
+        return MI_FALSE;
+
+    /* Order 0 entropy of the sample in 1/256ths of a bit: sampled*log2(sampled) - sum(count*log2(count)) */
+    entropy = (MI_Uint64)sampled * Log2Q8(sampled);
+    for (i = 0; i < 256; i++)
+    {
+        if (histogram[i])
+            entropy -= (MI_Uint64)histogram[i] * Log2Q8(histogram[i]);
+    }
+
+    return (entropy * 10) >= ((MI_Uint64)sampled * 8 * 256 * 39 / 4);
+}
+
+/* CompressChunk
+* Compresses a single chunk of at most MAX_COMPRESS_BUFFER_BLOCK bytes. The destination
+* needs room for chunkSize bytes. If compressing would not make the chunk any smaller
+* the original data is stored instead, which the receiver detects from the sizes being
+* equal. Tiny chunks, chunks that look incompressible, and chunks of a stream that has
+* not compressed for a while are stored without running the compressor at all. The
+* stream's run of stored chunks is kept in storedRun, which may be NULL.
+*/
+static MI_Result CompressChunk(MI_Uint8 *fromBuffer,
+    size_t chunkSize,
+    MI_Uint8 *toBuffer,
+    void *workspace,
+    CompressionCache *cache,
+    ptrdiff_t *storedRun,
+    MI_Uint32 *actualToChunkSize)
 {
-    char *toBufferCurrent;
-    char *fromBuffer = (char*)from;
-    size_t fromBytesLeft = fromBuffLen;
-    size_t toBytesLeft = toBuffLen;
-    size_t iconv_return;
-    iconv_t iconvData;
-    MI_Boolean returnValue = MI_FALSE;
+    MI_Uint32 status = STATUS_BUFFER_TOO_SMALL;
+    ptrdiff_t run = 0;
+
+    if (chunkSize < GetCompressMinChunkSize())
+    {
+        memcpy(toBuffer, fromBuffer, chunkSize);
+        *actualToChunkSize = chunkSize;
+        return MI_RESULT_OK;
+    }
+
+    if (storedRun)
+        run = Atomic_Read(storedRun);
+    if (((run < STORED_RUN_SKIP) || ((run % STORED_RUN_REPROBE) == 0)) &&
+        !LooksIncompressible(fromBuffer, chunkSize))
+    {
+        status = CompressBufferProgress(
+            fromBuffer,
+            chunkSize,
+            toBuffer,
+            chunkSize,
+            actualToChunkSize,
+            workspace,
+            cache->compressionLevel,
+            NULL,
+            0,
+            0
+            );
+    }
 
-    iconvData = iconv_open(toFormat, fromFormat);
-    if (iconvData == (iconv_t)-1)
+    if (status == STATUS_BUFFER_TOO_SMALL)
     {
-        printf("Failed to create iconv, %d\n", errno);
-        goto cleanup;
+        /* Compressed buffer was going to be bigger than the uncompressed buffer so lets just
+        * use the original.
+        */
+        memcpy(toBuffer, fromBuffer, chunkSize);
+        *actualToChunkSize = chunkSize;
+        if (storedRun)
+            Atomic_Inc(storedRun);
     }
-
-    *to = Batch_Get(batch, toBytesLeft);
-    if (*to == NULL)
-        goto cleanup;
-    toBufferCurrent = *to;
-
-    iconv_return = iconv(iconvData, &fromBuffer, &fromBytesLeft, &toBufferCurrent, &toBytesLeft);
-    if (iconv_return == (size_t)-1)
+    else if (status != STATUS_SUCCESS)
     {
-        printf("Failed to convert string with iconv, %d\n", errno);
-        goto cleanup;
+        return MI_RESULT_FAILED;
     }
-
-    returnValue = MI_TRUE;
-
-cleanup:
-    if (iconvData != (iconv_t)-1)
+    else if (run != 0)
     {
-        iconv_close(iconvData);
+        Atomic_Swap(storedRun, 0);
     }
-
-    return returnValue;
+    return MI_RESULT_OK;
 }
 
-MI_Boolean Utf8ToUtf16Le(Batch *batch, const char *from, MI_Char16 **to)
+/* Each chunk is compressed into its own slot in the destination, at the position it
+* would have if every chunk before it was stored uncompressed. Once all chunks are
+* done the slots are moved down in order to close up the gaps. When compressing into
+* a chain each slot is a segment of its own instead and there is nothing to move.
+*/
+#define COMPRESS_SLOT_SIZE (sizeof(CompressionHeader) + MAX_COMPRESS_BUFFER_BLOCK)
+
+/* Segment size for chains of compressed data built up a chunk at a time */
+#define COMPRESSED_CHAIN_SEGMENT_SIZE (256*1024)
+
+typedef struct _CompressSlots
 {
-    size_t fromBuffLen = strlen(from)+1;
-    return ConvertString(batch, "UTF-8", "UTF-16LE", from, fromBuffLen, (char**) to, fromBuffLen*2);
-}
+    MI_Uint8 *from;
+    MI_Uint32 fromLength;
+    MI_Uint8 *to;
+    MI_Uint32 *slotUsed;
+    DecodeBufferSegment **segments;
+    CompressionCache *cache;
+    ptrdiff_t *storedRun;
+} CompressSlots;
 
-size_t Utf16LeStrLenBytes(const MI_Char16* str)
+static MI_Result CompressSlot(void *context, MI_Uint32 chunk, void *workspace, MI_Uint8 *staging)
 {
-    size_t len = 0;
+    CompressSlots *slots = (CompressSlots*) context;
+    size_t offset = (size_t)chunk * MAX_COMPRESS_BUFFER_BLOCK;
+    size_t chunkSize = min(slots->fromLength - offset, MAX_COMPRESS_BUFFER_BLOCK);
+    MI_Uint8 *slot;
+    MI_Uint32 actualToChunkSize = 0;
+    CompressionHeader compressionHeader;
+    MI_Result miResult;
 
-    while (str[len] != 0 )
-    {
-        len++;
-    }
+    if (slots->segments)
+        slot = slots->segments[chunk]->data;
+    else
+        slot = slots->to + ((size_t)chunk * COMPRESS_SLOT_SIZE);
 
-    return (len+1)*2; /* Return null terminator length as well */
-}
-MI_Boolean Utf16LeToUtf8(Batch *batch, const MI_Char16 *from, char **to)
-{
-    size_t fromBuffLen = Utf16LeStrLenBytes(from);
-    return ConvertString(batch, "UTF-16LE", "UTF-8", (char*) from, fromBuffLen, to, fromBuffLen/2);
-}
+    miResult = CompressChunk(slots->from + offset, chunkSize, slot + sizeof(CompressionHeader), workspace, slots->cache, slots->storedRun, &actualToChunkSize);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
 
-static int Shell_Base64Dec_Callback(const void* data, size_t size,
-    void* callbackData)
-{
-    DecodeBuffer *thisBuffer = callbackData;
+    /* NOTE: Size encodings on the wire were originally implemented incorrectly so we need
+    * to adjust our encodings of the sizes as well.
+    */
+    compressionHeader.originalSize = chunkSize - 1;
+    compressionHeader.compressedSize = actualToChunkSize - 1;
+    memcpy(slot, &compressionHeader, sizeof(compressionHeader));
 
-    if ((thisBuffer->bufferUsed + size) > thisBuffer->bufferLength)
-        return -1;
+    if (slots->segments)
+        slots->segments[chunk]->segmentUsed = sizeof(CompressionHeader) + actualToChunkSize;
+    else
+        slots->slotUsed[chunk] = sizeof(CompressionHeader) + actualToChunkSize;
+    return MI_RESULT_OK;
+}
 
-    memcpy(thisBuffer->buffer + thisBuffer->bufferUsed, data, size);
-    thisBuffer->bufferUsed += size;
-    return 0;
+static MI_Boolean UseParallelCompression(MI_Uint32 length, MI_Uint32 numChunks)
+{
+    return (numChunks > 1) && (length >= GetParallelCompressThreshold()) && (GetChunkThreads() > 1);
 }
-MI_Result Base64DecodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
+
+/* CompressBufferParallel
+* Compresses all chunks of fromBuffer on several threads. The destination must be
+* big enough to hold every chunk uncompressed, with its header.
+*/
+static MI_Result CompressBufferParallel(DecodeBuffer *fromBuffer,
+    DecodeBuffer *toBuffer,
+    MI_Uint32 numChunks,
+    void *workspace,
+    MI_Uint32 wsCompressSize,
+    CompressionCache *cache,
+    ptrdiff_t *storedRun)
 {
-    toBuffer->bufferLength = fromBuffer->bufferUsed;
-    toBuffer->bufferUsed = 0;
-    toBuffer->buffer = malloc(toBuffer->bufferLength);
+    CompressSlots slots;
+    ChunkJob job;
+    MI_Uint8 *toBufferCursor;
+    MI_Uint32 chunk;
+    MI_Result miResult;
 
-    if (toBuffer->buffer == NULL)
+    slots.from = (MI_Uint8*) fromBuffer->buffer;
+    slots.fromLength = fromBuffer->bufferUsed;
+    slots.to = (MI_Uint8*) toBuffer->buffer;
+    slots.segments = NULL;
+    slots.cache = cache;
+    slots.storedRun = storedRun;
+    slots.slotUsed = malloc(numChunks * sizeof(MI_Uint32));
+    if (slots.slotUsed == NULL)
         return MI_RESULT_SERVER_LIMITS_EXCEEDED;
 
-    if (Base64Dec(fromBuffer->buffer,
-        fromBuffer->bufferLength,
-        Shell_Base64Dec_Callback, toBuffer) == -1)
+    memset(&job, 0, sizeof(job));
+    job.proc = CompressSlot;
+    job.context = &slots;
+    job.numChunks = numChunks;
+    job.workspaceSize = wsCompressSize;
+
+    miResult = ChunkJob_Run(&job, workspace, NULL, GetChunkThreads());
+    if (miResult == MI_RESULT_OK)
     {
-        free(toBuffer->buffer);
-        toBuffer->buffer = NULL;
-        return MI_RESULT_FAILED;
+        /* Close up the gaps. Slots only ever move down so memmove copes with any overlap */
+        toBufferCursor = slots.to;
+        for (chunk = 0; chunk < numChunks; chunk++)
+        {
+            memmove(toBufferCursor, slots.to + ((size_t)chunk * COMPRESS_SLOT_SIZE), slots.slotUsed[chunk]);
+            toBufferCursor += slots.slotUsed[chunk];
+        }
+        toBuffer->bufferUsed = toBufferCursor - slots.to;
     }
-    return MI_RESULT_OK;
+
+    free(slots.slotUsed);
+    return miResult;
 }
 
-static int Shell_Base64Enc_Callback(const char* data, size_t size,
-    void* callbackData)
+/* CompressBuffer
+* Compresses the buffer into chunks, compressing each 64K chunk of data with its own
+* CompressionHeader prepended to each chunk.
+* NOTE: This code compensates for the protocol bug in CompressionHeader
+*/
+MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate, CompressionCache *cache, ptrdiff_t *storedRun)
 {
-    DecodeBuffer *thisBuffer = callbackData;
+    MI_Uint32 wsCompressSize, wsDecompressSize;
+    void * workspace = NULL;
+    CompressionCache localCache;
+    MI_Uint8* fromBufferCursor;
+    MI_Uint8* fromBufferEnd;
+    MI_Uint8* toBufferCursor;
+    MI_Uint32 toBufferMaxNumChunks;
+    MI_Result miResult = MI_RESULT_OK;
+
+    memset(toBuffer, 0, sizeof(*toBuffer));
 
-    if (thisBuffer->bufferUsed + size > thisBuffer->bufferLength)
-        return -1;
+    /* Without a cache the buffers only live for this call */
+    memset(&localCache, 0, sizeof(localCache));
+    if (cache == NULL)
+        cache = &localCache;
 
-    memcpy(thisBuffer->buffer + thisBuffer->bufferUsed, data, size);
-    thisBuffer->bufferUsed += size;
-    return 0;
-}
+    toBufferMaxNumChunks = fromBuffer->bufferUsed / MAX_COMPRESS_BUFFER_BLOCK;
+    if (fromBuffer->bufferUsed%MAX_COMPRESS_BUFFER_BLOCK)
+        toBufferMaxNumChunks++;
 
-MI_Result Base64EncodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
-{
-    toBuffer->bufferLength = ((fromBuffer->bufferUsed * 4) / 3) + sizeof(MI_Char) + (sizeof(MI_T('=')) * 2);
+    /* We don't know how small it will be but it may end up being the same size, but chunked, so we need to work out how
+    * many chunks there are so we can account for the size of each chunks header.
+    */
+    toBuffer->bufferLength = (sizeof(CompressionHeader) * toBufferMaxNumChunks) + fromBuffer->bufferUsed + extraSpaceToAllocate;
     toBuffer->bufferUsed = 0;
     toBuffer->buffer = malloc(toBuffer->bufferLength);
-
     if (toBuffer->buffer == NULL)
-        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    {
+        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
 
-    if (Base64Enc(fromBuffer->buffer,
-        fromBuffer->bufferUsed,
-        Shell_Base64Enc_Callback, toBuffer) == -1)
+    /* Get the compression workspace size and check it out of the cache */
+    if (CompressWorkSpaceSizeXpressHuffLevel(cache->compressionLevel, &wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
     {
-        free(toBuffer->buffer);
-        toBuffer->buffer = NULL;
-        return MI_RESULT_FAILED;
+        GOTO_ERROR(MI_RESULT_FAILED);
+    }
+    workspace = CompressionCache_Get(&cache->compressWorkspace, wsCompressSize);
+    if (workspace == NULL)
+    {
+        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+
+    if (UseParallelCompression(fromBuffer->bufferUsed, toBufferMaxNumChunks))
+    {
+        miResult = CompressBufferParallel(fromBuffer, toBuffer, toBufferMaxNumChunks, workspace, wsCompressSize, cache, storedRun);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR(miResult);
+        }
+    }
+    else
+    {
+        toBufferCursor = (MI_Uint8*)toBuffer->buffer;
+
+        fromBufferCursor = (MI_Uint8*)fromBuffer->buffer;
+        fromBufferEnd = fromBufferCursor + fromBuffer->bufferUsed;
+
+        while (fromBufferCursor < fromBufferEnd)
+        {
+            /* Max compressed chunk size is MAX_COMPRESS_BUFFER_BLOCK or the uncompressed chunk size, whichever is smaller */
+            /* We allocated enough space for the uncompressed chunk so if the buffer is not big enough for some reason we
+            * will just use the uncompressed buffer itself for this chunk.
+            */
+            size_t chunkSize = min((size_t)(fromBufferEnd - fromBufferCursor), MAX_COMPRESS_BUFFER_BLOCK);
+            MI_Uint32 actualToChunkSize = 0;
+            CompressionHeader *compressionHeader = (CompressionHeader*)toBufferCursor;
+
+            if ((toBuffer->bufferUsed + chunkSize + sizeof(CompressionHeader)) > toBuffer->bufferLength)
+            {
+                GOTO_ERROR(MI_RESULT_FAILED);
+            }
+            toBufferCursor += sizeof(CompressionHeader);
+            toBuffer->bufferUsed += sizeof(CompressionHeader);
+
+            miResult = CompressChunk(fromBufferCursor, chunkSize, toBufferCursor, workspace, cache, storedRun, &actualToChunkSize);
+            if (miResult != MI_RESULT_OK)
+            {
+                GOTO_ERROR(miResult);
+            }
+
+            /* NOTE: Size encodings on the wire were originally implemented incorrectly so we need
+            * to adjust our encodings of the sizes as well.
+            */
+            compressionHeader->originalSize = chunkSize - 1;
+            compressionHeader->compressedSize = actualToChunkSize - 1;
+
+            toBuffer->bufferUsed += actualToChunkSize;
+            toBufferCursor += actualToChunkSize;
+
+            fromBufferCursor += chunkSize;
+        }
     }
-    if ((toBuffer->bufferLength - toBuffer->bufferUsed) < sizeof(MI_Char))
+
+error:
+    if (miResult != MI_RESULT_OK)
     {
-        /* failed to leave enough space on end */
         free(toBuffer->buffer);
         toBuffer->buffer = NULL;
-        return MI_RESULT_FAILED;
+        toBuffer->bufferUsed = 0;
+        toBuffer->bufferLength = 0;
     }
-    return MI_RESULT_OK;
+    CompressionCache_Put(&cache->compressWorkspace, workspace);
+    CompressionCache_Free(&localCache);
+
+    return miResult;
 }
 
-/* Compression of buffers splits the data into chunks. The code compressed 64K at a time and
-* prepends the CompressionHeader structure to hold the original uncompressed size and the
-* compressed size.
-* NOTE: The original protocol has a bug in it such that the two sizes are encoded incorrectly.
-*       The sizes in the protocol are 1 less than they actually are so the sizes need to be
-*       adjusted accordingly.
+/* CompressChainParallel
+* Compresses all chunks of fromBuffer on several threads, each into a segment of
+* its own at the end of toChain.
 */
-typedef struct _CompressionHeader
+static MI_Result CompressChainParallel(DecodeBuffer *fromBuffer,
+    DecodeBufferChain *toChain,
+    MI_Uint32 numChunks,
+    void *workspace,
+    MI_Uint32 wsCompressSize,
+    CompressionCache *cache,
+    ptrdiff_t *storedRun)
 {
-    USHORT originalSize;
-    USHORT compressedSize;
-} CompressionHeader;
+    CompressSlots slots;
+    ChunkJob job;
+    MI_Uint32 chunk;
+    MI_Result miResult;
 
-/* CalculateTotalUncompressedSize
-* This function enumerates the compressed buffer chunks to calculate the total
-* uncompressed size. It is used to allocate a buffer big enough for the full
-* uncompressed buffer.
-* NOTE: The CompressionHeader sizes are adjusted to accomodate the protocol bug.
-*/
-static MI_Uint32 CalculateTotalUncompressedSize(DecodeBuffer *compressedBuffer)
-{
-    CompressionHeader *header;
-    const MI_Uint8* bufferCursor = (const MI_Uint8*)compressedBuffer->buffer;
-    const MI_Uint8* endOfBuffer = bufferCursor + compressedBuffer->bufferLength;
-    MI_Uint32 currentSize = 0;
+    slots.from = (MI_Uint8*) fromBuffer->buffer;
+    slots.fromLength = fromBuffer->bufferUsed;
+    slots.to = NULL;
+    slots.slotUsed = NULL;
+    slots.cache = cache;
+    slots.storedRun = storedRun;
+    slots.segments = malloc(numChunks * sizeof(DecodeBufferSegment*));
+    if (slots.segments == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
 
-    while (bufferCursor < endOfBuffer)
+    for (chunk = 0; chunk < numChunks; chunk++)
     {
-        header = (CompressionHeader*)bufferCursor;
-        currentSize += (header->originalSize + 1); /* On the wire size is off-by-one */
+        slots.segments[chunk] = DecodeBufferChain_AddSegment(toChain, COMPRESS_SLOT_SIZE);
+        if (slots.segments[chunk] == NULL)
+        {
+            free(slots.segments);
+            return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+    }
 
-                                                   /* Move to next block */
-        bufferCursor += (header->compressedSize + 1); /* On the wire size is off-by-one */
-        bufferCursor += sizeof(CompressionHeader);
+    memset(&job, 0, sizeof(job));
+    job.proc = CompressSlot;
+    job.context = &slots;
+    job.numChunks = numChunks;
+    job.workspaceSize = wsCompressSize;
+
+    miResult = ChunkJob_Run(&job, workspace, NULL, GetChunkThreads());
+    if (miResult == MI_RESULT_OK)
+    {
+        for (chunk = 0; chunk < numChunks; chunk++)
+        {
+            toChain->bufferUsed += slots.segments[chunk]->segmentUsed;
+        }
     }
 
-    return currentSize;
+    free(slots.segments);
+    return miResult;
 }
 
-/* DecompressBuffer
-* Decompress the appended compressed chunks into a single buffer. This function
-* allocates the destination buffer and the caller needs to free the buffer.
-* NOTE: This code compensates for the protocol bug where the CompressionHeader values
-*       are encoded incorrectly.
+/* CompressBufferChain
+* Compresses the buffer into the same chunked form as CompressBuffer, but adds the
+* result to the end of a chain rather than allocating one contiguous buffer sized for
+* the uncompressed data. Compressed chunks are packed into the segments back to back.
+* The caller needs to free the chain, even on failure.
+* NOTE: This code compensates for the protocol bug in CompressionHeader
 */
-MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer)
+MI_Result CompressBufferChain(DecodeBuffer *fromBuffer, DecodeBufferChain *toChain, CompressionCache *cache, ptrdiff_t *storedRun)
 {
     MI_Uint32 wsCompressSize, wsDecompressSize;
     void * workspace = NULL;
+    MI_Uint8 *staging = NULL;
+    CompressionCache localCache;
     MI_Uint8* fromBufferCursor;
     MI_Uint8* fromBufferEnd;
-    MI_Uint8* toBufferCursor;
-    MI_Uint32 status;
+    MI_Uint32 numChunks;
     MI_Result miResult = MI_RESULT_OK;
 
-    memset(toBuffer, 0, sizeof(*toBuffer));
+    /* Without a cache the buffers only live for this call */
+    memset(&localCache, 0, sizeof(localCache));
+    if (cache == NULL)
+        cache = &localCache;
 
+    numChunks = fromBuffer->bufferUsed / MAX_COMPRESS_BUFFER_BLOCK;
+    if (fromBuffer->bufferUsed%MAX_COMPRESS_BUFFER_BLOCK)
+        numChunks++;
 
-    /* Decompression code needs a working buffer. We really need to cache this buffer
-    * so we don't need to keep reallocating and freeing it. We only need one for each
-    * of Send/Receive */
-    if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
+    if (CompressWorkSpaceSizeXpressHuffLevel(cache->compressionLevel, &wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
     {
         GOTO_ERROR(MI_RESULT_FAILED);
     }
-
-    workspace = malloc(wsDecompressSize);
+    workspace = CompressionCache_Get(&cache->compressWorkspace, wsCompressSize);
     if (workspace == NULL)
     {
         GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    /* Allocate the result buffer for decompression */
-    toBuffer->bufferUsed = 0;
-    toBuffer->bufferLength = CalculateTotalUncompressedSize(fromBuffer);
-    toBuffer->buffer = malloc(toBuffer->bufferLength);
-    if (toBuffer->buffer == NULL)
+    if (UseParallelCompression(fromBuffer->bufferUsed, numChunks))
     {
-        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        miResult = CompressChainParallel(fromBuffer, toChain, numChunks, workspace, wsCompressSize, cache, storedRun);
+        if (miResult != MI_RESULT_OK)
+        {
+            GOTO_ERROR(miResult);
+        }
     }
-
-    toBufferCursor = (MI_Uint8*)toBuffer->buffer;
-
-    fromBufferCursor = (MI_Uint8*)fromBuffer->buffer;
-    fromBufferEnd = fromBufferCursor + fromBuffer->bufferUsed;
-
-    /* We decompress one chunk of data at a time */
-    while (fromBufferCursor < fromBufferEnd)
+    else
     {
-        MI_Uint32 bufferUsed = 0;
-        CompressionHeader *compressionHeader = (CompressionHeader*)fromBufferCursor;
-
-        /* Shouldn't fail but to be same make sure we have enough buffer */
-        if ((toBuffer->bufferUsed + compressionHeader->originalSize + 1) > toBuffer->bufferLength)
+        staging = CompressionCache_Get(&cache->staging, STAGING_BUFFER_SIZE);
+        if (staging == NULL)
         {
-            GOTO_ERROR(MI_RESULT_FAILED);
+            GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
         }
 
-        fromBufferCursor += sizeof(CompressionHeader);
+        fromBufferCursor = (MI_Uint8*)fromBuffer->buffer;
+        fromBufferEnd = fromBufferCursor + fromBuffer->bufferUsed;
 
-        if (compressionHeader->originalSize == compressionHeader->compressedSize)
+        while (fromBufferCursor < fromBufferEnd)
         {
-            /* When sizes are the same it means that the compression algorithm could not do any compression
-            * so the original buffer was used
+            size_t chunkSize = min((size_t)(fromBufferEnd - fromBufferCursor), MAX_COMPRESS_BUFFER_BLOCK);
+            MI_Uint32 actualToChunkSize = 0;
+            CompressionHeader compressionHeader;
+
+            miResult = CompressChunk(fromBufferCursor, chunkSize, staging + sizeof(CompressionHeader), workspace, cache, storedRun, &actualToChunkSize);
+            if (miResult != MI_RESULT_OK)
+            {
+                GOTO_ERROR(miResult);
+            }
+
+            /* NOTE: Size encodings on the wire were originally implemented incorrectly so we need
+            * to adjust our encodings of the sizes as well.
             */
-            memcpy(toBufferCursor, fromBufferCursor, compressionHeader->originalSize + 1);
-            bufferUsed = compressionHeader->originalSize + 1;
-        }
-        else
-        {
-            /* Need to actually decompress now */
-            status = DecompressBufferProgress(
-                toBufferCursor,
-                compressionHeader->originalSize + 1,    /* Adjusting for incorrect compression header */
-                fromBufferCursor,
-                compressionHeader->compressedSize + 1, /* Adjusting for incorrect compression header */
-                &bufferUsed,
-                workspace,
-                NULL,
-                NULL,
-                0
-                );
-            if (status != STATUS_SUCCESS)
+            compressionHeader.originalSize = chunkSize - 1;
+            compressionHeader.compressedSize = actualToChunkSize - 1;
+            memcpy(staging, &compressionHeader, sizeof(compressionHeader));
+
+            miResult = DecodeBufferChain_Append(toChain, staging, sizeof(CompressionHeader) + actualToChunkSize);
+            if (miResult != MI_RESULT_OK)
             {
-                GOTO_ERROR(MI_RESULT_FAILED);
+                GOTO_ERROR(miResult);
             }
-        }
 
-        /* Update lengths and cursors ready for next iteration */
-        toBuffer->bufferUsed += bufferUsed;
-        toBufferCursor += bufferUsed;
-        fromBufferCursor += (compressionHeader->compressedSize + 1); /* Adjusting for incorrect compression header */
+            fromBufferCursor += chunkSize;
+        }
     }
 
 error:
-    free(workspace);
+    CompressionCache_Put(&cache->compressWorkspace, workspace);
+    CompressionCache_Put(&cache->staging, staging);
+    CompressionCache_Free(&localCache);
 
-    if (miResult != MI_RESULT_OK)
-    {
-        free(toBuffer->buffer);
-        toBuffer->buffer = NULL;
-    }
     return miResult;
 }
 
-/* Maximum concompressed buffer size is 64K */
-#define MAX_COMPRESS_BUFFER_BLOCK (64*1024)
-
-static size_t min(size_t a, size_t b)
-{
-    if (a < b)
-        return a;
-    else
-        return b;
-}
-
-/* CompressBuffer
-* Compresses the buffer into chunks, compressing each 64K chunk of data with its own
-* CompressionHeader prepended to each chunk.
+/* CompressBase64EncodeBuffer
+* Compresses the buffer in the same chunked form as CompressBuffer and base64 encodes
+* it into a single null terminated string. Each chunk is encoded as soon as it is
+* compressed, straight into a string sized for the worst case where every chunk is
+* stored, which is trimmed to size at the end. Bytes left over from a chunk that do not
+* make up a whole base64 quantum are carried to the front of the next chunk. Buffers big
+* enough to be compressed on several threads go through a DecodeBufferChain instead, as
+* their chunks finish out of order, with one segment per chunk so nothing is moved
+* before it is encoded. The terminator is not included in bufferUsed. The caller needs
+* to free the buffer.
 * NOTE: This code compensates for the protocol bug in CompressionHeader
 */
-MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate)
+MI_Result CompressBase64EncodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, CompressionCache *cache, ptrdiff_t *storedRun)
 {
     MI_Uint32 wsCompressSize, wsDecompressSize;
     void * workspace = NULL;
+    MI_Uint8 *staging = NULL;
+    CompressionCache localCache;
     MI_Uint8* fromBufferCursor;
     MI_Uint8* fromBufferEnd;
-    MI_Uint8* toBufferCursor;
     MI_Uint32 toBufferMaxNumChunks;
+    size_t carry = 0;
     MI_Result miResult = MI_RESULT_OK;
 
     memset(toBuffer, 0, sizeof(*toBuffer));
@@ -333,85 +1757,93 @@ MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Ui
     if (fromBuffer->bufferUsed%MAX_COMPRESS_BUFFER_BLOCK)
         toBufferMaxNumChunks++;
 
-    /* We don't know how small it will be but it may end up being the same size, but chunked, so we need to work out how
-    * many chunks there are so we can account for the size of each chunks header.
-    */
-    toBuffer->bufferLength = (sizeof(CompressionHeader) * toBufferMaxNumChunks) + fromBuffer->bufferUsed + extraSpaceToAllocate;
-    toBuffer->bufferUsed = 0;
-    toBuffer->buffer = malloc(toBuffer->bufferLength);
-    if (toBuffer->buffer == NULL)
+    if (UseParallelCompression(fromBuffer->bufferUsed, toBufferMaxNumChunks))
     {
-        GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
+        DecodeBufferChain compressedChain;
+
+        DecodeBufferChain_Init(&compressedChain, COMPRESSED_CHAIN_SEGMENT_SIZE);
+        miResult = CompressBufferChain(fromBuffer, &compressedChain, cache, storedRun);
+        if (miResult == MI_RESULT_OK)
+        {
+            miResult = Base64EncodeChain(&compressedChain, toBuffer);
+        }
+        DecodeBufferChain_Free(&compressedChain);
+        return miResult;
     }
 
-    /* Get the compression workspace size and allocate it. We really need to cache this */
-    if (CompressWorkSpaceSizeXpressHuff(&wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
+    /* Without a cache the buffers only live for this call */
+    memset(&localCache, 0, sizeof(localCache));
+    if (cache == NULL)
+        cache = &localCache;
+
+    toBuffer->bufferLength = Base64EncodedLength((sizeof(CompressionHeader) * toBufferMaxNumChunks) + fromBuffer->bufferUsed) + sizeof(MI_Char);
+    toBuffer->buffer = malloc(toBuffer->bufferLength);
+
+    if (CompressWorkSpaceSizeXpressHuffLevel(cache->compressionLevel, &wsCompressSize, &wsDecompressSize) != STATUS_SUCCESS)
     {
         GOTO_ERROR(MI_RESULT_FAILED);
     }
-    workspace = malloc(wsCompressSize);
-    if (workspace == NULL)
+    workspace = CompressionCache_Get(&cache->compressWorkspace, wsCompressSize);
+    staging = CompressionCache_Get(&cache->staging, STAGING_BUFFER_SIZE);
+    if (toBuffer->buffer == NULL || workspace == NULL || staging == NULL)
     {
         GOTO_ERROR(MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
 
-    toBufferCursor = (MI_Uint8*)toBuffer->buffer;
-
     fromBufferCursor = (MI_Uint8*)fromBuffer->buffer;
     fromBufferEnd = fromBufferCursor + fromBuffer->bufferUsed;
 
     while (fromBufferCursor < fromBufferEnd)
     {
-        /* Max compressed chunk size is MAX_COMPRESS_BUFFER_BLOCK or the uncompressed chunk size, whichever is smaller */
-        /* We allocated enough space for the uncompressed chunk so if the buffer is not big enough for some reason we
-        * will just use the uncompressed buffer itself for this chunk.
-        */
         size_t chunkSize = min((size_t)(fromBufferEnd - fromBufferCursor), MAX_COMPRESS_BUFFER_BLOCK);
         MI_Uint32 actualToChunkSize = 0;
-        CompressionHeader *compressionHeader = (CompressionHeader*)toBufferCursor;
-        MI_Uint32 status;
+        CompressionHeader compressionHeader;
+        size_t stagingUsed;
+        size_t encodeSize;
 
-        if ((toBuffer->bufferUsed + chunkSize + sizeof(CompressionHeader)) > toBuffer->bufferLength)
+        miResult = CompressChunk(fromBufferCursor, chunkSize, staging + carry + sizeof(CompressionHeader), workspace, cache, storedRun, &actualToChunkSize);
+        if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR(MI_RESULT_FAILED);
+            GOTO_ERROR(miResult);
         }
-        toBufferCursor += sizeof(CompressionHeader);
-        toBuffer->bufferUsed += sizeof(CompressionHeader);
 
-        status = CompressBufferProgress(
-            fromBufferCursor,
-            chunkSize,
-            toBufferCursor,
-            chunkSize,
-            &actualToChunkSize,
-            workspace,
-            NULL,
-            0,
-            0
-            );
-        if (status == STATUS_BUFFER_TOO_SMALL)
-        {
-            /* Compressed buffer was going to be bigger than the uncompressed buffer so lets just
-            * use the original.
-            */
-            memcpy(toBufferCursor, fromBufferCursor, chunkSize);
-            actualToChunkSize = chunkSize;
-        }
-        else if (status != STATUS_SUCCESS)
+        /* NOTE: Size encodings on the wire were originally implemented incorrectly so we need
+        * to adjust our encodings of the sizes as well.
+        */
+        compressionHeader.originalSize = chunkSize - 1;
+        compressionHeader.compressedSize = actualToChunkSize - 1;
+        memcpy(staging + carry, &compressionHeader, sizeof(compressionHeader));
+
+        fromBufferCursor += chunkSize;
+
+        /* Encode whole quanta only, unless this is the last chunk */
+        stagingUsed = carry + sizeof(CompressionHeader) + actualToChunkSize;
+        encodeSize = stagingUsed;
+        if (fromBufferCursor < fromBufferEnd)
+            encodeSize -= (stagingUsed % 3);
+
+        if ((toBuffer->bufferUsed + Base64EncodedLength(encodeSize)) >= toBuffer->bufferLength)
         {
             GOTO_ERROR(MI_RESULT_FAILED);
         }
+        Base64EncodeBytes(staging, encodeSize, toBuffer->buffer + toBuffer->bufferUsed);
+        toBuffer->bufferUsed += Base64EncodedLength(encodeSize);
 
-        /* NOTE: Size encodings on the wire were originally implemented incorrectly so we need
-        * to adjust our encodings of the sizes as well.
-        */
-        compressionHeader->originalSize = chunkSize - 1;
-        compressionHeader->compressedSize = actualToChunkSize - 1;
+        carry = stagingUsed - encodeSize;
+        memmove(staging, staging + encodeSize, carry);
+    }
 
-        toBuffer->bufferUsed += actualToChunkSize;
-        toBufferCursor += actualToChunkSize;
+    toBuffer->buffer[toBuffer->bufferUsed] = MI_T('\0');
 
-        fromBufferCursor += chunkSize;
+    /* Give back the space compression saved */
+    if ((toBuffer->bufferLength - toBuffer->bufferUsed) > MAX_COMPRESS_BUFFER_BLOCK)
+    {
+        MI_Char *trimmed = realloc(toBuffer->buffer, toBuffer->bufferUsed + sizeof(MI_Char));
+        if (trimmed)
+        {
+            toBuffer->buffer = trimmed;
+            toBuffer->bufferLength = toBuffer->bufferUsed + sizeof(MI_Char);
+        }
     }
 
 error:
@@ -422,7 +1854,9 @@ error:
         toBuffer->bufferUsed = 0;
         toBuffer->bufferLength = 0;
     }
-    free(workspace);
+    CompressionCache_Put(&cache->compressWorkspace, workspace);
+    CompressionCache_Put(&cache->staging, staging);
+    CompressionCache_Free(&localCache);
 
     return miResult;
 }
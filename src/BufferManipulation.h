@@ -20,10 +20,88 @@ typedef struct _DecodeBuffer
     MI_Uint32 bufferUsed;
 } DecodeBuffer;
 
+/* DecodeBufferChain
+* A buffer made up of a list of separately allocated segments. Large payloads can be
+* built up a piece at a time without one big contiguous allocation and without
+* reallocating and copying as they grow. Walk the data with DecodeBufferChain_ForEach.
+*/
+typedef struct _DecodeBufferSegment
+{
+    struct _DecodeBufferSegment *next;
+    MI_Uint8 *data;
+    MI_Uint32 segmentLength;
+    MI_Uint32 segmentUsed;
+} DecodeBufferSegment;
+
+typedef struct _DecodeBufferChain
+{
+    DecodeBufferSegment *first;
+    DecodeBufferSegment *last;
+
+    /* Size of the data area of each new segment */
+    MI_Uint32 segmentLength;
+
+    /* Total bytes used across all segments */
+    MI_Uint32 bufferUsed;
+} DecodeBufferChain;
+
+#define DecodeBufferChain_ForEach(chain, segment) \
+    for ((segment) = (chain)->first; (segment) != NULL; (segment) = (segment)->next)
+
+void DecodeBufferChain_Init(DecodeBufferChain *chain, MI_Uint32 segmentLength);
+void DecodeBufferChain_Free(DecodeBufferChain *chain);
+MI_Uint8 *DecodeBufferChain_Reserve(DecodeBufferChain *chain, MI_Uint32 length);
+void DecodeBufferChain_Commit(DecodeBufferChain *chain, MI_Uint32 length);
+MI_Result DecodeBufferChain_Append(DecodeBufferChain *chain, const MI_Uint8 *data, MI_Uint32 length);
+
+/* CompressionCache
+* Holds on to the compression and decompression workspaces and the chunk staging
+* buffer between calls so steady state Send/Receive traffic does not allocate
+* them for every message. Each slot is checked out with an atomic swap for the
+* duration of a call so concurrent callers never share one; a caller that finds
+* a slot empty allocates its own and hands it back when done. The owner frees
+* whatever is left with CompressionCache_Free. Initialize by zeroing it. A NULL
+* cache means allocate and free per call.
+* compressionLevel is the XPRESS_LEVEL_* used when compressing with this cache. Zero
+* is the default level. The compression workspace size depends on it, so cached
+* buffers remember their size and one that is too small for the level in use is
+* replaced.
+*/
+typedef struct _CompressionCache
+{
+    ptrdiff_t compressWorkspace;
+    ptrdiff_t decompressWorkspace;
+    ptrdiff_t staging;
+    MI_Uint32 compressionLevel;
+} CompressionCache;
+
+void CompressionCache_Free(CompressionCache *cache);
+MI_Uint32 CompressionLevelFromMode(const MI_Char *compressionMode);
+
 MI_Result Base64DecodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer);
 MI_Result Base64EncodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer);
-MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer);
-MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate);
+MI_Result Base64EncodeChain(DecodeBufferChain *fromChain, DecodeBuffer *toBuffer);
+MI_Result DecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, CompressionCache *cache);
+MI_Result Base64DecodeDecompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, CompressionCache *cache);
+
+/* The compressors take the storedRun of the stream the data belongs to. It counts the
+* chunks in a row that were sent stored because they would not compress. Once it gets
+* long enough the compressor is skipped for most chunks of that stream, so binary file
+* copies and the like do not pay for it. Initialize it to zero. NULL means every chunk
+* is tried.
+*/
+MI_Result CompressBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, MI_Uint32 extraSpaceToAllocate, CompressionCache *cache, ptrdiff_t *storedRun);
+MI_Result CompressBufferChain(DecodeBuffer *fromBuffer, DecodeBufferChain *toChain, CompressionCache *cache, ptrdiff_t *storedRun);
+MI_Result CompressBase64EncodeBuffer(DecodeBuffer *fromBuffer, DecodeBuffer *toBuffer, CompressionCache *cache, ptrdiff_t *storedRun);
+
+/* ChunkPool_Start / ChunkPool_Stop
+* The threads large buffers are compressed and decompressed on, one set for the whole
+* process with PSRP_CHUNK_THREADS less one threads. Every Start needs a matching Stop
+* and the threads go with the last one, even when Start failed. With no pool running
+* each buffer is done by its caller alone.
+*/
+MI_Result ChunkPool_Start();
+void ChunkPool_Stop();
 
 MI_Boolean Utf8ToUtf16Le(Batch *batch, const char *from, MI_Char16 **to);
 MI_Boolean Utf16LeToUtf8(Batch *batch, const MI_Char16 *from, char **to);
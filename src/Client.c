@@ -7,7 +7,6 @@
 **==============================================================================
 */
 
-#include <iconv.h>
 #include <stdlib.h>
 #include <pal/strings.h>
 #include <pal/atomic.h>
@@ -18,6 +17,8 @@
 #include <MI.h>
 #include "wsman.h"
 #include "BufferManipulation.h"
+#include "Transcode.h"
+#include "CpuFeatures.h"
 #include "Shell.h"
 #include "Command.h"
 #include "DesiredStream.h"
@@ -134,6 +135,9 @@ MI_EXPORT MI_Uint32 WINAPI WSManInitialize(
 
     LogFunctionStart("WSManInitialize");
 
+    /* Pick the data path kernels for this CPU before any traffic arrives */
+    CpuFeatures_Init();
+
     (*apiHandle) = calloc(1, sizeof(struct WSMAN_API));
     if (*apiHandle == NULL)
         return MI_RESULT_SERVER_LIMITS_EXCEEDED;
@@ -144,6 +148,11 @@ MI_EXPORT MI_Uint32 WINAPI WSManInitialize(
         free(*apiHandle);
         *apiHandle = NULL;
     }
+    else if (ChunkPool_Start() != MI_RESULT_OK)
+    {
+        /* Large buffers are still compressed, just on the calling thread */
+        __LOGE(("WSManInitialize - failed to start chunk threads"));
+    }
     LogFunctionEnd("WSManInitialize", miResult);
     return miResult;
 }
@@ -159,6 +168,7 @@ MI_EXPORT MI_Uint32 WINAPI WSManDeinitialize(
     {
         MI_Application_Close(&apiHandle->application);
         free(apiHandle);
+        ChunkPool_Stop();
     }
     LogFunctionEnd("WSManDeinitialize", MI_RESULT_OK);
 
@@ -181,11 +191,7 @@ MI_EXPORT MI_Uint32 WINAPI WSManGetErrorMessage(
     MI_Result miResult = MI_RESULT_OK;
     size_t tmpMessageLen;
     char *errorMessage = NULL;
-    size_t iconv_return;
-    iconv_t iconvData;
 
-    //MI_Char16 *convertedString;
-    //Utf8ToUtf16Le(batch, resultString, &convertedString);
     __LOGD(("%s: START, errorCode=%u, messageLength=%u", "WSManGetErrorMessage", errorCode, messageLength));
     if ((messageLength == 0) || (message == NULL))
     {
@@ -193,28 +199,12 @@ MI_EXPORT MI_Uint32 WINAPI WSManGetErrorMessage(
         return ERROR_INSUFFICIENT_BUFFER;
     }
 
-    iconvData = iconv_open("UTF-16LE", "UTF-8" );
-    if (iconvData == (iconv_t)-1)
+    if (!Utf8ToUtf16LeBuffer(resultString, resultStringLenth, message, messageLength, &tmpMessageLen))
     {
         GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
     }
 
-
-    tmpMessageLen = messageLength*2; /* Convert to bytes */
-
-    iconv_return = iconv(iconvData,
-            (char**)&resultString, &resultStringLenth,
-            (char**)&message, &tmpMessageLen);
-    if (iconv_return == (size_t) -1)
-    {
-        iconv_close(iconvData);
-        GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
-    }
-
-    iconv_close(iconvData);
-
-
-    *messageLengthUsed = messageLength - (tmpMessageLen / 2);
+    *messageLengthUsed = (MI_Uint32) tmpMessageLen;
 
 error:
     LogFunctionEnd("WSManGetErrorMessage", miResult);
@@ -636,37 +626,14 @@ MI_EXPORT MI_Uint32 WINAPI WSManGetSessionOptionAsString(
             }
             else if (string && stringLengthUsed && (session->redirectLocation) && (stringLength > Tcslen(session->redirectLocation)))
             {
-                size_t iconv_return;
-                iconv_t iconvData;
-                size_t tmpToStringLen;
-                size_t tmpFromStringLen;
-                char *tmpFromString = session->redirectLocation;
-                char *tmpToString = (char *)string;
-
-                iconvData = iconv_open("UTF-16LE", "UTF-8" );
-                if (iconvData == (iconv_t)-1)
+                if (!Utf8ToUtf16LeBuffer(session->redirectLocation, Tcslen(session->redirectLocation) + 1, string, stringLength, NULL))
                 {
                     miResult = MI_RESULT_FAILED;
                 }
                 else
                 {
-                    tmpFromStringLen = (Tcslen(session->redirectLocation) + 1);
-                    tmpToStringLen = stringLength * 2;
-
-                    iconv_return = iconv(iconvData,
-                            &tmpFromString, &tmpFromStringLen,
-                            &tmpToString, &tmpToStringLen);
-                    if (iconv_return == (size_t) -1)
-                    {
-                        miResult = MI_RESULT_FAILED;
-                    }
-                    else
-                    {
-                        *stringLengthUsed = (MI_Uint32) Tcslen(session->redirectLocation) + 1;
-                        __LOGE(("Redirect location: returning location: %s (length %u)",session->redirectLocation,  Tcslen(session->redirectLocation) + 1));
-                    }
-
-                    iconv_close(iconvData);
+                    *stringLengthUsed = (MI_Uint32) Tcslen(session->redirectLocation) + 1;
+                    __LOGE(("Redirect location: returning location: %s (length %u)",session->redirectLocation,  Tcslen(session->redirectLocation) + 1));
                 }
             }
             else
@@ -850,7 +817,7 @@ static MI_Result ExtractStreamSet(WSMAN_STREAM_ID_SET *streamSet, Batch *batch,
     /* Allocate a buffer that is as big as all strings with spaces in-between  */
     for (count = 0; count != streamSet->streamIDsCount; count++)
     {
-        stringLength += Utf16LeStrLenBytes(streamSet->streamIDs[count]);
+        stringLength += (Utf16LeStrLenBytes(streamSet->streamIDs[count]) / sizeof(MI_Char16)) * UTF8_BYTES_PER_UTF16_UNIT;
         stringLength ++; /* for space between strings, extra one not a big issue */
     }
     tmpStr = Batch_Get(batch, stringLength);
@@ -859,36 +826,20 @@ static MI_Result ExtractStreamSet(WSMAN_STREAM_ID_SET *streamSet, Batch *batch,
 
     cursor = tmpStr;
 
-    if (streamSet->streamIDsCount > 0)
+    for (count = 0; count != streamSet->streamIDsCount; count++)
     {
-        size_t iconv_return;
-        iconv_t iconvData;
+        size_t thisStringLen = Utf16LeStrLenBytes(streamSet->streamIDs[count]) / sizeof(MI_Char16);
+        size_t thisStringUsed;
 
-        iconvData = iconv_open("UTF-8", "UTF-16LE");
-        if (iconvData == (iconv_t)-1)
+        if (!Utf16LeToUtf8Buffer(streamSet->streamIDs[count], thisStringLen,
+                cursor, stringLength - (cursor - tmpStr), &thisStringUsed))
         {
             GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
         }
+        cursor += thisStringUsed;
 
-
-        for (count = 0; count != streamSet->streamIDsCount; count++)
-        {
-            size_t thisStringLen = Utf16LeStrLenBytes(streamSet->streamIDs[count]);
-            const MI_Char16 *strID = streamSet->streamIDs[count];
-
-            iconv_return = iconv(iconvData,
-                    (char**) &strID, &thisStringLen,
-                    &cursor, &stringLength);
-            if (iconv_return == (size_t) -1)
-            {
-                iconv_close(iconvData);
-                GOTO_ERROR("Failed to convert stream", MI_RESULT_FAILED);
-            }
-
-            /* Append space on end */
-            *(cursor-1) = ' ';
-        }
-        iconv_close(iconvData);
+        /* Append space on end */
+        *(cursor-1) = ' ';
     }
 
     /* Null terminate */
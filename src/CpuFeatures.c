@@ -0,0 +1,76 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <MI.h>
+#include <pthread.h>
+#include "CpuFeatures.h"
+#include "Utilities.h"
+
+/* One binary runs on every CPU generation in a fleet, so the vector kernels for
+ * base64 and transcoding are compiled for each instruction set with target
+ * attributes and picked at run time. The CPU is probed once and each module
+ * points its kernel table at the best variant it has; the per call cost is a
+ * single indirect call.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#define CPU_FEATURES_X86
+#endif
+
+#if defined(CPU_FEATURES_X86) && (defined(__clang__) || (__GNUC__ >= 8))
+#define CPU_FEATURES_AVX512
+#endif
+
+static pthread_once_t g_featuresOnce = PTHREAD_ONCE_INIT;
+static MI_Uint32 g_features;
+
+static MI_Uint32 ProbeCpu()
+{
+    MI_Uint32 features = 0;
+
+#if defined(CPU_FEATURES_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        features |= CPU_FEATURE_SSE2;
+    if (__builtin_cpu_supports("ssse3"))
+        features |= CPU_FEATURE_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        features |= CPU_FEATURE_AVX2;
+#if defined(CPU_FEATURES_AVX512)
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    {
+        features |= CPU_FEATURE_AVX512BW;
+        if (__builtin_cpu_supports("avx512vbmi"))
+            features |= CPU_FEATURE_AVX512VBMI;
+    }
+#endif
+#endif
+
+    return features & _GetTunableFromEnvironment("PSRP_CPU_FEATURES", 0xFFFFFFFF, 0, 0xFFFFFFFF);
+}
+
+static void CpuFeatures_InitOnce(void)
+{
+    g_features = ProbeCpu();
+    Base64Codec_SelectKernels(g_features);
+    Transcode_SelectKernels(g_features);
+}
+
+void CpuFeatures_Init(void)
+{
+    /* Callers racing the first one wait for it, and everyone sees the kernels it picked */
+    pthread_once(&g_featuresOnce, CpuFeatures_InitOnce);
+}
+
+MI_Uint32 CpuFeatures_Get(void)
+{
+    CpuFeatures_Init();
+    return g_features;
+}
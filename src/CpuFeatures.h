@@ -0,0 +1,41 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _CpuFeatures_h_
+#define _CpuFeatures_h_
+#include <MI.h>
+
+/* Instruction set extensions the data path kernels can use. AVX512BW implies
+ * AVX512F, and AVX512VBMI implies AVX512BW.
+ */
+#define CPU_FEATURE_SSE2        0x0001
+#define CPU_FEATURE_SSSE3       0x0002
+#define CPU_FEATURE_AVX2        0x0004
+#define CPU_FEATURE_AVX512BW    0x0008
+#define CPU_FEATURE_AVX512VBMI  0x0010
+
+/* CpuFeatures_Init
+ * Probes the CPU and has each module pick the kernels it will use from then on.
+ * Called once when the provider or client is loaded; calling it again does
+ * nothing. Modules that are used before it has been called run it themselves.
+ * Features can be masked off with PSRP_CPU_FEATURES, which takes the
+ * CPU_FEATURE_* bits that are allowed as a decimal number.
+ */
+void CpuFeatures_Init(void);
+
+/* CpuFeatures_Get
+ * The CPU_FEATURE_* bits in use, probing the CPU first if need be.
+ */
+MI_Uint32 CpuFeatures_Get(void);
+
+/* Kernel selection for each module, called by CpuFeatures_Init */
+void Base64Codec_SelectKernels(MI_Uint32 features);
+void Transcode_SelectKernels(MI_Uint32 features);
+
+#endif /* _CpuFeatures_h_ */
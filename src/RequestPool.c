@@ -0,0 +1,113 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <MI.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RequestPool.h"
+
+/* Objects and batch buffers start on this boundary */
+#define REQUEST_POOL_ALIGNMENT 16
+#define REQUEST_POOL_ALIGN(size) (((size) + (REQUEST_POOL_ALIGNMENT - 1)) & ~(size_t)(REQUEST_POOL_ALIGNMENT - 1))
+
+struct _RequestBlock
+{
+    RequestPool *pool;
+
+    /* Next block on the free list */
+    RequestBlock *next;
+
+    Batch batch;
+
+    /* The object follows, then the batch buffer */
+};
+
+#define REQUEST_BLOCK_HEADER_SIZE REQUEST_POOL_ALIGN(sizeof(RequestBlock))
+
+void RequestPool_Init(RequestPool *pool, const char *name, size_t objectSize, size_t batchBufferSize, MI_Uint32 maxFree)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    Lock_Init(&pool->lock);
+    pool->maxFree = maxFree;
+    pool->objectSize = REQUEST_POOL_ALIGN(objectSize);
+    pool->batchBufferSize = REQUEST_POOL_ALIGN(batchBufferSize);
+}
+
+void RequestPool_Destroy(RequestPool *pool)
+{
+    RequestBlock *block;
+
+    Lock_Acquire(&pool->lock);
+    block = pool->freeList;
+    pool->freeList = NULL;
+    pool->freeCount = 0;
+    Lock_Release(&pool->lock);
+
+    while (block)
+    {
+        RequestBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void *RequestPool_Get(RequestPool *pool, Batch **batch)
+{
+    RequestBlock *block;
+    MI_Uint8 *object;
+
+    Lock_Acquire(&pool->lock);
+    block = pool->freeList;
+    if (block)
+    {
+        pool->freeList = block->next;
+        pool->freeCount--;
+    }
+    Lock_Release(&pool->lock);
+
+    if (block == NULL)
+    {
+        block = malloc(REQUEST_BLOCK_HEADER_SIZE + pool->objectSize + pool->batchBufferSize);
+        if (block == NULL)
+            return NULL;
+        block->pool = pool;
+    }
+    block->next = NULL;
+
+    object = (MI_Uint8*) block + REQUEST_BLOCK_HEADER_SIZE;
+    memset(object, 0, pool->objectSize);
+
+    /* Allocations come out of the block until the buffer runs out, then from pages of their own */
+    Batch_InitFromBuffer(&block->batch, object + pool->objectSize, pool->batchBufferSize, BATCH_MAX_PAGES);
+
+    *batch = &block->batch;
+    return object;
+}
+
+void RequestPool_Put(void *object)
+{
+    RequestBlock *block = (RequestBlock*) ((MI_Uint8*) object - REQUEST_BLOCK_HEADER_SIZE);
+    RequestPool *pool = block->pool;
+
+    /* Only frees the pages the batch needed beyond the block's own buffer */
+    Batch_Destroy(&block->batch);
+
+    Lock_Acquire(&pool->lock);
+    if (pool->freeCount < pool->maxFree)
+    {
+        block->next = pool->freeList;
+        pool->freeList = block;
+        pool->freeCount++;
+        block = NULL;
+    }
+    Lock_Release(&pool->lock);
+
+    free(block);
+}
@@ -0,0 +1,63 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _RequestPool_h_
+#define _RequestPool_h_
+#include <MI.h>
+#include <pal/lock.h>
+#include <base/batch.h>
+
+/* RequestBlock
+* One allocation holding a request object, the Batch for everything allocated on behalf
+* of the request, and the first stretch of memory that batch hands out.
+*/
+typedef struct _RequestBlock RequestBlock;
+
+/* RequestPool
+* A free list of blocks for one type of request. A request that fits in its block's
+* batch buffer costs no allocation at all once the pool has warmed up. Released blocks
+* go back on the list, up to maxFree of them, and the rest are freed.
+*/
+typedef struct _RequestPool
+{
+    const char *name;
+
+    Lock lock;
+    RequestBlock *freeList;
+    MI_Uint32 freeCount;
+    MI_Uint32 maxFree;
+
+    size_t objectSize;
+    size_t batchBufferSize;
+} RequestPool;
+
+/* RequestPool_Init
+* Sets up an empty pool of objects objectSize bytes long whose batches start out with
+* batchBufferSize bytes. Nothing is allocated until the first request.
+*/
+void RequestPool_Init(RequestPool *pool, const char *name, size_t objectSize, size_t batchBufferSize, MI_Uint32 maxFree);
+
+/* RequestPool_Destroy
+* Frees the blocks on the free list. Objects still in use must not be released after this.
+*/
+void RequestPool_Destroy(RequestPool *pool);
+
+/* RequestPool_Get
+* Returns a zeroed object along with the empty batch that goes with it, or NULL if out
+* of memory. The batch lives as long as the object and must not be deleted.
+*/
+void *RequestPool_Get(RequestPool *pool, Batch **batch);
+
+/* RequestPool_Put
+* Frees everything allocated from the object's batch and returns the object to the pool
+* it came from.
+*/
+void RequestPool_Put(void *object);
+
+#endif /* _RequestPool_h_ */
@@ -7,13 +7,17 @@
 **==============================================================================
 */
 
-#include <iconv.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <MI.h>
 #include "Shell.h"
 #include "wsman.h"
 #include "BufferManipulation.h"
+#include "Transcode.h"
+#include "CpuFeatures.h"
+#include "WorkerPool.h"
+#include "TimerService.h"
+#include "RequestPool.h"
 #include "coreclrutil.h"
 #include <pal/strings.h>
 #include <pal/format.h>
@@ -64,6 +68,20 @@ typedef struct _SignalData SignalData;
 typedef struct _ConnectData ConnectData;
 
 
+/* Slots for the one Send, Receive, Signal and Connect a shell or command can have active at a time */
+#define CHILD_SLOT_COUNT (CommonData_Type_Connect - CommonData_Type_Send + 1)
+#define CHILD_SLOT_INDEX(requestType) ((requestType) - CommonData_Type_Send)
+
+typedef struct _ChildSlots
+{
+    /* Claiming and releasing a slot is a compare and swap. The lock is held shared by lookups
+     * that take a reference on a child and exclusive while one is released, so a child cannot
+     * be freed between being found and having its refcount bumped.
+     */
+    ReadWriteLock lock;
+    ptrdiff_t slots[CHILD_SLOT_COUNT];
+} ChildSlots;
+
 struct _CommonData
 {
     /* MUST BE FIRST ITEM IN STRUCTURE  as pluginRequest gets cast to CommonData*/
@@ -74,7 +92,7 @@ struct _CommonData
     /* Pointer to the owning operation data, either commandData, shellData or NULL if this is the shell */
     CommonData *parentData;
 
-    /* Pointer to sibling operation data, beit other shells, direct children list for shell or direct children list for command */
+    /* Next shell in the same registry bucket. Only used by shells. */
     CommonData *siblingData;
 
     /* Allows us to identify if we are a request for a Shell, Command, Send, Receive or Signal request */
@@ -103,8 +121,17 @@ struct _ShellData
     /* This shells ID */
     MI_Char *shellId;
 
-    /* pointer to list of all active child requests, including command, send, receive and signals. We only support 1 active command */
-    CommonData *childNext;
+    /* Active send, receive, signal and connect requests aimed at the shell itself */
+    ChildSlots children;
+
+    /* Active commands, each of which knows its index, and the same commands hashed by
+     * command ID into commandSize buckets linked through common.siblingData. Both are
+     * guarded by the children lock.
+     */
+    CommandData **commands;
+    CommandData **commandBuckets;
+    MI_Uint32 commandCount;
+    MI_Uint32 commandSize;
 
     StreamSet inputStreams;
     StreamSet outputStreams;
@@ -112,9 +139,17 @@ struct _ShellData
     WSMAN_SHELL_STARTUP_INFO wsmanStartupInfo;
     WSMAN_DATA extraInfo;
 
+    /* Hash of shellId, which picks the registry bucket */
+    MI_Uint32 shellIdHash;
+
     /* Is the inbound/outbound streams compressed? */
     MI_Boolean isCompressed;
 
+    /* Compression workspaces reused by every Send and Receive on this shell, along with the
+     * compression level picked from the CompressionMode. Freed with the shell.
+     */
+    CompressionCache compressionCache;
+
     /* MI provider self pointer that is returned from MI provider load which holds all shell state. When our shell
      * goes away we will need to remove ourself from the list
     */
@@ -127,6 +162,9 @@ struct _ShellData
      */
     MI_Context *deleteInstanceContext;
 
+    /* Plug-in calls for this shell, other than Receive, run one at a time in the order they came in */
+    WorkStrand dispatchStrand;
+
     enum { Connected, Disconnected } connectedState;
 };
 
@@ -140,8 +178,14 @@ struct _CommandData
     */
     MI_Char *commandId;
 
-    /* pointer to list of all active child requests, including send, receive and signals. We only support 1 active command */
-    CommonData *childNext;
+    /* Active send, receive, signal and connect requests aimed at this command */
+    ChildSlots children;
+
+    /* Position in the shell's command table */
+    MI_Uint32 commandIndex;
+
+    /* Hash of commandId, which picks the shell's command bucket */
+    MI_Uint32 commandIdHash;
 
     WSMAN_COMMAND_ARG_SET wsmanArgSet;
 
@@ -158,7 +202,39 @@ struct _SendData
 
 };
 
- PAL_Uint32 THREAD_API ReceiveTimeoutThread(void* param);
+static void ReceiveTimeoutExpired(Timer *timer);
+static void ReceiveLingerExpired(Timer *timer);
+
+typedef enum
+{
+    /* Send now if a response can be filled, otherwise give the plug-in a moment to add more */
+    ReceiveDrain_Linger,
+    /* Send whatever is queued */
+    ReceiveDrain_Now,
+    /* Send whatever is queued, or an empty response if nothing is */
+    ReceiveDrain_OrEmpty
+} ReceiveDrainMode;
+
+static void DrainReceiveQueue(ReceiveData *receiveData, ReceiveDrainMode mode);
+
+/* One result from the plug-in waiting to be sent back in a Receive response */
+typedef struct _ReceiveResult ReceiveResult;
+
+struct _ReceiveResult
+{
+    ReceiveResult *next;
+    MI_Uint32 flags;
+    MI_Uint32 exitCode;
+    MI_Char *streamName;
+    MI_Char *commandState;
+
+    /* Base64 encoded, and compressed if the shell is, NULL if the result has no data */
+    MI_Char *data;
+    MI_Uint32 dataLength;
+};
+
+/* Most streams packed into one Receive response */
+#define RECEIVE_MAX_STREAMS_PER_RESPONSE 32
 
 struct _ReceiveData
 {
@@ -168,11 +244,57 @@ struct _ReceiveData
     StreamSet outputStreams;
     WSMAN_STREAM_ID_SET wsmanOutputStreams;
 
-    MI_Boolean timeoutInUse;
-    MI_Uint64 timeoutMilliseconds;
-    Thread timeoutThread;
-    Sem timeoutSemaphore;
-    ptrdiff_t shutdownThread;
+    /* The run of stored chunks for each of the output streams, in the same order, so
+     * one stream that does not compress does not stop another one being compressed.
+     */
+    ptrdiff_t *storedRuns;
+
+    /* While a Receive request is waiting for output this timer is armed to send an empty
+     * response before the client's operation timeout. An armed timer holds a reference.
+     */
+    TimerService *timerService;
+    Timer timeoutTimer;
+    MI_Uint32 timeoutMilliseconds;
+
+    /* Results the plug-in has sent that are waiting for a Receive request from the client.
+     * The plug-in only has to wait for the client once queueLimit of them are queued.
+     */
+    Lock queueLock;
+    ReceiveResult *queueHead;
+    ReceiveResult *queueTail;
+    ptrdiff_t queueCount;
+    ptrdiff_t queueLimit;
+    MI_Uint64 queueBytes;
+
+    /* Room for stream data in one response, from the max envelope size of the waiting
+     * Receive request. Queued results are packed into a response up to this size.
+     */
+    MI_Uint32 responseBudget;
+
+    /* While armed, output that would not fill a response is held back for a moment in case
+     * more follows. An armed linger timer holds a reference.
+     */
+    Timer lingerTimer;
+    MI_Uint32 lingerMilliseconds;
+    MI_Boolean lingerArmed;
+
+    /* Set when the plug-in completes the Receive while results are still queued. The
+     * completion is passed on once the last of them has been sent.
+     */
+    MI_Boolean completionDeferred;
+    MI_Uint32 completionErrorCode;
+
+    /* The response instances, built for the first response and only patched with the
+     * stream data and state for each one after that. Streams are built as they are needed.
+     */
+    Lock responseLock;
+    MI_Boolean responseBuilt;
+    CommandState responseState;
+    MI_Instance *response;
+    MI_Instance *responseArray;
+    MI_Uint32 responseStreamCount;
+    Stream responseStreams[RECEIVE_MAX_STREAMS_PER_RESPONSE];
+    const Stream *responseStreamRefs[RECEIVE_MAX_STREAMS_PER_RESPONSE];
 };
 
 struct _SignalData
@@ -248,7 +370,7 @@ static const char* GetCommandId(CommonData *data)
     const char *commandId = NULL;
     if (data->requestType == CommonData_Type_Send)
     {
-        if (MI_Instance_GetElement(data->miOperationInstance, MI_T("Stream"), &value, &type, NULL, NULL) &&
+        if ((MI_Instance_GetElement(data->miOperationInstance, MI_T("streamData"), &value, &type, NULL, NULL) == MI_RESULT_OK) &&
                 (type == MI_INSTANCE))
         {
             inst = value.instance;
@@ -344,12 +466,29 @@ static void PrintDataFunctionEnd(CommonData *data, const char *function, MI_Resu
             function, data, CommonData_Type_String(data->requestType), shellId, commandId, miResult, Result_ToString(miResult)));
 }
 
+/* Number of buckets the shell registry starts with. It doubles whenever there are more
+ * than two shells per bucket.
+ */
+#define SHELL_REGISTRY_INITIAL_BUCKETS 64
+
+/* All active shells hashed by shell ID. Every operation starts by looking up its shell so
+ * lookups only take the lock shared. Shells in the bucket chains are linked through
+ * common.siblingData.
+ */
+typedef struct _ShellRegistry
+{
+    ReadWriteLock lock;
+    ShellData **buckets;
+    MI_Uint32 bucketCount;
+    MI_Uint32 shellCount;
+} ShellRegistry;
+
 /* The master shell object that the provider passes back as context for all provider
- * operations. Currently it only needs to point to the list of shells.
+ * operations. It holds the registry of shells and the threads that serve them.
  */
 struct _Shell_Self
 {
-    ShellData *shellList;
+    ShellRegistry shells;
 
     PwrshPluginWkr_Ptrs managedPointers;
 
@@ -357,31 +496,316 @@ struct _Shell_Self
 
     void* hostHandle;
     unsigned int domainId;
+
+    /* Threads that make the calls into the plug-in. Receive calls block until the plug-in
+     * has output so they get their own pool and never hold up the other calls. Both pools
+     * start another thread whenever every thread they have is busy, up to a configured
+     * maximum, and let the extra threads go once they are idle.
+     */
+    WorkerPool dispatchPool;
+    WorkerPool receivePool;
+
+    /* Fires the Receive timeouts for every shell */
+    TimerService timerService;
+
+    /* Results each Receive can queue before the plug-in has to wait for the client */
+    MI_Uint32 receiveQueueLength;
+
+    /* How long output waits for more to join it in the same Receive response */
+    MI_Uint32 receiveLingerMilliseconds;
+
+    /* Recycled request objects for the operations that come and go all the time */
+    RequestPool sendRequests;
+    RequestPool receiveRequests;
+    RequestPool signalRequests;
+    RequestPool connectRequests;
 } ;
 
+/* Number of threads started up front for Shell, Command, Send, Signal and Connect calls
+ * into the plug-in, across all shells. More are started when they are all busy, up to
+ * GetWorkerMaxThreads. Can be overridden with PSRP_WORKER_THREADS.
+ */
+static MI_Uint32 GetWorkerThreads()
+{
+    return _GetTunableFromEnvironment("PSRP_WORKER_THREADS", 8, 1, 256);
+}
+
+/* Most threads the Shell, Command, Send, Signal and Connect calls can have between them.
+ * Calls beyond that wait for a thread to come free. Can be overridden with
+ * PSRP_WORKER_MAX_THREADS.
+ */
+static MI_Uint32 GetWorkerMaxThreads()
+{
+    return _GetTunableFromEnvironment("PSRP_WORKER_MAX_THREADS", 64, 1, 4096);
+}
 
-/* Based on the shell ID, find the existing ShellData object */
-ShellData * FindShellFromSelf(struct _Shell_Self *shell, const MI_Char *shellId)
+/* Number of threads started up front for Receive calls into the plug-in. Every shell with
+ * a Receive in flight holds one while the plug-in has no output, so more are started when
+ * they are all busy, up to GetReceiveWorkerMaxThreads. Can be overridden with
+ * PSRP_RECEIVE_WORKER_THREADS.
+ */
+static MI_Uint32 GetReceiveWorkerThreads()
+{
+    return _GetTunableFromEnvironment("PSRP_RECEIVE_WORKER_THREADS", 16, 1, 1024);
+}
+
+/* Most threads the Receive calls can have between them. Once that many shells are waiting
+ * on the plug-in for output, another shell's Receive waits for one of them to finish. Can
+ * be overridden with PSRP_RECEIVE_WORKER_MAX_THREADS.
+ */
+static MI_Uint32 GetReceiveWorkerMaxThreads()
+{
+    return _GetTunableFromEnvironment("PSRP_RECEIVE_WORKER_MAX_THREADS", 512, 1, 16384);
+}
+
+/* Milliseconds a thread started beyond the up front count can sit idle before it exits.
+ * Can be overridden with PSRP_WORKER_IDLE_MS.
+ */
+static MI_Uint32 GetWorkerIdleMilliseconds()
+{
+    return _GetTunableFromEnvironment("PSRP_WORKER_IDLE_MS", 30000, 100, 3600000);
+}
+
+/* Number of plug-in results a Receive holds while waiting for the client to ask for them.
+ * Can be overridden with PSRP_RECEIVE_QUEUE_LENGTH.
+ */
+static MI_Uint32 GetReceiveQueueLength()
+{
+    return _GetTunableFromEnvironment("PSRP_RECEIVE_QUEUE_LENGTH", 64, 1, 65536);
+}
+
+/* Milliseconds a Receive response that is not full waits for more output to join it. Zero
+ * sends every result as soon as there is a request for it. Can be overridden with
+ * PSRP_RECEIVE_LINGER_MS.
+ */
+static MI_Uint32 GetReceiveLingerMilliseconds()
+{
+    return _GetTunableFromEnvironment("PSRP_RECEIVE_LINGER_MS", 5, 0, 1000);
+}
+
+/* Number of released request objects of each type kept for reuse. Can be overridden
+ * with PSRP_REQUEST_POOL_SIZE.
+ */
+static MI_Uint32 GetRequestPoolSize()
+{
+    return _GetTunableFromEnvironment("PSRP_REQUEST_POOL_SIZE", 64, 0, 4096);
+}
+
+/* Space each pooled request starts out with for its own allocations, enough for the
+ * cloned parameters of a typical request.
+ */
+#define REQUEST_BATCH_BUFFER_SIZE 4096
+
+/* Common header for the parameters of every call into the plug-in. The call holds a
+ * reference on the shell until the pool is finished with it because the strand the
+ * call is queued on lives in the ShellData.
+ */
+typedef struct _PluginCall
+{
+    /* MUST BE FIRST ITEM IN STRUCTURE as the work item gets cast to the call parameters */
+    WorkItem item;
+
+    ShellData *shellData;
+} PluginCall;
+
+static void PluginCall_Release(WorkItem *item)
+{
+    PluginCall *call = (PluginCall*) item;
+
+    CommonData_Release(&call->shellData->common);
+    free(call);
+}
+
+/* PostPluginCall
+ * Queues a call on one of the worker pools. Calls for a shell made with ordered set run
+ * in order on the shell's strand, others run as soon as a thread is free. On failure
+ * the caller still owns the call.
+ */
+static MI_Boolean PostPluginCall(WorkerPool *pool, ShellData *shellData, MI_Boolean ordered, PluginCall *call, WorkItem_Proc run)
+{
+    call->item.run = run;
+    call->item.release = PluginCall_Release;
+    call->shellData = shellData;
+
+    Atomic_Inc(&shellData->common.refcount);
+    if (WorkerPool_Post(pool, ordered ? &shellData->dispatchStrand : NULL, &call->item))
+        return MI_TRUE;
+
+    /* The caller still holds its own reference so this cannot be the last one */
+    Atomic_Dec(&shellData->common.refcount);
+    return MI_FALSE;
+}
+
+
+/* FNV-1a over a shell or command ID */
+static MI_Uint32 HashId(const MI_Char *id)
+{
+    MI_Uint32 hash = 2166136261u;
+
+    while (*id)
+    {
+        hash ^= (MI_Uint32)(unsigned char)*id++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static MI_Result ShellRegistry_Init(ShellRegistry *registry)
+{
+    ReadWriteLock_Init(&registry->lock);
+    registry->buckets = calloc(SHELL_REGISTRY_INITIAL_BUCKETS, sizeof(ShellData*));
+    if (registry->buckets == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    registry->bucketCount = SHELL_REGISTRY_INITIAL_BUCKETS;
+    registry->shellCount = 0;
+    return MI_RESULT_OK;
+}
+
+static void ShellRegistry_Free(ShellRegistry *registry)
+{
+    free(registry->buckets);
+    registry->buckets = NULL;
+    registry->bucketCount = 0;
+}
+
+/* Doubles the bucket array. Called with the lock held exclusive. If there is no memory
+ * the registry carries on with longer chains.
+ */
+static void ShellRegistry_Grow(ShellRegistry *registry)
+{
+    MI_Uint32 newCount = registry->bucketCount * 2;
+    ShellData **newBuckets = calloc(newCount, sizeof(ShellData*));
+    MI_Uint32 i;
+
+    if (newBuckets == NULL)
+        return;
+
+    for (i = 0; i != registry->bucketCount; i++)
+    {
+        ShellData *shellData = registry->buckets[i];
+
+        while (shellData)
+        {
+            ShellData *next = (ShellData*) shellData->common.siblingData;
+            ShellData **bucket = &newBuckets[shellData->shellIdHash & (newCount - 1)];
+
+            shellData->common.siblingData = (CommonData*) *bucket;
+            *bucket = shellData;
+            shellData = next;
+        }
+    }
+    free(registry->buckets);
+    registry->buckets = newBuckets;
+    registry->bucketCount = newCount;
+}
+
+static void ShellRegistry_Add(ShellRegistry *registry, ShellData *shellData)
+{
+    ShellData **bucket;
+
+    shellData->shellIdHash = HashId(shellData->shellId);
+
+    ReadWriteLock_AcquireWrite(&registry->lock);
+    if (registry->shellCount >= (registry->bucketCount * 2))
+        ShellRegistry_Grow(registry);
+
+    /* New shells go at the front so a reused shell ID finds the newest one, as before */
+    bucket = &registry->buckets[shellData->shellIdHash & (registry->bucketCount - 1)];
+    shellData->common.siblingData = (CommonData*) *bucket;
+    *bucket = shellData;
+    registry->shellCount++;
+    ReadWriteLock_ReleaseWrite(&registry->lock);
+}
+
+static void ShellRegistry_Remove(ShellRegistry *registry, ShellData *shellData)
+{
+    ShellData **pointerToPatch;
+
+    ReadWriteLock_AcquireWrite(&registry->lock);
+    pointerToPatch = &registry->buckets[shellData->shellIdHash & (registry->bucketCount - 1)];
+    while (*pointerToPatch && (*pointerToPatch != shellData))
+    {
+        pointerToPatch = (ShellData **)&(*pointerToPatch)->common.siblingData;
+    }
+    if (*pointerToPatch)
+    {
+        *pointerToPatch = (ShellData *)shellData->common.siblingData;
+        shellData->common.siblingData = NULL;
+        registry->shellCount--;
+    }
+    ReadWriteLock_ReleaseWrite(&registry->lock);
+}
+
+/* Returns a malloc'd array of every shell in the registry, each with a reference held
+ * that the caller must drop with CommonData_Release, so the shells can be worked on
+ * without holding the registry lock.
+ */
+static ShellData **ShellRegistry_Snapshot(ShellRegistry *registry, MI_Uint32 *shellCount)
 {
-    ShellData *shellData = shell->shellList;
+    ShellData **shells = NULL;
+    MI_Uint32 count = 0;
+    MI_Uint32 bucket;
+
+    *shellCount = 0;
+
+    ReadWriteLock_AcquireRead(&registry->lock);
+    if (registry->shellCount)
+    {
+        shells = malloc(registry->shellCount * sizeof(ShellData*));
+        if (shells)
+        {
+            for (bucket = 0; bucket != registry->bucketCount; bucket++)
+            {
+                ShellData *shellData;
+
+                for (shellData = registry->buckets[bucket]; shellData; shellData = (ShellData*) shellData->common.siblingData)
+                {
+                    Atomic_Inc(&shellData->common.refcount);
+                    shells[count++] = shellData;
+                }
+            }
+            *shellCount = count;
+        }
+        else
+        {
+            __LOGE(("ShellRegistry_Snapshot - out of memory, skipping %u shells", registry->shellCount));
+        }
+    }
+    ReadWriteLock_ReleaseRead(&registry->lock);
+
+    return shells;
+}
 
-    __LOGD(("FindShellFromSelf - looking for shell %s", shellId));
+/* Based on the shell ID, find the existing ShellData object. The shell comes back with a
+ * reference held so it cannot go away while the caller uses it, and the caller must
+ * drop it with CommonData_Release.
+ */
+ShellData * FindShellFromSelf(struct _Shell_Self *shell, const MI_Char *shellId)
+{
+    ShellRegistry *registry = &shell->shells;
+    ShellData *shellData;
+    MI_Uint32 hash;
 
     if (shellId == NULL)
         return NULL;
 
+    hash = HashId(shellId);
+
+    ReadWriteLock_AcquireRead(&registry->lock);
+    shellData = registry->buckets[hash & (registry->bucketCount - 1)];
     while (shellData)
     {
-        __LOGD(("FindShellFromSelf - currently found %s", shellData->shellId));
-
-        if (Tcscmp(shellId, shellData->shellId) == 0)
+        if ((shellData->shellIdHash == hash) && (Tcscmp(shellId, shellData->shellId) == 0))
         {
-            __LOGD(("FindShellFromSelf -- found what we were looking for"));
+            /* Shells leave the registry before their last reference is dropped */
+            Atomic_Inc(&shellData->common.refcount);
             break;
         }
         shellData = (ShellData*)shellData->common.siblingData;
     }
+    ReadWriteLock_ReleaseRead(&registry->lock);
 
+    __LOGD(("FindShellFromSelf - shell %s %s", shellId, shellData ? "found" : "not found"));
     return shellData;
 }
 
@@ -396,15 +820,33 @@ void MI_CALL Shell_Load(Shell_Self** self, MI_Module_Self* selfModule,
     MI_Uint32 miResult = MI_RESULT_OK;
     int ret;
     char *errorMessage = NULL;
+    MI_Uint32 threadCount;
+    MI_Uint32 maxThreadCount;
 
     _GetLogOptionsFromConfigFile(SHELL_LOGGING_FILE);
 
+    /* Pick the data path kernels for this CPU before any traffic arrives */
+    CpuFeatures_Init();
+    __LOGD(("Shell_Load - CPU features 0x%x", CpuFeatures_Get()));
+
     __LOGD(("Shell_Load - allocating shell"));
     *self = calloc(1, sizeof(Shell_Self));
     if (*self == NULL)
     {
         GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
+    if (ShellRegistry_Init(&(*self)->shells) != MI_RESULT_OK)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
+    {
+        MI_Uint32 poolSize = GetRequestPoolSize();
+
+        RequestPool_Init(&(*self)->sendRequests, "send", sizeof(SendData), REQUEST_BATCH_BUFFER_SIZE, poolSize);
+        RequestPool_Init(&(*self)->receiveRequests, "receive", sizeof(ReceiveData), REQUEST_BATCH_BUFFER_SIZE, poolSize);
+        RequestPool_Init(&(*self)->signalRequests, "signal", sizeof(SignalData), REQUEST_BATCH_BUFFER_SIZE, poolSize);
+        RequestPool_Init(&(*self)->connectRequests, "connect", sizeof(ConnectData), REQUEST_BATCH_BUFFER_SIZE, poolSize);
+    }
 
     /* Initialize the environment
      *
@@ -462,6 +904,45 @@ void MI_CALL Shell_Load(Shell_Self** self, MI_Module_Self* selfModule,
             GOTO_ERROR("Powershell InitPlugin failed", miResult);
         }
     }
+
+    /* Start the threads that call into the plug-in. A maximum below the up front count is
+     * taken as the up front count.
+     */
+    threadCount = GetWorkerThreads();
+    maxThreadCount = GetWorkerMaxThreads();
+    miResult = WorkerPool_Start(&(*self)->dispatchPool, "dispatch", threadCount,
+        (maxThreadCount < threadCount) ? threadCount : maxThreadCount, GetWorkerIdleMilliseconds());
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("Failed to start plug-in worker threads", miResult);
+    }
+    threadCount = GetReceiveWorkerThreads();
+    maxThreadCount = GetReceiveWorkerMaxThreads();
+    miResult = WorkerPool_Start(&(*self)->receivePool, "receive", threadCount,
+        (maxThreadCount < threadCount) ? threadCount : maxThreadCount, GetWorkerIdleMilliseconds());
+    if (miResult != MI_RESULT_OK)
+    {
+        WorkerPool_Stop(&(*self)->dispatchPool);
+        GOTO_ERROR("Failed to start plug-in receive threads", miResult);
+    }
+    miResult = TimerService_Start(&(*self)->timerService);
+    if (miResult != MI_RESULT_OK)
+    {
+        WorkerPool_Stop(&(*self)->receivePool);
+        WorkerPool_Stop(&(*self)->dispatchPool);
+        GOTO_ERROR("Failed to start timer service", miResult);
+    }
+    if (ChunkPool_Start() != MI_RESULT_OK)
+    {
+        /* Large buffers are still compressed, just on the calling thread */
+        __LOGE(("Shell_Load - failed to start chunk threads"));
+    }
+    (*self)->receiveQueueLength = GetReceiveQueueLength();
+    (*self)->receiveLingerMilliseconds = GetReceiveLingerMilliseconds();
+    __LOGD(("Shell_Load - %u (up to %u) plug-in worker threads, %u (up to %u) receive threads, %u queued receive results",
+        (*self)->dispatchPool.threadCount, (*self)->dispatchPool.maxThreadCount,
+        (*self)->receivePool.threadCount, (*self)->receivePool.maxThreadCount, (*self)->receiveQueueLength));
+
     __LOGE(("Shell_Load PostResult %p, %u", context, miResult));
     MI_Context_PostResult(context, miResult);
     return;
@@ -487,10 +968,19 @@ void MI_CALL Shell_Unload(Shell_Self* self, MI_Context* context)
 
     /* NOTE: Expectation is that WSManPluginReportCompletion should be called, but it is not looking like that is always happening */
 
-    /* Call managed code Shutdown function */
+    /* Call managed code Shutdown function. This goes first as it is what releases a
+     * Receive still waiting in the plug-in for output, which the pools below would
+     * otherwise wait for with no limit.
+     */
     if (self->managedPointers.shutdownPluginFuncPtr)
         self->managedPointers.shutdownPluginFuncPtr(self);
 
+    /* Now the calls still queued or running can finish and the threads be joined */
+    WorkerPool_Stop(&self->dispatchPool);
+    WorkerPool_Stop(&self->receivePool);
+    TimerService_Stop(&self->timerService);
+    ChunkPool_Stop();
+
     /* TODO: Shut down CLR */
     ret = stopCoreCLR(self->hostHandle, self->domainId);
     if (ret != 0)
@@ -502,6 +992,11 @@ void MI_CALL Shell_Unload(Shell_Self* self, MI_Context* context)
     {
         PAL_Free((void*)self->home);
     }
+    ShellRegistry_Free(&self->shells);
+    RequestPool_Destroy(&self->sendRequests);
+    RequestPool_Destroy(&self->receiveRequests);
+    RequestPool_Destroy(&self->signalRequests);
+    RequestPool_Destroy(&self->connectRequests);
     free(self);
 
     __LOGD(("Shell_Unload PostResult %p, %u", context, MI_RESULT_OK));
@@ -519,23 +1014,32 @@ void MI_CALL Shell_EnumerateInstances(Shell_Self* self, MI_Context* context,
         const MI_PropertySet* propertySet, MI_Boolean keysOnly,
         const MI_Filter* filter)
 {
-    /* Enumerate through the list of shells and post the results back */
-    ShellData *shellData = self->shellList;
+    /* Enumerate through the registry of shells and post the results back. Posting can be
+     * slow so it is done from a snapshot rather than with the registry locked.
+     */
     MI_Result miResult = MI_RESULT_OK;
+    ShellData **shells;
+    MI_Uint32 shellCount;
+    MI_Uint32 i;
 
     __LOGD(("Shell_EnumerateInstances"));
-    while (shellData)
+    shells = ShellRegistry_Snapshot(&self->shells, &shellCount);
+    for (i = 0; i != shellCount; i++)
     {
-        __LOGD(("Shell_EnumerateInstances PostInstance %p, %p", context, shellData->common.miOperationInstance));
-        miResult = MI_Context_PostInstance(context, shellData->common.miOperationInstance);
-        if (miResult != MI_RESULT_OK)
+        MI_Instance *shellInstance = shells[i]->common.miOperationInstance;
+
+        if ((miResult == MI_RESULT_OK) && shellInstance)
         {
-            __LOGE(("Shell_EnumerateInstances failed to post instance"));
-            break;
+            __LOGD(("Shell_EnumerateInstances PostInstance %p, %p", context, shellInstance));
+            miResult = MI_Context_PostInstance(context, shellInstance);
+            if (miResult != MI_RESULT_OK)
+            {
+                __LOGE(("Shell_EnumerateInstances failed to post instance"));
+            }
         }
-
-        shellData = (ShellData*) shellData->common.siblingData;
+        CommonData_Release(&shells[i]->common);
     }
+    free(shells);
     __LOGD(("Shell_EnumerateInstances PostResult %p, %u", context, miResult));
     MI_Context_PostResult(context, miResult);
 }
@@ -558,6 +1062,7 @@ void MI_CALL Shell_GetInstance(Shell_Self* self, MI_Context* context,
         {
             __LOGE(("Shell_GetInstances failed to post instance"));
         }
+        CommonData_Release(&shellData->common);
     }
     __LOGD(("Shell_GetInstance PostResult %p, %u", context, miResult));
     MI_Context_PostResult(context, miResult);
@@ -765,93 +1270,45 @@ MI_Boolean ExtractPluginRequest(MI_Context *context, CommonData *commonData)
 
 MI_Boolean ExtractExtraInfo(MI_Boolean isCreate, Batch *batch, const MI_Char *inData, WSMAN_DATA *outData)
 {
-    size_t toBytesTotal;
-    size_t toBytesLeft;
-    char *toBuffer;
-    char *toBufferCurrent;
-    MI_Boolean returnValue = MI_FALSE;
-
-    char *fromBuffer;
-    size_t fromBytesLeft;
-
+    const char *startXml = isCreate ? CREATION_XML_START : CONNECT_XML_START;
+    const char *endXml = isCreate ? CREATION_XML_END : CONNECT_XML_END;
+    size_t startXmlLength = isCreate ? sizeof(CREATION_XML_START) - 1 : sizeof(CONNECT_XML_START) - 1;
+    size_t endXmlLength = isCreate ? sizeof(CREATION_XML_END) - 1 : sizeof(CONNECT_XML_END) - 1;
     size_t creationXmlLength = Tcslen(inData);
+    size_t toLength;
+    size_t toUsed;
+    size_t thisUsed;
+    MI_Char16 *toBuffer;
 
-    size_t iconv_return;
-    iconv_t iconvData;
-
-    iconvData = iconv_open("UTF-16LE", "UTF-8");
-    if (iconvData == (iconv_t)-1)
-    {
-        goto cleanup;
-    }
-
-    if (isCreate)
-        toBytesTotal = (sizeof(CREATION_XML_START) - 1 + creationXmlLength + sizeof(CREATION_XML_END) - 1 ) * 2; /* Assume buffer is twice as big as buffer is simple xml. */
-    else
-        toBytesTotal = (sizeof(CONNECT_XML_START) - 1 + creationXmlLength + sizeof(CONNECT_XML_END) - 1 ) * 2; /* Assume buffer is twice as big as buffer is simple xml */
-    toBytesLeft = toBytesTotal;
+    /* Every UTF-8 byte produces at most one UTF-16 code unit */
+    toLength = startXmlLength + creationXmlLength + endXmlLength;
 
-    toBuffer = Batch_Get(batch, toBytesTotal);
+    toBuffer = Batch_Get(batch, toLength * sizeof(MI_Char16));
     if (toBuffer == NULL)
-        goto cleanup;
-    toBufferCurrent = toBuffer;
+        return MI_FALSE;
 
+    if (!Utf8ToUtf16LeBuffer(startXml, startXmlLength, toBuffer, toLength, &toUsed))
+        return MI_FALSE;
 
-    if (isCreate)
-    {
-        fromBytesLeft =  sizeof(CREATION_XML_START) - 1; /* Remove null terminator */
-        fromBuffer = CREATION_XML_START;
-    }
-    else
-    {
-        fromBytesLeft =  sizeof(CONNECT_XML_START) - 1; /* Remove null terminator */
-        fromBuffer = CONNECT_XML_START;
-    }
-    iconv_return = iconv(iconvData, &fromBuffer, &fromBytesLeft, &toBufferCurrent, &toBytesLeft);
-    if (iconv_return == (size_t) -1)
-    {
-        goto cleanup;
-    }
-    fromBytesLeft = creationXmlLength;
-    fromBuffer = (char*)inData;
-    iconv_return = iconv(iconvData, &fromBuffer, &fromBytesLeft, &toBufferCurrent, &toBytesLeft);
-    if (iconv_return == (size_t)-1)
-    {
-        goto cleanup;
-    }
+    if (!Utf8ToUtf16LeBuffer(inData, creationXmlLength, toBuffer + toUsed, toLength - toUsed, &thisUsed))
+        return MI_FALSE;
+    toUsed += thisUsed;
 
-    if (isCreate)
-    {
-        fromBytesLeft = sizeof(CREATION_XML_END) - 1; /* remove null terminator */
-        fromBuffer = CREATION_XML_END;
-    }
-    else
-    {
-        fromBytesLeft = sizeof(CONNECT_XML_END) - 1; /* remove null terminator */
-        fromBuffer = CONNECT_XML_END;
-    }
-    iconv_return = iconv(iconvData, &fromBuffer, &fromBytesLeft, &toBufferCurrent, &toBytesLeft);
-    if (iconv_return == (size_t)-1)
-    {
-        goto cleanup;
-    }
+    if (!Utf8ToUtf16LeBuffer(endXml, endXmlLength, toBuffer + toUsed, toLength - toUsed, &thisUsed))
+        return MI_FALSE;
+    toUsed += thisUsed;
 
     outData->type = WSMAN_DATA_TYPE_TEXT;
-    /* Adjust for any unused buffer... length is also string length, not byte length -- another assumption being made about buffer being twice as long */
-    outData->text.bufferLength = (toBytesTotal - toBytesLeft)/2;
+    /* Length is in characters, not bytes */
+    outData->text.bufferLength = toUsed;
     outData->text.buffer = (const MI_Char16*) toBuffer;
 
-    returnValue = MI_TRUE;
-
-cleanup:
-    if (iconvData != (iconv_t)-1)
-        iconv_close(iconvData);
-
-    return returnValue;
+    return MI_TRUE;
 }
 
 typedef struct _CreateShellParams
 {
+    PluginCall call;
     _In_ Shell_Self* self;
     _In_ WSMAN_PLUGIN_REQUEST *requestDetails;
     _In_ MI_Uint32 flags;
@@ -860,9 +1317,9 @@ typedef struct _CreateShellParams
     _In_opt_ WSMAN_DATA *inboundShellInformation;
 } CreateShellParams;
 
-PAL_Uint32  _CallCreateShell(void *_params)
+static void _CallCreateShell(WorkItem *item)
 {
-    CreateShellParams *params = (CreateShellParams*) _params;
+    CreateShellParams *params = (CreateShellParams*) item;
 
     params->self->managedPointers.wsManPluginShellFuncPtr(
             params->self,
@@ -871,8 +1328,6 @@ PAL_Uint32  _CallCreateShell(void *_params)
             params->extraInfo,
             params->startupInfo,
             params->inboundShellInformation);
-    free(params);
-    return 0;
 }
 MI_Boolean CallCreateShell(
         _In_ Shell_Self* self,
@@ -891,7 +1346,7 @@ MI_Boolean CallCreateShell(
         params->extraInfo = extraInfo;
         params->startupInfo = startupInfo;
         params->inboundShellInformation = inboundShellInformation;
-        if (Thread_CreateDetached(_CallCreateShell, NULL, params) == 0)
+        if (PostPluginCall(&self->dispatchPool, GetShellFromOperation((CommonData*)requestDetails), MI_TRUE, &params->call, _CallCreateShell))
             return MI_TRUE;
 
         free(params);
@@ -1016,6 +1471,7 @@ void MI_CALL Shell_CreateInstance(Shell_Self* self, MI_Context* context,
                 value.string)
         {
             shellData->isCompressed = MI_TRUE;
+            shellData->compressionCache.compressionLevel = CompressionLevelFromMode(value.string);
         }
     }
 
@@ -1027,14 +1483,14 @@ void MI_CALL Shell_CreateInstance(Shell_Self* self, MI_Context* context,
     shellData->common.refcount = 1;
     shellData->common.parentData = NULL;    /* We are the top-level shell object */
     shellData->common.requestType = CommonData_Type_Shell;
+    ReadWriteLock_Init(&shellData->children.lock);
     shellData->common.miRequestContext = context;
     shellData->common.miOperationInstance = miOperationInstance;
 
-    /* Plumb this shell into our list. Failure paths after this need to unplumb it!
+    /* Plumb this shell into our registry. Failure paths after this need to unplumb it!
     */
-    shellData->common.siblingData = (CommonData *)self->shellList;
-    self->shellList = shellData;
     shellData->shell = self;
+    ShellRegistry_Add(&self->shells, shellData);
     shellData->connectedState = Connected;
 
 
@@ -1052,9 +1508,11 @@ void MI_CALL Shell_CreateInstance(Shell_Self* self, MI_Context* context,
     PrintDataFunctionStart(&shellData->common, "Shell_CreateInstance");
     if (!CallCreateShell(self, &shellData->common.pluginRequest, 0, initString, &shellData->wsmanStartupInfo, pExtraInfo))
     {
-        /* Need to detatch ourself */
-        /* TODO: This is not thread safe... another shell could come in and mess this up */
-        self->shellList = (ShellData*) shellData->common.siblingData;
+        /* Need to detatch ourself. A lookup may have found the shell while it was registered
+         * so the last reference frees it rather than the batch being deleted here.
+         */
+        ShellRegistry_Remove(&self->shells, shellData);
+        batch = NULL;
         GOTO_ERROR("CallCreateShell failed", MI_RESULT_FAILED);
     }
 
@@ -1065,6 +1523,8 @@ error:
     PrintDataFunctionEnd(&shellData->common, "Shell_CreateInstance", miResult);
     if (batch)
         Batch_Delete(batch);
+    else if (shellData)
+        CommonData_Release(&shellData->common);
 
     MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
 }
@@ -1079,51 +1539,249 @@ void MI_CALL Shell_ModifyInstance(Shell_Self* self, MI_Context* context,
     MI_Context_PostResult(context, MI_RESULT_NOT_SUPPORTED);
 }
 
-void RecursiveNotifyShutdown(CommonData *commonData)
+static ChildSlots *GetChildSlots(CommonData *parent)
 {
-    CommonData *child = NULL;;
+    if (parent->requestType == CommonData_Type_Command)
+        return &((CommandData*)parent)->children;
+    return &((ShellData*)parent)->children;
+}
 
-    /* If there are children notify them first */
-    if (commonData->requestType == CommonData_Type_Shell)
-    {
-        child = ((ShellData*)commonData)->childNext;
-    }
-    else if (commonData->requestType == CommonData_Type_Command)
-    {
-        child = ((CommandData*)commonData)->childNext;
-    }
+static MI_Boolean ClaimChildSlot(CommonData *parent, CommonData *childData)
+{
+    ChildSlots *children = GetChildSlots(parent);
 
-    while (child)
+    if (Atomic_CompareAndSwap(&children->slots[CHILD_SLOT_INDEX(childData->requestType)], (ptrdiff_t) NULL, (ptrdiff_t) childData) != (ptrdiff_t) NULL)
     {
-        RecursiveNotifyShutdown(child);
-        child = child->siblingData;
+        /* Already have one of those */
+        return MI_FALSE;
     }
 
-    /* Now notify for this object if a shutdown registration is present */
-    if (commonData->shutdownCallback)
-    {
-        PrintDataFunctionTag(commonData, "RecursiveNotifyShutdown", "Calling registered shutdown callback");
-        commonData->shutdownCallback(commonData->shutdownContext);
-        commonData->shutdownCallback = NULL;
-        commonData->shutdownContext = NULL;
-    }
+    Atomic_Inc(&parent->refcount);
+    return MI_TRUE;
 }
 
-PAL_Uint32 _RecursiveNotifyShutdown(void *params)
+static MI_Boolean AddCommandToShell(ShellData *shellParent, CommandData *commandData)
 {
-    CommonData *commonData = (CommonData*) params;
-    RecursiveNotifyShutdown(commonData);
-    return 0;
-}
+    CommandData **bucket;
 
-/* Delete a shell instance. This should not be done by the client until
- * the command is finished and shut down.
- */
-void MI_CALL Shell_DeleteInstance(Shell_Self* self, MI_Context* context,
-        const MI_Char* nameSpace, const MI_Char* className,
-        const Shell* instanceName)
-{
-    ShellData *shellData;
+    commandData->commandIdHash = HashId(commandData->commandId);
+
+    ReadWriteLock_AcquireWrite(&shellParent->children.lock);
+    if (shellParent->commandCount == shellParent->commandSize)
+    {
+        /* The bucket count tracks the table size, a power of two, so rehash into new buckets */
+        MI_Uint32 newSize = shellParent->commandSize ? (shellParent->commandSize * 2) : 4;
+        CommandData **commands = realloc(shellParent->commands, newSize * sizeof(CommandData*));
+        CommandData **buckets;
+        MI_Uint32 i;
+
+        if (commands == NULL)
+        {
+            ReadWriteLock_ReleaseWrite(&shellParent->children.lock);
+            return MI_FALSE;
+        }
+        shellParent->commands = commands;
+
+        buckets = calloc(newSize, sizeof(CommandData*));
+        if (buckets == NULL)
+        {
+            ReadWriteLock_ReleaseWrite(&shellParent->children.lock);
+            return MI_FALSE;
+        }
+        for (i = 0; i != shellParent->commandCount; i++)
+        {
+            bucket = &buckets[commands[i]->commandIdHash & (newSize - 1)];
+            commands[i]->common.siblingData = (CommonData*) *bucket;
+            *bucket = commands[i];
+        }
+        free(shellParent->commandBuckets);
+        shellParent->commandBuckets = buckets;
+        shellParent->commandSize = newSize;
+    }
+    commandData->commandIndex = shellParent->commandCount;
+    shellParent->commands[shellParent->commandCount++] = commandData;
+
+    /* Newest first so a reused command ID finds the newest command */
+    bucket = &shellParent->commandBuckets[commandData->commandIdHash & (shellParent->commandSize - 1)];
+    commandData->common.siblingData = (CommonData*) *bucket;
+    *bucket = commandData;
+    ReadWriteLock_ReleaseWrite(&shellParent->children.lock);
+
+    Atomic_Inc(&shellParent->common.refcount);
+    return MI_TRUE;
+}
+
+MI_Boolean AddChildToShell(ShellData *shellParent, CommonData *childData)
+{
+    if (childData->requestType == CommonData_Type_Command)
+        return AddCommandToShell(shellParent, (CommandData*)childData);
+
+    return ClaimChildSlot(&shellParent->common, childData);
+}
+
+MI_Boolean AddChildToCommand(CommandData *commandParent, CommonData *childData)
+{
+    return ClaimChildSlot(&commandParent->common, childData);
+}
+
+MI_Boolean DetachOperationFromParent(CommonData *commonData)
+{
+    CommonData *parent = commonData->parentData;
+    ChildSlots *children;
+    MI_Boolean found = MI_FALSE;
+
+    if (!parent)
+    {
+        /* We have been orphaned or we are the shell */
+        return MI_TRUE;
+    }
+
+    children = GetChildSlots(parent);
+
+    ReadWriteLock_AcquireWrite(&children->lock);
+    if (commonData->requestType == CommonData_Type_Command)
+    {
+        ShellData *shellParent = (ShellData*)parent;
+        CommandData *commandData = (CommandData*)commonData;
+        MI_Uint32 index = commandData->commandIndex;
+
+        if ((index < shellParent->commandCount) && (shellParent->commands[index] == commandData))
+        {
+            /* Move the last command into the hole */
+            CommandData *last = shellParent->commands[--shellParent->commandCount];
+            CommandData **pointerToPatch = &shellParent->commandBuckets[commandData->commandIdHash & (shellParent->commandSize - 1)];
+
+            shellParent->commands[index] = last;
+            last->commandIndex = index;
+
+            while (*pointerToPatch != commandData)
+            {
+                pointerToPatch = (CommandData **)&(*pointerToPatch)->common.siblingData;
+            }
+            *pointerToPatch = (CommandData *)commandData->common.siblingData;
+            commandData->common.siblingData = NULL;
+            found = MI_TRUE;
+        }
+    }
+    else if (Atomic_CompareAndSwap(&children->slots[CHILD_SLOT_INDEX(commonData->requestType)], (ptrdiff_t) commonData, (ptrdiff_t) NULL) == (ptrdiff_t) commonData)
+    {
+        found = MI_TRUE;
+    }
+    ReadWriteLock_ReleaseWrite(&children->lock);
+
+    if (found)
+        CommonData_Release(parent);
+
+    return found;
+}
+
+/* Returns the active child request of the given type, with a reference held that the
+ * caller must drop with CommonData_Release.
+ */
+static CommonData *FindChildOperation(CommonData *parent, CommonData_Type requestType)
+{
+    ChildSlots *children = GetChildSlots(parent);
+    CommonData *child;
+
+    ReadWriteLock_AcquireRead(&children->lock);
+    child = (CommonData*) children->slots[CHILD_SLOT_INDEX(requestType)];
+    if (child)
+        Atomic_Inc(&child->refcount);
+    ReadWriteLock_ReleaseRead(&children->lock);
+
+    return child;
+}
+
+/* Copies the active commands of a shell, each with a reference held. The caller releases
+ * them and frees the array.
+ */
+static CommandData **SnapshotCommands(ShellData *shellData, MI_Uint32 *commandCount)
+{
+    CommandData **commands = NULL;
+    MI_Uint32 i;
+
+    *commandCount = 0;
+
+    ReadWriteLock_AcquireRead(&shellData->children.lock);
+    if (shellData->commandCount)
+    {
+        commands = malloc(shellData->commandCount * sizeof(CommandData*));
+        if (commands)
+        {
+            for (i = 0; i != shellData->commandCount; i++)
+            {
+                commands[i] = shellData->commands[i];
+                Atomic_Inc(&commands[i]->common.refcount);
+            }
+            *commandCount = shellData->commandCount;
+        }
+        else
+        {
+            __LOGE(("SnapshotCommands - out of memory, skipping %u commands", shellData->commandCount));
+        }
+    }
+    ReadWriteLock_ReleaseRead(&shellData->children.lock);
+
+    return commands;
+}
+
+void RecursiveNotifyShutdown(CommonData *commonData)
+{
+    /* If there are children notify them first */
+    if (commonData->requestType == CommonData_Type_Shell)
+    {
+        MI_Uint32 commandCount;
+        MI_Uint32 i;
+        CommandData **commands = SnapshotCommands((ShellData*)commonData, &commandCount);
+
+        for (i = 0; i != commandCount; i++)
+        {
+            RecursiveNotifyShutdown(&commands[i]->common);
+            CommonData_Release(&commands[i]->common);
+        }
+        free(commands);
+    }
+
+    if ((commonData->requestType == CommonData_Type_Shell) ||
+        (commonData->requestType == CommonData_Type_Command))
+    {
+        MI_Uint32 slot;
+
+        for (slot = 0; slot != CHILD_SLOT_COUNT; slot++)
+        {
+            CommonData *child = FindChildOperation(commonData, (CommonData_Type) (CommonData_Type_Send + slot));
+            if (child)
+            {
+                RecursiveNotifyShutdown(child);
+                CommonData_Release(child);
+            }
+        }
+    }
+
+    /* Now notify for this object if a shutdown registration is present */
+    if (commonData->shutdownCallback)
+    {
+        PrintDataFunctionTag(commonData, "RecursiveNotifyShutdown", "Calling registered shutdown callback");
+        commonData->shutdownCallback(commonData->shutdownContext);
+        commonData->shutdownCallback = NULL;
+        commonData->shutdownContext = NULL;
+    }
+}
+
+static void _RecursiveNotifyShutdown(WorkItem *item)
+{
+    PluginCall *call = (PluginCall*) item;
+    RecursiveNotifyShutdown(&call->shellData->common);
+}
+
+/* Delete a shell instance. This should not be done by the client until
+ * the command is finished and shut down.
+ */
+void MI_CALL Shell_DeleteInstance(Shell_Self* self, MI_Context* context,
+        const MI_Char* nameSpace, const MI_Char* className,
+        const Shell* instanceName)
+{
+    ShellData *shellData;
     MI_Result miResult = MI_RESULT_NOT_FOUND;
 
     __LOGD(("Shell_DeleteInstance Name=%s, ShellId=%s", instanceName->Name.value, instanceName->ShellId.value));
@@ -1131,6 +1789,8 @@ void MI_CALL Shell_DeleteInstance(Shell_Self* self, MI_Context* context,
 
     if (shellData)
     {
+        PluginCall *call;
+
         __LOGD(("Shell_DeleteInstance shellId=%s", instanceName->ShellId.value));
 
         /* Record the context so OperationComplete on the shell can report the shell is gone. */
@@ -1138,10 +1798,24 @@ void MI_CALL Shell_DeleteInstance(Shell_Self* self, MI_Context* context,
 
         /* Notify shell to shut itself down. We don't delete things
            here because the shell itself will tell us when it is finished.
-           We do it on a separate thread so we do not block the protocol
-           thread if another request is needed during the shutdown.
+           We do it on a worker thread so we do not block the protocol
+           thread if another request is needed during the shutdown. It is
+           not queued behind the shell's other calls as the shutdown may be
+           what one of them is waiting for.
            */
-        Thread_CreateDetached(_RecursiveNotifyShutdown, NULL, shellData);
+        call = malloc(sizeof(PluginCall));
+        if (call && PostPluginCall(&self->dispatchPool, shellData, MI_FALSE, call, _RecursiveNotifyShutdown))
+        {
+            CommonData_Release(&shellData->common);
+            return;
+        }
+
+        free(call);
+        shellData->deleteInstanceContext = NULL;
+        miResult = MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        __LOGE(("Shell_DeleteInstance shellId=%s, failed to queue shutdown, result=%u", instanceName->ShellId.value, miResult));
+        MI_Context_PostResult(context, miResult);
+        CommonData_Release(&shellData->common);
     }
     else
     {
@@ -1174,85 +1848,11 @@ MI_Boolean ExtractCommandArgs(CommonData *commonData, Shell_Command* shellInstan
     return MI_TRUE;
 }
 
-MI_Boolean AddChildToShell(ShellData *shellParent, CommonData *childData)
-{
-    CommonData *currentChild = shellParent->childNext;
-
-    while (currentChild)
-    {
-        if ((currentChild->requestType != CommonData_Type_Command) &&
-                (currentChild->requestType == childData->requestType))
-        {
-            /* Already have one of those */
-            return MI_FALSE;
-        }
-
-        currentChild = currentChild->siblingData;
-    }
-
-    /* Not found this type so we can add it */
-    childData->siblingData = shellParent->childNext;
-    shellParent->childNext = childData;
-    Atomic_Inc(&shellParent->common.refcount);
-
-    return MI_TRUE;
-}
-MI_Boolean AddChildToCommand(CommandData *commandParent, CommonData *childData)
-{
-    CommonData *currentChild = commandParent->childNext;
-
-    while (currentChild)
-    {
-        if ((currentChild->requestType != CommonData_Type_Command) &&
-                (currentChild->requestType == childData->requestType))
-        {
-            /* Already have one of those */
-            return MI_FALSE;
-        }
-
-        currentChild = currentChild->siblingData;
-    }
-
-    /* Not found this type so we can add it */
-    childData->siblingData = commandParent->childNext;
-    commandParent->childNext = childData;
-    Atomic_Inc(&commandParent->common.refcount);
-
-    return MI_TRUE;
-}
-MI_Boolean DetachOperationFromParent(CommonData *commonData)
-{
-    CommonData *parent = commonData->parentData;
-    CommonData **parentsChildren;
-
-    if (!parent)
-    {
-        /* We have been orphaned or we are the shell */
-        return MI_TRUE;
-    }
-    else if (parent->requestType == CommonData_Type_Command)
-        parentsChildren = &((CommandData*)parent)->childNext;
-    else
-        parentsChildren = &((ShellData*)parent)->childNext;
-
-    while (*parentsChildren)
-    {
-        if ((*parentsChildren) == commonData)
-        {
-            /* found it, remove it from the list */
-            (*parentsChildren) = commonData->siblingData;
-            CommonData_Release(parent);
-            return MI_TRUE;
-        }
-        parentsChildren = &(*parentsChildren)->siblingData;
-    }
-
-    return MI_FALSE;
-}
 
 
 typedef struct _CommandParams
 {
+    PluginCall call;
     _In_ Shell_Self* self;
     _In_ WSMAN_PLUGIN_REQUEST *requestDetails;
     _In_ MI_Uint32 flags;
@@ -1261,9 +1861,9 @@ typedef struct _CommandParams
     _In_opt_ WSMAN_COMMAND_ARG_SET *arguments;
 } CommandParams;
 
-PAL_Uint32  _CallCommand(void *_params)
+static void _CallCommand(WorkItem *item)
 {
-    CommandParams *params = (CommandParams*) _params;
+    CommandParams *params = (CommandParams*) item;
 
     params->self->managedPointers.wsManPluginCommandFuncPtr(
             params->self,
@@ -1272,8 +1872,6 @@ PAL_Uint32  _CallCommand(void *_params)
             params->shellContext,
             params->commandLine,
             params->arguments);
-    free(params);
-    return 0;
 }
 MI_Boolean CallCommand(
         _In_ Shell_Self* self,
@@ -1292,7 +1890,7 @@ MI_Boolean CallCommand(
         params->shellContext = shellContext;
         params->commandLine = commandLine;
         params->arguments = arguments;
-        if (Thread_CreateDetached(_CallCommand, NULL, params) == 0)
+        if (PostPluginCall(&self->dispatchPool, GetShellFromOperation((CommonData*)requestDetails), MI_TRUE, &params->call, _CallCommand))
             return MI_TRUE;
 
         free(params);
@@ -1317,6 +1915,7 @@ void MI_CALL Shell_Invoke_Command(Shell_Self* self, MI_Context* context,
     Batch *batch = NULL;
     MI_Char16 *command = NULL;
     char *errorMessage = NULL;
+    MI_Boolean attached = MI_FALSE;
 
     __LOGD(("Shell_Invoke_Command Name=%s, ShellId=%s", instanceName->Name.value, instanceName->ShellId.value));
 
@@ -1389,13 +1988,15 @@ void MI_CALL Shell_Invoke_Command(Shell_Self* self, MI_Context* context,
     commandData->common.refcount = 1;
     commandData->common.parentData = (CommonData*)shellData;
     commandData->common.requestType = CommonData_Type_Command;
+    ReadWriteLock_Init(&commandData->children.lock);
     commandData->common.miRequestContext = context;
     commandData->common.miOperationInstance = miOperationInstance;
 
     if (!AddChildToShell(shellData, (CommonData*) commandData))
     {
-        GOTO_ERROR("AddChildToShell failed", MI_RESULT_ALREADY_EXISTS); /* Only one command allowed at a time */
+        GOTO_ERROR("AddChildToShell failed", MI_RESULT_SERVER_LIMITS_EXCEEDED); /* Command table could not grow */
     }
+    attached = MI_TRUE;
     PrintDataFunctionStart(&commandData->common, "Shell_Invoke_Command");
 
     if (!CallCommand(
@@ -1411,6 +2012,7 @@ void MI_CALL Shell_Invoke_Command(Shell_Self* self, MI_Context* context,
     }
 
     /* Success path will send the response back from the callback from this API*/
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -1422,36 +2024,46 @@ error:
     if (commandData)
         PrintDataFunctionEnd(&commandData->common, "Shell_Invoke_Command", miResult);
 
-    if (batch)
+    /* Once in the command table others may hold references, so the last one frees it */
+    if (attached)
+        CommonData_Release(&commandData->common);
+    else if (batch)
         Batch_Delete(batch);
+
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
-CommandData *FindCommandFromShell(const ShellData *shell, const MI_Char *commandId)
+/* Finds the command with a reference held that the caller must drop with CommonData_Release */
+CommandData *FindCommandFromShell(ShellData *shell, const MI_Char *commandId)
 {
-    CommonData *child = shell->childNext;
+    CommandData *command = NULL;
+    MI_Uint32 hash;
 
     if (commandId == NULL)
         return NULL;
 
-    while (child)
+    hash = HashId(commandId);
+
+    ReadWriteLock_AcquireRead(&shell->children.lock);
+    if (shell->commandSize)
     {
-        if (child->requestType == CommonData_Type_Command)
+        command = shell->commandBuckets[hash & (shell->commandSize - 1)];
+        while (command && ((command->commandIdHash != hash) || (Tcscmp(commandId, command->commandId) != 0)))
         {
-            CommandData *command = (CommandData*)child;
-            if (Tcscmp(commandId, command->commandId) == 0)
-            {
-                return command;
-            }
+            command = (CommandData*) command->common.siblingData;
         }
-
-        child = child->siblingData;
+        if (command)
+            Atomic_Inc(&command->common.refcount);
     }
+    ReadWriteLock_ReleaseRead(&shell->children.lock);
 
-    return NULL;
+    return command;
 }
 
 typedef struct _SendParams
 {
+    PluginCall call;
     _In_ Shell_Self* self;
     _In_ WSMAN_PLUGIN_REQUEST *requestDetails;
     _In_ MI_Uint32 flags;
@@ -1461,9 +2073,9 @@ typedef struct _SendParams
     _In_ WSMAN_DATA *inboundData;
 } SendParams;
 
-PAL_Uint32  _CallSend(void *_params)
+static void _CallSend(WorkItem *item)
 {
-    SendParams *params = (SendParams*) _params;
+    SendParams *params = (SendParams*) item;
 
     params->self->managedPointers.wsManPluginSendFuncPtr(
             params->self,
@@ -1473,8 +2085,6 @@ PAL_Uint32  _CallSend(void *_params)
             params->commandContext,
             params->stream,
             params->inboundData);
-    free(params);
-    return 0;
 }
 MI_Boolean CallSend(
         _In_ Shell_Self* self,
@@ -1495,7 +2105,7 @@ MI_Boolean CallSend(
         params->commandContext = commandContext;
         params->stream = stream;
         params->inboundData = inboundData;
-        if (Thread_CreateDetached(_CallSend, NULL, params) == 0)
+        if (PostPluginCall(&self->dispatchPool, GetShellFromOperation((CommonData*)requestDetails), MI_TRUE, &params->call, _CallSend))
             return MI_TRUE;
 
         free(params);
@@ -1503,6 +2113,35 @@ MI_Boolean CallSend(
 
     return MI_FALSE;
 }
+/* Builds the instance a Send posts back when it completes. Only MIReturn goes back to the
+ * client, so rather than cloning the input with its encoded payload this carries just the
+ * stream's commandId and streamName, which are kept for logging.
+ */
+static MI_Result NewSendCompletion(const Shell_Send *in, Batch *batch, MI_Instance **completion)
+{
+    MI_Result miResult;
+    Stream *stream;
+
+    miResult = Instance_New(completion, (const MI_ClassDecl*) &Shell_Send_rtti, batch);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    miResult = Instance_New((MI_Instance**) &stream, &Stream_rtti, batch);
+    if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    if (in->streamData.value->commandId.exists &&
+        ((miResult = Stream_Set_commandId(stream, in->streamData.value->commandId.value)) != MI_RESULT_OK))
+        return miResult;
+
+    if (in->streamData.value->streamName.exists &&
+        ((miResult = Stream_Set_streamName(stream, in->streamData.value->streamName.value)) != MI_RESULT_OK))
+        return miResult;
+
+    /* Both live in the Send's batch so the stream is only borrowed */
+    return Shell_Send_SetPtr_streamData((Shell_Send*) *completion, stream);
+}
+
 /* Shell_Invoke_Send
  *
  * This CIM method is called when the client is delivering a chunk of data to the shell.
@@ -1523,9 +2162,10 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
     SendData *sendData = NULL;
     Batch *batch = NULL;
     DecodeBuffer decodeBuffer, decodedBuffer;
-    MI_Instance *clonedIn = NULL;
+    MI_Instance *completion = NULL;
     MI_Char16 *streamName;
     char *errorMessage = NULL;
+    MI_Boolean attached = MI_FALSE;
 
     memset(&decodeBuffer, 0, sizeof(decodeBuffer));
     memset(&decodedBuffer, 0, sizeof(decodedBuffer));
@@ -1548,20 +2188,14 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
         }
     }
 
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-
-    sendData = Batch_GetClear(batch, sizeof(SendData));
+    sendData = RequestPool_Get(&self->sendRequests, &batch);
     if (sendData == NULL)
     {
         GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
     sendData->common.batch = batch;
 
-    miResult = Instance_Clone(&in->__instance, &clonedIn, batch);
+    miResult = NewSendCompletion(in, batch, &completion);
     if (miResult != MI_RESULT_OK)
     {
         GOTO_ERROR("out of memory", miResult);
@@ -1576,39 +2210,23 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
         decodeBuffer.bufferLength = in->streamData.value->dataLength.value * sizeof(MI_Char);
         decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
 
-        /* Base-64 decode the data from decodeBuffer to decodedBuffer. The result buffer
-         * gets allocated in this function and we need to free it.*/
-        miResult = Base64DecodeBuffer(&decodeBuffer, &decodedBuffer);
+        /* Base-64 decode (and decompress if needed) the data from decodeBuffer to decodedBuffer
+         * in a single pass. The result buffer gets allocated in this function and we need to free it.
+         */
+        if (shellData->isCompressed)
+            miResult = Base64DecodeDecompressBuffer(&decodeBuffer, &decodedBuffer, &shellData->compressionCache);
+        else
+            miResult = Base64DecodeBuffer(&decodeBuffer, &decodedBuffer);
         if (miResult != MI_RESULT_OK)
         {
             /* decodeBuffer.buffer does not need deleting */
-            GOTO_ERROR("Failed to base64 decode send buffer", miResult);
+            GOTO_ERROR("Failed to decode send buffer", miResult);
         }
 
         /* decodeBuffer.buffer does not need freeing as it was from method in parameters. */
         /* We switch the decodedBuffer to decodeBuffer for further processing. */
         decodeBuffer = decodedBuffer;
         memset(&decodedBuffer, 0, sizeof(decodedBuffer));
-
-        if (shellData->isCompressed)
-        {
-            /* Decompress it from decodeBuffer to decodedBuffer. The result buffer
-             * gets allocated in this function and we need to free it.
-             */
-            miResult = DecompressBuffer(&decodeBuffer, &decodedBuffer);
-            if (miResult != MI_RESULT_OK)
-            {
-                free(decodeBuffer.buffer);
-                decodeBuffer.buffer = NULL;
-                GOTO_ERROR("Failed to decompress send buffer", miResult);
-            }
-
-            /* Free the previously allocated buffer and switch the
-             * decodedBuffer back to decodeBuffer for further processing.
-             */
-            free(decodeBuffer.buffer);
-            decodeBuffer = decodedBuffer;
-        }
     }
     else
     {
@@ -1632,7 +2250,7 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
 
         sendData->common.refcount = 1;
         sendData->common.miRequestContext = context;
-        sendData->common.miOperationInstance = clonedIn;
+        sendData->common.miOperationInstance = completion;
         sendData->common.requestType = CommonData_Type_Send;
 
         PrintDataFunctionStartStr(&sendData->common, "Shell_Invoke_Send", "streamName", in->streamData.value->streamName.value);
@@ -1645,6 +2263,7 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
             {
                 GOTO_ERROR("Already have a child send request", MI_RESULT_ALREADY_EXISTS);
             }
+            attached = MI_TRUE;
 
             if (!CallSend(
                         self,
@@ -1667,6 +2286,7 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
             {
                 GOTO_ERROR("Already have a child send request", MI_RESULT_ALREADY_EXISTS);
             }
+            attached = MI_TRUE;
 
             if (!CallSend(
                         self,
@@ -1683,6 +2303,9 @@ void MI_CALL Shell_Invoke_Send(Shell_Self* self, MI_Context* context,
         }
     }
     /* Now the plugin has been called the result is sent from the WSManPluginOperationComplete callback */
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -1694,12 +2317,21 @@ error:
     if (decodedBuffer.buffer)
         free(decodedBuffer.buffer);
 
-    if (batch)
-        Batch_Delete(batch);
+    /* Once attached others may hold references, so the last one puts it back */
+    if (attached)
+        CommonData_Release(&sendData->common);
+    else if (sendData)
+        RequestPool_Put(sendData);
+
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 typedef struct _ReceiveParams
 {
+    PluginCall call;
     _In_ Shell_Self* self;
     _In_ WSMAN_PLUGIN_REQUEST *requestDetails;
     _In_ MI_Uint32 flags;
@@ -1708,9 +2340,9 @@ typedef struct _ReceiveParams
     _In_opt_ WSMAN_STREAM_ID_SET* streamSet;
 } ReceiveParams;
 
-PAL_Uint32  _CallReceive(void *_params)
+static void _CallReceive(WorkItem *item)
 {
-    ReceiveParams *params = (ReceiveParams*) _params;
+    ReceiveParams *params = (ReceiveParams*) item;
 
     params->self->managedPointers.wsManPluginReceiveFuncPtr(
             params->self,
@@ -1719,8 +2351,6 @@ PAL_Uint32  _CallReceive(void *_params)
             params->shellContext,
             params->commandContext,
             params->streamSet);
-    free(params);
-    return 0;
 }
 MI_Boolean CallReceive(
         _In_ Shell_Self* self,
@@ -1739,7 +2369,7 @@ MI_Boolean CallReceive(
         params->shellContext = shellContext;
         params->commandContext = commandContext;
         params->streamSet = streamSet;
-        if (Thread_CreateDetached(_CallReceive, NULL, params) == 0)
+        if (PostPluginCall(&self->receivePool, GetShellFromOperation((CommonData*)requestDetails), MI_FALSE, &params->call, _CallReceive))
             return MI_TRUE;
 
         free(params);
@@ -1748,22 +2378,21 @@ MI_Boolean CallReceive(
     return MI_FALSE;
 }
 
-static MI_Uint32 _ShutdownReceiveTimeoutThread(ReceiveData *receiveData)
-{
-    MI_Uint32 threadResult = 0;
+/* The empty response is sent this long before the client's operation timeout so it
+ * gets there before the client gives up on the Receive.
+ */
+#define RECEIVE_TIMEOUT_MARGIN_MS 5000
 
-    /* ShutdownThread == 1 if shut down, 0 if running */
-    if (Atomic_CompareAndSwap(&receiveData->shutdownThread, 0, 1) == 0)
-    {
-        Sem_Post(&receiveData->timeoutSemaphore, 1);
-        Thread_Join(&receiveData->timeoutThread, &threadResult);
-        Sem_Destroy(&receiveData->timeoutSemaphore);
-        Thread_Destroy(&receiveData->timeoutThread);
-    }
-    return threadResult;
+static void _CancelReceiveTimeout(ReceiveData *receiveData)
+{
+    if (TimerService_Cancel(receiveData->timerService, &receiveData->timeoutTimer))
+        CommonData_Release(&receiveData->common);
 }
 
-static MI_Result  _CreateReceiveTimeoutThread(ReceiveData *receiveData)
+/* Work out how long a Receive request can wait for output. This has to be done before
+ * the request is handed over as the context may be gone once it has been.
+ */
+static MI_Uint32 _GetReceiveTimeout(MI_Context *context)
 {
     /* The WSMAN_OperationTimeout operation option (datetime) means we need to send a response back
      * before that time or the client will fail the operation. If a Receive respose is set we can cancel
@@ -1771,40 +2400,79 @@ static MI_Result  _CreateReceiveTimeoutThread(ReceiveData *receiveData)
      */
     MI_Type timeoutType;
     MI_Value timeout;
+    MI_Uint64 timeoutUsec = 0;
+    MI_Uint64 timeoutMilliseconds;
 
-    if ((MI_Context_GetCustomOption(receiveData->common.miRequestContext, MI_T("WSMan_OperationTimeout"), &timeoutType, &timeout) != MI_RESULT_OK) ||
+    if ((MI_Context_GetCustomOption(context, MI_T("WSMan_OperationTimeout"), &timeoutType, &timeout) != MI_RESULT_OK) ||
         (timeoutType != MI_DATETIME))
     {
         memset(&timeout, 0, sizeof(timeout));
         timeout.datetime.u.interval.seconds = 50;
     }
-    DatetimeToUsec(&timeout.datetime, &receiveData->timeoutMilliseconds);
-    receiveData->timeoutInUse = MI_TRUE;
+    DatetimeToUsec(&timeout.datetime, &timeoutUsec);
 
-    if (receiveData->timeoutInUse)
+    timeoutMilliseconds = timeoutUsec / 1000;
+    if (timeoutMilliseconds > 0xFFFFFFFF)
+        timeoutMilliseconds = 0xFFFFFFFF;
+
+    if (timeoutMilliseconds > (2 * RECEIVE_TIMEOUT_MARGIN_MS))
+        timeoutMilliseconds -= RECEIVE_TIMEOUT_MARGIN_MS;
+    else
+        timeoutMilliseconds /= 2;
+
+    return (MI_Uint32) timeoutMilliseconds;
+}
+
+/* Allowance for the XML around the stream data in a Receive response, and for each stream in it */
+#define RECEIVE_ENVELOPE_OVERHEAD 4096
+#define RECEIVE_STREAM_OVERHEAD 512
+
+/* WS-Management default for requests that do not say */
+#define RECEIVE_DEFAULT_MAX_ENVELOPE_SIZE 153600
+
+/* Work out how much stream data one response to a Receive request can carry. Like the
+ * timeout this has to be done before the request is handed over.
+ */
+static MI_Uint32 _GetReceiveResponseBudget(MI_Context *context)
+{
+    MI_Type envelopeType;
+    MI_Value envelope;
+    MI_Uint64 envelopeSize = RECEIVE_DEFAULT_MAX_ENVELOPE_SIZE;
+
+    if (MI_Context_GetCustomOption(context, MI_T("WSMan_MaxEnvelopeSize"), &envelopeType, &envelope) == MI_RESULT_OK)
     {
-        /* ShutdownThread == 1 if shut down, 0 if running */
-        if (Atomic_CompareAndSwap(&receiveData->shutdownThread, 1, 0) == 1)
-        {
-            if (Sem_Init(&receiveData->timeoutSemaphore, 0 /* TODO */, 0)!= 0)
-            {
-                //FAILED
-                receiveData->timeoutInUse = MI_FALSE;
-                receiveData->shutdownThread = 1;
-                return MI_RESULT_FAILED;
-            }
-            if (Thread_CreateJoinable(&receiveData->timeoutThread, ReceiveTimeoutThread, NULL /* threadDestructor */, receiveData)!= 0)
-            {
-                //FAILED
-                receiveData->timeoutInUse = MI_FALSE;
-                Sem_Destroy(&receiveData->timeoutSemaphore);
-                receiveData->shutdownThread = 1;
-                return MI_RESULT_FAILED;
-            }
-        }
+        if (envelopeType == MI_UINT32)
+            envelopeSize = envelope.uint32;
+        else if (envelopeType == MI_UINT64)
+            envelopeSize = envelope.uint64;
+    }
+    if (envelopeSize > 0xFFFFFFFF)
+        envelopeSize = 0xFFFFFFFF;
+
+    if (envelopeSize > (2 * RECEIVE_ENVELOPE_OVERHEAD))
+        envelopeSize -= RECEIVE_ENVELOPE_OVERHEAD;
+    else
+        envelopeSize /= 2;
+
+    return (MI_Uint32) envelopeSize;
+}
+
+/* Start or restart the timeout for the Receive request that is now waiting for output */
+static MI_Result _ArmReceiveTimeout(ReceiveData *receiveData)
+{
+    MI_Boolean rearmed = MI_FALSE;
+    MI_Result miResult;
 
-     }
-     return MI_RESULT_OK;
+    Atomic_Inc(&receiveData->common.refcount);
+    miResult = TimerService_Arm(receiveData->timerService, &receiveData->timeoutTimer, receiveData->timeoutMilliseconds, ReceiveTimeoutExpired, &rearmed);
+    if ((miResult != MI_RESULT_OK) || rearmed)
+    {
+        /* The timer already had its reference, or did not get armed. The caller still
+         * holds its own so this is never the last one.
+         */
+        Atomic_Dec(&receiveData->common.refcount);
+    }
+    return miResult;
 }
 
 /* Shell_Invoke_Receive
@@ -1826,6 +2494,7 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
     Batch *batch = NULL;
     MI_Instance *clonedIn = NULL;
     char *errorMessage = NULL;
+    MI_Boolean attached = MI_FALSE;
 
     __LOGD(("Shell_Invoke_Receive ShellId=%s", instanceName->ShellId.value));
 
@@ -1851,24 +2520,12 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
         }
 
         /* Find an existing receiveData is one exists */
-        {
-            CommonData *tmp = commandData->childNext;
-            while (tmp && (tmp->requestType != CommonData_Type_Receive))
-            {
-                tmp = tmp->siblingData;
-            }
-            receiveData = (ReceiveData*) tmp;
-        }
+        receiveData = (ReceiveData*) FindChildOperation(&commandData->common, CommonData_Type_Receive);
     }
     else
     {
         /* Find an existing receiveData is one exists */
-        CommonData *tmp = shellData->childNext;
-        while (tmp && (tmp->requestType != CommonData_Type_Receive))
-        {
-            tmp = tmp->siblingData;
-        }
-        receiveData = (ReceiveData*)tmp;
+        receiveData = (ReceiveData*) FindChildOperation(&shellData->common, CommonData_Type_Receive);
     }
 
 
@@ -1881,41 +2538,49 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
     if (receiveData)
     {
         /* We already have a Receive queued up with the plug-in so cache the context and wake it up in case it is waiting for it */
-        MI_Context *tmpContext = (MI_Context*) Atomic_Swap((ptrdiff_t*) &receiveData->common.miRequestContext, (ptrdiff_t) context);
+        MI_Context *tmpContext;
+        MI_Uint32 timeoutMilliseconds = _GetReceiveTimeout(context);
+        MI_Uint32 responseBudget = _GetReceiveResponseBudget(context);
+
+        /* The timeout and budget belong to the request whose context is in place, so they
+         * only change along with it. A request that is turned away must not touch them.
+         */
+        Lock_Acquire(&receiveData->queueLock);
+        tmpContext = (MI_Context*) Atomic_CompareAndSwap((ptrdiff_t*) &receiveData->common.miRequestContext, (ptrdiff_t) NULL, (ptrdiff_t) context);
+        if (tmpContext == NULL)
+        {
+            receiveData->timeoutMilliseconds = timeoutMilliseconds;
+            receiveData->responseBudget = responseBudget;
+        }
+        Lock_Release(&receiveData->queueLock);
         if (tmpContext != NULL)
         {
+            CommonData_Release(&receiveData->common);
+            receiveData = NULL;
             GOTO_ERROR("Receive is still processing a command so cannot process another one yet", MI_RESULT_NOT_SUPPORTED);
         }
         PrintDataFunctionStart(&receiveData->common, "Shell_Invoke_Receive* - using existing queued up receive");
 
-        /* Create timeout thread if one is not there...
-         * remember, it could have been disconnnected and so the thread
-         * would have been shut down.
+        /* Restart the timeout for this request, then send anything that was queued while
+         * there was no request to carry it. That cancels the timeout again.
          */
-        _CreateReceiveTimeoutThread(receiveData);
-
-        Sem_Post(&receiveData->timeoutSemaphore, 1);   /* Wake up thread to reset timer */
-        CondLock_Broadcast((ptrdiff_t)&receiveData->common.miRequestContext); /* Broadcast in case we have thread waiting for context */
+        if (_ArmReceiveTimeout(receiveData) != MI_RESULT_OK)
+        {
+            __LOGE(("Shell_Invoke_Receive - failed to arm receive timeout"));
+        }
+        DrainReceiveQueue(receiveData, ReceiveDrain_Now);
+        CommonData_Release(&receiveData->common);
+        if (commandData)
+            CommonData_Release(&commandData->common);
+        CommonData_Release(&shellData->common);
         return;
     }
 
     /* new one */
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-
-    miResult = Instance_Clone(&in->__instance, &clonedIn, batch);
-    if (miResult != MI_RESULT_OK)
-    {
-        GOTO_ERROR("out of memory", miResult);
-    }
-
-    receiveData = Batch_GetClear(batch, sizeof(ReceiveData));
+    receiveData = RequestPool_Get(&self->receiveRequests, &batch);
     if (receiveData == NULL)
     {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED); /* Broadcast in case we have thread waiting for context */
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
     receiveData->common.batch = batch;
 
@@ -1929,6 +2594,11 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
     {
         GOTO_ERROR("ExtractStreamSet failed", MI_RESULT_SERVER_LIMITS_EXCEEDED);
     }
+    receiveData->storedRuns = Batch_GetClear(batch, sizeof(ptrdiff_t) * receiveData->outputStreams.streamNamesCount);
+    if ((receiveData->storedRuns == NULL) && receiveData->outputStreams.streamNamesCount)
+    {
+        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
+    }
 
     if (!ExtractPluginRequest(context, &shellData->common))
     {
@@ -1944,13 +2614,15 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
     receiveData->common.miOperationInstance = clonedIn;
     receiveData->common.requestType = CommonData_Type_Receive;
 
-    PrintDataFunctionStart(&receiveData->common, "Shell_Invoke_Receive");
+    receiveData->timerService = &self->timerService;
+    receiveData->timeoutMilliseconds = _GetReceiveTimeout(context);
+    receiveData->responseBudget = _GetReceiveResponseBudget(context);
+    Lock_Init(&receiveData->queueLock);
+    Lock_Init(&receiveData->responseLock);
+    receiveData->queueLimit = self->receiveQueueLength;
+    receiveData->lingerMilliseconds = self->receiveLingerMilliseconds;
 
-    receiveData->shutdownThread = 1;    /* initial state is shut down */
-    if (_CreateReceiveTimeoutThread(receiveData)!= MI_RESULT_OK)
-    {
-        GOTO_ERROR("Failed to create Receive timeout thread", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
+    PrintDataFunctionStart(&receiveData->common, "Shell_Invoke_Receive");
 
     if (commandData)
     {
@@ -1958,10 +2630,12 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
 
         if (!AddChildToCommand(commandData, (CommonData*)receiveData))
         {
-            _ShutdownReceiveTimeoutThread(receiveData);
             GOTO_ERROR("Failed to add receive operation to command", MI_RESULT_ALREADY_EXISTS);
         }
+        attached = MI_TRUE;
 
+        /* Keep the receive alive until its timeout is armed, the plug-in may be done with it before then */
+        Atomic_Inc(&receiveData->common.refcount);
         if (!CallReceive(
                     self,
                     &receiveData->common.pluginRequest,
@@ -1970,7 +2644,7 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
                     commandData->pluginCommandContext,
                     &receiveData->wsmanOutputStreams))
         {
-            _ShutdownReceiveTimeoutThread(receiveData);
+            Atomic_Dec(&receiveData->common.refcount);
             DetachOperationFromParent(&receiveData->common);
             GOTO_ERROR("CallReceive failed", MI_RESULT_FAILED);
         }
@@ -1981,10 +2655,12 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
 
         if (!AddChildToShell(shellData, (CommonData*)receiveData))
         {
-            _ShutdownReceiveTimeoutThread(receiveData);
             GOTO_ERROR("Adding child receive request failed", MI_RESULT_ALREADY_EXISTS);
         }
+        attached = MI_TRUE;
 
+        /* Keep the receive alive until its timeout is armed, the plug-in may be done with it before then */
+        Atomic_Inc(&receiveData->common.refcount);
         if (!CallReceive(
                     self,
                     &receiveData->common.pluginRequest,
@@ -1993,13 +2669,23 @@ void MI_CALL Shell_Invoke_Receive(Shell_Self* self, MI_Context* context,
                     NULL,
                     &receiveData->wsmanOutputStreams))
         {
-            _ShutdownReceiveTimeoutThread(receiveData);
+            Atomic_Dec(&receiveData->common.refcount);
             DetachOperationFromParent(&receiveData->common);
             GOTO_ERROR("Adding child receive request failed", MI_RESULT_FAILED);
         }
     }
 
+    /* If the output beat us to the context the timer finds nothing to send when it fires */
+    if (_ArmReceiveTimeout(receiveData) != MI_RESULT_OK)
+    {
+        __LOGE(("Shell_Invoke_Receive - failed to arm receive timeout"));
+    }
+    CommonData_Release(&receiveData->common);
+
     /* Posting on receive context happens when we get WSManPluginOperationComplete callback to terminate the request or WSManPluginReceiveResult with some data */
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -2009,14 +2695,21 @@ error:
 
     if (receiveData)
         PrintDataFunctionEnd(&receiveData->common, "Shell_Invoke_Receive", miResult);
-    if (batch)
-    {
-        Batch_Delete(batch);
-    }
+    /* Once attached others may hold references, so the last one puts it back */
+    if (attached)
+        CommonData_Release(&receiveData->common);
+    else if (receiveData)
+        RequestPool_Put(receiveData);
+
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 typedef struct _SignalParams
 {
+    PluginCall call;
     _In_ Shell_Self* self;
     _In_ WSMAN_PLUGIN_REQUEST *requestDetails;
     _In_ MI_Uint32 flags;
@@ -2025,9 +2718,9 @@ typedef struct _SignalParams
     _In_ MI_Char16 *code;
 } SignalParams;
 
-PAL_Uint32  _CallSignal(void *_params)
+static void _CallSignal(WorkItem *item)
 {
-    SignalParams *params = (SignalParams*) _params;
+    SignalParams *params = (SignalParams*) item;
     params->self->managedPointers.wsManPluginSignalFuncPtr(
             params->self,
             params->requestDetails,
@@ -2035,8 +2728,6 @@ PAL_Uint32  _CallSignal(void *_params)
             params->shellContext,
             params->commandContext,
             params->code);
-    free(params);
-    return 0;
 }
 MI_Boolean CallSignal(
         _In_ Shell_Self* self,
@@ -2055,7 +2746,9 @@ MI_Boolean CallSignal(
         params->shellContext = shellContext;
         params->commandContext = commandContext;
         params->code = code;
-        if (Thread_CreateDetached(_CallSignal, NULL, params) == 0)
+
+        /* Not ordered behind the shell's other calls as a signal is often what unblocks them */
+        if (PostPluginCall(&self->dispatchPool, GetShellFromOperation((CommonData*)requestDetails), MI_FALSE, &params->call, _CallSignal))
             return MI_TRUE;
 
         free(params);
@@ -2083,6 +2776,7 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
     MI_Instance *clonedIn = NULL;
     MI_Char16 *signalCode = NULL;
     char *errorMessage = NULL;
+    MI_Boolean attached = MI_FALSE;
 
     __LOGD(("Shell_Invoke_Signal Name=%s, ShellId=%s", instanceName->Name.value, instanceName->ShellId.value));
 
@@ -2104,13 +2798,7 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
         }
     }
 
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-
-    signalData = Batch_GetClear(batch, sizeof(SignalData));
+    signalData = RequestPool_Get(&self->signalRequests, &batch);
     if (signalData == NULL)
     {
         GOTO_ERROR("Out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
@@ -2154,6 +2842,7 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
             {
                 GOTO_ERROR("Failed to add signal operation, already exists?", MI_RESULT_ALREADY_EXISTS);
             }
+            attached = MI_TRUE;
         }
         else
         {
@@ -2163,6 +2852,7 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
             {
                 GOTO_ERROR("Failed to add signal operation, already exists?", MI_RESULT_ALREADY_EXISTS);
             }
+            attached = MI_TRUE;
         }
 
         PrintDataFunctionStartStr(&signalData->common, "Shell_Invoke_Signal", "code", ((Shell_Signal*)clonedIn)->code.value);
@@ -2182,6 +2872,9 @@ void MI_CALL Shell_Invoke_Signal(Shell_Self* self, MI_Context* context,
     }
 
     /* Posting on signal context happens when we get a WSManPluginOperationComplete callback */
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -2190,9 +2883,33 @@ error:
     MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
     PrintDataFunctionEnd(&signalData->common, "Shell_Invoke_Signal", miResult);
 
-    if (batch)
+    /* Once attached others may hold references, so the last one puts it back */
+    if (attached)
+        CommonData_Release(&signalData->common);
+    else if (signalData)
+        RequestPool_Put(signalData);
+
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    if (shellData)
+        CommonData_Release(&shellData->common);
+}
+
+/* Fails any Receive that is waiting on parent so the client sees the stream disconnect */
+static void DisconnectReceive(CommonData *parent)
+{
+    CommonData *child = FindChildOperation(parent, CommonData_Type_Receive);
+
+    if (child)
     {
-        Batch_Delete(batch);
+        /* Send error to this to disconnect it */
+        MI_Context *miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&child->miRequestContext, (ptrdiff_t) NULL);
+        if (miContext)
+        {
+            MI_Context_PostError(miContext, ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED, MI_RESULT_TYPE_WINRM, MI_T("The WS-Management service cannot process the request because the stream is currently disconnected."));
+            _CancelReceiveTimeout((ReceiveData*)child);
+        }
+        CommonData_Release(child);
     }
 }
 
@@ -2228,43 +2945,19 @@ void MI_CALL Shell_Invoke_Disconnect(
         shellData->connectedState = Disconnected;
     }
 
-    /* Enumerate through the nested Receive operations to disconnect them */
+    /* Disconnect the Receive operations on the shell and on each of its commands */
     {
-        CommonData *child = shellData->childNext;
+        MI_Uint32 commandCount;
+        MI_Uint32 i;
+        CommandData **commands = SnapshotCommands(shellData, &commandCount);
 
-        while (child)
+        DisconnectReceive(&shellData->common);
+        for (i = 0; i != commandCount; i++)
         {
-            if (child->requestType == CommonData_Type_Receive)
-            {
-                /* Send error to this to disconnect it */
-                MI_Context *miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&child->miRequestContext, (ptrdiff_t) NULL);
-                if (miContext)
-                {
-                    MI_Context_PostError(miContext, ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED, MI_RESULT_TYPE_WINRM, MI_T("The WS-Management service cannot process the request because the stream is currently disconnected."));
-                    _ShutdownReceiveTimeoutThread((ReceiveData*)child);
-                }
-            }
-            else if (child->requestType == CommonData_Type_Command)
-            {
-                CommandData *command = (CommandData*)child;
-                CommonData *commandChild = command->childNext;
-                while (commandChild)
-                {
-                    if (commandChild->requestType == CommonData_Type_Receive)
-                    {
-                        /* Send error to this to disconnect it */
-                        MI_Context *miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&commandChild->miRequestContext, (ptrdiff_t) NULL);
-                        if (miContext)
-                        {
-                            MI_Context_PostError(miContext, ERROR_WSMAN_SERVICE_STREAM_DISCONNECTED, MI_RESULT_TYPE_WINRM, MI_T("The WS-Management service cannot process the request because the stream is currently disconnected."));
-                        }
-                    }
-                    commandChild = commandChild->siblingData;
-                }
-            }
-
-            child = child->siblingData;
+            DisconnectReceive(&commands[i]->common);
+            CommonData_Release(&commands[i]->common);
         }
+        free(commands);
     }
 
 
@@ -2289,6 +2982,8 @@ error:
     }
     __LOGD(("Shell_Invoke_Disconnect PostResult %p, %u", context, miResult));
 
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 void MI_CALL Shell_Invoke_Reconnect(
@@ -2339,10 +3034,14 @@ error:
         MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
     }
     __LOGD(("Shell_Invoke_Reconnect PostResult %p, %u", context, miResult));
+
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 typedef struct _ConnectParams
 {
+    PluginCall call;
     _In_ Shell_Self* self;
     _In_ WSMAN_PLUGIN_REQUEST *requestDetails;
     _In_ MI_Uint32 flags;
@@ -2352,9 +3051,9 @@ typedef struct _ConnectParams
     _In_opt_ WSMAN_DATA inboundConnectInformation;
 } ConnectParams;
 
-PAL_Uint32  _CallConnect(void *_params)
+static void _CallConnect(WorkItem *item)
 {
-    ConnectParams *params = (ConnectParams*) _params;
+    ConnectParams *params = (ConnectParams*) item;
     params->self->managedPointers.wsManPluginConnectFuncPtr(
             params->self,
             params->requestDetails,
@@ -2362,8 +3061,6 @@ PAL_Uint32  _CallConnect(void *_params)
             params->shellContext,
             params->commandContext,
             &params->inboundConnectInformation);
-    free(params);
-    return 0;
 }
 MI_Boolean CallConnect(
         _In_ Shell_Self* self,
@@ -2382,7 +3079,7 @@ MI_Boolean CallConnect(
         params->shellContext = shellContext;
         params->commandContext = commandContext;
         params->inboundConnectInformation = *inboundConnectInformation;
-        if (Thread_CreateDetached(_CallConnect, NULL, params) == 0)
+        if (PostPluginCall(&self->dispatchPool, GetShellFromOperation((CommonData*)requestDetails), MI_TRUE, &params->call, _CallConnect))
             return MI_TRUE;
 
         free(params);
@@ -2406,6 +3103,7 @@ void MI_CALL Shell_Invoke_Connect(
     Batch *batch = NULL;
     MI_Instance *clonedIn = NULL;
     char *errorMessage = NULL;
+    MI_Boolean attached = MI_FALSE;
 
     __LOGD(("Shell_Invoke_Connect Name=%s, ShellId=%s", instanceName->Name.value, instanceName->ShellId.value));
 
@@ -2414,13 +3112,7 @@ void MI_CALL Shell_Invoke_Connect(
         GOTO_ERROR("Failed to find shell", MI_RESULT_NOT_FOUND);
     }
 
-    batch = Batch_New(BATCH_MAX_PAGES);
-    if (batch == NULL)
-    {
-        GOTO_ERROR("out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
-    }
-
-    connectData = Batch_GetClear(batch, sizeof(ConnectData));
+    connectData = RequestPool_Get(&self->connectRequests, &batch);
     if (connectData == NULL)
     {
         GOTO_ERROR("Out of memory", MI_RESULT_SERVER_LIMITS_EXCEEDED);
@@ -2475,6 +3167,7 @@ void MI_CALL Shell_Invoke_Connect(
             {
                 GOTO_ERROR("Failed to add connect operation, already exists?", MI_RESULT_ALREADY_EXISTS);
             }
+            attached = MI_TRUE;
         }
         else
         {
@@ -2484,6 +3177,7 @@ void MI_CALL Shell_Invoke_Connect(
             {
                 GOTO_ERROR("Failed to add connect operation, already exists?", MI_RESULT_ALREADY_EXISTS);
             }
+            attached = MI_TRUE;
         }
 
         PrintDataFunctionStart(&connectData->common, "Shell_Invoke_Connect");
@@ -2512,6 +3206,9 @@ void MI_CALL Shell_Invoke_Connect(
     }
 
     /* Posting on signal context happens when we get a WSManPluginOperationComplete callback */
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    CommonData_Release(&shellData->common);
     return;
 
 error:
@@ -2520,10 +3217,16 @@ error:
     MI_Context_PostError(context, miResult, MI_RESULT_TYPE_MI, errorMessage);
     PrintDataFunctionEnd(&connectData->common, "Shell_Invoke_Connect", miResult);
 
-    if (batch)
-    {
-        Batch_Delete(batch);
-    }
+    /* Once attached others may hold references, so the last one puts it back */
+    if (attached)
+        CommonData_Release(&connectData->common);
+    else if (connectData)
+        RequestPool_Put(connectData);
+
+    if (commandData)
+        CommonData_Release(&commandData->common);
+    if (shellData)
+        CommonData_Release(&shellData->common);
 }
 
 /* report a shell or command context from the winrm plugin. We use this for future calls into the plugin.
@@ -2585,6 +3288,17 @@ MI_Boolean IsStreamCompressed(CommonData *commonData)
     return IsStreamCompressed(commonData->parentData);
 }
 
+/* Max recursion is for a child operation of a command which is 2 recursions to hit the shell */
+static CompressionCache *GetCompressionCache(CommonData *commonData)
+{
+    if (commonData->parentData == NULL)
+    {
+        ShellData *shellData = (ShellData*)commonData;
+        return &shellData->compressionCache;
+    }
+    return GetCompressionCache(commonData->parentData);
+}
+
 static const char *ReceiveResultsFlags(MI_Uint32 flag)
 {
     static const char *flagStrings[] =
@@ -2604,208 +3318,383 @@ static const char *ReceiveResultsFlags(MI_Uint32 flag)
         return "<invalid>";
 }
 
-/*
- * The WSMAN plug-in gets called once and it keeps sending data back to us.
- * At our level, however, we need to potentially wait for the next request
- * before we can send more.
+/* Converts a result from the plug-in into the form it is sent back in. The plug-in's
+ * buffers are only valid for the duration of the call so everything is copied.
  */
-MI_Uint32 _WSManPluginReceiveResult(
-    _In_ MI_Context *receiveContext,
+/* Finds the run of stored chunks kept for an output stream of the Receive. Streams it
+ * was not asked for get none, so every chunk of them is tried.
+ */
+static ptrdiff_t *GetStoredRun(ReceiveData *receiveData, const MI_Char16 *streamName, size_t streamNameLength)
+{
+    MI_Uint32 i;
+
+    for (i = 0; i != receiveData->outputStreams.streamNamesCount; i++)
+    {
+        const MI_Char16 *name = receiveData->outputStreams.streamNames[i];
+
+        if ((Utf16LeStrLenBytes(name) == streamNameLength * sizeof(MI_Char16)) &&
+            (memcmp(name, streamName, streamNameLength * sizeof(MI_Char16)) == 0))
+        {
+            return &receiveData->storedRuns[i];
+        }
+    }
+    return NULL;
+}
+
+static MI_Result ReceiveResult_New(
     _In_ CommonData *commonData,
     _In_ MI_Uint32 flags,
     _In_opt_ const MI_Char16 * _streamName,
     _In_opt_ WSMAN_DATA *streamResult,
     _In_opt_ const MI_Char16 * _commandState,
-    _In_ MI_Uint32 exitCode
-    )
+    _In_ MI_Uint32 exitCode,
+    _Out_ ReceiveResult **result)
 {
-    MI_Result miResult;
-    char *errorMessage = NULL;
-    CommandState commandStateInst;
-    MI_Instance *receive = NULL;
-    Stream receiveStream;
-    DecodeBuffer decodeBuffer, decodedBuffer;
-    MI_Char *streamName = NULL;
-    MI_Char *commandState = NULL;
-    Batch *tempBatch;
-    MI_Char *commandId = NULL;
-    MI_Value miValue;
+    size_t streamNameLength = _streamName ? (Utf16LeStrLenBytes(_streamName) / sizeof(MI_Char16)) : 0;
+    size_t commandStateLength = _commandState ? (Utf16LeStrLenBytes(_commandState) / sizeof(MI_Char16)) : 0;
+    ReceiveResult *newResult;
+    char *strings;
+    MI_Result miResult = MI_RESULT_OK;
 
-    memset(&decodeBuffer, 0, sizeof(decodeBuffer));
-    memset(&decodedBuffer, 0, sizeof(decodedBuffer));
+    *result = NULL;
 
-    if (commonData->requestType != CommonData_Type_Receive)
-        return MI_RESULT_INVALID_PARAMETER;
-
-    tempBatch = Batch_New(BATCH_MAX_PAGES);
-    if (tempBatch == NULL)
+    /* Non-ASCII characters take more than one byte so size for the worst case */
+    newResult = malloc(sizeof(ReceiveResult) + ((streamNameLength + commandStateLength) * UTF8_BYTES_PER_UTF16_UNIT));
+    if (newResult == NULL)
         return MI_RESULT_SERVER_LIMITS_EXCEEDED;
 
-    if (_streamName && !Utf16LeToUtf8(tempBatch, _streamName, &streamName))
+    memset(newResult, 0, sizeof(ReceiveResult));
+    newResult->flags = flags;
+    newResult->exitCode = exitCode;
+    strings = (char*)(newResult + 1);
+
+    if (_streamName)
     {
-        GOTO_ERROR_EX("Utf16LeToUtf8 failed", MI_RESULT_SERVER_LIMITS_EXCEEDED, errorSkipInstanceDeletes);
+        newResult->streamName = strings;
+        if (!Utf16LeToUtf8Buffer(_streamName, streamNameLength, strings, streamNameLength * UTF8_BYTES_PER_UTF16_UNIT, NULL))
+        {
+            free(newResult);
+            return MI_RESULT_INVALID_PARAMETER;
+        }
+        strings += streamNameLength * UTF8_BYTES_PER_UTF16_UNIT;
     }
-    if (_commandState && !Utf16LeToUtf8(tempBatch, _commandState, &commandState))
+    if (_commandState)
     {
-        GOTO_ERROR_EX("Utf16LeToUtf8 failed", MI_RESULT_SERVER_LIMITS_EXCEEDED, errorSkipInstanceDeletes);
+        newResult->commandState = strings;
+        if (!Utf16LeToUtf8Buffer(_commandState, commandStateLength, strings, commandStateLength * UTF8_BYTES_PER_UTF16_UNIT, NULL))
+        {
+            free(newResult);
+            return MI_RESULT_INVALID_PARAMETER;
+        }
     }
-    /* TODO: Which stream if stream is NULL? */
 
-    PrintDataFunctionStartStr2(commonData, "_WSManPluginReceiveResult", "commandState", commandState, "flags", ReceiveResultsFlags(flags));
+    if (streamResult)
+    {
+        DecodeBuffer decodeBuffer, decodedBuffer;
 
+        memset(&decodedBuffer, 0, sizeof(decodedBuffer));
+        decodeBuffer.buffer = (MI_Char*)streamResult->binaryData.data;
+        decodeBuffer.bufferLength = streamResult->binaryData.dataLength;
+        decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
+
+        /* NOTE: Both encoders allocate and write the NULL terminator so the result
+        * can be used as a string as is.
+        */
+        if (IsStreamCompressed(commonData))
+        {
+            /* Re-compress and encode it from decodeBuffer to decodedBuffer in a single
+             * pass. The result buffer gets allocated in this function and we need to free it.
+             */
+            miResult = CompressBase64EncodeBuffer(&decodeBuffer, &decodedBuffer, GetCompressionCache(commonData),
+                _streamName ? GetStoredRun((ReceiveData*)commonData, _streamName, streamNameLength) : NULL);
+        }
+        else
+        {
+            miResult = Base64EncodeBuffer(&decodeBuffer, &decodedBuffer);
+        }
+        if (miResult != MI_RESULT_OK)
+        {
+            __LOGE(("ReceiveResult_New - failed to encode stream data (result=%u)", miResult));
+            free(decodedBuffer.buffer);
+            free(newResult);
+            return miResult;
+        }
+        newResult->data = decodedBuffer.buffer;
+        newResult->dataLength = decodedBuffer.bufferUsed;
+    }
+
+    *result = newResult;
+    return MI_RESULT_OK;
+}
 
-    /* Clone the result object for Receive because we will reuse it for each receive response */
-//    miResult = Instance_Clone(commonData->miOperationInstance, (MI_Instance**)&receive, NULL);
-    miResult = Instance_NewDynamic(&receive, MI_T("Receive"), MI_FLAG_METHOD, tempBatch);
+static void ReceiveResult_Free(ReceiveResult *result)
+{
+    free(result->data);
+    free(result);
+}
+
+/* Builds the command state a Receive reuses for every response it sends, with the
+ * command ID already set. Called with the response lock held.
+ */
+static MI_Result BuildReceiveResponse(ReceiveData *receiveData, MI_Context *receiveContext)
+{
+    MI_Result miResult;
+    MI_Value miValue;
+
+    miResult = CommandState_Construct(&receiveData->responseState, receiveContext);
     if (miResult != MI_RESULT_OK)
+        return miResult;
+    receiveData->responseBuilt = MI_TRUE;
+
+    if (MI_Instance_GetElement(receiveData->common.miOperationInstance, MI_T("commandId"), &miValue, NULL, NULL, NULL) == MI_RESULT_OK &&
+        miValue.string)
+    {
+        CommandState_Set_commandId(&receiveData->responseState, miValue.string);
+    }
+
+    return MI_RESULT_OK;
+}
+
+/* Returns the Receive instance to post streamCount streams with, building it the first
+ * time. The Stream out parameter is a single embedded instance or an array of them
+ * depending on the count, and the type of an element cannot change once added, so there
+ * is one instance for none or one stream and another for several. Everything is
+ * borrowed so each response only has to patch the streams and state. Called with the
+ * response lock held and at least one stream instance built.
+ */
+static MI_Result GetReceiveResponse(ReceiveData *receiveData, MI_Uint32 streamCount, MI_Instance **response)
+{
+    MI_Instance **slot = (streamCount > 1) ? &receiveData->responseArray : &receiveData->response;
+    MI_Instance *receive = NULL;
+    MI_Result miResult;
+    MI_Value miValue;
+
+    if (*slot)
     {
-        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+        *response = *slot;
+        return MI_RESULT_OK;
     }
 
-    miResult =  CommandState_Construct(&commandStateInst, receiveContext);
+    /* The instance owns its batch as it lives as long as the Receive */
+    miResult = Instance_NewDynamic(&receive, MI_T("Receive"), MI_FLAG_METHOD, NULL);
     if (miResult != MI_RESULT_OK)
+        return miResult;
+
+    if (streamCount > 1)
+    {
+        miValue.instancea.data = (MI_Instance**) receiveData->responseStreamRefs;
+        miValue.instancea.size = streamCount;
+        miResult = MI_Instance_AddElement(receive, MI_T("Stream"), &miValue, MI_INSTANCEA, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
+    }
+    else
     {
-        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+        miValue.instance = &receiveData->responseStreams[0].__instance;
+        miResult = MI_Instance_AddElement(receive, MI_T("Stream"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
     }
-    miResult = Stream_Construct(&receiveStream, receiveContext);
     if (miResult != MI_RESULT_OK)
+        goto error;
+
+    /* The result of the Receive contains the command results and a set of streams */
+    miValue.uint32 = MI_RESULT_OK;
+    miResult = MI_Instance_AddElement(receive, MI_T("MIReturn"), &miValue, MI_UINT32, MI_FLAG_OUT | MI_FLAG_PARAMETER);
+    if (miResult != MI_RESULT_OK)
+        goto error;
+
+    miValue.instance = &receiveData->responseState.__instance;
+    miResult = MI_Instance_AddElement(receive, MI_T("CommandState"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
+    if (miResult != MI_RESULT_OK)
+        goto error;
+
+    *slot = receive;
+    *response = receive;
+    return MI_RESULT_OK;
+
+error:
+    MI_Instance_Delete(receive);
+    return miResult;
+}
+
+/* Makes sure there are at least streamCount stream instances to fill in. Called with the
+ * response lock held.
+ */
+static MI_Result BuildReceiveResponseStreams(ReceiveData *receiveData, MI_Context *receiveContext, MI_Uint32 streamCount)
+{
+    MI_Result miResult;
+
+    if (streamCount > RECEIVE_MAX_STREAMS_PER_RESPONSE)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+
+    while (receiveData->responseStreamCount < streamCount)
     {
-        Stream_Destruct(&receiveStream);
-        GOTO_ERROR_EX("out of memory", miResult, errorSkipInstanceDeletes);
+        Stream *receiveStream = &receiveData->responseStreams[receiveData->responseStreamCount];
+
+        miResult = Stream_Construct(receiveStream, receiveContext);
+        if (miResult != MI_RESULT_OK)
+            return miResult;
+
+        if (receiveData->responseState.commandId.exists)
+        {
+            Stream_SetPtr_commandId(receiveStream, receiveData->responseState.commandId.value);
+        }
+        receiveData->responseStreamRefs[receiveData->responseStreamCount++] = receiveStream;
     }
+    return MI_RESULT_OK;
+}
 
-    /* Set the command ID for the instances that need it */
-    if (MI_Instance_GetElement(commonData->miOperationInstance, MI_T("commandId"), &miValue, NULL, NULL, NULL) == MI_RESULT_OK)
+static void FreeReceiveResponse(ReceiveData *receiveData)
+{
+    /* The instances only borrow the streams and state so go before them */
+    if (receiveData->response)
     {
-        commandId = miValue.string;
+        MI_Instance_Delete(receiveData->response);
+        receiveData->response = NULL;
     }
-    if (commandId)
+    if (receiveData->responseArray)
     {
-        CommandState_SetPtr_commandId(&commandStateInst, commandId);
-        Stream_SetPtr_commandId(&receiveStream, commandId);
+        MI_Instance_Delete(receiveData->responseArray);
+        receiveData->responseArray = NULL;
     }
 
-    if (streamResult)
+    while (receiveData->responseStreamCount)
+        Stream_Destruct(&receiveData->responseStreams[--receiveData->responseStreamCount]);
+
+    if (receiveData->responseBuilt)
     {
-        decodeBuffer.buffer = (MI_Char*)streamResult->binaryData.data;
-        decodeBuffer.bufferLength = streamResult->binaryData.dataLength;
-        decodeBuffer.bufferUsed = decodeBuffer.bufferLength;
+        CommandState_Destruct(&receiveData->responseState);
+        receiveData->responseBuilt = MI_FALSE;
+    }
+}
 
-        if (IsStreamCompressed(commonData))
-        {
-            /* Re-compress it from decodeBuffer to decodedBuffer. The result buffer
-             * gets allocated in this function and we need to free it.
-             */
-            miResult = CompressBuffer(&decodeBuffer, &decodedBuffer, sizeof(MI_Char));
-            if (miResult != MI_RESULT_OK)
-            {
-                decodeBuffer.buffer = NULL;
-                GOTO_ERROR("CompressBuffer failed", miResult);
-            }
+/* Sends a chain of results back as the response to one Receive request, one Stream for
+ * each result with data. The command state comes from the last result in the chain.
+ */
+static MI_Result PostReceiveResults(
+    _In_ MI_Context *receiveContext,
+    _In_ CommonData *commonData,
+    _In_ const ReceiveResult *results
+    )
+{
+    ReceiveData *receiveData = (ReceiveData*) commonData;
+    MI_Result miResult;
+    char *errorMessage = NULL;
+    MI_Uint32 streamCount = 0;
+    const ReceiveResult *result;
+    const ReceiveResult *lastResult = results;
+    Stream *receiveStream;
+    MI_Instance *receive = NULL;
+    MI_Value miValue;
 
-            /* switch the decodedBuffer back to decodeBuffer for further processing.
-             */
-            decodeBuffer = decodedBuffer;
-        }
+    for (result = results; result; result = result->next)
+    {
+        if (result->data)
+            streamCount++;
+        lastResult = result;
+    }
 
-        /* NOTE: Base64EncodeBuffer allocates enough space for a NULL terminator */
-        miResult = Base64EncodeBuffer(&decodeBuffer, &decodedBuffer);
+    PrintDataFunctionStartNumStr(commonData, "PostReceiveResults", "streams", streamCount, "commandState", lastResult->commandState);
 
-        /* Free previously allocated buffer if it was compressed. */
-        if (IsStreamCompressed(commonData))
-        {
-            free(decodeBuffer.buffer);
-        }
-        decodeBuffer.buffer = NULL;
+    /* The client does not send another Receive until it has this response, but the
+     * response must not change until it has been posted all the same.
+     */
+    Lock_Acquire(&receiveData->responseLock);
 
+    if (!receiveData->responseBuilt)
+    {
+        miResult = BuildReceiveResponse(receiveData, receiveContext);
         if (miResult != MI_RESULT_OK)
         {
-            GOTO_ERROR("Base64EncodeBuffer failed", miResult);
+            GOTO_ERROR("out of memory", miResult);
         }
+    }
 
-        /* Set the null terminator on the end of the buffer as this is supposed to be a string*/
-        memset(decodedBuffer.buffer + decodedBuffer.bufferUsed, 0, sizeof(MI_Char));
+    /* There is always one stream instance for the single stream response to borrow */
+    miResult = BuildReceiveResponseStreams(receiveData, receiveContext, streamCount ? streamCount : 1);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("out of memory", miResult);
+    }
+
+    miResult = GetReceiveResponse(receiveData, streamCount, &receive);
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("out of memory", miResult);
+    }
+
+    receiveStream = receiveData->responseStreams;
+    for (result = results; result; result = result->next)
+    {
+        if (result->data == NULL)
+            continue;
 
         /* Add the final string to the stream. This is just a pointer to it and
-        * is not getting copied so we need to delete the buffer after we have posted the instance
-        * to the receive context.
+        * is not getting copied so the result has to outlive the post.
         */
-        Stream_SetPtr_data(&receiveStream, decodedBuffer.buffer);
+        Stream_SetPtr_data(receiveStream, result->data);
 
         /* Stream holds the results of the inbound/outbound stream. A result can have more
         * than one stream, either for the same stream or different ones.
         */
-        if (flags & WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA)
-            Stream_Set_endOfStream(&receiveStream, MI_TRUE);
+        if (result->flags & WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA)
+            Stream_Set_endOfStream(receiveStream, MI_TRUE);
         else
-            Stream_Set_endOfStream(&receiveStream, MI_FALSE);
+            Stream_Set_endOfStream(receiveStream, MI_FALSE);
 
-        if (streamName)
-        {
-            Stream_SetPtr_streamName(&receiveStream, streamName);
-        }
+        if (result->streamName)
+            Stream_SetPtr_streamName(receiveStream, result->streamName);
+        else
+            Stream_Clear_streamName(receiveStream);
 
-        /* Add the stream embedded instance to the receive result.  */
-        {
-            MI_Value miValue;
-            miValue.instance = &receiveStream.__instance;
-            miResult = MI_Instance_AddElement(receive, MI_T("Stream"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
-            if (miResult != MI_RESULT_OK)
-            {
-                GOTO_ERROR("MI_Instance_AddElement failed", miResult);
-            }
-        }
+        receiveStream++;
     }
 
-    /* CommandState tells the client if we are done or not with this stream.
-    */
-
-    if (commandState &&
-        (Tcscasecmp(commandState, WSMAN_COMMAND_STATE_DONE) == 0))
+    /* Add the stream embedded instances to the receive result */
+    if (streamCount > 1)
     {
-        /* TODO: Mark stream as complete for either shell or command */
-        CommandState_SetPtr_state(&commandStateInst, WSMAN_COMMAND_STATE_DONE);
+        miValue.instancea.data = (MI_Instance**) receiveData->responseStreamRefs;
+        miValue.instancea.size = streamCount;
+        miResult = MI_Instance_SetElement(receive, MI_T("Stream"), &miValue, MI_INSTANCEA, MI_FLAG_BORROW);
     }
-    else if (commandState)
+    else if (streamCount)
     {
-        CommandState_SetPtr_state(&commandStateInst, commandState);
+        miValue.instance = &receiveData->responseStreams[0].__instance;
+        miResult = MI_Instance_SetElement(receive, MI_T("Stream"), &miValue, MI_INSTANCE, MI_FLAG_BORROW);
     }
     else
     {
-        CommandState_SetPtr_state(&commandStateInst, WSMAN_COMMAND_STATE_RUNNING);
+        miResult = MI_Instance_ClearElement(receive, MI_T("Stream"));
+    }
+    if (miResult != MI_RESULT_OK)
+    {
+        GOTO_ERROR("MI_Instance_SetElement failed", miResult);
     }
 
-
-    /* The result of the Receive contains the command results and a set of streams.
-    * We only support one stream at a time for now.
+    /* CommandState tells the client if we are done or not with this stream.
     */
-    miValue.uint32 = MI_RESULT_OK;
-    miResult = MI_Instance_AddElement(receive, MI_T("MIReturn"), &miValue, MI_UINT32, MI_FLAG_OUT | MI_FLAG_PARAMETER);
-    if (miResult != MI_RESULT_OK)
+
+    if (lastResult->commandState &&
+        (Tcscasecmp(lastResult->commandState, WSMAN_COMMAND_STATE_DONE) == 0))
     {
-        GOTO_ERROR("MI_Instance_AddElement failed", miResult);
+        /* TODO: Mark stream as complete for either shell or command */
+        CommandState_SetPtr_state(&receiveData->responseState, WSMAN_COMMAND_STATE_DONE);
     }
-    miValue.instance = &commandStateInst.__instance;
-    miResult = MI_Instance_AddElement(receive, MI_T("CommandState"), &miValue, MI_INSTANCE, MI_FLAG_BORROW | MI_FLAG_OUT | MI_FLAG_PARAMETER);
-    if (miResult != MI_RESULT_OK)
+    else if (lastResult->commandState)
+    {
+        CommandState_SetPtr_state(&receiveData->responseState, lastResult->commandState);
+    }
+    else
     {
-        GOTO_ERROR("MI_Instance_AddElement failed", miResult);
+        CommandState_SetPtr_state(&receiveData->responseState, WSMAN_COMMAND_STATE_RUNNING);
     }
 
 
-    /* Post the result back to the client. We can delete the base-64 encoded buffer after
-    * posting it.
-    */
-    PrintDataFunctionTag(commonData, "_WSManPluginReceiveResult", "PostInstance");
+    /* Post the result back to the client */
+    PrintDataFunctionTag(commonData, "PostReceiveResults", "PostInstance");
     MI_Context_PostInstance(receiveContext, receive);
 
 error:
-    /* Clean up the various result objects */
-    CommandState_Destruct(&commandStateInst);
-    Stream_Destruct(&receiveStream);
+    Lock_Release(&receiveData->responseLock);
 
-errorSkipInstanceDeletes:
-    PrintDataFunctionTag(commonData, "_WSManPluginReceiveResult", "PostResult");
+    PrintDataFunctionTag(commonData, "PostReceiveResults", "PostResult");
     if (miResult == MI_RESULT_OK)
     {
         MI_Context_PostResult(receiveContext, miResult);
@@ -2815,95 +3704,326 @@ errorSkipInstanceDeletes:
         MI_Context_PostError(receiveContext, miResult, MI_RESULT_TYPE_MI, errorMessage);
     }
 
-
-    if (tempBatch)
-        Batch_Delete(tempBatch);
-
-    if (decodedBuffer.buffer)
-        free(decodedBuffer.buffer);
-
-    PrintDataFunctionEnd(commonData, "_WSManPluginReceiveResult", miResult);
-    return (MI_Uint32) miResult;
-
+    PrintDataFunctionEnd(commonData, "PostReceiveResults", miResult);
+    return miResult;
 }
 
-MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReceiveResult(
-    _In_ WSMAN_PLUGIN_REQUEST *requestDetails,
+/*
+ * Sends a result straight back on a Receive context that is already in hand, bypassing
+ * the queue. Used for the final and the empty responses.
+ */
+MI_Uint32 _WSManPluginReceiveResult(
+    _In_ MI_Context *receiveContext,
+    _In_ CommonData *commonData,
     _In_ MI_Uint32 flags,
-    _In_opt_ const MI_Char16 * streamName,
+    _In_opt_ const MI_Char16 * _streamName,
     _In_opt_ WSMAN_DATA *streamResult,
-    _In_opt_ const MI_Char16 * commandState,
+    _In_opt_ const MI_Char16 * _commandState,
     _In_ MI_Uint32 exitCode
     )
 {
-    ReceiveData *receiveData = (ReceiveData*)requestDetails;
-    MI_Context *miContext;
-    MI_Result miResult = MI_RESULT_FAILED;
+    ReceiveResult *result;
+    MI_Result miResult;
 
+    if (commonData->requestType != CommonData_Type_Receive)
+        return MI_RESULT_INVALID_PARAMETER;
 
-    /* Wait for a Receive request to come in before we post the result back */
-    do
+    miResult = ReceiveResult_New(commonData, flags, _streamName, streamResult, _commandState, exitCode, &result);
+    if (miResult != MI_RESULT_OK)
     {
-    } while (CondLock_Wait((ptrdiff_t)&receiveData->common.miRequestContext,
-                           (ptrdiff_t*)&receiveData->common.miRequestContext,
-                           0,
-                           CONDLOCK_DEFAULT_SPINCOUNT) == 0);
+        MI_Context_PostError(receiveContext, miResult, MI_RESULT_TYPE_MI, "Failed to convert receive result");
+        return (MI_Uint32) miResult;
+    }
 
-    PrintDataFunctionStart(&receiveData->common, "WSManPluginReceiveResult");
+    miResult = PostReceiveResults(receiveContext, commonData, result);
+    ReceiveResult_Free(result);
+    return (MI_Uint32) miResult;
+}
+
+/* A result that changes the command state or has nothing more to follow it ends a response */
+static MI_Boolean ReceiveResult_EndsResponse(const ReceiveResult *result)
+{
+    return ((result->data == NULL) ||
+            result->commandState ||
+            (result->flags & WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA)) ? MI_TRUE : MI_FALSE;
+}
 
-    miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) NULL);
-    if (miContext)
+/* Whether what is queued is worth sending without waiting for more. Called with the queue
+ * lock held.
+ */
+static MI_Boolean ReceiveQueue_IsReady(ReceiveData *receiveData)
+{
+    MI_Uint64 queued = receiveData->queueBytes + ((MI_Uint64) receiveData->queueCount * RECEIVE_STREAM_OVERHEAD);
+
+    return ((queued >= receiveData->responseBudget) ||
+            (receiveData->queueCount >= receiveData->queueLimit) ||
+            (receiveData->queueCount >= RECEIVE_MAX_STREAMS_PER_RESPONSE) ||
+            ReceiveResult_EndsResponse(receiveData->queueTail)) ? MI_TRUE : MI_FALSE;
+}
+
+/* Takes as many results off the front of the queue as fit in one response, and always at
+ * least one. Called with the queue lock held. complete is set if the queue is now empty and
+ * the plug-in has already completed the Receive.
+ */
+static ReceiveResult *ReceiveQueue_Take(ReceiveData *receiveData, MI_Boolean *complete)
+{
+    ReceiveResult *first = receiveData->queueHead;
+    ReceiveResult *last = first;
+    MI_Uint64 used = first->dataLength + RECEIVE_STREAM_OVERHEAD;
+    ptrdiff_t count = 1;
+
+    while (last->next &&
+           !ReceiveResult_EndsResponse(last) &&
+           last->next->data &&
+           (count < RECEIVE_MAX_STREAMS_PER_RESPONSE) &&
+           ((used + last->next->dataLength + RECEIVE_STREAM_OVERHEAD) <= receiveData->responseBudget))
     {
-        Sem_Post(&receiveData->timeoutSemaphore, 1);
-        miResult = _WSManPluginReceiveResult(miContext, &receiveData->common, flags, streamName, streamResult, commandState, exitCode);
+        used += last->next->dataLength + RECEIVE_STREAM_OVERHEAD;
+        last = last->next;
+        count++;
     }
 
-    PrintDataFunctionEnd(&receiveData->common, "WSManPluginReceiveResult", miResult);
+    /* A result with no data only carries a state so it can ride along at the end */
+    if (last->next && !ReceiveResult_EndsResponse(last) && (last->next->data == NULL))
+    {
+        last = last->next;
+        count++;
+    }
 
-    return miResult;
+    receiveData->queueHead = last->next;
+    last->next = NULL;
+    receiveData->queueCount -= count;
+    for (last = first; last; last = last->next)
+        receiveData->queueBytes -= last->dataLength;
+
+    *complete = MI_FALSE;
+    if (receiveData->queueHead == NULL)
+    {
+        receiveData->queueTail = NULL;
+
+        /* The plug-in finished with the Receive while these were still queued */
+        *complete = receiveData->completionDeferred;
+        receiveData->completionDeferred = MI_FALSE;
+    }
+    return first;
 }
 
-PAL_Uint32 THREAD_API ReceiveTimeoutThread(void* param)
+/* Arms the linger timer unless it already is. Called with the queue lock held. Returns
+ * MI_FALSE if it could not be armed, in which case the caller should not wait.
+ */
+static MI_Boolean _ArmReceiveLinger(ReceiveData *receiveData)
 {
-    ReceiveData *receiveData = (ReceiveData*) param;
-    MI_Result miResult = MI_RESULT_OK;
+    if (receiveData->lingerArmed)
+        return MI_TRUE;
 
-    PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Thread starting");
-    while (!receiveData->shutdownThread)
+    /* An armed linger timer holds a reference, which the caller's own keeps alive for now */
+    Atomic_Inc(&receiveData->common.refcount);
+    if (TimerService_Arm(receiveData->timerService, &receiveData->lingerTimer, receiveData->lingerMilliseconds, ReceiveLingerExpired, NULL) != MI_RESULT_OK)
     {
-        int semWaitRet;
+        Atomic_Dec(&receiveData->common.refcount);
+        return MI_FALSE;
+    }
+    receiveData->lingerArmed = MI_TRUE;
+    return MI_TRUE;
+}
 
-        PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Waiting....");
-        semWaitRet = Sem_TimedWait(&receiveData->timeoutSemaphore, 30*1000);
-        //semWaitRet = Sem_TimedWait(&receiveData->timeoutSemaphore, receiveData->timeoutMilliseconds);
+/* Sends what is queued on a Receive to the context of the waiting Receive request, packing
+ * as many results into the response as fit. Everything that adds a result or a context
+ * calls this afterwards, so a context is never left waiting while there is output queued.
+ * ReceiveDrain_Linger, used as results come in, holds back a response that is not full for
+ * a moment so more results can join it. ReceiveDrain_OrEmpty, used when the timeout fires,
+ * sends an empty response if nothing is queued.
+ */
+static void DrainReceiveQueue(ReceiveData *receiveData, ReceiveDrainMode mode)
+{
+    MI_Context *miContext = NULL;
+    ReceiveResult *results = NULL;
+    MI_Boolean complete = MI_FALSE;
+    MI_Boolean lingerCancelled = MI_FALSE;
+
+    Lock_Acquire(&receiveData->queueLock);
+    if (receiveData->queueHead || (mode == ReceiveDrain_OrEmpty))
+    {
+        if ((mode == ReceiveDrain_Linger) &&
+            receiveData->lingerMilliseconds &&
+            receiveData->common.miRequestContext &&
+            !ReceiveQueue_IsReady(receiveData) &&
+            _ArmReceiveLinger(receiveData))
+        {
+            /* The linger timer sends it */
+            Lock_Release(&receiveData->queueLock);
+            return;
+        }
 
-        if (semWaitRet == 1)
+        miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) NULL);
+        if (miContext && receiveData->queueHead)
         {
-            MI_Context *miContext;
-            /* It timed out so probably need to post a result */
-            PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Thread timed out");
+            results = ReceiveQueue_Take(receiveData, &complete);
 
-            miContext = (MI_Context *) Atomic_Swap((ptrdiff_t*)&receiveData->common.miRequestContext, (ptrdiff_t) NULL);
-            if (miContext)
+            if (receiveData->lingerArmed && TimerService_Cancel(receiveData->timerService, &receiveData->lingerTimer))
             {
-                PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Sending timeout response");
-                miResult = _WSManPluginReceiveResult(miContext, &receiveData->common, 0, NULL, NULL, NULL, 0);
+                receiveData->lingerArmed = MI_FALSE;
+                lingerCancelled = MI_TRUE;
             }
         }
-        else if (semWaitRet == -1)
+    }
+    Lock_Release(&receiveData->queueLock);
+
+    /* The caller holds a reference of its own so this is never the last one */
+    if (lingerCancelled)
+        CommonData_Release(&receiveData->common);
+
+    if (miContext == NULL)
+        return;
+
+    if (results)
+    {
+        _CancelReceiveTimeout(receiveData);
+        PostReceiveResults(miContext, &receiveData->common, results);
+        while (results)
         {
-            miResult = MI_RESULT_FAILED;
-            break;
+            ReceiveResult *next = results->next;
+            ReceiveResult_Free(results);
+            results = next;
         }
-        else
+
+        /* Wake the plug-in if it is waiting for room in the queue */
+        CondLock_Broadcast((ptrdiff_t)&receiveData->queueCount);
+
+        if (complete)
         {
-            PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Thread got signalled");
-            /* 0 means we were woken up so nothing to do except check to see if we need to go back to sleep or exit  */
+            PrintDataFunctionTag(&receiveData->common, "DrainReceiveQueue", "Passing on deferred completion");
+            WSManPluginOperationComplete(&receiveData->common.pluginRequest, 0, receiveData->completionErrorCode, NULL);
         }
     }
+    else
+    {
+        PrintDataFunctionTag(&receiveData->common, "DrainReceiveQueue", "Sending empty response");
+        _WSManPluginReceiveResult(miContext, &receiveData->common, 0, NULL, NULL, NULL, 0);
+    }
+}
 
-    PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutThread", "Thread exiting");
-    return miResult;
+/* Holds back the completion of a Receive until the results it has queued have been sent.
+ * Returns MI_FALSE if nothing is queued and the completion can go ahead now.
+ */
+static MI_Boolean DeferReceiveCompletion(ReceiveData *receiveData, MI_Uint32 errorCode)
+{
+    MI_Boolean deferred = MI_FALSE;
+
+    Lock_Acquire(&receiveData->queueLock);
+    if (receiveData->queueHead)
+    {
+        receiveData->completionDeferred = MI_TRUE;
+        receiveData->completionErrorCode = errorCode;
+        deferred = MI_TRUE;
+    }
+    Lock_Release(&receiveData->queueLock);
+
+    return deferred;
+}
+
+static void FreeReceiveQueue(ReceiveData *receiveData)
+{
+    while (receiveData->queueHead)
+    {
+        ReceiveResult *result = receiveData->queueHead;
+        receiveData->queueHead = result->next;
+        ReceiveResult_Free(result);
+    }
+    receiveData->queueTail = NULL;
+    receiveData->queueCount = 0;
+    receiveData->queueBytes = 0;
+}
+
+/*
+ * The WSMAN plug-in gets called once and it keeps sending data back to us.
+ * Results are queued on the Receive and sent as Receive requests come in from
+ * the client, so the plug-in only has to wait when the queue is full.
+ */
+MI_EXPORT  MI_Uint32 MI_CALL WSManPluginReceiveResult(
+    _In_ WSMAN_PLUGIN_REQUEST *requestDetails,
+    _In_ MI_Uint32 flags,
+    _In_opt_ const MI_Char16 * streamName,
+    _In_opt_ WSMAN_DATA *streamResult,
+    _In_opt_ const MI_Char16 * commandState,
+    _In_ MI_Uint32 exitCode
+    )
+{
+    ReceiveData *receiveData = (ReceiveData*)requestDetails;
+    ReceiveResult *result;
+    MI_Result miResult;
+
+    if (receiveData->common.requestType != CommonData_Type_Receive)
+        return MI_RESULT_INVALID_PARAMETER;
+
+    /* Encoding happens here on the plug-in thread, before the result is queued */
+    miResult = ReceiveResult_New(&receiveData->common, flags, streamName, streamResult, commandState, exitCode, &result);
+    if (miResult != MI_RESULT_OK)
+    {
+        PrintDataFunctionEnd(&receiveData->common, "WSManPluginReceiveResult", miResult);
+        return miResult;
+    }
+    PrintDataFunctionStartStr2(&receiveData->common, "WSManPluginReceiveResult", "commandState", result->commandState, "flags", ReceiveResultsFlags(flags));
+
+    for (;;)
+    {
+        Lock_Acquire(&receiveData->queueLock);
+        if (receiveData->queueCount < receiveData->queueLimit)
+        {
+            if (receiveData->queueTail)
+                receiveData->queueTail->next = result;
+            else
+                receiveData->queueHead = result;
+            receiveData->queueTail = result;
+            receiveData->queueCount++;
+            receiveData->queueBytes += result->dataLength;
+            Lock_Release(&receiveData->queueLock);
+            break;
+        }
+        Lock_Release(&receiveData->queueLock);
+
+        /* Queue is full, wait for a Receive request to take something off it */
+        CondLock_Wait((ptrdiff_t)&receiveData->queueCount,
+                      &receiveData->queueCount,
+                      receiveData->queueLimit,
+                      CONDLOCK_DEFAULT_SPINCOUNT);
+    }
+
+    DrainReceiveQueue(receiveData, ReceiveDrain_Linger);
+
+    PrintDataFunctionEnd(&receiveData->common, "WSManPluginReceiveResult", MI_RESULT_OK);
+
+    return MI_RESULT_OK;
+}
+
+/* Called on the timer service thread when a Receive request has waited for output for
+ * as long as the client allows. Send an empty response so the client can post another.
+ */
+static void ReceiveTimeoutExpired(Timer *timer)
+{
+    ReceiveData *receiveData = (ReceiveData*) ((char*)timer - offsetof(ReceiveData, timeoutTimer));
+
+    PrintDataFunctionTag(&receiveData->common, "ReceiveTimeoutExpired", "Timed out");
+
+    DrainReceiveQueue(receiveData, ReceiveDrain_OrEmpty);
+
+    /* Drop the reference the armed timer held */
+    CommonData_Release(&receiveData->common);
+}
+
+/* Called on the timer service thread once output has had a moment to build up */
+static void ReceiveLingerExpired(Timer *timer)
+{
+    ReceiveData *receiveData = (ReceiveData*) ((char*)timer - offsetof(ReceiveData, lingerTimer));
+
+    Lock_Acquire(&receiveData->queueLock);
+    receiveData->lingerArmed = MI_FALSE;
+    Lock_Release(&receiveData->queueLock);
+
+    DrainReceiveQueue(receiveData, ReceiveDrain_Now);
+
+    /* Drop the reference the armed timer held */
+    CommonData_Release(&receiveData->common);
 }
 
 static const char *OperationParamToString(MI_Uint32 flag)
@@ -2982,7 +4102,27 @@ void CommonData_Release(CommonData *commonData)
     if (Atomic_Dec(&commonData->refcount) == 0)
     {
         PrintDataFunctionTag(commonData, "CommonData_Release", "Deleting");
-        Batch_Delete(commonData->batch);
+        switch (commonData->requestType)
+        {
+        case CommonData_Type_Shell:
+            CompressionCache_Free(&((ShellData*)commonData)->compressionCache);
+            free(((ShellData*)commonData)->commands);
+            free(((ShellData*)commonData)->commandBuckets);
+            Batch_Delete(commonData->batch);
+            break;
+        case CommonData_Type_Command:
+            Batch_Delete(commonData->batch);
+            break;
+        case CommonData_Type_Receive:
+            FreeReceiveQueue((ReceiveData*)commonData);
+            FreeReceiveResponse((ReceiveData*)commonData);
+            RequestPool_Put(commonData);
+            break;
+        default:
+            /* Send, Signal and Connect go back to the pool they came from */
+            RequestPool_Put(commonData);
+            break;
+        }
     }
 }
 
@@ -3010,6 +4150,14 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
     }
     PrintDataFunctionStartNumStr(commonData, "WSManPluginOperationComplete", "errorCode", errorCode, "extendedInfo", extendedInformation);
 
+    /* Results the client has not asked for yet still need to go out before the Receive ends */
+    if ((commonData->requestType == CommonData_Type_Receive) &&
+        DeferReceiveCompletion((ReceiveData*)commonData, errorCode))
+    {
+        PrintDataFunctionTag(commonData, "WSManPluginOperationComplete", "Deferred until queued results are sent");
+        return MI_RESULT_OK;
+    }
+
     miContext = (MI_Context*) Atomic_Swap((ptrdiff_t*)&commonData->miRequestContext, (ptrdiff_t) NULL);
     miInstance = (MI_Instance*) Atomic_Swap((ptrdiff_t*) &commonData->miOperationInstance, (ptrdiff_t) NULL);
 
@@ -3022,14 +4170,8 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
         /* TODO: Are there other outstanding operations? */
 
         ShellData *shellData = (ShellData *)commonData;
-        ShellData **pointerToPatch = &shellData->shell->shellList;
 
-        while (*pointerToPatch && (*pointerToPatch != shellData))
-        {
-            pointerToPatch = (ShellData **)&(*pointerToPatch)->common.siblingData;
-        }
-        if (*pointerToPatch)
-            *pointerToPatch = (ShellData *)shellData->common.siblingData;
+        ShellRegistry_Remove(&shellData->shell->shells, shellData);
 
         if (miContext)
         {
@@ -3075,7 +4217,7 @@ MI_EXPORT  MI_Uint32 MI_CALL WSManPluginOperationComplete(
             /* We have a pending request that needs to be terminated */
             _WSManPluginReceiveResult(miContext, commonData, WSMAN_FLAG_RECEIVE_RESULT_NO_MORE_DATA, NULL, NULL, commandState, errorCode);
         }
-        _ShutdownReceiveTimeoutThread(receiveData);
+        _CancelReceiveTimeout(receiveData);
 
         break;
     }
@@ -0,0 +1,244 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <MI.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "TimerService.h"
+
+/* Longest the thread sleeps in one go, which also bounds the wait passed to Sem_TimedWait */
+#define TIMER_MAX_SLEEP_MS (60 * 60 * 1000)
+
+#define TIMER_INITIAL_HEAP_SIZE 64
+
+MI_Uint64 TimerService_Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((MI_Uint64)now.tv_sec * 1000) + ((MI_Uint64)now.tv_nsec / 1000000);
+}
+
+static void Heap_Place(TimerService *service, Timer *timer, MI_Uint32 index)
+{
+    service->heap[index] = timer;
+    timer->heapIndex = index + 1;
+}
+
+static void Heap_SiftUp(TimerService *service, MI_Uint32 index)
+{
+    Timer *timer = service->heap[index];
+
+    while (index > 0)
+    {
+        MI_Uint32 parent = (index - 1) / 2;
+
+        if (service->heap[parent]->deadline <= timer->deadline)
+            break;
+        Heap_Place(service, service->heap[parent], index);
+        index = parent;
+    }
+    Heap_Place(service, timer, index);
+}
+
+static void Heap_SiftDown(TimerService *service, MI_Uint32 index)
+{
+    Timer *timer = service->heap[index];
+
+    for (;;)
+    {
+        MI_Uint32 child = (index * 2) + 1;
+
+        if (child >= service->heapCount)
+            break;
+        if (((child + 1) < service->heapCount) &&
+            (service->heap[child + 1]->deadline < service->heap[child]->deadline))
+        {
+            child++;
+        }
+        if (timer->deadline <= service->heap[child]->deadline)
+            break;
+        Heap_Place(service, service->heap[child], index);
+        index = child;
+    }
+    Heap_Place(service, timer, index);
+}
+
+static void Heap_Remove(TimerService *service, Timer *timer)
+{
+    MI_Uint32 index = timer->heapIndex - 1;
+    Timer *last = service->heap[--service->heapCount];
+
+    timer->heapIndex = 0;
+    if (last == timer)
+        return;
+
+    /* Fill the hole with the last timer and move it whichever way it needs to go */
+    Heap_Place(service, last, index);
+    if ((index > 0) && (service->heap[(index - 1) / 2]->deadline > last->deadline))
+        Heap_SiftUp(service, index);
+    else
+        Heap_SiftDown(service, index);
+}
+
+static PAL_Uint32 THREAD_API TimerService_Thread(void *param)
+{
+    TimerService *service = (TimerService*) param;
+
+    Lock_Acquire(&service->lock);
+    while (!service->stopping)
+    {
+        MI_Uint64 now = TimerService_Now();
+        MI_Uint64 sleep = TIMER_MAX_SLEEP_MS;
+
+        if (service->heapCount)
+        {
+            Timer *timer = service->heap[0];
+
+            if (timer->deadline <= now)
+            {
+                Heap_Remove(service, timer);
+
+                /* Callbacks are free to arm or cancel timers, including this one */
+                Lock_Release(&service->lock);
+                timer->proc(timer);
+                Lock_Acquire(&service->lock);
+                continue;
+            }
+            if ((timer->deadline - now) < sleep)
+                sleep = timer->deadline - now;
+        }
+        Lock_Release(&service->lock);
+
+        /* Woken early when a new earliest deadline is armed or the service is stopping */
+        Sem_TimedWait(&service->wakeup, (int) sleep);
+
+        Lock_Acquire(&service->lock);
+    }
+    Lock_Release(&service->lock);
+    return 0;
+}
+
+MI_Result TimerService_Start(TimerService *service)
+{
+    memset(service, 0, sizeof(*service));
+    Lock_Init(&service->lock);
+
+    service->heap = malloc(TIMER_INITIAL_HEAP_SIZE * sizeof(Timer*));
+    if (service->heap == NULL)
+        return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+    service->heapSize = TIMER_INITIAL_HEAP_SIZE;
+
+    if (Sem_Init(&service->wakeup, 0, 0) != 0)
+    {
+        free(service->heap);
+        service->heap = NULL;
+        return MI_RESULT_FAILED;
+    }
+
+    if (Thread_CreateJoinable(&service->thread, TimerService_Thread, NULL /* threadDestructor */, service) != 0)
+    {
+        Sem_Destroy(&service->wakeup);
+        free(service->heap);
+        service->heap = NULL;
+        return MI_RESULT_FAILED;
+    }
+    service->running = MI_TRUE;
+    return MI_RESULT_OK;
+}
+
+void TimerService_Stop(TimerService *service)
+{
+    PAL_Uint32 threadResult;
+    MI_Uint32 i;
+
+    if (!service->running)
+        return;
+
+    Lock_Acquire(&service->lock);
+    service->stopping = MI_TRUE;
+    Lock_Release(&service->lock);
+
+    Sem_Post(&service->wakeup, 1);
+    Thread_Join(&service->thread, &threadResult);
+    Thread_Destroy(&service->thread);
+
+    for (i = 0; i < service->heapCount; i++)
+        service->heap[i]->heapIndex = 0;
+
+    Sem_Destroy(&service->wakeup);
+    free(service->heap);
+    service->heap = NULL;
+    service->heapCount = 0;
+    service->heapSize = 0;
+    service->running = MI_FALSE;
+}
+
+MI_Result TimerService_Arm(TimerService *service, Timer *timer, MI_Uint32 milliseconds, Timer_Proc proc, MI_Boolean *rearmed)
+{
+    MI_Uint64 deadline = TimerService_Now() + milliseconds;
+    MI_Boolean wake;
+
+    Lock_Acquire(&service->lock);
+    if (!service->running || service->stopping)
+    {
+        Lock_Release(&service->lock);
+        return MI_RESULT_FAILED;
+    }
+
+    if (rearmed)
+        *rearmed = timer->heapIndex ? MI_TRUE : MI_FALSE;
+
+    if (timer->heapIndex)
+    {
+        /* Already armed, take it out and put it back with the new deadline */
+        Heap_Remove(service, timer);
+    }
+    else if (service->heapCount == service->heapSize)
+    {
+        Timer **heap = realloc(service->heap, service->heapSize * 2 * sizeof(Timer*));
+        if (heap == NULL)
+        {
+            Lock_Release(&service->lock);
+            return MI_RESULT_SERVER_LIMITS_EXCEEDED;
+        }
+        service->heap = heap;
+        service->heapSize *= 2;
+    }
+
+    timer->proc = proc;
+    timer->deadline = deadline;
+    Heap_Place(service, timer, service->heapCount++);
+    Heap_SiftUp(service, service->heapCount - 1);
+
+    /* The thread only needs waking if it is sleeping past the new deadline */
+    wake = (service->heap[0] == timer) ? MI_TRUE : MI_FALSE;
+    Lock_Release(&service->lock);
+
+    if (wake)
+        Sem_Post(&service->wakeup, 1);
+
+    return MI_RESULT_OK;
+}
+
+MI_Boolean TimerService_Cancel(TimerService *service, Timer *timer)
+{
+    MI_Boolean armed = MI_FALSE;
+
+    Lock_Acquire(&service->lock);
+    if (timer->heapIndex)
+    {
+        Heap_Remove(service, timer);
+        armed = MI_TRUE;
+    }
+    Lock_Release(&service->lock);
+
+    return armed;
+}
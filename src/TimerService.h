@@ -0,0 +1,84 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _TimerService_h_
+#define _TimerService_h_
+#include <MI.h>
+#include <pal/thread.h>
+#include <pal/lock.h>
+#include <pal/sem.h>
+
+/* Timer
+* A deadline that is armed with TimerService_Arm. The caller owns the memory, normally
+* by embedding the timer in the object it times out, and must zero it before first use.
+* proc runs on the service thread once the deadline has passed, unless the timer is
+* cancelled or re-armed first. Timers that fire are no longer armed by the time proc
+* is called so proc may arm them again.
+*/
+typedef struct _Timer Timer;
+typedef void (*Timer_Proc)(Timer *timer);
+
+struct _Timer
+{
+    Timer_Proc proc;
+
+    /* Monotonic time in milliseconds when the timer fires */
+    MI_Uint64 deadline;
+
+    /* Position in the service heap plus one, zero when the timer is not armed */
+    MI_Uint32 heapIndex;
+};
+
+/* TimerService
+* One thread that fires every timer in the process. Armed timers are kept in a binary
+* min-heap ordered by deadline, so arming, re-arming and cancelling are all O(log n)
+* and the thread only ever sleeps until the earliest deadline.
+*/
+typedef struct _TimerService
+{
+    Lock lock;
+    Sem wakeup;
+    Thread thread;
+    MI_Boolean running;
+    MI_Boolean stopping;
+
+    Timer **heap;
+    MI_Uint32 heapCount;
+    MI_Uint32 heapSize;
+} TimerService;
+
+/* TimerService_Start
+* Starts the service thread.
+*/
+MI_Result TimerService_Start(TimerService *service);
+
+/* TimerService_Stop
+* Stops the service thread. Timers that are still armed are dropped without firing.
+*/
+void TimerService_Stop(TimerService *service);
+
+/* TimerService_Arm
+* Arms timer to fire milliseconds from now with proc, moving the deadline if it is
+* already armed. rearmed, if not NULL, is set to whether the timer was already armed.
+* Fails if the service is not running or the heap cannot grow.
+*/
+MI_Result TimerService_Arm(TimerService *service, Timer *timer, MI_Uint32 milliseconds, Timer_Proc proc, MI_Boolean *rearmed);
+
+/* TimerService_Cancel
+* Disarms timer. Returns MI_TRUE if it was armed, in which case proc will not be called.
+* MI_FALSE means it was not armed or has already fired, and proc may still be running.
+*/
+MI_Boolean TimerService_Cancel(TimerService *service, Timer *timer);
+
+/* TimerService_Now
+* Current monotonic time in milliseconds.
+*/
+MI_Uint64 TimerService_Now(void);
+
+#endif /* _TimerService_h_ */
@@ -0,0 +1,471 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <MI.h>
+#include "Transcode.h"
+#include "CpuFeatures.h"
+
+/* Native UTF-8 <-> UTF-16LE conversion.
+ * Nearly everything that flows through the provider and client (option names,
+ * stream names, command lines, CLIXML) is ASCII, so both directions look for runs
+ * of ASCII characters and widen or narrow them 16, 32 or 64 at a time with SSE2,
+ * AVX2 or AVX-512BW, as picked by CpuFeatures_Init. Anything else drops to a
+ * validating scalar loop one character at a time.
+ */
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define TO_UTF16LE(c) ((MI_Char16)((((c) & 0xFF) << 8) | (((c) >> 8) & 0xFF)))
+#define FROM_UTF16LE(c) ((MI_Uint32)((((c) & 0xFF) << 8) | (((c) >> 8) & 0xFF)))
+#else
+#define TO_UTF16LE(c) ((MI_Char16)(c))
+#define FROM_UTF16LE(c) ((MI_Uint32)(c))
+#define TRANSCODE_LITTLE_ENDIAN
+#endif
+
+#if defined(TRANSCODE_LITTLE_ENDIAN) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TRANSCODE_SSE2
+#endif
+
+#if defined(TRANSCODE_LITTLE_ENDIAN) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#include <immintrin.h>
+#define TRANSCODE_AVX2
+#endif
+
+#if defined(TRANSCODE_AVX2) && (defined(__clang__) || (__GNUC__ >= 8))
+#define TRANSCODE_AVX512
+#endif
+
+/* ASCII kernels convert the leading run of ASCII characters, up to count, in whole
+ * vectors and return how many characters they converted.
+ */
+typedef size_t (*WidenAsciiProc)(const MI_Uint8 *from, size_t count, MI_Char16 *to);
+typedef size_t (*NarrowAsciiProc)(const MI_Char16 *from, size_t count, MI_Uint8 *to);
+
+static WidenAsciiProc s_widenAscii = NULL;
+static NarrowAsciiProc s_narrowAscii = NULL;
+
+static size_t WidenAsciiNone(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    (void)from;
+    (void)count;
+    (void)to;
+    return 0;
+}
+
+static size_t NarrowAsciiNone(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    (void)from;
+    (void)count;
+    (void)to;
+    return 0;
+}
+
+#if defined(TRANSCODE_AVX512)
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t WidenAsciiAvx512(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    size_t done = 0;
+
+    while ((count - done) >= 64)
+    {
+        __m512i in = _mm512_loadu_si512((const void*)(from + done));
+
+        if (_mm512_movepi8_mask(in) != 0)
+            break;
+
+        _mm512_storeu_si512((void*)(to + done), _mm512_cvtepu8_epi16(_mm512_castsi512_si256(in)));
+        _mm512_storeu_si512((void*)(to + done + 32), _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(in, 1)));
+        done += 64;
+    }
+    return done;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t NarrowAsciiAvx512(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    const __m512i nonAscii = _mm512_set1_epi16((short)0xFF80);
+    size_t done = 0;
+
+    while ((count - done) >= 64)
+    {
+        __m512i low = _mm512_loadu_si512((const void*)(from + done));
+        __m512i high = _mm512_loadu_si512((const void*)(from + done + 32));
+
+        if (_mm512_test_epi16_mask(_mm512_or_si512(low, high), nonAscii) != 0)
+            break;
+
+        _mm256_storeu_si256((__m256i*)(to + done), _mm512_cvtepi16_epi8(low));
+        _mm256_storeu_si256((__m256i*)(to + done + 32), _mm512_cvtepi16_epi8(high));
+        done += 64;
+    }
+    return done;
+}
+
+#endif /* TRANSCODE_AVX512 */
+
+#if defined(TRANSCODE_AVX2)
+
+__attribute__((target("avx2")))
+static size_t WidenAsciiAvx2(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    size_t done = 0;
+
+    while ((count - done) >= 32)
+    {
+        __m256i in = _mm256_loadu_si256((const __m256i*)(from + done));
+
+        if (_mm256_movemask_epi8(in) != 0)
+            break;
+
+        _mm256_storeu_si256((__m256i*)(to + done), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(in)));
+        _mm256_storeu_si256((__m256i*)(to + done + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(in, 1)));
+        done += 32;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t NarrowAsciiAvx2(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    const __m256i nonAscii = _mm256_set1_epi16((short)0xFF80);
+    size_t done = 0;
+
+    while ((count - done) >= 32)
+    {
+        __m256i low = _mm256_loadu_si256((const __m256i*)(from + done));
+        __m256i high = _mm256_loadu_si256((const __m256i*)(from + done + 16));
+
+        if (!_mm256_testz_si256(_mm256_or_si256(low, high), nonAscii))
+            break;
+
+        /* packus works within 128-bit lanes so the quadwords need putting back in order */
+        _mm256_storeu_si256((__m256i*)(to + done),
+            _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8));
+        done += 32;
+    }
+    return done;
+}
+
+#endif /* TRANSCODE_AVX2 */
+
+#if defined(TRANSCODE_SSE2)
+
+static size_t WidenAsciiSse2(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t done = 0;
+
+    while ((count - done) >= 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i*)(from + done));
+
+        if (_mm_movemask_epi8(in) != 0)
+            break;
+
+        _mm_storeu_si128((__m128i*)(to + done), _mm_unpacklo_epi8(in, zero));
+        _mm_storeu_si128((__m128i*)(to + done + 8), _mm_unpackhi_epi8(in, zero));
+        done += 16;
+    }
+    return done;
+}
+
+static size_t NarrowAsciiSse2(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    const __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    size_t done = 0;
+
+    while ((count - done) >= 16)
+    {
+        __m128i low = _mm_loadu_si128((const __m128i*)(from + done));
+        __m128i high = _mm_loadu_si128((const __m128i*)(from + done + 8));
+        __m128i test = _mm_and_si128(_mm_or_si128(low, high), nonAscii);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(test, zero)) != 0xFFFF)
+            break;
+
+        _mm_storeu_si128((__m128i*)(to + done), _mm_packus_epi16(low, high));
+        done += 16;
+    }
+    return done;
+}
+
+#endif /* TRANSCODE_SSE2 */
+
+/* Wider kernels leave the characters that do not fill one of their vectors to the
+ * narrower ones.
+ */
+#if defined(TRANSCODE_SSE2)
+
+static size_t WidenAsciiSse2Blocks(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    return WidenAsciiSse2(from, count, to);
+}
+
+static size_t NarrowAsciiSse2Blocks(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    return NarrowAsciiSse2(from, count, to);
+}
+
+#else
+
+#define WidenAsciiSse2Blocks WidenAsciiNone
+#define NarrowAsciiSse2Blocks NarrowAsciiNone
+
+#endif /* TRANSCODE_SSE2 */
+
+#if defined(TRANSCODE_AVX2)
+
+static size_t WidenAsciiAvx2Blocks(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    size_t done = WidenAsciiAvx2(from, count, to);
+
+    return done + WidenAsciiSse2Blocks(from + done, count - done, to + done);
+}
+
+static size_t NarrowAsciiAvx2Blocks(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    size_t done = NarrowAsciiAvx2(from, count, to);
+
+    return done + NarrowAsciiSse2Blocks(from + done, count - done, to + done);
+}
+
+#endif /* TRANSCODE_AVX2 */
+
+#if defined(TRANSCODE_AVX512)
+
+static size_t WidenAsciiAvx512Blocks(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    size_t done = WidenAsciiAvx512(from, count, to);
+
+    return done + WidenAsciiAvx2Blocks(from + done, count - done, to + done);
+}
+
+static size_t NarrowAsciiAvx512Blocks(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    size_t done = NarrowAsciiAvx512(from, count, to);
+
+    return done + NarrowAsciiAvx2Blocks(from + done, count - done, to + done);
+}
+
+#endif /* TRANSCODE_AVX512 */
+
+void Transcode_SelectKernels(MI_Uint32 features)
+{
+    s_widenAscii = WidenAsciiNone;
+    s_narrowAscii = NarrowAsciiNone;
+#if defined(TRANSCODE_AVX512)
+    if (features & CPU_FEATURE_AVX512BW)
+    {
+        s_widenAscii = WidenAsciiAvx512Blocks;
+        s_narrowAscii = NarrowAsciiAvx512Blocks;
+        return;
+    }
+#endif
+#if defined(TRANSCODE_AVX2)
+    if (features & CPU_FEATURE_AVX2)
+    {
+        s_widenAscii = WidenAsciiAvx2Blocks;
+        s_narrowAscii = NarrowAsciiAvx2Blocks;
+        return;
+    }
+#endif
+#if defined(TRANSCODE_SSE2)
+    if (features & CPU_FEATURE_SSE2)
+    {
+        s_widenAscii = WidenAsciiSse2Blocks;
+        s_narrowAscii = NarrowAsciiSse2Blocks;
+    }
+#endif
+    (void)features;
+}
+
+/* WidenAscii
+ * Converts the leading run of ASCII characters, up to count, in whole vectors.
+ * Returns how many characters were converted; the caller finishes any remainder.
+ */
+static size_t WidenAscii(const MI_Uint8 *from, size_t count, MI_Char16 *to)
+{
+    CpuFeatures_Init();
+    return s_widenAscii(from, count, to);
+}
+
+static size_t NarrowAscii(const MI_Char16 *from, size_t count, MI_Uint8 *to)
+{
+    CpuFeatures_Init();
+    return s_narrowAscii(from, count, to);
+}
+
+static size_t MinSize(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+MI_Boolean Utf8ToUtf16LeBuffer(const char *from, size_t fromLength, MI_Char16 *to, size_t toLength, size_t *toUsed)
+{
+    const MI_Uint8 *in = (const MI_Uint8*)from;
+    const MI_Uint8 *inEnd = in + fromLength;
+    MI_Char16 *out = to;
+    MI_Char16 *outEnd = to + toLength;
+
+    while (in < inEnd)
+    {
+        MI_Uint32 c = in[0];
+        MI_Uint32 codePoint;
+
+        if (c < 0x80)
+        {
+            size_t done = WidenAscii(in, MinSize(inEnd - in, outEnd - out), out);
+            in += done;
+            out += done;
+
+            while ((in < inEnd) && (*in < 0x80))
+            {
+                if (out == outEnd)
+                    return MI_FALSE;
+                *out++ = TO_UTF16LE(*in);
+                in++;
+            }
+            continue;
+        }
+
+        if (c < 0xC2)
+        {
+            /* Continuation byte without a lead byte, or an overlong two byte sequence */
+            return MI_FALSE;
+        }
+        else if (c < 0xE0)
+        {
+            if ((inEnd - in) < 2 || (in[1] & 0xC0) != 0x80)
+                return MI_FALSE;
+            codePoint = ((c & 0x1F) << 6) | (in[1] & 0x3F);
+            in += 2;
+        }
+        else if (c < 0xF0)
+        {
+            if ((inEnd - in) < 3 || (in[1] & 0xC0) != 0x80 || (in[2] & 0xC0) != 0x80)
+                return MI_FALSE;
+            if ((c == 0xE0 && in[1] < 0xA0) ||  /* overlong */
+                (c == 0xED && in[1] > 0x9F))    /* surrogate */
+                return MI_FALSE;
+            codePoint = ((c & 0x0F) << 12) | ((in[1] & 0x3F) << 6) | (in[2] & 0x3F);
+            in += 3;
+        }
+        else if (c < 0xF5)
+        {
+            if ((inEnd - in) < 4 || (in[1] & 0xC0) != 0x80 || (in[2] & 0xC0) != 0x80 || (in[3] & 0xC0) != 0x80)
+                return MI_FALSE;
+            if ((c == 0xF0 && in[1] < 0x90) ||  /* overlong */
+                (c == 0xF4 && in[1] > 0x8F))    /* beyond U+10FFFF */
+                return MI_FALSE;
+            codePoint = ((c & 0x07) << 18) | ((in[1] & 0x3F) << 12) | ((in[2] & 0x3F) << 6) | (in[3] & 0x3F);
+            in += 4;
+        }
+        else
+        {
+            return MI_FALSE;
+        }
+
+        if (codePoint < 0x10000)
+        {
+            if (out == outEnd)
+                return MI_FALSE;
+            *out++ = TO_UTF16LE(codePoint);
+        }
+        else
+        {
+            if ((outEnd - out) < 2)
+                return MI_FALSE;
+            codePoint -= 0x10000;
+            out[0] = TO_UTF16LE(0xD800 | (codePoint >> 10));
+            out[1] = TO_UTF16LE(0xDC00 | (codePoint & 0x3FF));
+            out += 2;
+        }
+    }
+
+    if (toUsed)
+        *toUsed = out - to;
+    return MI_TRUE;
+}
+
+MI_Boolean Utf16LeToUtf8Buffer(const MI_Char16 *from, size_t fromLength, char *to, size_t toLength, size_t *toUsed)
+{
+    const MI_Char16 *in = from;
+    const MI_Char16 *inEnd = from + fromLength;
+    MI_Uint8 *out = (MI_Uint8*)to;
+    MI_Uint8 *outEnd = out + toLength;
+
+    while (in < inEnd)
+    {
+        MI_Uint32 c = FROM_UTF16LE(in[0]);
+
+        if (c < 0x80)
+        {
+            size_t done = NarrowAscii(in, MinSize(inEnd - in, outEnd - out), out);
+            in += done;
+            out += done;
+
+            while ((in < inEnd) && ((c = FROM_UTF16LE(*in)) < 0x80))
+            {
+                if (out == outEnd)
+                    return MI_FALSE;
+                *out++ = (MI_Uint8)c;
+                in++;
+            }
+            continue;
+        }
+
+        if (c < 0x800)
+        {
+            if ((outEnd - out) < 2)
+                return MI_FALSE;
+            out[0] = (MI_Uint8)(0xC0 | (c >> 6));
+            out[1] = (MI_Uint8)(0x80 | (c & 0x3F));
+            out += 2;
+            in++;
+        }
+        else if (c < 0xD800 || c > 0xDFFF)
+        {
+            if ((outEnd - out) < 3)
+                return MI_FALSE;
+            out[0] = (MI_Uint8)(0xE0 | (c >> 12));
+            out[1] = (MI_Uint8)(0x80 | ((c >> 6) & 0x3F));
+            out[2] = (MI_Uint8)(0x80 | (c & 0x3F));
+            out += 3;
+            in++;
+        }
+        else
+        {
+            MI_Uint32 low;
+
+            /* Must be a high surrogate followed by a low surrogate */
+            if (c > 0xDBFF || (inEnd - in) < 2)
+                return MI_FALSE;
+            low = FROM_UTF16LE(in[1]);
+            if (low < 0xDC00 || low > 0xDFFF)
+                return MI_FALSE;
+            if ((outEnd - out) < 4)
+                return MI_FALSE;
+            c = 0x10000 + (((c & 0x3FF) << 10) | (low & 0x3FF));
+            out[0] = (MI_Uint8)(0xF0 | (c >> 18));
+            out[1] = (MI_Uint8)(0x80 | ((c >> 12) & 0x3F));
+            out[2] = (MI_Uint8)(0x80 | ((c >> 6) & 0x3F));
+            out[3] = (MI_Uint8)(0x80 | (c & 0x3F));
+            out += 4;
+            in += 2;
+        }
+    }
+
+    if (toUsed)
+        *toUsed = out - (MI_Uint8*)to;
+    return MI_TRUE;
+}
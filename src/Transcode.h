@@ -0,0 +1,39 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _Transcode_h_
+#define _Transcode_h_
+#include <MI.h>
+
+/* Maximum number of UTF-8 bytes produced for a single UTF-16 code unit. A
+ * surrogate pair is two code units and produces four bytes so this bound holds
+ * for all input.
+ */
+#define UTF8_BYTES_PER_UTF16_UNIT 3
+
+/* Utf8ToUtf16LeBuffer
+ * Converts fromLength bytes of UTF-8 into UTF-16LE code units. The input is
+ * validated; overlong encodings, encoded surrogates, code points beyond U+10FFFF
+ * and truncated sequences are rejected. A null character in the input is
+ * converted like any other character so callers wanting a terminated string
+ * include it in fromLength. toLength is the capacity of the destination in code
+ * units. Returns MI_FALSE if the input is invalid or the destination is too small.
+ * On success toUsed (if not NULL) receives the number of code units written.
+ */
+MI_Boolean Utf8ToUtf16LeBuffer(const char *from, size_t fromLength, MI_Char16 *to, size_t toLength, size_t *toUsed);
+
+/* Utf16LeToUtf8Buffer
+ * Converts fromLength UTF-16LE code units into UTF-8. Unpaired surrogates are
+ * rejected. toLength is the capacity of the destination in bytes. Returns MI_FALSE
+ * if the input is invalid or the destination is too small. On success toUsed
+ * (if not NULL) receives the number of bytes written.
+ */
+MI_Boolean Utf16LeToUtf8Buffer(const MI_Char16 *from, size_t fromLength, char *to, size_t toLength, size_t *toUsed);
+
+#endif /* _Transcode_h_ */
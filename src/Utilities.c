@@ -72,3 +72,26 @@ error:
     return MI_RESULT_INVALID_PARAMETER;
 }
 
+/* Reads a numeric tuning value from the environment. If the variable is not set
+ * or is not a number the default is used, otherwise the value is clamped to the
+ * given range.
+ */
+MI_Uint32 _GetTunableFromEnvironment(const char *name, MI_Uint32 defaultValue, MI_Uint32 minValue, MI_Uint32 maxValue)
+{
+    const char *value = getenv(name);
+    char *end;
+    unsigned long number;
+
+    if (value == NULL || *value == '\0')
+        return defaultValue;
+
+    number = strtoul(value, &end, 10);
+    if (*end != '\0')
+        return defaultValue;
+
+    if (number < minValue)
+        return minValue;
+    if (number > maxValue)
+        return maxValue;
+    return (MI_Uint32) number;
+}
@@ -8,4 +8,4 @@
 */
 
 MI_Result _GetLogOptionsFromConfigFile(const MI_Char *logFileName);
-
+MI_Uint32 _GetTunableFromEnvironment(const char *name, MI_Uint32 defaultValue, MI_Uint32 minValue, MI_Uint32 maxValue);
@@ -0,0 +1,340 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#include <MI.h>
+#include <stdlib.h>
+#include <string.h>
+#include "WorkerPool.h"
+
+static void WorkerPool_AppendStrand(WorkerPool *pool, WorkStrand *strand)
+{
+    strand->next = NULL;
+    if (pool->readyTail)
+        pool->readyTail->next = strand;
+    else
+        pool->readyHead = strand;
+    pool->readyTail = strand;
+}
+
+static PAL_Uint32 THREAD_API WorkerPool_Thread(void *param);
+
+/* Joins and frees the threads in a list */
+static void WorkerPool_JoinThreads(WorkerThread *thread)
+{
+    while (thread)
+    {
+        WorkerThread *next = thread->next;
+        PAL_Uint32 threadResult;
+
+        Thread_Join(&thread->thread, &threadResult);
+        Thread_Destroy(&thread->thread);
+        free(thread);
+        thread = next;
+    }
+}
+
+/* Starts one more thread. Called with the pool lock held. Threads that went idle and
+ * exited are joined first. They released the lock on their way out so this does not wait
+ * on anything but their return.
+ */
+static MI_Boolean WorkerPool_AddThread(WorkerPool *pool)
+{
+    WorkerThread *thread;
+
+    WorkerPool_JoinThreads(pool->exitedThreads);
+    pool->exitedThreads = NULL;
+
+    thread = malloc(sizeof(WorkerThread));
+    if (thread == NULL)
+        return MI_FALSE;
+    thread->pool = pool;
+
+    if (Thread_CreateJoinable(&thread->thread, WorkerPool_Thread, NULL /* threadDestructor */, thread) != 0)
+    {
+        free(thread);
+        return MI_FALSE;
+    }
+    thread->next = pool->threads;
+    pool->threads = thread;
+    pool->threadCount++;
+    return MI_TRUE;
+}
+
+/* Called by a thread that has been idle for idleMilliseconds. The thread exits if the pool
+ * has more than its minimum and enough threads would be left for the wakeups already
+ * posted. Returns MI_TRUE if the thread is to exit, in which case it has been moved to the
+ * exited list for the next WorkerPool_AddThread or WorkerPool_Stop to join.
+ */
+static MI_Boolean WorkerPool_RetireThread(WorkerPool *pool, WorkerThread *thread)
+{
+    MI_Boolean retire;
+
+    Lock_Acquire(&pool->lock);
+    retire = !pool->stopping &&
+        (pool->threadCount > pool->minThreadCount) &&
+        ((pool->busyCount + pool->wakeupCount) < pool->threadCount);
+    if (retire)
+    {
+        WorkerThread **pointerToPatch = &pool->threads;
+
+        while (*pointerToPatch != thread)
+        {
+            pointerToPatch = &(*pointerToPatch)->next;
+        }
+        *pointerToPatch = thread->next;
+
+        thread->next = pool->exitedThreads;
+        pool->exitedThreads = thread;
+        pool->threadCount--;
+    }
+    Lock_Release(&pool->lock);
+
+    return retire;
+}
+
+/* Counts a wakeup the caller is about to post, and starts another thread if every thread
+ * is either busy or already has a wakeup waiting for it. Called with the pool lock held.
+ * If the thread cannot be started the item waits for one of the others.
+ */
+static void WorkerPool_CountWakeup(WorkerPool *pool)
+{
+    pool->wakeupCount++;
+
+    if (!pool->stopping &&
+        ((pool->busyCount + pool->wakeupCount) > pool->threadCount) &&
+        ((pool->maxThreadCount == 0) || (pool->threadCount < pool->maxThreadCount)))
+    {
+        WorkerPool_AddThread(pool);
+    }
+}
+
+static PAL_Uint32 THREAD_API WorkerPool_Thread(void *param)
+{
+    WorkerThread *thread = (WorkerThread*) param;
+    WorkerPool *pool = thread->pool;
+
+    for (;;)
+    {
+        WorkStrand *strand = NULL;
+        WorkItem *item = NULL;
+
+        if (pool->idleMilliseconds)
+        {
+            int waitResult = Sem_TimedWait(&pool->wakeup, (int) pool->idleMilliseconds);
+
+            if (waitResult == 1)
+            {
+                /* Timed out with nothing to do */
+                if (WorkerPool_RetireThread(pool, thread))
+                    break;
+                continue;
+            }
+            if (waitResult != 0)
+                break;
+        }
+        else if (Sem_Wait(&pool->wakeup) != 0)
+        {
+            break;
+        }
+
+        Lock_Acquire(&pool->lock);
+        if (pool->readyHead)
+        {
+            /* The strand stays scheduled while its item runs so no other thread picks it up */
+            strand = pool->readyHead;
+            pool->readyHead = strand->next;
+            if (pool->readyHead == NULL)
+                pool->readyTail = NULL;
+
+            item = strand->head;
+            strand->head = item->next;
+            if (strand->head == NULL)
+                strand->tail = NULL;
+        }
+        else if (pool->looseHead)
+        {
+            item = pool->looseHead;
+            pool->looseHead = item->next;
+            if (pool->looseHead == NULL)
+                pool->looseTail = NULL;
+        }
+        if (item)
+        {
+            pool->wakeupCount--;
+            pool->busyCount++;
+        }
+        Lock_Release(&pool->lock);
+
+        /* Every post queues something except the ones from WorkerPool_Stop, which are
+         * only consumed once everything else has been taken.
+         */
+        if (item == NULL)
+            break;
+
+        item->next = NULL;
+        item->run(item);
+
+        {
+            MI_Boolean requeued = MI_FALSE;
+
+            Lock_Acquire(&pool->lock);
+            pool->busyCount--;
+
+            /* Go to the back of the ready list rather than running the next item here so a
+             * busy strand cannot starve the others.
+             */
+            if (strand && strand->head)
+            {
+                WorkerPool_AppendStrand(pool, strand);
+                WorkerPool_CountWakeup(pool);
+                requeued = MI_TRUE;
+            }
+            else if (strand)
+            {
+                strand->scheduled = MI_FALSE;
+            }
+            Lock_Release(&pool->lock);
+
+            if (requeued)
+                Sem_Post(&pool->wakeup, 1);
+        }
+
+        /* Last thing we do as it may free the strand along with the item */
+        if (item->release)
+            item->release(item);
+    }
+    return 0;
+}
+
+MI_Result WorkerPool_Start(WorkerPool *pool, const char *name, MI_Uint32 threadCount, MI_Uint32 maxThreadCount, MI_Uint32 idleMilliseconds)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->minThreadCount = threadCount;
+    pool->maxThreadCount = maxThreadCount;
+    pool->idleMilliseconds = idleMilliseconds;
+    Lock_Init(&pool->lock);
+
+    if (Sem_Init(&pool->wakeup, 0, 0) != 0)
+        return MI_RESULT_FAILED;
+
+    /* Nothing can be posted yet, but the pool grows under the lock */
+    Lock_Acquire(&pool->lock);
+    while ((pool->threadCount < threadCount) && WorkerPool_AddThread(pool))
+        ;
+    Lock_Release(&pool->lock);
+
+    /* Fewer threads than asked for still works, none at all does not */
+    if (pool->threadCount == 0)
+    {
+        Sem_Destroy(&pool->wakeup);
+        return MI_RESULT_FAILED;
+    }
+
+    /* Threads started up front never go idle for good, whatever the count that started */
+    pool->minThreadCount = pool->threadCount;
+    return MI_RESULT_OK;
+}
+
+void WorkerPool_Stop(WorkerPool *pool)
+{
+    MI_Uint32 threadCount;
+
+    if (pool->threads == NULL)
+        return;
+
+    /* Once stopping is set no thread starts or exits on its own, so the lists are fixed */
+    Lock_Acquire(&pool->lock);
+    pool->stopping = MI_TRUE;
+    threadCount = pool->threadCount;
+    Lock_Release(&pool->lock);
+
+    /* One extra wakeup per thread. Each thread exits when it wakes to empty lists. */
+    Sem_Post(&pool->wakeup, threadCount);
+
+    WorkerPool_JoinThreads(pool->threads);
+    WorkerPool_JoinThreads(pool->exitedThreads);
+
+    pool->threads = NULL;
+    pool->exitedThreads = NULL;
+    pool->threadCount = 0;
+    Sem_Destroy(&pool->wakeup);
+}
+
+MI_Boolean WorkerPool_Post(WorkerPool *pool, WorkStrand *strand, WorkItem *item)
+{
+    MI_Boolean wake = MI_FALSE;
+
+    item->next = NULL;
+
+    Lock_Acquire(&pool->lock);
+    if ((pool->threads == NULL) || pool->stopping)
+    {
+        Lock_Release(&pool->lock);
+        return MI_FALSE;
+    }
+
+    if (strand)
+    {
+        if (strand->tail)
+            strand->tail->next = item;
+        else
+            strand->head = item;
+        strand->tail = item;
+
+        /* A strand that is already scheduled picks the item up when its turn comes */
+        if (!strand->scheduled)
+        {
+            strand->scheduled = MI_TRUE;
+            WorkerPool_AppendStrand(pool, strand);
+            wake = MI_TRUE;
+        }
+    }
+    else
+    {
+        if (pool->looseTail)
+            pool->looseTail->next = item;
+        else
+            pool->looseHead = item;
+        pool->looseTail = item;
+        wake = MI_TRUE;
+    }
+    if (wake)
+        WorkerPool_CountWakeup(pool);
+    Lock_Release(&pool->lock);
+
+    if (wake)
+        Sem_Post(&pool->wakeup, 1);
+
+    return MI_TRUE;
+}
+
+MI_Boolean WorkerPool_PostIfIdle(WorkerPool *pool, WorkItem *item)
+{
+    item->next = NULL;
+
+    Lock_Acquire(&pool->lock);
+    if ((pool->threads == NULL) || pool->stopping ||
+        ((pool->busyCount + pool->wakeupCount) >= pool->threadCount))
+    {
+        Lock_Release(&pool->lock);
+        return MI_FALSE;
+    }
+
+    if (pool->looseTail)
+        pool->looseTail->next = item;
+    else
+        pool->looseHead = item;
+    pool->looseTail = item;
+    pool->wakeupCount++;
+    Lock_Release(&pool->lock);
+
+    Sem_Post(&pool->wakeup, 1);
+    return MI_TRUE;
+}
@@ -0,0 +1,128 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+#ifndef _WorkerPool_h_
+#define _WorkerPool_h_
+#include <MI.h>
+#include <pal/thread.h>
+#include <pal/lock.h>
+#include <pal/sem.h>
+
+/* WorkItem
+* A unit of work posted to a pool. The caller owns the memory, normally by embedding
+* the item in the parameters of the call. run does the work. release, if set, is
+* called once the pool has finished with the item and its strand, so it is the place
+* to free the item and drop any reference that keeps the strand alive.
+*/
+typedef struct _WorkItem WorkItem;
+typedef void (*WorkItem_Proc)(WorkItem *item);
+
+struct _WorkItem
+{
+    WorkItem *next;
+    WorkItem_Proc run;
+    WorkItem_Proc release;
+};
+
+/* WorkStrand
+* Items posted to the same strand run one at a time in the order they were posted,
+* though not always on the same thread. Different strands run in parallel. A strand
+* needs no set up beyond being zeroed and must stay alive until the release of the
+* last item posted to it has been called.
+*/
+typedef struct _WorkStrand WorkStrand;
+
+struct _WorkStrand
+{
+    WorkItem *head;
+    WorkItem *tail;
+
+    /* Next strand in the pool ready list */
+    WorkStrand *next;
+
+    /* Set while the strand is in the ready list or one of its items is running */
+    MI_Boolean scheduled;
+};
+
+/* WorkerThread
+* One thread of a pool. Threads that exit before the pool stops are kept on the exited
+* list until they are joined.
+*/
+typedef struct _WorkerThread WorkerThread;
+
+struct _WorkerThread
+{
+    Thread thread;
+    struct _WorkerPool *pool;
+    WorkerThread *next;
+};
+
+/* WorkerPool
+* A set of threads that run posted work items. Wakeups are counted with the semaphore,
+* one post for every strand or loose item in the ready lists. When an item is posted and
+* every thread is already busy, which is what happens when calls block, another thread
+* is started so the item does not wait behind them, up to maxThreadCount. Threads above
+* minThreadCount exit once they have been idle for idleMilliseconds.
+*/
+typedef struct _WorkerPool
+{
+    const char *name;
+
+    Lock lock;
+    Sem wakeup;
+
+    WorkStrand *readyHead;
+    WorkStrand *readyTail;
+
+    /* Items that do not need ordering */
+    WorkItem *looseHead;
+    WorkItem *looseTail;
+
+    WorkerThread *threads;
+    WorkerThread *exitedThreads;
+    MI_Uint32 threadCount;
+    MI_Uint32 minThreadCount;
+    MI_Uint32 maxThreadCount;
+    MI_Uint32 idleMilliseconds;
+    MI_Boolean stopping;
+
+    /* Threads running an item, and wakeups posted that no thread has taken yet */
+    MI_Uint32 busyCount;
+    MI_Uint32 wakeupCount;
+} WorkerPool;
+
+/* WorkerPool_Start
+* Starts threadCount threads, which stay until the pool is stopped. The pool grows from
+* there as needed up to maxThreadCount threads, or without limit if maxThreadCount is 0,
+* and shrinks back as the extra threads go idle. Fails only if not a single thread could
+* be started.
+*/
+MI_Result WorkerPool_Start(WorkerPool *pool, const char *name, MI_Uint32 threadCount, MI_Uint32 maxThreadCount, MI_Uint32 idleMilliseconds);
+
+/* WorkerPool_Stop
+* Runs everything already posted, then stops and joins the threads. Nothing may be
+* posted once this has been called.
+*/
+void WorkerPool_Stop(WorkerPool *pool);
+
+/* WorkerPool_Post
+* Queues item to run after everything already posted to strand. A NULL strand means
+* the item can run as soon as a thread is free. Returns MI_FALSE if the pool is not
+* running, in which case the item is untouched and release is not called.
+*/
+MI_Boolean WorkerPool_Post(WorkerPool *pool, WorkStrand *strand, WorkItem *item);
+
+/* WorkerPool_PostIfIdle
+* Queues an item that needs no ordering, but only if a thread is free to take it straight
+* away. Returns MI_FALSE, leaving the item untouched, if every thread is busy or the pool
+* is not running. Used by callers that would rather do the work themselves than wait.
+*/
+MI_Boolean WorkerPool_PostIfIdle(WorkerPool *pool, WorkItem *item);
+
+#endif /* _WorkerPool_h_ */
@@ -0,0 +1,547 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+/* psrp_bench
+ * Microbenchmarks for the Send/Receive data path: base64, compression and UTF-8 <->
+ * UTF-16LE transcoding. Each operation is run over a sweep of payload sizes and
+ * content types and the results are written as JSON, one object per operation, size
+ * and content type, with allocations per operation, the compression ratio where it
+ * applies and throughput in MB/s. Throughput is always measured against the payload
+ * size so the figures for each direction of an operation can be compared directly.
+ *
+ * Usage: psrp_bench [--quick] [--max-size bytes] [--min-time milliseconds] [--level n] [--output file]
+ *
+ * --level picks the Xpress compression level (XPRESS_LEVEL_*) for CompressBuffer, and
+ * for the compressed input DecompressBuffer is timed against.
+ *
+ * Allocations are only counted when built with PSRP_BENCH_COUNT_ALLOCS and linked
+ * with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, otherwise they are reported
+ * as null.
+ *
+ * The CPU_FEATURE_* bits the kernels were picked with are reported as cpu_features.
+ * Set PSRP_CPU_FEATURES to mask some off and compare the variants on one machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <MI.h>
+#include <base/batch.h>
+#include "BufferManipulation.h"
+#include "CpuFeatures.h"
+
+#if defined(PSRP_BENCH_COUNT_ALLOCS)
+
+static volatile size_t g_allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    g_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    g_allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    g_allocations++;
+    return __real_realloc(ptr, size);
+}
+
+#endif /* PSRP_BENCH_COUNT_ALLOCS */
+
+static const size_t g_sizes[] =
+{
+    100,
+    1024,
+    10 * 1024,
+    64 * 1024,
+    256 * 1024,
+    1024 * 1024,
+    4 * 1024 * 1024,
+    16 * 1024 * 1024
+};
+
+typedef enum _ContentType
+{
+    Content_Clixml,
+    Content_Random,
+    Content_Text
+} ContentType;
+
+static const char *g_contentNames[] = { "clixml", "random", "text" };
+
+typedef enum _Operation
+{
+    Op_Base64Encode,
+    Op_Base64Decode,
+    Op_Compress,
+    Op_Decompress,
+    Op_Utf8ToUtf16Le,
+    Op_Utf16LeToUtf8
+} Operation;
+
+static const char *g_operationNames[] =
+{
+    "Base64EncodeBuffer",
+    "Base64DecodeBuffer",
+    "CompressBuffer",
+    "DecompressBuffer",
+    "Utf8ToUtf16Le",
+    "Utf16LeToUtf8"
+};
+
+typedef struct _BenchOptions
+{
+    size_t maxSize;
+    double minSeconds;
+    FILE *output;
+} BenchOptions;
+
+/* Inputs prepared once per size and content type so only the operation itself is timed */
+typedef struct _BenchInput
+{
+    DecodeBuffer plain;         /* Raw payload */
+    DecodeBuffer encoded;       /* Base64 of the payload */
+    DecodeBuffer compressed;    /* CompressBuffer of the payload */
+    char *utf8;                 /* Payload as a null terminated UTF-8 string */
+    MI_Char16 *utf16;           /* Same string as UTF-16LE */
+} BenchInput;
+
+static MI_Uint32 g_compressionLevel = 0;
+
+static unsigned long long g_randomState = 0x2545F4914F6CDD1DULL;
+
+static MI_Uint32 NextRandom()
+{
+    g_randomState ^= g_randomState << 13;
+    g_randomState ^= g_randomState >> 7;
+    g_randomState ^= g_randomState << 17;
+    return (MI_Uint32) g_randomState;
+}
+
+/* CompressBuffer at the level picked on the command line. The cache is freed straight
+ * away so each call allocates its workspace just like passing no cache.
+ */
+static MI_Result CompressAtLevel(DecodeBuffer *from, DecodeBuffer *to)
+{
+    CompressionCache cache;
+    ptrdiff_t storedRun = 0;
+    MI_Result miResult;
+
+    memset(&cache, 0, sizeof(cache));
+    cache.compressionLevel = g_compressionLevel;
+    miResult = CompressBuffer(from, to, 0, &cache, &storedRun);
+    CompressionCache_Free(&cache);
+    return miResult;
+}
+
+static double Now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1e9);
+}
+
+static size_t AllocationCount()
+{
+#if defined(PSRP_BENCH_COUNT_ALLOCS)
+    return g_allocations;
+#else
+    return 0;
+#endif
+}
+
+/* Appends text to buffer up to length bytes and returns the new position */
+static size_t AppendText(char *buffer, size_t position, size_t length, const char *text)
+{
+    while (*text && position < length)
+    {
+        buffer[position++] = *text++;
+    }
+    return position;
+}
+
+/* Serialized PowerShell objects similar to what Get-Process | Format-List * produces */
+static void FillClixml(char *buffer, size_t length)
+{
+    static const char *names[] = { "pwsh", "omiserver", "systemd", "sshd", "bash", "cron" };
+    size_t position = 0;
+    MI_Uint32 refId = 0;
+
+    while (position < length)
+    {
+        char record[512];
+
+        snprintf(record, sizeof(record),
+            "<Obj RefId=\"%u\"><TN RefId=\"0\"><T>System.Diagnostics.Process</T><T>System.Object</T></TN>"
+            "<ToString>System.Diagnostics.Process (%s)</ToString><Props><S N=\"Name\">%s</S>"
+            "<I32 N=\"Id\">%u</I32><I64 N=\"WorkingSet64\">%u</I64><Db N=\"CPU\">%u.%02u</Db>"
+            "<B N=\"Responding\">true</B><Nil N=\"MainWindowTitle\" /></Props></Obj>",
+            refId, names[refId % 6], names[refId % 6], NextRandom() % 65536, NextRandom(),
+            NextRandom() % 1000, NextRandom() % 100);
+        position = AppendText(buffer, position, length, record);
+        refId++;
+    }
+}
+
+static void FillText(char *buffer, size_t length)
+{
+    static const char *words[] =
+    {
+        "the ", "remote ", "session ", "command ", "output ", "is ", "streamed ", "back ",
+        "to ", "client ", "and ", "each ", "record ", "contains ", "a ", "value. ", "\n"
+    };
+    size_t position = 0;
+
+    while (position < length)
+    {
+        position = AppendText(buffer, position, length, words[NextRandom() % 17]);
+    }
+}
+
+static void FillRandom(char *buffer, size_t length)
+{
+    size_t position;
+
+    for (position = 0; position < length; position++)
+    {
+        buffer[position] = (char) NextRandom();
+    }
+}
+
+/* Random content is not valid UTF-8 so the transcoding benchmarks use a string of
+ * random code points from all of the UTF-8 sequence lengths instead.
+ */
+static void FillRandomUtf8(char *buffer, size_t length)
+{
+    size_t position = 0;
+
+    while (position < length)
+    {
+        MI_Uint32 codePoint = NextRandom();
+        size_t sequenceLength = 1 + (codePoint % 4);
+
+        /* Fill the last few bytes with ASCII rather than a truncated sequence */
+        if (sequenceLength > (length - position))
+            sequenceLength = 1;
+
+        codePoint >>= 8;
+        switch (sequenceLength)
+        {
+        case 1:
+            buffer[position++] = (char)(0x20 + codePoint % 0x5F);
+            break;
+        case 2:
+            codePoint = 0x80 + codePoint % 0x780;
+            buffer[position++] = (char)(0xC0 | (codePoint >> 6));
+            buffer[position++] = (char)(0x80 | (codePoint & 0x3F));
+            break;
+        case 3:
+            codePoint = 0x800 + codePoint % 0xD000; /* stays below the surrogates */
+            buffer[position++] = (char)(0xE0 | (codePoint >> 12));
+            buffer[position++] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+            buffer[position++] = (char)(0x80 | (codePoint & 0x3F));
+            break;
+        default:
+            codePoint = 0x10000 + codePoint % 0x100000;
+            buffer[position++] = (char)(0xF0 | (codePoint >> 18));
+            buffer[position++] = (char)(0x80 | ((codePoint >> 12) & 0x3F));
+            buffer[position++] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+            buffer[position++] = (char)(0x80 | (codePoint & 0x3F));
+            break;
+        }
+    }
+}
+
+static void FreeInput(BenchInput *input)
+{
+    free(input->plain.buffer);
+    free(input->encoded.buffer);
+    free(input->compressed.buffer);
+    free(input->utf8);
+    free(input->utf16);
+    memset(input, 0, sizeof(*input));
+}
+
+static int PrepareInput(BenchInput *input, ContentType content, size_t size)
+{
+    Batch *batch;
+    MI_Char16 *utf16;
+    size_t utf16Bytes;
+
+    memset(input, 0, sizeof(*input));
+
+    input->plain.buffer = malloc(size);
+    input->utf8 = malloc(size + 1);
+    if (input->plain.buffer == NULL || input->utf8 == NULL)
+        goto error;
+
+    switch (content)
+    {
+    case Content_Clixml:
+        FillClixml(input->plain.buffer, size);
+        memcpy(input->utf8, input->plain.buffer, size);
+        break;
+    case Content_Text:
+        FillText(input->plain.buffer, size);
+        memcpy(input->utf8, input->plain.buffer, size);
+        break;
+    default:
+        FillRandom(input->plain.buffer, size);
+        FillRandomUtf8(input->utf8, size);
+        break;
+    }
+    input->utf8[size] = '\0';
+    input->plain.bufferLength = size;
+    input->plain.bufferUsed = size;
+
+    if (Base64EncodeBuffer(&input->plain, &input->encoded) != MI_RESULT_OK ||
+        CompressAtLevel(&input->plain, &input->compressed) != MI_RESULT_OK)
+    {
+        goto error;
+    }
+
+    /* Base64DecodeBuffer decodes bufferLength characters, which must not include the terminator */
+    input->encoded.bufferLength = input->encoded.bufferUsed;
+
+    /* Utf8ToUtf16Le only produces into a batch so take a copy of the result */
+    batch = Batch_New(BATCH_MAX_PAGES);
+    if (batch == NULL)
+        goto error;
+    if (!Utf8ToUtf16Le(batch, input->utf8, &utf16))
+    {
+        Batch_Delete(batch);
+        goto error;
+    }
+    utf16Bytes = Utf16LeStrLenBytes(utf16);
+    input->utf16 = malloc(utf16Bytes);
+    if (input->utf16)
+        memcpy(input->utf16, utf16, utf16Bytes);
+    Batch_Delete(batch);
+    if (input->utf16 == NULL)
+        goto error;
+
+    return 0;
+
+error:
+    FreeInput(input);
+    return -1;
+}
+
+/* Runs one operation once. Returns the number of output bytes or -1 on failure. */
+static long long RunOperation(Operation operation, BenchInput *input)
+{
+    DecodeBuffer result;
+    Batch *batch;
+    long long resultSize = -1;
+
+    switch (operation)
+    {
+    case Op_Base64Encode:
+        if (Base64EncodeBuffer(&input->plain, &result) == MI_RESULT_OK)
+        {
+            resultSize = result.bufferUsed;
+            free(result.buffer);
+        }
+        break;
+    case Op_Base64Decode:
+        if (Base64DecodeBuffer(&input->encoded, &result) == MI_RESULT_OK)
+        {
+            resultSize = result.bufferUsed;
+            free(result.buffer);
+        }
+        break;
+    case Op_Compress:
+        if (CompressAtLevel(&input->plain, &result) == MI_RESULT_OK)
+        {
+            resultSize = result.bufferUsed;
+            free(result.buffer);
+        }
+        break;
+    case Op_Decompress:
+        if (DecompressBuffer(&input->compressed, &result, NULL) == MI_RESULT_OK)
+        {
+            resultSize = result.bufferUsed;
+            free(result.buffer);
+        }
+        break;
+    case Op_Utf8ToUtf16Le:
+    case Op_Utf16LeToUtf8:
+        batch = Batch_New(BATCH_MAX_PAGES);
+        if (batch == NULL)
+            break;
+        if (operation == Op_Utf8ToUtf16Le)
+        {
+            MI_Char16 *utf16;
+            if (Utf8ToUtf16Le(batch, input->utf8, &utf16))
+                resultSize = Utf16LeStrLenBytes(utf16);
+        }
+        else
+        {
+            char *utf8;
+            if (Utf16LeToUtf8(batch, input->utf16, &utf8))
+                resultSize = strlen(utf8) + 1;
+        }
+        Batch_Delete(batch);
+        break;
+    }
+    return resultSize;
+}
+
+static int RunBenchmark(const BenchOptions *options, Operation operation, ContentType content, size_t size, BenchInput *input, int *first)
+{
+    size_t iterations = 0;
+    size_t allocations;
+    long long resultSize;
+    double start, elapsed;
+
+    /* Warm up caches and any lazily initialized state before timing */
+    resultSize = RunOperation(operation, input);
+    if (resultSize < 0)
+    {
+        fprintf(stderr, "psrp_bench: %s failed for %s payload of %lu bytes\n",
+            g_operationNames[operation], g_contentNames[content], (unsigned long) size);
+        return -1;
+    }
+
+    allocations = AllocationCount();
+    start = Now();
+    do
+    {
+        if (RunOperation(operation, input) < 0)
+            return -1;
+        iterations++;
+        elapsed = Now() - start;
+    } while (elapsed < options->minSeconds || iterations < 3);
+    allocations = AllocationCount() - allocations;
+
+    fprintf(options->output, "%s    {\"operation\": \"%s\", \"content\": \"%s\", \"size\": %lu, \"iterations\": %lu, "
+        "\"mb_per_s\": %.2f, \"ns_per_op\": %.0f, ",
+        *first ? "" : ",\n",
+        g_operationNames[operation], g_contentNames[content], (unsigned long) size, (unsigned long) iterations,
+        ((double) size * iterations) / (elapsed * 1024.0 * 1024.0),
+        (elapsed * 1e9) / iterations);
+#if defined(PSRP_BENCH_COUNT_ALLOCS)
+    fprintf(options->output, "\"allocs_per_op\": %.2f", (double) allocations / iterations);
+#else
+    fprintf(options->output, "\"allocs_per_op\": null");
+#endif
+    if (operation == Op_Compress)
+    {
+        fprintf(options->output, ", \"compression_ratio\": %.3f", (double) size / (double) resultSize);
+    }
+    fprintf(options->output, "}");
+    *first = 0;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    const char *outputPath = NULL;
+    int first = 1;
+    int result = 0;
+    int i;
+    unsigned int content, sizeIndex, operation;
+
+    options.maxSize = 16 * 1024 * 1024;
+    options.minSeconds = 0.2;
+    options.output = stdout;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            options.maxSize = 1024 * 1024;
+            options.minSeconds = 0.01;
+        }
+        else if (strcmp(argv[i], "--max-size") == 0 && (i + 1) < argc)
+        {
+            options.maxSize = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--min-time") == 0 && (i + 1) < argc)
+        {
+            options.minSeconds = strtoul(argv[++i], NULL, 10) / 1000.0;
+        }
+        else if (strcmp(argv[i], "--level") == 0 && (i + 1) < argc)
+        {
+            g_compressionLevel = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--output") == 0 && (i + 1) < argc)
+        {
+            outputPath = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--quick] [--max-size bytes] [--min-time milliseconds] [--level n] [--output file]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (outputPath)
+    {
+        options.output = fopen(outputPath, "w");
+        if (options.output == NULL)
+        {
+            fprintf(stderr, "psrp_bench: cannot open %s\n", outputPath);
+            return 2;
+        }
+    }
+
+    fprintf(options.output, "{\n  \"cpu_features\": %u,\n  \"benchmarks\": [\n", (unsigned) CpuFeatures_Get());
+
+    /* Large buffers are split over the chunk threads, as they are in the provider */
+    ChunkPool_Start();
+
+    for (content = Content_Clixml; content <= Content_Text && result == 0; content++)
+    {
+        for (sizeIndex = 0; sizeIndex < sizeof(g_sizes) / sizeof(g_sizes[0]) && result == 0; sizeIndex++)
+        {
+            BenchInput input;
+
+            if (g_sizes[sizeIndex] > options.maxSize)
+                break;
+
+            if (PrepareInput(&input, (ContentType) content, g_sizes[sizeIndex]) != 0)
+            {
+                fprintf(stderr, "psrp_bench: failed to prepare %s payload of %lu bytes\n",
+                    g_contentNames[content], (unsigned long) g_sizes[sizeIndex]);
+                result = 1;
+                break;
+            }
+
+            for (operation = Op_Base64Encode; operation <= Op_Utf16LeToUtf8 && result == 0; operation++)
+            {
+                if (RunBenchmark(&options, (Operation) operation, (ContentType) content, g_sizes[sizeIndex], &input, &first) != 0)
+                    result = 1;
+            }
+
+            FreeInput(&input);
+        }
+    }
+
+    fprintf(options.output, "\n  ]\n}\n");
+    ChunkPool_Stop();
+
+    if (outputPath)
+        fclose(options.output);
+
+    return result;
+}
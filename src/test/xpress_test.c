@@ -0,0 +1,684 @@
+/*
+**==============================================================================
+**
+** Copyright (c) Microsoft Corporation. All rights reserved. See file LICENSE
+** for license information.
+**
+**==============================================================================
+*/
+
+/* psrpxpress_test
+ * Tests for the Xpress compressor and the chunked wire format built on it. Each
+ * vector is an input made up on the fly from a fixed seed, plus one or more golden
+ * files in the vectors directory holding that input as it goes over the wire
+ * (CompressBuffer output) at a given compression level.
+ *
+ * The golden files are reference streams, not a record of what the compressor in
+ * this tree does. The level 0 files were made by the original compressor, from
+ * before the compression levels and the faster parsing went in. The level 1 and 2
+ * files cannot come from it, so they were checked with the original decoder
+ * instead. The original decoder also gave the checksum of the input each vector
+ * must decompress to. Its last two match copies are memcpy calls, which get
+ * overlapping matches wrong with glibc, so they were made forward byte copies for
+ * this, as the movsb they replaced was. For every vector:
+ *
+ *   - the input must match that checksum,
+ *   - the golden files must decompress, both raw and base64 encoded, to the input,
+ *   - the chunk headers in the golden files must follow the protocol, sizes stored
+ *     one less than they are and stored chunks marked by equal sizes,
+ *   - truncated golden files must be rejected,
+ *   - the input must round trip at every compression level, and the output of
+ *     each level must decompress with the common decoder,
+ *   - the output of a level must not be noticeably bigger than its golden file.
+ *
+ * The golden files pin the format, not the exact bytes the compressor produces, so
+ * the compressor is free to change as long as its output still decompresses and
+ * does not get worse. A change to the decoder that misreads the format shows up as
+ * a golden file that no longer decompresses.
+ *
+ * Usage: psrpxpress_test <vector directory>
+ *        psrpxpress_test --generate <vector directory>
+ *        psrpxpress_test --throughput [--min-time milliseconds]
+ *
+ * --generate writes the golden files that are missing from the current compressor,
+ * for a new vector or level, and prints the checksum of its input. It never
+ * replaces an existing file. Check new files, and their checksum, with the original
+ * decoder before adding them.
+ *
+ * --throughput reports compression and decompression speed for each vector and
+ * level instead of testing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <MI.h>
+#include <base/batch.h>
+#include "xpress.h"
+#include "BufferManipulation.h"
+
+typedef enum _ContentType
+{
+    Content_Text,
+    Content_Clixml,
+    Content_Utf16,
+    Content_Random,
+    Content_Run,
+    Content_Period,
+    Content_Mixed
+} ContentType;
+
+#define LEVEL_MASK(level) (1 << (level))
+#define ALL_LEVELS (LEVEL_MASK(XPRESS_LEVEL_DEFAULT) | LEVEL_MASK(XPRESS_LEVEL_FAST) | LEVEL_MASK(XPRESS_LEVEL_HIGH))
+#define NUM_LEVELS 3
+
+/* Wire chunks hold at most 64K of input */
+#define CHUNK_SIZE (64 * 1024)
+
+typedef struct _TestVector
+{
+    const char *name;
+    ContentType content;
+    size_t size;
+
+    /* Levels there are golden files for */
+    MI_Uint32 goldenLevels;
+
+    /* FNV-1a of the input, as the original decoder gives it back from the golden files */
+    unsigned long long checksum;
+} TestVector;
+
+static const TestVector g_vectors[] =
+{
+    /* A prompt, far too small to compress, so sent as a stored chunk */
+    { "prompt", Content_Text, 16, LEVEL_MASK(XPRESS_LEVEL_DEFAULT), 0xefe002899109e64dULL },
+
+    /* Incompressible data is sent stored as well */
+    { "random-300", Content_Random, 300, LEVEL_MASK(XPRESS_LEVEL_DEFAULT), 0x0b95ce85fb6aeda0ULL },
+
+    /* Typical Receive output */
+    { "clixml-4k", Content_Clixml, 4096, ALL_LEVELS, 0xfeb16c855222caf3ULL },
+
+    /* Exactly one full chunk, whose original size only fits in the header because
+     * it is stored one less than it is. Also one long match.
+     */
+    { "run-64k", Content_Run, CHUNK_SIZE, LEVEL_MASK(XPRESS_LEVEL_DEFAULT), 0x1f0c0019bbd72325ULL },
+
+    /* Matches with offsets shorter than their length */
+    { "period-20k", Content_Period, 20000, LEVEL_MASK(XPRESS_LEVEL_DEFAULT), 0xd05265b96ff91afdULL },
+
+    /* A full chunk followed by a one byte chunk, whose sizes are both stored as 0 */
+    { "text-65537", Content_Text, CHUNK_SIZE + 1, LEVEL_MASK(XPRESS_LEVEL_DEFAULT), 0x5714671227ddfa35ULL },
+
+    /* Strings as PowerShell hands them over */
+    { "utf16-100k", Content_Utf16, 100000, ALL_LEVELS, 0xa202a61d1653acaaULL },
+
+    /* Several chunks with incompressible stretches in them */
+    { "mixed-200k", Content_Mixed, 200000, LEVEL_MASK(XPRESS_LEVEL_DEFAULT), 0xeb5f315ff3c7977eULL }
+};
+
+#define NUM_VECTORS (sizeof(g_vectors) / sizeof(g_vectors[0]))
+
+static const char *g_words[] =
+{
+    "Get-Process", "PowerShell", "remoting", "session", "the", "of", "and", "runspace",
+    "pipeline", "Invoke-Command", "-ComputerName", "output", "stream", "error", "a", "is"
+};
+
+static unsigned long long g_randomState;
+
+static MI_Uint32 NextRandom()
+{
+    g_randomState ^= g_randomState << 13;
+    g_randomState ^= g_randomState >> 7;
+    g_randomState ^= g_randomState << 17;
+    return (MI_Uint32) g_randomState;
+}
+
+/* Appends text to buffer up to length bytes and returns the new position */
+static size_t AppendText(MI_Uint8 *buffer, size_t position, size_t length, const char *text)
+{
+    while (*text && position < length)
+    {
+        buffer[position++] = (MI_Uint8) *text++;
+    }
+    return position;
+}
+
+static void FillText(MI_Uint8 *buffer, size_t length)
+{
+    size_t position = 0;
+
+    while (position < length)
+    {
+        position = AppendText(buffer, position, length, g_words[NextRandom() % 16]);
+        position = AppendText(buffer, position, length, (NextRandom() % 12) ? " " : ".\r\n");
+    }
+}
+
+static void FillClixml(MI_Uint8 *buffer, size_t length)
+{
+    size_t position = 0;
+    MI_Uint32 refId = 0;
+
+    while (position < length)
+    {
+        char record[512];
+
+        snprintf(record, sizeof(record),
+            "<Obj RefId=\"%u\"><TN RefId=\"0\"><T>System.Diagnostics.Process</T><T>System.Object</T></TN>"
+            "<Props><S N=\"Name\">%s</S><I32 N=\"Id\">%u</I32><I64 N=\"WorkingSet64\">%u</I64>"
+            "<B N=\"Responding\">true</B></Props></Obj>",
+            refId, g_words[refId % 16], NextRandom() % 65536, NextRandom());
+        position = AppendText(buffer, position, length, record);
+        refId++;
+    }
+}
+
+/* Makes up the input for a vector. Every vector starts from the same seed so the
+ * input is the same each time.
+ */
+static MI_Uint8 *MakeInput(const TestVector *vector)
+{
+    MI_Uint8 *buffer = malloc(vector->size);
+    size_t i;
+
+    if (buffer == NULL)
+        return NULL;
+
+    g_randomState = 0x2545F4914F6CDD1DULL;
+
+    switch (vector->content)
+    {
+    case Content_Text:
+        FillText(buffer, vector->size);
+        break;
+
+    case Content_Clixml:
+        FillClixml(buffer, vector->size);
+        break;
+
+    case Content_Utf16:
+        /* Text in the low bytes, zeros in the high bytes */
+        FillText(buffer, vector->size / 2);
+        for (i = vector->size / 2; i-- > 0; )
+        {
+            buffer[2 * i] = buffer[i];
+            buffer[2 * i + 1] = 0;
+        }
+        if (vector->size & 1)
+            buffer[vector->size - 1] = 0;
+        break;
+
+    case Content_Random:
+        for (i = 0; i < vector->size; i++)
+            buffer[i] = (MI_Uint8) NextRandom();
+        break;
+
+    case Content_Run:
+        memset(buffer, 'a', vector->size);
+        break;
+
+    case Content_Period:
+        /* Short repeating patterns, changing every so often */
+        for (i = 0; i < vector->size; i++)
+        {
+            size_t period = 1 + ((i / 1000) % 7);
+
+            buffer[i] = (MI_Uint8) ((i < period) ? NextRandom() : buffer[i - period]);
+            if ((i % 1000) < period)
+                buffer[i] = (MI_Uint8) NextRandom();
+        }
+        break;
+
+    case Content_Mixed:
+        /* Each chunk is mostly CLIXML with 8K of random data in the middle */
+        FillClixml(buffer, vector->size);
+        for (i = 0; i < vector->size; i++)
+        {
+            if ((i % CHUNK_SIZE) >= 24 * 1024 && (i % CHUNK_SIZE) < 32 * 1024)
+                buffer[i] = (MI_Uint8) NextRandom();
+        }
+        break;
+    }
+    return buffer;
+}
+
+static unsigned long long Checksum(const MI_Uint8 *buffer, size_t length)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash ^= buffer[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void GoldenPath(char *path, size_t pathLength, const char *directory, const TestVector *vector, MI_Uint32 level)
+{
+    snprintf(path, pathLength, "%s/%s.l%u.xpress", directory, vector->name, level);
+}
+
+static MI_Uint8 *ReadFile(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    MI_Uint8 *buffer = NULL;
+    long fileLength;
+
+    if (file == NULL)
+        return NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0 && (fileLength = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        buffer = malloc(fileLength);
+        if (buffer && fread(buffer, 1, fileLength, file) != (size_t) fileLength)
+        {
+            free(buffer);
+            buffer = NULL;
+        }
+        *length = fileLength;
+    }
+    fclose(file);
+    return buffer;
+}
+
+static int WriteFile(const char *path, const MI_Uint8 *buffer, size_t length)
+{
+    FILE *file = fopen(path, "wb");
+    int result = 0;
+
+    if (file == NULL)
+        return 1;
+    if (fwrite(buffer, 1, length, file) != length)
+        result = 1;
+    if (fclose(file) != 0)
+        result = 1;
+    return result;
+}
+
+/* CompressBuffer at the given level with a cache of its own, so the result does not
+ * depend on anything compressed before.
+ */
+static MI_Result CompressAtLevel(const MI_Uint8 *input, size_t length, MI_Uint32 level, DecodeBuffer *to)
+{
+    DecodeBuffer from;
+    CompressionCache cache;
+    ptrdiff_t storedRun = 0;
+    MI_Result miResult;
+
+    from.buffer = (MI_Char*) input;
+    from.bufferLength = length;
+    from.bufferUsed = length;
+
+    memset(&cache, 0, sizeof(cache));
+    cache.compressionLevel = level;
+    miResult = CompressBuffer(&from, to, 0, &cache, &storedRun);
+    CompressionCache_Free(&cache);
+    return miResult;
+}
+
+/* Decompresses wire data and checks it comes back as the input */
+static int CheckDecompress(const MI_Uint8 *compressed, size_t compressedLength, const MI_Uint8 *input, size_t length)
+{
+    DecodeBuffer from;
+    DecodeBuffer to;
+    int result = 0;
+
+    from.buffer = (MI_Char*) compressed;
+    from.bufferLength = compressedLength;
+    from.bufferUsed = compressedLength;
+
+    if (DecompressBuffer(&from, &to, NULL) != MI_RESULT_OK)
+        return 1;
+    if (to.bufferUsed != length || memcmp(to.buffer, input, length) != 0)
+        result = 1;
+    free(to.buffer);
+    return result;
+}
+
+/* Same again with the wire data base64 encoded, as it is in the protocol */
+static int CheckBase64Decompress(const MI_Uint8 *compressed, size_t compressedLength, const MI_Uint8 *input, size_t length)
+{
+    DecodeBuffer from;
+    DecodeBuffer encoded;
+    DecodeBuffer to;
+    int result = 0;
+
+    from.buffer = (MI_Char*) compressed;
+    from.bufferLength = compressedLength;
+    from.bufferUsed = compressedLength;
+
+    if (Base64EncodeBuffer(&from, &encoded) != MI_RESULT_OK)
+        return 1;
+    if (Base64DecodeDecompressBuffer(&encoded, &to, NULL) != MI_RESULT_OK)
+    {
+        free(encoded.buffer);
+        return 1;
+    }
+    if (to.bufferUsed != length || memcmp(to.buffer, input, length) != 0)
+        result = 1;
+    free(to.buffer);
+    free(encoded.buffer);
+    return result;
+}
+
+/* Walks the chunk headers. On the wire each chunk starts with its original and
+ * compressed sizes as little endian 16-bit values, both one less than they really
+ * are. A chunk is stored rather than compressed when the two are equal.
+ */
+static int CheckChunkHeaders(const MI_Uint8 *compressed, size_t compressedLength, size_t length)
+{
+    size_t position = 0;
+    size_t total = 0;
+
+    while (position < compressedLength)
+    {
+        size_t originalSize;
+        size_t compressedSize;
+
+        if ((compressedLength - position) < 4)
+            return 1;
+
+        originalSize = (compressed[position] | (compressed[position + 1] << 8)) + 1;
+        compressedSize = (compressed[position + 2] | (compressed[position + 3] << 8)) + 1;
+        position += 4;
+
+        /* Every chunk but the last is full, and compressing never makes a chunk bigger */
+        if (compressedSize > originalSize || (compressedLength - position) < compressedSize)
+            return 1;
+        if ((total + originalSize) < length && originalSize != CHUNK_SIZE)
+            return 1;
+
+        position += compressedSize;
+        total += originalSize;
+    }
+    return (total == length) ? 0 : 1;
+}
+
+static int CheckTruncated(const MI_Uint8 *compressed, size_t compressedLength)
+{
+    DecodeBuffer from;
+    DecodeBuffer to;
+    size_t cut;
+
+    for (cut = 1; cut <= 3 && cut < compressedLength; cut++)
+    {
+        from.buffer = (MI_Char*) compressed;
+        from.bufferLength = compressedLength - cut;
+        from.bufferUsed = compressedLength - cut;
+
+        if (DecompressBuffer(&from, &to, NULL) == MI_RESULT_OK)
+        {
+            free(to.buffer);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int Report(const char *vectorName, const char *check, MI_Uint32 level, int failed)
+{
+    printf("%s %s level %u: %s\n", vectorName, check, level, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+static int TestVectors(const char *directory)
+{
+    size_t v;
+    MI_Uint32 level;
+    int failures = 0;
+
+    for (v = 0; v < NUM_VECTORS; v++)
+    {
+        const TestVector *vector = &g_vectors[v];
+        MI_Uint8 *input = MakeInput(vector);
+
+        if (input == NULL)
+            return 1;
+
+        failures += Report(vector->name, "input checksum", 0, Checksum(input, vector->size) != vector->checksum);
+
+        for (level = 0; level < NUM_LEVELS; level++)
+        {
+            char path[1024];
+            MI_Uint8 *golden = NULL;
+            size_t goldenLength = 0;
+            DecodeBuffer compressed;
+
+            if (vector->goldenLevels & LEVEL_MASK(level))
+            {
+                GoldenPath(path, sizeof(path), directory, vector, level);
+                golden = ReadFile(path, &goldenLength);
+                if (golden == NULL)
+                {
+                    printf("%s: cannot read %s\n", vector->name, path);
+                    failures++;
+                    continue;
+                }
+
+                failures += Report(vector->name, "golden headers", level, CheckChunkHeaders(golden, goldenLength, vector->size));
+                failures += Report(vector->name, "golden decompress", level, CheckDecompress(golden, goldenLength, input, vector->size));
+                failures += Report(vector->name, "golden base64 decompress", level, CheckBase64Decompress(golden, goldenLength, input, vector->size));
+                failures += Report(vector->name, "golden truncated", level, CheckTruncated(golden, goldenLength));
+            }
+
+            if (CompressAtLevel(input, vector->size, level, &compressed) != MI_RESULT_OK)
+            {
+                failures += Report(vector->name, "compress", level, 1);
+            }
+            else
+            {
+                const MI_Uint8 *output = (const MI_Uint8*) compressed.buffer;
+
+                failures += Report(vector->name, "headers", level, CheckChunkHeaders(output, compressed.bufferUsed, vector->size));
+                failures += Report(vector->name, "round trip", level, CheckDecompress(output, compressed.bufferUsed, input, vector->size));
+
+                /* Allow a little slack so small changes in parsing do not trip this */
+                if (golden)
+                {
+                    int bigger = (compressed.bufferUsed > goldenLength + (goldenLength / 100) + 16);
+
+                    if (bigger)
+                        printf("%s: %u bytes at level %u, golden file is %lu\n",
+                            vector->name, compressed.bufferUsed, level, (unsigned long) goldenLength);
+                    failures += Report(vector->name, "size", level, bigger);
+                }
+                free(compressed.buffer);
+            }
+            free(golden);
+        }
+        free(input);
+    }
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
+
+static int GenerateVectors(const char *directory)
+{
+    size_t v;
+    MI_Uint32 level;
+
+    for (v = 0; v < NUM_VECTORS; v++)
+    {
+        const TestVector *vector = &g_vectors[v];
+        MI_Uint8 *input = MakeInput(vector);
+
+        if (input == NULL)
+            return 1;
+
+        printf("%s input checksum 0x%016llxULL\n", vector->name, Checksum(input, vector->size));
+
+        for (level = 0; level < NUM_LEVELS; level++)
+        {
+            char path[1024];
+            DecodeBuffer compressed;
+            FILE *existing;
+            int result;
+
+            if ((vector->goldenLevels & LEVEL_MASK(level)) == 0)
+                continue;
+
+            /* Existing files are reference streams, so they are never overwritten */
+            GoldenPath(path, sizeof(path), directory, vector, level);
+            existing = fopen(path, "rb");
+            if (existing)
+            {
+                fclose(existing);
+                printf("kept %s\n", path);
+                continue;
+            }
+
+            if (CompressAtLevel(input, vector->size, level, &compressed) != MI_RESULT_OK)
+            {
+                free(input);
+                return 1;
+            }
+
+            result = WriteFile(path, (const MI_Uint8*) compressed.buffer, compressed.bufferUsed);
+            free(compressed.buffer);
+            if (result != 0)
+            {
+                printf("cannot write %s\n", path);
+                free(input);
+                return 1;
+            }
+            printf("wrote %s\n", path);
+        }
+        free(input);
+    }
+    return 0;
+}
+
+static double Now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1e9);
+}
+
+/* Compresses and decompresses each vector at each level for at least minSeconds
+ * each and reports MB/s of input.
+ */
+static int Throughput(double minSeconds)
+{
+    size_t v;
+    MI_Uint32 level;
+
+    for (v = 0; v < NUM_VECTORS; v++)
+    {
+        const TestVector *vector = &g_vectors[v];
+        MI_Uint8 *input = MakeInput(vector);
+
+        if (input == NULL)
+            return 1;
+
+        for (level = 0; level < NUM_LEVELS; level++)
+        {
+            DecodeBuffer compressed;
+            DecodeBuffer decompressed;
+            CompressionCache cache;
+            ptrdiff_t storedRun = 0;
+            double start;
+            double compressSeconds;
+            double decompressSeconds;
+            unsigned long iterations;
+            size_t compressedSize = 0;
+
+            /* Same as steady state traffic, the workspaces and the stream's run of
+             * stored chunks are kept between calls
+             */
+            memset(&cache, 0, sizeof(cache));
+            cache.compressionLevel = level;
+
+            start = Now();
+            for (iterations = 0; (iterations == 0) || (Now() - start) < minSeconds; iterations++)
+            {
+                DecodeBuffer from;
+
+                from.buffer = (MI_Char*) input;
+                from.bufferLength = vector->size;
+                from.bufferUsed = vector->size;
+                if (CompressBuffer(&from, &compressed, 0, &cache, &storedRun) != MI_RESULT_OK)
+                {
+                    CompressionCache_Free(&cache);
+                    free(input);
+                    return 1;
+                }
+                compressedSize = compressed.bufferUsed;
+                free(compressed.buffer);
+            }
+            compressSeconds = (Now() - start) / iterations;
+
+            /* Compressed once more outside the loop to have something to decompress */
+            if (CompressAtLevel(input, vector->size, level, &compressed) != MI_RESULT_OK)
+            {
+                CompressionCache_Free(&cache);
+                free(input);
+                return 1;
+            }
+
+            start = Now();
+            for (iterations = 0; (iterations == 0) || (Now() - start) < minSeconds; iterations++)
+            {
+                if (DecompressBuffer(&compressed, &decompressed, &cache) != MI_RESULT_OK)
+                {
+                    free(compressed.buffer);
+                    CompressionCache_Free(&cache);
+                    free(input);
+                    return 1;
+                }
+                free(decompressed.buffer);
+            }
+            decompressSeconds = (Now() - start) / iterations;
+
+            printf("%-12s level %u: ratio %6.3f  compress %8.1f MB/s  decompress %8.1f MB/s\n",
+                vector->name, level, (double) vector->size / (double) compressedSize,
+                vector->size / compressSeconds / 1e6, vector->size / decompressSeconds / 1e6);
+
+            free(compressed.buffer);
+            CompressionCache_Free(&cache);
+        }
+        free(input);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int result;
+
+    if (argc == 3 && strcmp(argv[1], "--generate") == 0)
+        return GenerateVectors(argv[2]);
+
+    /* Large vectors are split over the chunk threads, as they are in the provider */
+    if (argc >= 2 && strcmp(argv[1], "--throughput") == 0)
+    {
+        double minSeconds = 0.2;
+
+        if (argc == 4 && strcmp(argv[2], "--min-time") == 0)
+            minSeconds = atof(argv[3]) / 1000.0;
+        ChunkPool_Start();
+        result = Throughput(minSeconds);
+        ChunkPool_Stop();
+        return result;
+    }
+
+    if (argc == 2 && argv[1][0] != '-')
+    {
+        ChunkPool_Start();
+        result = TestVectors(argv[1]);
+        ChunkPool_Stop();
+        return result;
+    }
+
+    fprintf(stderr, "Usage: %s <vector directory>\n", argv[0]);
+    fprintf(stderr, "       %s --generate <vector directory>\n", argv[0]);
+    fprintf(stderr, "       %s --throughput [--min-time milliseconds]\n", argv[0]);
+    return 2;
+}
@@ -91,6 +91,36 @@ typedef struct _XPRESS_LZ_WORKSPACE {
     MI_Uint8 * HashTableEx[HASH_TABLE_EX_SIZE];
 } XPRESS_LZ_WORKSPACE, *PXPRESS_LZ_WORKSPACE;
 
+//
+// The fast and high compression levels use a different match finder.  Head
+// holds the most recent position (plus one, so zero means empty) for each hash
+// of the next few input bytes.  The high level also links every position to the
+// previous one with the same hash through Prev, which is indexed by position
+// modulo the window size.  The fast level only uses part of Head and does not
+// need Prev at all.  Small inputs use fewer hash bits so that clearing Head
+// does not cost more than compressing them.
+//
+
+#define CHAIN_HASH_BITS_MIN     10
+#define CHAIN_HASH_BITS_FAST    13
+#define CHAIN_HASH_BITS_HIGH    15
+
+#define CHAIN_HASH_SIZE         (1 << CHAIN_HASH_BITS_HIGH)
+
+//
+// How hard the high level searches.  It stops walking a chain after
+// CHAIN_MAX_DEPTH candidates, or as soon as it finds a match of at least
+// CHAIN_NICE_LENGTH bytes.
+//
+
+#define CHAIN_MAX_DEPTH         32
+#define CHAIN_NICE_LENGTH       160
+
+typedef struct _XPRESS_LZ_CHAIN_WORKSPACE {
+    MI_Uint32 Head[CHAIN_HASH_SIZE];
+    MI_Uint32 Prev[1 << 16];
+} XPRESS_LZ_CHAIN_WORKSPACE, *PXPRESS_LZ_CHAIN_WORKSPACE;
+
 //
 // The rest of these #defines and structs are for the Huffman encoder/decoder.
 //
@@ -105,7 +135,36 @@ typedef struct _XPRESS_LZ_WORKSPACE {
 #define HUFFMAN_ALPHABET_SIZE        512
 #define MAX_ENCODING_LENGTH          15
 
-#define HUFFMAN_DECODE_LENGTH        10
+#define HUFFMAN_DECODE_LENGTH        12
+
+//
+// Literals are counted in several interleaved tables, chosen by the low bits
+// of the LZ output position, and summed when the codes are built.  Runs of the
+// same literal then increment different counters instead of each waiting on
+// the store to the previous one.
+//
+
+#define HUFFMAN_LITERAL_LANES        4
+
+#define XPRESS_COUNT_LITERAL(LiteralFrequencies, Literal, OutputPos)          \
+    (++(LiteralFrequencies)[(Literal) * HUFFMAN_LITERAL_LANES +               \
+                            ((ULONG_PTR)(OutputPos) & (HUFFMAN_LITERAL_LANES - 1))])
+
+//
+// Layout of the DecodeTableMulti entries.  An entry either holds two literals
+// (the first in the low byte) and the total bit length of both codes, or the
+// same value as DecodeTable in its low 16 bits.
+//
+
+#define DECODE_MULTI_TWO_LITERALS    0x100000
+#define DECODE_MULTI_LENGTH_SHIFT    16
+
+//
+// The decoder's fast loop reads the input without bounds checks while at least
+// this many bytes remain: two refills and the longest raw match length.
+//
+
+#define DECODE_INPUT_MARGIN          16
 
 typedef struct _HUFFMAN_NODE {
     ULONG_PTR Frequency;
@@ -149,6 +208,8 @@ typedef struct _HUFFMAN_WORKSPACE {
 
     MI_Uint32 Frequencies[HUFFMAN_ALPHABET_SIZE];
 
+    MI_Uint32 LiteralFrequencies[256 * HUFFMAN_LITERAL_LANES];
+
     MI_Uint8 CompactBitLengths[HUFFMAN_ALPHABET_SIZE / 2];
 } HUFFMAN_WORKSPACE, *PHUFFMAN_WORKSPACE;
 
@@ -171,12 +232,23 @@ typedef struct _XPRESS_HUFF_WORKSPACE {
     MI_Uint8 LzPass[HUFFMAN_BLOCK_SIZE * 9 / 8 + 20];
 } XPRESS_HUFF_WORKSPACE, *PXPRESS_HUFF_WORKSPACE;
 
+//
+// Workspace for the fast and high levels.  The fast level only needs the Head
+// table, so its workspace ends at Chain.Prev.
+//
+
+typedef struct _XPRESS_HUFF_LEVEL_WORKSPACE {
+    XPRESS_HUFF_WORKSPACE Huff;
+    XPRESS_LZ_CHAIN_WORKSPACE Chain;
+} XPRESS_HUFF_LEVEL_WORKSPACE, *PXPRESS_HUFF_LEVEL_WORKSPACE;
+
 
 typedef struct _XPRESS_HUFF_DECODE_WORKSPACE {
     USHORT LengthSortedListNext[HUFFMAN_ALPHABET_SIZE];
     USHORT LengthSortedListHead[MAX_ENCODING_LENGTH + 1];
     SHORT DecodeTable[1 << HUFFMAN_DECODE_LENGTH];
     SHORT DecodeTree[HUFFMAN_ALPHABET_SIZE * 2 + 1];
+    MI_Uint32 DecodeTableMulti[1 << HUFFMAN_DECODE_LENGTH];
 } XPRESS_HUFF_DECODE_WORKSPACE, *PXPRESS_HUFF_DECODE_WORKSPACE;
 
 typedef struct _XPRESS_CALLBACK_PARAMS {
@@ -200,6 +272,20 @@ CompressBufferXpressHuffStandard (
     _In_ MI_Uint32 ProgressBytes
     );
 
+MI_Uint32
+CompressBufferXpressHuffLevel (
+    _In_ MI_Uint8 * UncompressedBuffer,
+    _In_ MI_Uint32 UncompressedBufferSize,
+    _Out_ MI_Uint8 * CompressedBuffer,
+    _In_ MI_Uint32 CompressedBufferSize,
+    _Out_ MI_Uint32* FinalCompressedSize,
+    _In_ PXPRESS_HUFF_LEVEL_WORKSPACE Workspace,
+    _In_ MI_Uint32 Level,
+    _In_ PXPRESS_CALLBACK_FUNCTION Callback,
+    _In_ void* CallbackContext,
+    _In_ MI_Uint32 ProgressBytes
+    );
+
 
 MI_Uint32
 CompressBufferProgress (
@@ -209,6 +295,7 @@ CompressBufferProgress (
     _In_ MI_Uint32 CompressedBufferSize,
     _Out_ MI_Uint32* FinalCompressedSize,
     _In_ void* WorkSpace,
+    _In_ MI_Uint32 Level,
     _In_ PXPRESS_CALLBACK_FUNCTION Callback,
     _In_ void* CallbackContext,
     _In_ MI_Uint32 ProgressBytes
@@ -241,7 +328,11 @@ Arguments:
     FinalCompressedSize - Receives the number of bytes needed in the compressed
         buffer to store the compressed data.
 
-    WorkSpace - A buffer for compression data structures.
+    WorkSpace - A buffer for compression data structures.  It must be at least
+        the size returned by CompressWorkSpaceSizeXpressHuffLevel for Level.
+
+    Level - One of the XPRESS_LEVEL_* values.  All levels produce the same
+        format; they only trade speed for compression ratio.
 
     Callback - The function to call back periodically.
 
@@ -268,6 +359,20 @@ Return Value:
 
     AlignedWorkspace = ALIGN_UP_POINTER(WorkSpace, ULONG_PTR);
 
+    if (Level == XPRESS_LEVEL_FAST || Level == XPRESS_LEVEL_HIGH) {
+
+        return CompressBufferXpressHuffLevel(UncompressedBuffer,
+                                             UncompressedBufferSize,
+                                             CompressedBuffer,
+                                             CompressedBufferSize,
+                                             FinalCompressedSize,
+                                             (PXPRESS_HUFF_LEVEL_WORKSPACE)AlignedWorkspace,
+                                             Level,
+                                             Callback,
+                                             CallbackContext,
+                                             ProgressBytes);
+    }
+
     HuffStandardWorkspace = (PXPRESS_HUFF_WORKSPACE)AlignedWorkspace;
 
     return CompressBufferXpressHuffStandard(UncompressedBuffer,
@@ -369,10 +474,45 @@ CompressWorkSpaceSizeXpressHuff (
 Routine Description:
 
     This routine returns to the caller the size in bytes of the different work
-    space buffers need to perform the compression.
+    space buffers need to perform the compression at the default level.
+
+Arguments:
+
+    CompressBufferWorkSpaceSize - Receives the size in bytes needed to compress
+        a buffer.
+
+    DecompressBufferWorkSpaceSize - Receives the size in bytes need to
+        decompress a buffer.
+
+Return Value:
+
+
+--*/
+
+{
+    return CompressWorkSpaceSizeXpressHuffLevel(XPRESS_LEVEL_DEFAULT,
+                                                CompressBufferWorkSpaceSize,
+                                                DecompressBufferWorkSpaceSize);
+}
+
+MI_Uint32
+CompressWorkSpaceSizeXpressHuffLevel (
+    _In_ MI_Uint32 Level,
+    _Out_ MI_Uint32* CompressBufferWorkSpaceSize,
+    _Out_ MI_Uint32* DecompressBufferWorkSpaceSize
+    )
+
+/*++
+
+Routine Description:
+
+    This routine returns to the caller the size in bytes of the different work
+    space buffers need to perform the compression at the given level.
 
 Arguments:
 
+    Level - One of the XPRESS_LEVEL_* values.
+
     CompressBufferWorkSpaceSize - Receives the size in bytes needed to compress
         a buffer.
 
@@ -381,16 +521,35 @@ Arguments:
 
 Return Value:
 
+    STATUS_SUCCESS - The sizes were returned.
+
+    STATUS_INVALID_PARAMETER - Level is not a known compression level.
 
 --*/
 
 {
+    ULONG_PTR WorkspaceSize;
+
+    switch (Level) {
+    case XPRESS_LEVEL_DEFAULT:
+        WorkspaceSize = sizeof(XPRESS_HUFF_WORKSPACE);
+        break;
+    case XPRESS_LEVEL_FAST:
+        WorkspaceSize = offsetof(XPRESS_HUFF_LEVEL_WORKSPACE, Chain.Prev);
+        break;
+    case XPRESS_LEVEL_HIGH:
+        WorkspaceSize = sizeof(XPRESS_HUFF_LEVEL_WORKSPACE);
+        break;
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
     //
     // Make the size big enough to let us align it to a pointer boundary.
     //
 
-    *CompressBufferWorkSpaceSize = sizeof(XPRESS_HUFF_WORKSPACE) +
-                                   sizeof(ULONG_PTR) - 1;
+    *CompressBufferWorkSpaceSize = (MI_Uint32)(WorkspaceSize +
+                                               sizeof(ULONG_PTR) - 1);
 
     *DecompressBufferWorkSpaceSize = sizeof(XPRESS_HUFF_DECODE_WORKSPACE) +
                                      sizeof(ULONG_PTR) - 1;
@@ -441,10 +600,20 @@ Return Value:
     ULONG_PTR MaxBitCount;
     ULONG_PTR CurrentMask;
     ULONG_PTR TotalBitCount;
-    ULONG_PTR TotalFrequency;
-    MI_Uint8* CurrentCompactBitLen;
+    ULONG_PTR BitLenCount[MAX_ENCODING_LENGTH + 1];
+    ULONG_PTR NextCode[MAX_ENCODING_LENGTH + 1];
+    MI_Uint32* Lanes;
     HUFFMAN_ENCODING* Code;
 
+    //
+    // Add the literal counts from the interleaved tables into Frequencies.
+    //
+
+    for (i = 0; i < 256; ++i) {
+        Lanes = &Workspace->LiteralFrequencies[i * HUFFMAN_LITERAL_LANES];
+        Workspace->Frequencies[i] += Lanes[0] + Lanes[1] + Lanes[2] + Lanes[3];
+    }
+
     //
     // First, sort the symbols by frequency.  The maximum frequency this
     // function supports is 2^16-1, so we will sort with a two-pass radix sort.
@@ -802,59 +971,53 @@ Return Value:
 
     assert(MaxBitCount == Workspace->NodeBuffer[1].BitLength);
 
-    CurrentMask = 0;
-    TotalBitCount = 0;
-
-    for (BitLen = MinBitCount; BitLen <= MaxBitCount; ++BitLen) {
-
-        //
-        // For each possible bit length, enumerate (in "alphabetical" order) all
-        // the symbols with that bit length.  Maintain the canonical code by
-        // incrementing it for each symbol and doubling it for each new bit
-        // length.  Add up the frequencies to compute the total bit length of
-        // the data.
-        //
-
-        TotalFrequency = 0;
-        CurrentCompactBitLen = &Workspace->CompactBitLengths[0];
+    //
+    // Count the symbols of each bit length, then compute the first canonical
+    // code of each length: codes are assigned in "alphabetical" order within a
+    // length, and the code doubles for each new bit length.  That lets us
+    // assign every code in one pass over the symbols instead of one pass per
+    // bit length.
+    //
 
-        for (i = 0; i < HUFFMAN_ALPHABET_SIZE; ++i) {
+    memset(&BitLenCount[0], 0, sizeof(BitLenCount));
 
-            if (Workspace->SymbolToBitLength[i] == BitLen) {
+    for (i = 0; i < HUFFMAN_ALPHABET_SIZE; ++i) {
+        ++BitLenCount[Workspace->SymbolToBitLength[i]];
+    }
 
-                assert(Workspace->Frequencies[i] > 0);
+    CurrentMask = 0;
 
-                TotalFrequency += Workspace->Frequencies[i];
+    for (BitLen = MinBitCount; BitLen <= MaxBitCount; ++BitLen) {
+        NextCode[BitLen] = CurrentMask;
+        CurrentMask = (CurrentMask + BitLenCount[BitLen]) << 1;
+    }
 
-                CurrentCompactBitLen[0] |= BitLen;
+    //
+    // Assign the codes, fill in CompactBitLengths (two 4-bit lengths per
+    // byte, the even symbol in the low nibble) and add up the total bit
+    // length of the data.
+    //
 
-                Code = &Workspace->Encodings[i];
-                Code->BitLength = (USHORT)BitLen;
-                Code->Code = (USHORT)CurrentMask;
-                ++CurrentMask;
-            }
+    TotalBitCount = 0;
 
-            ++i;
+    for (i = 0; i < HUFFMAN_ALPHABET_SIZE; ++i) {
 
-            if (Workspace->SymbolToBitLength[i] == BitLen) {
+        BitLen = Workspace->SymbolToBitLength[i];
 
-                assert(Workspace->Frequencies[i] > 0);
+        if (BitLen != 0) {
 
-                TotalFrequency += Workspace->Frequencies[i];
+            assert(Workspace->Frequencies[i] > 0);
+            assert(BitLen >= MinBitCount && BitLen <= MaxBitCount);
 
-                CurrentCompactBitLen[0] |= BitLen * 16;
+            TotalBitCount += Workspace->Frequencies[i] * BitLen;
 
-                Code = &Workspace->Encodings[i];
-                Code->BitLength = (USHORT)BitLen;
-                Code->Code = (USHORT)CurrentMask;
-                ++CurrentMask;
-            }
+            Workspace->CompactBitLengths[i / 2] |= (MI_Uint8)(BitLen << (4 * (i % 2)));
 
-            ++CurrentCompactBitLen;
+            Code = &Workspace->Encodings[i];
+            Code->BitLength = (USHORT)BitLen;
+            Code->Code = (USHORT)NextCode[BitLen];
+            ++NextCode[BitLen];
         }
-
-        CurrentMask <<= 1;
-        TotalBitCount += TotalFrequency * BitLen;
     }
 
     return TotalBitCount;
@@ -895,11 +1058,11 @@ Return Value:
 --*/
 
 {
-    ULONG_PTR CurrentShift;
-    USHORT NextShort;
+    MI_Uint64 BitBuffer;
+    ULONG_PTR BitCount;
     MI_Uint8 * HuffOutputPos1;
     MI_Uint8 * HuffOutputPos2;
-    INT Tags;
+    MI_Uint32 Tags;
     HUFFMAN_ENCODING* HuffCode;
     MI_Uint8 HuffValue;
     ULONG_PTR MatchLen;
@@ -918,22 +1081,49 @@ Return Value:
     //
     // Perform the Huffman encoding of the first-pass buffer.
     //
+    // The pending bits are kept in the low BitCount bits of a 64-bit buffer,
+    // so a code never has to be split across two USHORTs.  Once more than 16
+    // bits are pending, the oldest 16 are written out as one USHORT.  A full
+    // USHORT is held back until the next code arrives because the decoder
+    // reads the length bytes of a match before it refills, so the USHORT
+    // slots must rotate at exactly those points.  No code is longer than 16
+    // bits, so there are never more than 32 bits pending.
+    //
+    // We need three HuffOutputPos variables for the match length encoding to
+    // work properly.  The full symbol encoding must come before the length
+    // bytes, and it might straddle two USHORTs, so we need to reserve the
+    // second USHORT in advance.
+    //
 
-    CurrentShift = 16;
-    NextShort = 0;
+    BitBuffer = 0;
+    BitCount = 0;
 
     HuffOutputPos1 = HuffOutputPos;
     HuffOutputPos += sizeof(USHORT);
     HuffOutputPos2 = HuffOutputPos;
     HuffOutputPos += sizeof(USHORT);
 
+#define XPRESS_PUT_BITS(Bits, Length)                                           \
+    {                                                                           \
+        BitBuffer = (BitBuffer << (Length)) | (Bits);                           \
+        BitCount += (Length);                                                   \
+                                                                                \
+        if (BitCount > 16) {                                                    \
+            BitCount -= 16;                                                     \
+            *((USHORT UNALIGNED *)HuffOutputPos1) = (USHORT)(BitBuffer >> BitCount); \
+            HuffOutputPos1 = HuffOutputPos2;                                    \
+            HuffOutputPos2 = HuffOutputPos;                                     \
+            HuffOutputPos += sizeof(USHORT);                                    \
+        }                                                                       \
+    }
+
     goto HuffEncodeGetTags;
 
     for (;;) {
 
         for (;;) {
 
-            if (Tags < 0) {
+            if ((INT)Tags < 0) {
                 break;
             }
 
@@ -944,49 +1134,7 @@ Return Value:
             HuffCode = &Workspace->Encodings[LzInputPos[0]];
             ++LzInputPos;
 
-            if (CurrentShift >= HuffCode->BitLength) {
-
-                //
-                // This symbols fits in the current USHORT.  Make room for it
-                // and OR it into the lower bits.
-                //
-
-                CurrentShift -= HuffCode->BitLength;
-                NextShort <<= HuffCode->BitLength;
-                NextShort |= HuffCode->Code;
-
-            } else {
-
-                //
-                // This symbol will have to straddle two USHORTs.  First, OR in
-                // the high bits.
-                //
-
-                NextShort <<= CurrentShift;
-                NextShort |= HuffCode->Code >>
-                             (HuffCode->BitLength - CurrentShift);
-                CurrentShift -= HuffCode->BitLength;
-
-                //
-                // Write out the now-filled USHORT.  We need three HuffOutputPos
-                // variables for the match length encoding to work properly.
-                // The full symbol encoding must come before the length bytes,
-                // and it might straddle two USHORTs, so we need to reserve the
-                // second USHORT in advance.
-                //
-
-                *((USHORT UNALIGNED *)HuffOutputPos1) = NextShort;
-                HuffOutputPos1 = HuffOutputPos2;
-                HuffOutputPos2 = HuffOutputPos;
-                HuffOutputPos += sizeof(USHORT);
-
-                //
-                // Put the low bits of the symbol into the next USHORT.
-                //
-
-                CurrentShift += 16;
-                NextShort = HuffCode->Code;
-            }
+            XPRESS_PUT_BITS(HuffCode->Code, HuffCode->BitLength);
         }
 
         Tags *= 2;
@@ -1004,10 +1152,10 @@ Return Value:
             __prefetch(LzInputPos + 64);
 #endif
 
-            Tags = *((INT UNALIGNED *)LzInputPos);
+            Tags = *((MI_Uint32 UNALIGNED *)LzInputPos);
             LzInputPos += sizeof(Tags);
 
-            if (Tags < 0) {
+            if ((INT)Tags < 0) {
                 Tags = Tags * 2 + 1;
             } else {
                 Tags = Tags * 2 + 1;
@@ -1032,22 +1180,7 @@ Return Value:
 
         HuffCode = &Workspace->Encodings[HuffValue + 256];
 
-        if (CurrentShift >= HuffCode->BitLength) {
-            CurrentShift -= HuffCode->BitLength;
-            NextShort <<= HuffCode->BitLength;
-            NextShort |= HuffCode->Code;
-        } else {
-            NextShort <<= CurrentShift;
-            NextShort |= HuffCode->Code >>
-                        (HuffCode->BitLength - CurrentShift);
-            CurrentShift -= HuffCode->BitLength;
-            *((USHORT UNALIGNED *)HuffOutputPos1) = NextShort;
-            HuffOutputPos1 = HuffOutputPos2;
-            HuffOutputPos2 = HuffOutputPos;
-            HuffOutputPos += sizeof(USHORT);
-            CurrentShift += 16;
-            NextShort = HuffCode->Code;
-        }
+        XPRESS_PUT_BITS(HuffCode->Code, HuffCode->BitLength);
 
         if ((HuffValue % LEN_MULT) == LEN_MULT - 1) {
 
@@ -1095,22 +1228,7 @@ Return Value:
         // Write the offset.
         //
 
-        if (CurrentShift >= HuffValue) {
-            CurrentShift -= HuffValue;
-            NextShort <<= HuffValue;
-            NextShort |= *((USHORT UNALIGNED *)LzInputPos);
-        } else {
-            NextShort <<= CurrentShift;
-            NextShort |= *((USHORT UNALIGNED *)LzInputPos) >>
-                         (HuffValue - CurrentShift);
-            CurrentShift -= HuffValue;
-            *((USHORT UNALIGNED *)HuffOutputPos1) = NextShort;
-            HuffOutputPos1 = HuffOutputPos2;
-            HuffOutputPos2 = HuffOutputPos;
-            HuffOutputPos += sizeof(USHORT);
-            CurrentShift += 16;
-            NextShort = *((USHORT UNALIGNED *)LzInputPos);
-        }
+        XPRESS_PUT_BITS(*((USHORT UNALIGNED *)LzInputPos), HuffValue);
 
         LzInputPos += sizeof(USHORT);
     }
@@ -1123,30 +1241,16 @@ Return Value:
 
         HuffCode = &Workspace->Encodings[256];
 
-        if (CurrentShift >= HuffCode->BitLength) {
-            CurrentShift -= HuffCode->BitLength;
-            NextShort <<= HuffCode->BitLength;
-            NextShort |= HuffCode->Code;
-        } else {
-            NextShort <<= CurrentShift;
-            NextShort |= HuffCode->Code >>
-                         (HuffCode->BitLength - CurrentShift);
-            CurrentShift -= HuffCode->BitLength;
-            *((USHORT UNALIGNED *)HuffOutputPos1) = NextShort;
-            HuffOutputPos1 = HuffOutputPos2;
-            HuffOutputPos2 = HuffOutputPos;
-            HuffOutputPos += sizeof(USHORT);
-            CurrentShift += 16;
-            NextShort = HuffCode->Code;
-        }
+        XPRESS_PUT_BITS(HuffCode->Code, HuffCode->BitLength);
     }
 
+#undef XPRESS_PUT_BITS
+
     //
     // Write out the unfinished USHORT.
     //
 
-    NextShort <<= CurrentShift;
-    *((USHORT UNALIGNED *)HuffOutputPos1) = NextShort;
+    *((USHORT UNALIGNED *)HuffOutputPos1) = (USHORT)(BitBuffer << (16 - BitCount));
     *((USHORT UNALIGNED *)HuffOutputPos2) = 0;
 
     return HuffOutputPos;
@@ -1350,6 +1454,8 @@ Return Value:
 
         memset(&Workspace->Huffman.Frequencies[0], 0,
                       sizeof(Workspace->Huffman.Frequencies));
+        memset(&Workspace->Huffman.LiteralFrequencies[0], 0,
+                      sizeof(Workspace->Huffman.LiteralFrequencies));
 
         OutputPos = &Workspace->LzPass[0];
 
@@ -1382,7 +1488,7 @@ Return Value:
             // with the UncompressedBuffer pointer).
             //
 
-            ++Workspace->Huffman.Frequencies[InputPos[0]];
+            XPRESS_COUNT_LITERAL(Workspace->Huffman.LiteralFrequencies, InputPos[0], OutputPos);
             OutputPos[0] = InputPos[0];
             ++InputPos;
             ++OutputPos;
@@ -1422,7 +1528,7 @@ Return Value:
                 // Encode a literal.
                 //
 
-                ++Workspace->Huffman.Frequencies[InputPos[0]];
+                XPRESS_COUNT_LITERAL(Workspace->Huffman.LiteralFrequencies, InputPos[0], OutputPos);
                 OutputPos[0] = InputPos[0];
                 ++OutputPos;
                 ++InputPos;
@@ -1739,7 +1845,7 @@ Return Value:
             // Encode the "unsafe" remainder as literals.
             //
 
-            ++Workspace->Huffman.Frequencies[InputPos[0]];
+            XPRESS_COUNT_LITERAL(Workspace->Huffman.LiteralFrequencies, InputPos[0], OutputPos);
             OutputPos[0] = InputPos[0];
             ++OutputPos;
             ++InputPos;
@@ -1826,132 +1932,849 @@ Return Value:
     return STATUS_SUCCESS;
 }
 
-MI_Uint32
-XpressBuildHuffmanDecodingTable (
-    _Out_ PXPRESS_HUFF_DECODE_WORKSPACE Workspace,
-    _In_ MI_Uint8 * BitLengths
+//
+// Helpers for the fast and high levels.  These write the first-pass LZ77
+// stream in exactly the same form as the match finder in
+// CompressBufferXpressHuffStandard so that XpressDoHuffmanPass can encode it.
+//
+
+typedef struct _XPRESS_LZ_PASS {
+    MI_Uint8 * OutputPos;
+    MI_Uint32 UNALIGNED * TagsOut;
+    MI_Uint32 RunningTags;
+    ULONG_PTR OffsetBits;
+    ULONG_PTR NonHuffmanBytes;
+    MI_Uint32 * Frequencies;
+    MI_Uint32 * LiteralFrequencies;
+} XPRESS_LZ_PASS, *PXPRESS_LZ_PASS;
+
+static __inline void
+XpressLzPassTag (
+    _In_ PXPRESS_LZ_PASS Pass,
+    _In_ MI_Uint32 Tag
     )
+{
+    if ((INT)Pass->RunningTags > 0) {
+        Pass->RunningTags = Pass->RunningTags * 2 + Tag;
+        return;
+    }
 
-/*++
+    //
+    // Start a new chunk of tags.
+    //
 
-Routine Description:
+    Pass->RunningTags = Pass->RunningTags * 2 + Tag;
+    *Pass->TagsOut = Pass->RunningTags;
+    Pass->RunningTags = 1;
+    Pass->TagsOut = (MI_Uint32 UNALIGNED *)Pass->OutputPos;
+    Pass->OutputPos += sizeof(MI_Uint32);
+}
 
-    Takes symbol bit lengths, and computes canonical Huffman codes in a format
-    convenient for efficient decoding.
+static __inline void
+XpressLzPassLiteral (
+    _In_ PXPRESS_LZ_PASS Pass,
+    _In_ MI_Uint8 Literal
+    )
+{
+    XPRESS_COUNT_LITERAL(Pass->LiteralFrequencies, Literal, Pass->OutputPos);
+    Pass->OutputPos[0] = Literal;
+    ++Pass->OutputPos;
+    XpressLzPassTag(Pass, 0);
+}
 
-Arguments:
+static __inline void
+XpressLzPassMatch (
+    _In_ PXPRESS_LZ_PASS Pass,
+    _In_ ULONG_PTR MatchLen,
+    _In_ ULONG_PTR MatchOffset
+    )
+{
+    ULONG_PTR OffsetBitSize;
+    MI_Uint8 HuffValue;
+    MI_Uint8 * OutputPos = Pass->OutputPos;
 
-    Workspace - The decoding table, tree, and misc extra space.
+    assert(MatchLen >= 3);
+    assert(MatchOffset > 0 && MatchOffset < HUFF_WINDOW_SIZE);
 
-    BitLengths - The CompactBitLengths array produced by
-                 XpressBuildHuffmanEncodings.
+    if (MatchOffset >= 256) {
+        OffsetBitSize = XpressHighBitIndexTable[MatchOffset >> 8] + 8;
+    } else {
+        OffsetBitSize = XpressHighBitIndexTable[MatchOffset];
+    }
 
-Return Value:
+    MatchOffset -= ((ULONG_PTR)1 << OffsetBitSize);
+    Pass->OffsetBits += OffsetBitSize;
 
-    STATUS_BAD_COMPRESSION_BUFFER - The Huffman table is not valid.
+    HuffValue = (MI_Uint8)(OffsetBitSize * LEN_MULT);
+    MatchLen -= 3;
 
---*/
+    if (MatchLen >= LEN_MULT - 1) {
 
-{
-    ULONG_PTR i;
-    ULONG_PTR j;
-    ULONG_PTR k;
-    ULONG_PTR BitLen;
-    ULONG_PTR Code;
-    ULONG_PTR TableLo;
-    ULONG_PTR NextTreeNode;
-    SHORT PrevLevelPointer;
-    SHORT PrevLevelEnd;
-    SHORT DecodeValue = 0;
-    LOGICAL FilledTable;
+        HuffValue += LEN_MULT - 1;
+        MatchLen -= LEN_MULT - 1;
 
-    //
-    // This function builds a hybrid table/tree structure for canonical Huffman
-    // decoding.  The idea is to use the table to decode short (frequent)
-    // symbols, and to use the more-space-efficient tree to decode long symbols.
-    //
-    // Each 16-bit entry in the table/tree follows this protocol:
-    //   If the high bit is zero, the table/tree value is
-    //   (decoded symbol) * 16 + (symbol bit length)
-    //   If the high bit is one, the table/tree value is
-    //   -(index of tree node to decode remaining bits)
-    //
-    // The code for constructing the table/tree is somewhat hard to understand
-    // because it's very fast.
-    //
+        OutputPos[0] = HuffValue;
+        ++OutputPos;
 
-    //
-    // First, initialize our lists.
-    //
+        if (MatchLen < 255) {
 
-    for (i = 0; i <= MAX_ENCODING_LENGTH; ++i) {
-        Workspace->LengthSortedListHead[i] = HUFFMAN_ALPHABET_SIZE;
-    }
+            OutputPos[0] = (MI_Uint8)MatchLen;
+            ++OutputPos;
+            ++Pass->NonHuffmanBytes;
 
-    //
-    // We want to bucketize the symbols according to bit length (between 1 and
-    // 15) in lists that are sorted by symbol value in reverse order.
-    //
+        } else {
 
-    for (i = 0; i < HUFFMAN_ALPHABET_SIZE / 2; ++i) {
+            OutputPos[0] = 255;
+            MatchLen += LEN_MULT - 1;
 
-        BitLen = BitLengths[i] & 15;
+            if (MatchLen < (1 << 16)) {
 
-        if (BitLen) {
+                *((USHORT UNALIGNED *)(OutputPos + 1)) = (USHORT)MatchLen;
+                OutputPos += 3;
+                Pass->NonHuffmanBytes += 3;
 
-            //
-            // Insert this symbol into the appropriate single-linked list.  The
-            // symbol value is 2 * i.
-            //
+            } else {
 
-            Workspace->LengthSortedListNext[2 * i] =
-                Workspace->LengthSortedListHead[BitLen];
-            Workspace->LengthSortedListHead[BitLen] = (USHORT)(2 * i);
+                *((USHORT UNALIGNED *)(OutputPos + 1)) = 0;
+                OutputPos += 3;
+                *((MI_Uint32 UNALIGNED *)OutputPos) = (MI_Uint32)MatchLen;
+                OutputPos += 4;
+                Pass->NonHuffmanBytes += 7;
+            }
         }
 
-        BitLen = BitLengths[i] >> 4;
-
-        if (BitLen) {
-
-            //
-            // The symbol value is now 2 * i + 1.  Note that we do larger symbol
-            // second so that they will be properly sorted if they have the same
-            // bit length.
-            //
+    } else {
 
-            Workspace->LengthSortedListNext[2 * i + 1] =
-                Workspace->LengthSortedListHead[BitLen];
-            Workspace->LengthSortedListHead[BitLen] = (USHORT)(2 * i + 1);
-        }
+        HuffValue += (MI_Uint8)MatchLen;
+        OutputPos[0] = HuffValue;
+        ++OutputPos;
     }
 
-    //
-    // Next we're going to build the tree.  We do this from the bottom up.
-    // Here's an example of how the algorithm works: suppose we have 20 symbols
-    // with a bit length of 15.  First, create the leaf nodes for each of these
-    // 20 symbols.  Then, move to the length-14 case.  Create 10 non-leaf nodes
-    // whose children are the 20 initial leaf nodes (in order).  Create (let's
-    // say 30) leaf nodes for the length-14 symbols.  Create 20 ([30 + 10] / 2)
-    // non-leaf nodes linking to the existing 40 nodes.  And so on, for each bit
-    // length down to 11.  Then, create entries in the decoding *table* (not
-    // tree) linking to all the remaining top-level nodes in the tree.
-    //
-    // The number of nodes in the tree cannot exceed 2 * HUFFMAN_ALPHABET_SIZE.
-    //
+    ++Pass->Frequencies[HuffValue + 256];
 
-    NextTreeNode = HUFFMAN_ALPHABET_SIZE * 2;
-    PrevLevelEnd = -HUFFMAN_ALPHABET_SIZE * 2;
-    PrevLevelPointer = -HUFFMAN_ALPHABET_SIZE * 2 + 1;
+    *((USHORT UNALIGNED *)OutputPos) = (USHORT)MatchOffset;
+    OutputPos += sizeof(USHORT);
 
-    for (i = MAX_ENCODING_LENGTH; i > HUFFMAN_DECODE_LENGTH; --i) {
+    Pass->OutputPos = OutputPos;
+    XpressLzPassTag(Pass, 1);
+}
 
-        //
-        // Create non-leaf nodes linking to every other existing node.  Note
-        // that a node's children are -DecodeTree[node] and -DecodeTree[node]+1.
-        // So we only specify the '0' child, and the '1' child is implied.
-        //
+static __inline ULONG_PTR
+XpressMatchLength (
+    _In_ const MI_Uint8 * InputPos,
+    _In_ const MI_Uint8 * Match,
+    _In_ ULONG_PTR Limit
+    )
 
-        while (PrevLevelPointer < PrevLevelEnd) {
+/*++
+
+Routine Description:
+
+    Returns how many bytes at InputPos and Match are equal, up to Limit.
+
+--*/
+
+{
+    ULONG_PTR Length = 0;
+
+    while (Length + sizeof(MI_Uint32) <= Limit &&
+           *((MI_Uint32 UNALIGNED *)(InputPos + Length)) ==
+           *((MI_Uint32 UNALIGNED *)(Match + Length)))
+    {
+        Length += sizeof(MI_Uint32);
+    }
+
+    while (Length < Limit && InputPos[Length] == Match[Length]) {
+        ++Length;
+    }
+
+    return Length;
+}
+
+#define XPRESS_HASH3(Pos, Bits) \
+    ((((MI_Uint32)(Pos)[0] << 16 | (MI_Uint32)(Pos)[1] << 8 | (Pos)[2]) * 2654435761U) >> (32 - (Bits)))
+
+#define XPRESS_HASH4(Pos, Bits) \
+    ((*((MI_Uint32 UNALIGNED *)(Pos)) * 2654435761U) >> (32 - (Bits)))
+
+//
+// Matches are only looked for while at least this many bytes of input remain,
+// so that hashing never reads past the end of the buffer.
+//
+
+#define CHAIN_MIN_LOOKAHEAD     4
+
+static __inline void
+XpressChainInsert (
+    _In_ PXPRESS_LZ_CHAIN_WORKSPACE Chain,
+    _In_ ULONG_PTR Position,
+    _In_ const MI_Uint8 * InputPos,
+    _In_ ULONG_PTR HashBits
+    )
+{
+    ULONG_PTR Hash = XPRESS_HASH3(InputPos, HashBits);
+
+    Chain->Prev[Position & (HUFF_WINDOW_SIZE - 1)] = Chain->Head[Hash];
+    Chain->Head[Hash] = (MI_Uint32)(Position + 1);
+}
+
+static ULONG_PTR
+XpressChainFindMatch (
+    _In_ PXPRESS_LZ_CHAIN_WORKSPACE Chain,
+    _In_ MI_Uint8 * UncompressedBuffer,
+    _In_ MI_Uint8 * InputPos,
+    _In_ MI_Uint8 * InputBufferEnd,
+    _In_ ULONG_PTR HashBits,
+    _Out_ ULONG_PTR * MatchOffset
+    )
+
+/*++
+
+Routine Description:
+
+    Walks the hash chain for InputPos looking for the longest match within the
+    window, then adds InputPos to the chain.  Earlier candidates are closer, so
+    a later candidate only replaces the best match if it is strictly longer.
+
+Return Value:
+
+    The length of the best match, or zero if there is no usable match.
+
+--*/
+
+{
+    ULONG_PTR Position = InputPos - UncompressedBuffer;
+    ULONG_PTR Limit = InputBufferEnd - InputPos;
+    ULONG_PTR Hash = XPRESS_HASH3(InputPos, HashBits);
+    ULONG_PTR Depth = CHAIN_MAX_DEPTH;
+    ULONG_PTR BestLength = 2;
+    ULONG_PTR Candidate;
+    ULONG_PTR Distance;
+    ULONG_PTR Length;
+    MI_Uint8 * Match;
+
+    Candidate = Chain->Head[Hash];
+    Chain->Prev[Position & (HUFF_WINDOW_SIZE - 1)] = (MI_Uint32)Candidate;
+    Chain->Head[Hash] = (MI_Uint32)(Position + 1);
+
+    *MatchOffset = 0;
+
+    while (Candidate != 0 && Depth-- > 0) {
+
+        //
+        // Positions are stored plus one.  Anything that is not strictly
+        // behind us and within the window ends the chain, which also covers
+        // Prev entries that have since been reused for newer positions.
+        //
+
+        Distance = Position - (Candidate - 1);
+
+        if (Distance == 0 || Distance >= HUFF_WINDOW_SIZE) {
+            break;
+        }
+
+        Match = InputPos - Distance;
+
+        if (Match[BestLength] == InputPos[BestLength]) {
+
+            Length = XpressMatchLength(InputPos, Match, Limit);
+
+            //
+            // Like the default level, skip three-byte long-distance matches;
+            // they cost about as much as the literals.
+            //
+
+            if (Length > BestLength && (Length > 3 || Distance <= (1 << 12))) {
+
+                BestLength = Length;
+                *MatchOffset = Distance;
+
+                if (Length >= CHAIN_NICE_LENGTH || Length >= Limit) {
+                    break;
+                }
+            }
+        }
+
+        Candidate = Chain->Prev[(Candidate - 1) & (HUFF_WINDOW_SIZE - 1)];
+    }
+
+    return (*MatchOffset != 0) ? BestLength : 0;
+}
+
+//
+// State shared by the fast and high level parsers across Huffman blocks.
+//
+
+typedef struct _XPRESS_LZ_PARSE {
+    PXPRESS_LZ_CHAIN_WORKSPACE Chain;
+    MI_Uint8 * UncompressedBuffer;
+    MI_Uint8 * InputBufferEnd;
+    ULONG_PTR HashBits;
+    PXPRESS_CALLBACK_PARAMS CallbackParams;
+
+    //
+    // A match the high level found at the next position while looking ahead,
+    // if it was still pending when the block ended.
+    //
+
+    ULONG_PTR PendingMatchLen;
+    ULONG_PTR PendingMatchOffset;
+} XPRESS_LZ_PARSE, *PXPRESS_LZ_PARSE;
+
+static MI_Uint8 *
+XpressLzParseFast (
+    _In_ PXPRESS_LZ_PARSE Parse,
+    _Inout_ PXPRESS_LZ_PASS OutPass,
+    _In_ MI_Uint8 * InputPos,
+    _In_ MI_Uint8 * HuffBlockEnd
+    )
+
+/*++
+
+Routine Description:
+
+    LZ77 pass over one Huffman block for the fast level.  Each position is
+    checked against the single most recent position with the same four-byte
+    hash, and the longer we go without a match the more positions are skipped
+    over, so incompressible data goes quickly.
+
+Return Value:
+
+    The position to start the next block at.
+
+--*/
+
+{
+    PXPRESS_LZ_CHAIN_WORKSPACE Chain = Parse->Chain;
+    MI_Uint8 * UncompressedBuffer = Parse->UncompressedBuffer;
+    MI_Uint8 * InputBufferEnd = Parse->InputBufferEnd;
+    MI_Uint8 * SafeEnd;
+    MI_Uint8 * ProgressMark;
+    MI_Uint8 * Match;
+    ULONG_PTR HashBits = Parse->HashBits;
+    ULONG_PTR Hash;
+    ULONG_PTR Candidate;
+    ULONG_PTR MatchLen;
+    ULONG_PTR MatchOffset;
+    ULONG_PTR Misses = 0;
+    ULONG_PTR Step;
+    XPRESS_LZ_PASS Pass = *OutPass;
+
+    //
+    // Matches are only looked for while there is room to hash and to add the
+    // positions at the end of the match without bounds checks.
+    //
+
+    SafeEnd = min(HuffBlockEnd, InputBufferEnd - (CHAIN_MIN_LOOKAHEAD + 2));
+
+    if (InputBufferEnd - InputPos < CHAIN_MIN_LOOKAHEAD + 2) {
+        SafeEnd = InputPos;
+    }
+
+    ProgressMark = min(SafeEnd, InputPos + Parse->CallbackParams->ProgressBytes);
+
+    while (InputPos < SafeEnd) {
+
+        Hash = XPRESS_HASH4(InputPos, HashBits);
+        Candidate = Chain->Head[Hash];
+        Chain->Head[Hash] = (MI_Uint32)(InputPos - UncompressedBuffer + 1);
+
+        MatchOffset = (InputPos - UncompressedBuffer) - (Candidate - 1);
+
+        if (Candidate == 0 ||
+            MatchOffset >= HUFF_WINDOW_SIZE ||
+            *((MI_Uint32 UNALIGNED *)InputPos) !=
+            *((MI_Uint32 UNALIGNED *)(InputPos - MatchOffset)))
+        {
+            Step = 1 + (Misses++ >> 5);
+
+            do {
+                XpressLzPassLiteral(&Pass, InputPos[0]);
+                ++InputPos;
+            } while (--Step > 0 && InputPos < SafeEnd);
+
+            continue;
+        }
+
+        Misses = 0;
+        Match = InputPos - MatchOffset;
+
+        MatchLen = sizeof(MI_Uint32) +
+                   XpressMatchLength(InputPos + sizeof(MI_Uint32),
+                                     Match + sizeof(MI_Uint32),
+                                     (InputBufferEnd - InputPos) - sizeof(MI_Uint32));
+
+        XpressLzPassMatch(&Pass, MatchLen, MatchOffset);
+        InputPos += MatchLen;
+
+        //
+        // Add the last positions of the match so that the next repeat of this
+        // data can be found.
+        //
+
+        if (InputBufferEnd - InputPos >= CHAIN_MIN_LOOKAHEAD + 2) {
+            Chain->Head[XPRESS_HASH4(InputPos - 2, HashBits)] =
+                (MI_Uint32)(InputPos - 2 - UncompressedBuffer + 1);
+            Chain->Head[XPRESS_HASH4(InputPos - 1, HashBits)] =
+                (MI_Uint32)(InputPos - 1 - UncompressedBuffer + 1);
+        }
+
+        if (InputPos >= ProgressMark && InputPos < SafeEnd) {
+            ProgressMark = pMakeXpressCallback(Parse->CallbackParams,
+                                                  SafeEnd,
+                                                  InputPos);
+        }
+    }
+
+    //
+    // Whatever is left of the block near the end of the input is literals.
+    //
+
+    while (InputPos < HuffBlockEnd) {
+        XpressLzPassLiteral(&Pass, InputPos[0]);
+        ++InputPos;
+    }
+
+    *OutPass = Pass;
+
+    return InputPos;
+}
+
+static MI_Uint8 *
+XpressLzParseHigh (
+    _In_ PXPRESS_LZ_PARSE Parse,
+    _Inout_ PXPRESS_LZ_PASS OutPass,
+    _In_ MI_Uint8 * InputPos,
+    _In_ MI_Uint8 * HuffBlockEnd
+    )
+
+/*++
+
+Routine Description:
+
+    LZ77 pass over one Huffman block for the high level.  Every position goes
+    into the hash chains.  Before committing to a match, the next position is
+    searched as well, and if it has a longer match a literal is taken instead.
+
+Return Value:
+
+    The position to start the next block at.
+
+--*/
+
+{
+    PXPRESS_LZ_CHAIN_WORKSPACE Chain = Parse->Chain;
+    MI_Uint8 * UncompressedBuffer = Parse->UncompressedBuffer;
+    MI_Uint8 * InputBufferEnd = Parse->InputBufferEnd;
+    MI_Uint8 * ProgressMark;
+    MI_Uint8 * MatchEnd;
+    ULONG_PTR HashBits = Parse->HashBits;
+    ULONG_PTR MatchLen = Parse->PendingMatchLen;
+    ULONG_PTR MatchOffset = Parse->PendingMatchOffset;
+    ULONG_PTR NextMatchLen;
+    ULONG_PTR NextMatchOffset;
+    XPRESS_LZ_PASS Pass = *OutPass;
+
+    ProgressMark = min(HuffBlockEnd, InputPos + Parse->CallbackParams->ProgressBytes);
+
+    while (InputPos < HuffBlockEnd) {
+
+        if (InputPos >= ProgressMark) {
+            ProgressMark = pMakeXpressCallback(Parse->CallbackParams,
+                                                  HuffBlockEnd,
+                                                  InputPos);
+        }
+
+        if (InputBufferEnd - InputPos < CHAIN_MIN_LOOKAHEAD) {
+            XpressLzPassLiteral(&Pass, InputPos[0]);
+            ++InputPos;
+            continue;
+        }
+
+        //
+        // MatchLen is already set if the previous step found a match at this
+        // position while looking ahead.
+        //
+
+        if (MatchLen == 0) {
+
+            MatchLen = XpressChainFindMatch(Chain,
+                                            UncompressedBuffer,
+                                            InputPos,
+                                            InputBufferEnd,
+                                            HashBits,
+                                            &MatchOffset);
+
+            if (MatchLen == 0) {
+                XpressLzPassLiteral(&Pass, InputPos[0]);
+                ++InputPos;
+                continue;
+            }
+        }
+
+        MatchEnd = InputPos + MatchLen;
+
+        if (MatchLen < CHAIN_NICE_LENGTH &&
+            InputBufferEnd - (InputPos + 1) >= CHAIN_MIN_LOOKAHEAD)
+        {
+            NextMatchLen = XpressChainFindMatch(Chain,
+                                                UncompressedBuffer,
+                                                InputPos + 1,
+                                                InputBufferEnd,
+                                                HashBits,
+                                                &NextMatchOffset);
+
+            if (NextMatchLen > MatchLen) {
+                XpressLzPassLiteral(&Pass, InputPos[0]);
+                ++InputPos;
+                MatchLen = NextMatchLen;
+                MatchOffset = NextMatchOffset;
+                continue;
+            }
+
+            //
+            // The position after this one is already in the chains.
+            //
+
+            InputPos += 2;
+
+        } else {
+
+            InputPos += 1;
+        }
+
+        XpressLzPassMatch(&Pass, MatchLen, MatchOffset);
+
+        //
+        // Add the rest of the positions covered by the match to the chains.
+        //
+
+        while (InputPos < MatchEnd &&
+               InputBufferEnd - InputPos >= CHAIN_MIN_LOOKAHEAD)
+        {
+            XpressChainInsert(Chain,
+                              InputPos - UncompressedBuffer,
+                              InputPos,
+                              HashBits);
+            ++InputPos;
+        }
+
+        InputPos = MatchEnd;
+        MatchLen = 0;
+    }
+
+    Parse->PendingMatchLen = MatchLen;
+    Parse->PendingMatchOffset = MatchOffset;
+
+    *OutPass = Pass;
+
+    return InputPos;
+}
+
+MI_Uint32
+CompressBufferXpressHuffLevel (
+    _In_ MI_Uint8 * UncompressedBuffer,
+    _In_ MI_Uint32 UncompressedBufferSize,
+    _Out_ MI_Uint8 * CompressedBuffer,
+    _In_ MI_Uint32 CompressedBufferSize,
+    _Out_ MI_Uint32* FinalCompressedSize,
+    _In_ PXPRESS_HUFF_LEVEL_WORKSPACE Workspace,
+    _In_ MI_Uint32 Level,
+    _In_ PXPRESS_CALLBACK_FUNCTION Callback,
+    _In_ void* CallbackContext,
+    _In_ MI_Uint32 ProgressBytes
+    )
+
+/*++
+
+Routine Description:
+
+    The same as CompressBufferXpressHuffStandard, but with the match finder
+    for the fast or high level.  Block layout, Huffman encoding and output
+    bound checks are the same as for the default level.
+
+Arguments:
+
+    See CompressBufferXpressHuffStandard.
+
+    Level - XPRESS_LEVEL_FAST or XPRESS_LEVEL_HIGH.
+
+Return Value:
+
+    STATUS_SUCCESS - Compression was successful.
+
+    STATUS_BUFFER_TOO_SMALL - The compressed buffer is too small to hold the
+        compressed data.
+
+--*/
+
+{
+    PXPRESS_HUFF_WORKSPACE Huff = &Workspace->Huff;
+    MI_Uint8 * InputBufferEnd;
+    MI_Uint8 * OutputBufferEnd;
+    MI_Uint8 * InputPos;
+    MI_Uint8 * HuffOutputPos;
+    MI_Uint8 * HuffBlockEnd;
+    ULONG_PTR HashBits;
+    ULONG_PTR BlockBitSize;
+    ULONG_PTR BlockByteSize;
+    LOGICAL ReachedEnd;
+    XPRESS_LZ_PASS Pass;
+    XPRESS_LZ_PARSE Parse;
+    XPRESS_CALLBACK_PARAMS CallbackParams;
+
+    InputBufferEnd = UncompressedBuffer + UncompressedBufferSize;
+    OutputBufferEnd = CompressedBuffer + CompressedBufferSize;
+
+    if (CompressedBufferSize < 300) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    //
+    // Size the hash to the input, up to the window size, and clear it.
+    //
+
+    HashBits = CHAIN_HASH_BITS_MIN;
+
+    while (HashBits < CHAIN_HASH_BITS_HIGH &&
+           ((ULONG_PTR)1 << HashBits) < UncompressedBufferSize)
+    {
+        ++HashBits;
+    }
+
+    if (Level == XPRESS_LEVEL_FAST && HashBits > CHAIN_HASH_BITS_FAST) {
+        HashBits = CHAIN_HASH_BITS_FAST;
+    }
+
+    memset(&Workspace->Chain.Head[0], 0, sizeof(Workspace->Chain.Head[0]) << HashBits);
+
+    if (Callback == NULL ||
+        ProgressBytes > UncompressedBufferSize)
+    {
+        ProgressBytes = UncompressedBufferSize;
+    }
+
+    CallbackParams.Callback = Callback;
+    CallbackParams.CallbackContext = CallbackContext;
+    CallbackParams.ProgressBytes = ProgressBytes;
+
+    Parse.Chain = &Workspace->Chain;
+    Parse.UncompressedBuffer = UncompressedBuffer;
+    Parse.InputBufferEnd = InputBufferEnd;
+    Parse.HashBits = HashBits;
+    Parse.CallbackParams = &CallbackParams;
+    Parse.PendingMatchLen = 0;
+    Parse.PendingMatchOffset = 0;
+
+    Pass.Frequencies = &Huff->Huffman.Frequencies[0];
+    Pass.LiteralFrequencies = &Huff->Huffman.LiteralFrequencies[0];
+
+    InputPos = UncompressedBuffer;
+    HuffOutputPos = CompressedBuffer;
+
+    for (;;) {
+
+        //
+        // LZ77 pass over the next Huffman block, see
+        // CompressBufferXpressHuffStandard for the format.
+        //
+
+        Pass.OffsetBits = 0;
+        Pass.NonHuffmanBytes = 0;
+
+        memset(Pass.Frequencies, 0, sizeof(Huff->Huffman.Frequencies));
+        memset(Pass.LiteralFrequencies, 0, sizeof(Huff->Huffman.LiteralFrequencies));
+
+        Pass.OutputPos = &Huff->LzPass[0];
+        Pass.RunningTags = 1;
+        Pass.TagsOut = (MI_Uint32 UNALIGNED *)Pass.OutputPos;
+        Pass.OutputPos += sizeof(MI_Uint32);
+
+        HuffBlockEnd = InputPos + HUFFMAN_BLOCK_SIZE;
+
+        if (HuffBlockEnd > InputBufferEnd) {
+            HuffBlockEnd = InputBufferEnd;
+        }
+
+        if (Level == XPRESS_LEVEL_FAST) {
+            InputPos = XpressLzParseFast(&Parse, &Pass, InputPos, HuffBlockEnd);
+        } else {
+            InputPos = XpressLzParseHigh(&Parse, &Pass, InputPos, HuffBlockEnd);
+        }
+
+        while ((INT)Pass.RunningTags > 0) {
+            Pass.RunningTags = Pass.RunningTags * 2 + 1;
+        }
+
+        Pass.RunningTags = Pass.RunningTags * 2 + 1;
+
+        *Pass.TagsOut = Pass.RunningTags;
+
+        if (InputPos >= InputBufferEnd) {
+
+            ReachedEnd = MI_TRUE;
+            ++Pass.Frequencies[256];
+
+        } else {
+
+            ReachedEnd = MI_FALSE;
+        }
+
+        BlockBitSize = XpressBuildHuffmanEncodings(&Huff->Huffman);
+
+        BlockBitSize += Pass.OffsetBits;
+
+        BlockByteSize = (BlockBitSize + 31) / 32 * 4 + Pass.NonHuffmanBytes + 2
+                        + sizeof(Huff->Huffman.CompactBitLengths);
+
+        if (HuffOutputPos + BlockByteSize >= OutputBufferEnd) {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        HuffOutputPos = XpressDoHuffmanPass(&Huff->Huffman,
+                                            &Huff->LzPass[0],
+                                            Pass.OutputPos,
+                                            HuffOutputPos,
+                                            ReachedEnd);
+
+        if (ReachedEnd) {
+            break;
+        }
+    }
+
+    assert(HuffOutputPos <= OutputBufferEnd);
+
+    *FinalCompressedSize = (MI_Uint32)(HuffOutputPos - CompressedBuffer);
+
+    return STATUS_SUCCESS;
+}
+
+MI_Uint32
+XpressBuildHuffmanDecodingTable (
+    _Out_ PXPRESS_HUFF_DECODE_WORKSPACE Workspace,
+    _In_ MI_Uint8 * BitLengths
+    )
+
+/*++
+
+Routine Description:
+
+    Takes symbol bit lengths, and computes canonical Huffman codes in a format
+    convenient for efficient decoding.
+
+Arguments:
+
+    Workspace - The decoding table, tree, and misc extra space.
+
+    BitLengths - The CompactBitLengths array produced by
+                 XpressBuildHuffmanEncodings.
+
+Return Value:
+
+    STATUS_BAD_COMPRESSION_BUFFER - The Huffman table is not valid.
+
+--*/
+
+{
+    ULONG_PTR i;
+    ULONG_PTR j;
+    ULONG_PTR k;
+    ULONG_PTR BitLen;
+    ULONG_PTR Code;
+    ULONG_PTR TableLo;
+    ULONG_PTR NextTreeNode;
+    SHORT PrevLevelPointer;
+    SHORT PrevLevelEnd;
+    SHORT DecodeValue = 0;
+    LOGICAL FilledTable;
+
+    //
+    // This function builds a hybrid table/tree structure for canonical Huffman
+    // decoding.  The idea is to use the table to decode short (frequent)
+    // symbols, and to use the more-space-efficient tree to decode long symbols.
+    //
+    // Each 16-bit entry in the table/tree follows this protocol:
+    //   If the high bit is zero, the table/tree value is
+    //   (decoded symbol) * 16 + (symbol bit length)
+    //   If the high bit is one, the table/tree value is
+    //   -(index of tree node to decode remaining bits)
+    //
+    // The code for constructing the table/tree is somewhat hard to understand
+    // because it's very fast.
+    //
+
+    //
+    // First, initialize our lists.
+    //
+
+    for (i = 0; i <= MAX_ENCODING_LENGTH; ++i) {
+        Workspace->LengthSortedListHead[i] = HUFFMAN_ALPHABET_SIZE;
+    }
+
+    //
+    // We want to bucketize the symbols according to bit length (between 1 and
+    // 15) in lists that are sorted by symbol value in reverse order.
+    //
+
+    for (i = 0; i < HUFFMAN_ALPHABET_SIZE / 2; ++i) {
+
+        BitLen = BitLengths[i] & 15;
+
+        if (BitLen) {
+
+            //
+            // Insert this symbol into the appropriate single-linked list.  The
+            // symbol value is 2 * i.
+            //
+
+            Workspace->LengthSortedListNext[2 * i] =
+                Workspace->LengthSortedListHead[BitLen];
+            Workspace->LengthSortedListHead[BitLen] = (USHORT)(2 * i);
+        }
+
+        BitLen = BitLengths[i] >> 4;
+
+        if (BitLen) {
+
+            //
+            // The symbol value is now 2 * i + 1.  Note that we do larger symbol
+            // second so that they will be properly sorted if they have the same
+            // bit length.
+            //
+
+            Workspace->LengthSortedListNext[2 * i + 1] =
+                Workspace->LengthSortedListHead[BitLen];
+            Workspace->LengthSortedListHead[BitLen] = (USHORT)(2 * i + 1);
+        }
+    }
+
+    //
+    // Next we're going to build the tree.  We do this from the bottom up.
+    // Here's an example of how the algorithm works: suppose we have 20 symbols
+    // with a bit length of 15.  First, create the leaf nodes for each of these
+    // 20 symbols.  Then, move to the length-14 case.  Create 10 non-leaf nodes
+    // whose children are the 20 initial leaf nodes (in order).  Create (let's
+    // say 30) leaf nodes for the length-14 symbols.  Create 20 ([30 + 10] / 2)
+    // non-leaf nodes linking to the existing 40 nodes.  And so on, for each bit
+    // length down to 13.  Then, create entries in the decoding *table* (not
+    // tree) linking to all the remaining top-level nodes in the tree.
+    //
+    // The number of nodes in the tree cannot exceed 2 * HUFFMAN_ALPHABET_SIZE.
+    //
+
+    NextTreeNode = HUFFMAN_ALPHABET_SIZE * 2;
+    PrevLevelEnd = -HUFFMAN_ALPHABET_SIZE * 2;
+    PrevLevelPointer = -HUFFMAN_ALPHABET_SIZE * 2 + 1;
+
+    for (i = MAX_ENCODING_LENGTH; i > HUFFMAN_DECODE_LENGTH; --i) {
+
+        //
+        // Create non-leaf nodes linking to every other existing node.  Note
+        // that a node's children are -DecodeTree[node] and -DecodeTree[node]+1.
+        // So we only specify the '0' child, and the '1' child is implied.
+        //
+
+        while (PrevLevelPointer < PrevLevelEnd) {
 
             //
             // Note that PrevLevelPointer and PrevLevelEnd are negative values.
@@ -2010,7 +2833,7 @@ Return Value:
     // half the number of top-level nodes in the tree.
     //
     // Note that we don't have to worry about the Code < 0 case, because that
-    // would imply that there were 2^10 symbols with a length of 11 or more, and
+    // would imply that there were 2^12 symbols with a length of 13 or more, and
     // since the total number of symbols is 2^9, this cannot happen.
     //
 
@@ -2079,6 +2902,24 @@ Return Value:
             TableLo = Code << (HUFFMAN_DECODE_LENGTH - i);
 
             switch (HUFFMAN_DECODE_LENGTH - i) {
+            case 11:
+                for (k = 0; k < (1 << 11); k += 4) {
+                    Workspace->DecodeTable[TableLo] = DecodeValue;
+                    Workspace->DecodeTable[TableLo+1] = DecodeValue;
+                    Workspace->DecodeTable[TableLo+2] = DecodeValue;
+                    Workspace->DecodeTable[TableLo+3] = DecodeValue;
+                    TableLo += 4;
+                }
+                break;
+            case 10:
+                for (k = 0; k < (1 << 10); k += 4) {
+                    Workspace->DecodeTable[TableLo] = DecodeValue;
+                    Workspace->DecodeTable[TableLo+1] = DecodeValue;
+                    Workspace->DecodeTable[TableLo+2] = DecodeValue;
+                    Workspace->DecodeTable[TableLo+3] = DecodeValue;
+                    TableLo += 4;
+                }
+                break;
             case 9:
                 for (k = 0; k < (1 << 9); k += 4) {
                     Workspace->DecodeTable[TableLo] = DecodeValue;
@@ -2165,6 +3006,17 @@ Return Value:
             --Code;
         }
 
+        //
+        // An odd number of codes at this length leaves half a code over at the
+        // next shorter length.  The tree rejects that for the long lengths, so
+        // reject it here too for lengths above 10.  That way the tables we
+        // accept do not depend on how wide the decoding table is.
+        //
+
+        if (i > 10 && (Code & 1) == 0) {
+            return STATUS_BAD_COMPRESSION_BUFFER;
+        }
+
         //
         // We're going from the longest bit length to the shortest, so we need
         // to half the canonical code.
@@ -2222,6 +3074,101 @@ Return Value:
 }
 
 
+static void
+XpressBuildHuffmanMultiSymbolTable (
+    _Inout_ PXPRESS_HUFF_DECODE_WORKSPACE Workspace
+    )
+
+/*++
+
+Routine Description:
+
+    Builds DecodeTableMulti from a DecodeTable filled in by
+    XpressBuildHuffmanDecodingTable.  When the table index starts with a
+    literal whose code is followed, within the same index, by the whole code of
+    a second literal, the entry decodes both at once.  Every other entry is
+    copied from DecodeTable unchanged.
+
+Arguments:
+
+    Workspace - The decoding workspace holding a valid DecodeTable.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+    ULONG_PTR i;
+    ULONG_PTR BitLength;
+    SHORT DecodeValue;
+    SHORT NextValue;
+    MI_Uint32 Entry;
+
+    for (i = 0; i < (1 << HUFFMAN_DECODE_LENGTH); ++i) {
+
+        DecodeValue = Workspace->DecodeTable[i];
+        Entry = (USHORT)DecodeValue;
+
+        if (DecodeValue > 0 && DecodeValue < 256 * 16) {
+
+            //
+            // The bits after the first literal are followed by zeros in the
+            // shifted index, so the second code is only known if it fits in
+            // the bits that remain.
+            //
+
+            BitLength = DecodeValue & 15;
+            NextValue = Workspace->DecodeTable[
+                (i << BitLength) & ((1 << HUFFMAN_DECODE_LENGTH) - 1)];
+
+            if (NextValue > 0 && NextValue < 256 * 16 &&
+                BitLength + (NextValue & 15) <= HUFFMAN_DECODE_LENGTH)
+            {
+                Entry = (MI_Uint32)(DecodeValue >> 4) |
+                        ((MI_Uint32)(NextValue >> 4) << 8) |
+                        ((MI_Uint32)(BitLength + (NextValue & 15))
+                            << DECODE_MULTI_LENGTH_SHIFT) |
+                        DECODE_MULTI_TWO_LITERALS;
+            }
+        }
+
+        Workspace->DecodeTableMulti[i] = Entry;
+    }
+}
+
+//
+// For a match whose offset is under 8, the decoder copies four bytes one at a
+// time, then four more at once from MatchSrc + XpressOverlapCopyAdvance[offset].
+// That is a whole number of offsets behind the bytes being written.
+// Subtracting XpressOverlapCopyRewind[offset] afterwards leaves MatchSrc a
+// whole number of offsets, and at least 8 bytes, behind the next output byte.
+//
+
+static const MI_Uint8 XpressOverlapCopyAdvance[8] = {0, 1, 2, 1, 0, 4, 4, 4};
+static const signed char XpressOverlapCopyRewind[8] = {0, 0, 0, -1, -4, 1, 2, 3};
+
+//
+// Refills the bit buffer with the next USHORT of the stream when fewer than 16
+// bits are left, without branching.  The word is read either way, so two input
+// bytes must be available.  Words are taken at exactly the points the checked
+// refill takes them, which matters because raw match length bytes are
+// interleaved with them in the stream.
+//
+
+#define XPRESS_REFILL_BRANCHLESS(NextBits, CurrentShift, InputPos)              \
+    {                                                                           \
+        ULONG_PTR Refill_ = (ULONG_PTR)((CurrentShift) < 0);                    \
+        MI_Uint64 Word_ = *((USHORT UNALIGNED *)(InputPos));                    \
+                                                                                \
+        (NextBits) += (Word_ << (32 - (CurrentShift))) &                        \
+                      ((MI_Uint64)0 - Refill_);                                 \
+        (InputPos) += Refill_ * sizeof(USHORT);                                 \
+        (CurrentShift) += Refill_ * 16;                                         \
+    }
+
+
 
 MI_Uint32
 DecompressBufferProgress (
@@ -2294,16 +3241,19 @@ Return Value:
     MI_Uint32 Status;
     PXPRESS_HUFF_DECODE_WORKSPACE Workspace;
     LONG_PTR CurrentShift;
-    MI_Uint32 NextBits;
+    MI_Uint64 NextBits;
     MI_Uint8 * InputPos;
     MI_Uint8 * OutputPos;
     MI_Uint8 * InputEnd;
+    MI_Uint8 * SafeInputEnd;
     MI_Uint8 * OutputEnd;
     MI_Uint8 * MatchSrc;
+    MI_Uint8 * MatchEnd;
     MI_Uint8 * HuffBlockEnd;
     MI_Uint8 * SafeHuffBlockEnd;
     MI_Uint8 * ProgressOutputMark;
     ULONG_PTR TableIndex;
+    MI_Uint32 TableEntry;
     SHORT DecodeValue;
     ULONG_PTR OffsetBitLength;
     ULONG_PTR MatchLen;
@@ -2383,12 +3333,18 @@ Return Value:
             return STATUS_BAD_COMPRESSION_BUFFER;
         }
 
+        XpressBuildHuffmanMultiSymbolTable(Workspace);
+
+        //
+        // The bit buffer is 64 bits wide with the unread bits at the top.
+        // CurrentShift is the number of unread bits minus 16.
+        //
+
         CurrentShift = 16;
         InputPos += HUFFMAN_ALPHABET_SIZE / 2;
-        NextBits = *((USHORT UNALIGNED *)InputPos);
+        NextBits = ((MI_Uint64)*((USHORT UNALIGNED *)InputPos)) << 48;
         InputPos += sizeof(USHORT);
-        NextBits <<= 16;
-        NextBits += *((USHORT UNALIGNED *)InputPos);
+        NextBits += ((MI_Uint64)*((USHORT UNALIGNED *)InputPos)) << 32;
         InputPos += sizeof(USHORT);
 
         //
@@ -2405,11 +3361,14 @@ Return Value:
         }
 
         //
-        // 11 * 17 comes from (11 bytes copied per match without bounds
-        // checking) * (16 one-bit symbols per USHORT between bound checks).
+        // The fast loop checks this bound before each table lookup, and a
+        // lookup writes at most 8 bytes (the start of a match) before the next
+        // check.  The rest of a match is only copied without checks when its
+        // 16-byte copies end before this bound, otherwise the bound is tested
+        // again every 16 bytes.
         //
 
-        SafeHuffBlockEnd = HuffBlockEnd - 11 * 17 - 1;
+        SafeHuffBlockEnd = HuffBlockEnd - 16 - 1;
 
         if (OutputPos >= SafeHuffBlockEnd) {
             goto SafeDecode;
@@ -2417,22 +3376,75 @@ Return Value:
 
         ProgressOutputMark = min(SafeHuffBlockEnd, OutputPos + ProgressBytes);
 
+        //
+        // There were at least HUFFMAN_ALPHABET_SIZE / 2 + 4 bytes left at the
+        // start of this block, so this does not point before the input.
+        //
+
+        SafeInputEnd = InputEnd - DECODE_INPUT_MARGIN;
+
         for (;;) {
 
             for (;;) {
 
+                if (OutputPos >= ProgressOutputMark) {
+
+                    if (OutputPos >= SafeHuffBlockEnd) {
+                        goto SafeDecode;
+                    }
+
+                    ProgressOutputMark = pMakeXpressCallback(&CallbackParams,
+                                                             SafeHuffBlockEnd,
+                                                             OutputPos);
+                }
+
                 //
-                // Get the next 10 bits and look up their table entry.
+                // Near the end of the input fall back to the checked loop.  The
+                // state is the same at the top of both loops.
                 //
 
-                TableIndex = NextBits >> (32 - HUFFMAN_DECODE_LENGTH);
+                if (InputPos >= SafeInputEnd) {
+                    goto SafeDecode;
+                }
 
-                DecodeValue = Workspace->DecodeTable[TableIndex];
+#if defined(_ARM_) || defined(_ARM64_)
+                __prefetch(InputPos + 12);
+#endif
+
+                //
+                // Get the next 12 bits and look up their table entry.
+                //
+
+                TableEntry = Workspace->DecodeTableMulti[
+                                NextBits >> (64 - HUFFMAN_DECODE_LENGTH)];
+
+                if (TableEntry & DECODE_MULTI_TWO_LITERALS) {
+
+                    //
+                    // Two literals whose codes fit in the 12 bits.  Together
+                    // they use no more than 12 bits, so at most one refill is
+                    // needed, as there would be when decoding them one by one.
+                    //
+
+                    OutputPos[0] = (MI_Uint8)TableEntry;
+                    OutputPos[1] = (MI_Uint8)(TableEntry >> 8);
+                    OutputPos += 2;
+
+                    DecodedBitCount = (TableEntry >> DECODE_MULTI_LENGTH_SHIFT) & 15;
+
+                    NextBits <<= DecodedBitCount;
+                    CurrentShift -= DecodedBitCount;
+
+                    XPRESS_REFILL_BRANCHLESS(NextBits, CurrentShift, InputPos);
+                    continue;
+                }
+
+                DecodeValue = (SHORT)TableEntry;
 
                 if (DecodeValue <= 0) {
 
                     //
-                    // This means the symbol is longer than 10 bits.  Decode the
+                    // This means the symbol is longer than 12 bits.  Decode the
                     // remainder using the tree.
                     //
 
@@ -2451,7 +3463,7 @@ Return Value:
                         // But this is an unpredictable (hence, slow) branch.
                         //
 
-                        DecodeValue += (NextBits >> 31);
+                        DecodeValue += (SHORT)(NextBits >> 63);
 
                         NextBits *= 2;
                         --CurrentShift;
@@ -2488,55 +3500,15 @@ Return Value:
 
                 DecodeValue -= 256;
 
-                if (CurrentShift < 0) {
-
-                    //
-                    // Get the next 16 bits from the data stream.
-                    //
-
-                    if (OutputPos >= ProgressOutputMark) {
-
-                        if (OutputPos >= SafeHuffBlockEnd) {
-                            goto SafeDecodeEntry1;
-                        }
-
-                        ProgressOutputMark = pMakeXpressCallback(&CallbackParams,
-                                                                    SafeHuffBlockEnd,
-                                                                    OutputPos);
-                    }
-
-                    if (InputPos + 1 >= InputEnd) {
-                        return STATUS_BAD_COMPRESSION_BUFFER;
-                    }
-
-#if defined(_ARM_) || defined(_ARM64_)
-                    __prefetch(InputPos + 12);
-#endif
-
-                    NextBits += ((MI_Uint32)(*((USHORT UNALIGNED *)InputPos)))
-                                << (-CurrentShift);
-                    InputPos += sizeof(USHORT);
-                    CurrentShift += 16;
-                }
+                XPRESS_REFILL_BRANCHLESS(NextBits, CurrentShift, InputPos);
 
                 if (DecodeValue >= 0) {
 
                     //
-                    // This is a match.
+                    // This is a match.  It cannot be the EOF symbol because
+                    // OutputPos is short of the end of the output.
                     //
 
-                    if (DecodeValue == 0) {
-
-                        //
-                        // This could be the EOF if (OutputPos == OutputEnd).
-                        // It could also be a match of length 3 and offset 1.
-                        //
-
-                        if (InputPos >= InputEnd && OutputPos == OutputEnd) {
-                            goto DecodeDone;
-                        }
-                    }
-
                     break;
                 }
 
@@ -2550,7 +3522,9 @@ Return Value:
             }
 
             //
-            // Extract the match length and the offset bit length.
+            // Extract the match length and the offset bit length.  The input
+            // margin covers the raw length bytes, but they are still checked
+            // as in the safe loop.
             //
 
             OffsetBitLength = DecodeValue / LEN_MULT;
@@ -2604,34 +3578,17 @@ Return Value:
             MatchLen += 3;
 
             //
-            // Be careful about the OffsetBitLength == 0 case.  Shifting by 32
+            // Be careful about the OffsetBitLength == 0 case.  Shifting by 64
             // does nothing, while one might expect it to zero-out the value.
             //
 
-            MatchOffset = (NextBits >> (31 - OffsetBitLength)) >> 1;
+            MatchOffset = (ULONG_PTR)((NextBits >> (63 - OffsetBitLength)) >> 1);
             MatchOffset += (((ULONG_PTR)1) << OffsetBitLength);
 
             NextBits <<= OffsetBitLength;
             CurrentShift -= OffsetBitLength;
 
-            if (CurrentShift < 0) {
-
-                if (OutputPos >= SafeHuffBlockEnd) {
-                    goto SafeDecodeEntry2;
-                }
-                if (InputPos + 1 >= InputEnd) {
-                    return STATUS_BAD_COMPRESSION_BUFFER;
-                }
-
-#if defined(_ARM_) || defined(_ARM64_)
-                __prefetch(InputPos + 12);
-#endif
-
-                NextBits += ((MI_Uint32)(*((USHORT UNALIGNED *)InputPos)))
-                            << (-CurrentShift);
-                InputPos += sizeof(USHORT);
-                CurrentShift += 16;
-            }
+            XPRESS_REFILL_BRANCHLESS(NextBits, CurrentShift, InputPos);
 
             MatchSrc = OutputPos - MatchOffset;
 
@@ -2639,116 +3596,128 @@ Return Value:
                 return STATUS_BAD_COMPRESSION_BUFFER;
             }
 
-            if (MatchOffset < 4) {
+            //
+            // Copy the first eight bytes of the match.  The safe output bound
+            // lets us do this without checking for the end of the output
+            // buffer, even when the match is shorter.
+            //
+
+            if (MatchOffset < 8) {
 
                 //
-                // When the offset is less than four, copying four bytes at once
-                // doesn't do what we want.  Fix this by copying the first part
-                // of the match, then fall through to the normal case.
+                // The match overlaps the bytes it produces.  Copy four bytes
+                // one at a time, then move MatchSrc back by a multiple of the
+                // offset so the next four can be copied at once.  Afterwards
+                // MatchSrc is at least eight bytes behind and the pattern
+                // repeats from there, so the rest can be copied eight bytes at
+                // a time.
                 //
 
-                switch (MatchOffset) {
+                OutputPos[0] = MatchSrc[0];
+                OutputPos[1] = MatchSrc[1];
+                OutputPos[2] = MatchSrc[2];
+                OutputPos[3] = MatchSrc[3];
 
-                case 1:
-                    OutputPos[0] = MatchSrc[0];
-                    OutputPos[1] = MatchSrc[0];
-                    OutputPos[2] = MatchSrc[0];
-                    MatchLen -= 3;
-                    OutputPos += 3;
-                    break;
-                case 2:
-                    OutputPos[0] = MatchSrc[0];
-                    OutputPos[1] = MatchSrc[1];
-                    MatchLen -= 2;
-                    OutputPos += 2;
-                    break;
-                case 3:
-                    OutputPos[0] = MatchSrc[0];
-                    OutputPos[1] = MatchSrc[1];
-                    OutputPos[2] = MatchSrc[2];
-                    OutputPos += 3;
-                    MatchLen -= 3;
-                    break;
-                default:
-                    __assume(0);
-                }
+                MatchSrc += XpressOverlapCopyAdvance[MatchOffset];
 
-                if (MatchLen == 0) {
-                    continue;
-                }
+                *((MI_Uint32 UNALIGNED *)(OutputPos+4)) = *((MI_Uint32 UNALIGNED *)MatchSrc);
+
+                MatchSrc -= XpressOverlapCopyRewind[MatchOffset];
+
+            } else {
+
+                *((MI_Uint64 UNALIGNED *)OutputPos) = *((MI_Uint64 UNALIGNED *)MatchSrc);
+                MatchSrc += 8;
             }
 
-            for (;;) {
+            if (MatchLen <= 8) {
+                OutputPos += MatchLen;
+                continue;
+            }
+
+            OutputPos += 8;
+            MatchLen -= 8;
+
+            if (OutputPos < ProgressOutputMark &&
+                MatchLen < (ULONG_PTR)(ProgressOutputMark - OutputPos))
+            {
 
                 //
-                // Copy eight bytes then see if that was enough.  Note that the
-                // safe output bound lets us copy short matches without checking
-                // for the end of the output buffer.
+                // The match, and the up to 15 bytes the last copy writes past
+                // it, end before the safe bound, so copy 16 bytes at a time
+                // without testing it.  Each 8-byte copy reads what the previous
+                // one wrote when the offset is under 16.
                 //
 
-                *((MI_Uint32 UNALIGNED *)OutputPos) = *((MI_Uint32 UNALIGNED *)MatchSrc);
-                *((MI_Uint32 UNALIGNED *)(OutputPos+4)) = *((MI_Uint32 UNALIGNED *)(MatchSrc+4));
+                MatchEnd = OutputPos + MatchLen;
 
-                if (MatchLen < 9) {
-                    OutputPos += MatchLen;
-                    break;
-                }
+                do {
 
-                OutputPos += 8;
-                MatchSrc += 8;
-                MatchLen -= 8;
+                    *((MI_Uint64 UNALIGNED *)OutputPos) = *((MI_Uint64 UNALIGNED *)MatchSrc);
+                    *((MI_Uint64 UNALIGNED *)(OutputPos+8)) = *((MI_Uint64 UNALIGNED *)(MatchSrc+8));
 
-                for (;;) {
+                    OutputPos += 16;
+                    MatchSrc += 16;
 
-                    //
-                    // Now we must test the safe bound.
-                    //
+                } while (OutputPos < MatchEnd);
+
+                OutputPos = MatchEnd;
+                continue;
+            }
+
+            for (;;) {
+
+                //
+                // Now we must test the safe bound.
+                //
 
-                    if (OutputPos >= ProgressOutputMark) {
+                if (OutputPos >= ProgressOutputMark) {
 
-                        if (OutputPos >= SafeHuffBlockEnd) {
+                    if (OutputPos >= SafeHuffBlockEnd) {
 
-                            if (OutputPos + MatchLen > OutputEnd) {
-                                return STATUS_BAD_COMPRESSION_BUFFER;
-                            }
+                        if (OutputPos + MatchLen > OutputEnd) {
+                            return STATUS_BAD_COMPRESSION_BUFFER;
+                        }
 
-                            memcpy(OutputPos, MatchSrc, MatchLen);
-                            OutputPos += MatchLen;
+                        //
+                        // The match can overlap the bytes it produces so
+                        // it must be copied forwards a byte at a time.
+                        //
 
-                            goto SafeDecode;
+                        while (MatchLen != 0) {
+                            *OutputPos++ = *MatchSrc++;
+                            --MatchLen;
                         }
 
-                        ProgressOutputMark = pMakeXpressCallback(&CallbackParams,
-                                                                    SafeHuffBlockEnd,
-                                                                    OutputPos);
+                        goto SafeDecode;
                     }
 
+                    ProgressOutputMark = pMakeXpressCallback(&CallbackParams,
+                                                             SafeHuffBlockEnd,
+                                                             OutputPos);
+                }
+
 #if defined(_ARM_) || defined(_ARM64_)
-                    if (MatchLen > 32) {
-                        __prefetch(MatchSrc + 32);
-                    }
+                if (MatchLen > 32) {
+                    __prefetch(MatchSrc + 32);
+                }
 #endif
-                    //
-                    // Copy 16 bytes at a time so we can process long matches
-                    // quickly.
-                    //
-
-                    *((MI_Uint32 UNALIGNED *)OutputPos) = *((MI_Uint32 UNALIGNED *)MatchSrc);
-                    *((MI_Uint32 UNALIGNED *)(OutputPos+4)) = *((MI_Uint32 UNALIGNED *)(MatchSrc+4));
-                    *((MI_Uint32 UNALIGNED *)(OutputPos+8)) = *((MI_Uint32 UNALIGNED *)(MatchSrc+8));
-                    *((MI_Uint32 UNALIGNED *)(OutputPos+12)) = *((MI_Uint32 UNALIGNED *)(MatchSrc+12));
+                //
+                // Copy 16 bytes at a time so we can process long matches
+                // quickly.
+                //
 
-                    if (MatchLen < 17) {
-                        OutputPos += MatchLen;
-                        break;
-                    }
+                *((MI_Uint64 UNALIGNED *)OutputPos) = *((MI_Uint64 UNALIGNED *)MatchSrc);
+                *((MI_Uint64 UNALIGNED *)(OutputPos+8)) = *((MI_Uint64 UNALIGNED *)(MatchSrc+8));
 
-                    OutputPos += 16;
-                    MatchSrc += 16;
-                    MatchLen -= 16;
+                if (MatchLen < 17) {
+                    OutputPos += MatchLen;
+                    break;
                 }
 
-                break;
+                OutputPos += 16;
+                MatchSrc += 16;
+                MatchLen -= 16;
             }
         }
 
@@ -2766,7 +3735,7 @@ Return Value:
                     goto HuffmanBlockDone;
                 }
 
-                TableIndex = NextBits >> (32 - HUFFMAN_DECODE_LENGTH);
+                TableIndex = (ULONG_PTR)(NextBits >> (64 - HUFFMAN_DECODE_LENGTH));
 
                 DecodeValue = Workspace->DecodeTable[TableIndex];
 
@@ -2779,7 +3748,7 @@ Return Value:
 
                         assert(DecodeValue != 0);
 
-                        DecodeValue = -DecodeValue + (NextBits >> 31);
+                        DecodeValue = -DecodeValue + (SHORT)(NextBits >> 63);
 
                         NextBits *= 2;
                         --CurrentShift;
@@ -2800,12 +3769,11 @@ Return Value:
                 DecodeValue -= 256;
 
                 if (CurrentShift < 0) {
-                SafeDecodeEntry1:
                     if (InputPos + 1 >= InputEnd) {
                         return STATUS_BAD_COMPRESSION_BUFFER;
                     }
-                    NextBits += ((MI_Uint32)(*((USHORT UNALIGNED *)InputPos)))
-                                << (-CurrentShift);
+                    NextBits += ((MI_Uint64)(*((USHORT UNALIGNED *)InputPos)))
+                                << (32 - CurrentShift);
                     InputPos += sizeof(USHORT);
                     CurrentShift += 16;
                 }
@@ -2870,19 +3838,18 @@ Return Value:
 
             MatchLen += 3;
 
-            MatchOffset = (NextBits >> (31 - OffsetBitLength)) >> 1;
+            MatchOffset = (ULONG_PTR)((NextBits >> (63 - OffsetBitLength)) >> 1);
             MatchOffset += (((ULONG_PTR)1) << OffsetBitLength);
 
             NextBits <<= OffsetBitLength;
             CurrentShift -= OffsetBitLength;
 
             if (CurrentShift < 0) {
-            SafeDecodeEntry2:
                 if (InputPos + 1 >= InputEnd) {
                     return STATUS_BAD_COMPRESSION_BUFFER;
                 }
-                NextBits += ((MI_Uint32)(*((USHORT UNALIGNED *)InputPos)))
-                            << (-CurrentShift);
+                NextBits += ((MI_Uint64)(*((USHORT UNALIGNED *)InputPos)))
+                            << (32 - CurrentShift);
                 InputPos += sizeof(USHORT);
                 CurrentShift += 16;
             }
@@ -2898,12 +3865,14 @@ Return Value:
             }
 
             //
-            // The movsb instruction seems to be an efficient way to copy in a
-            // precise boundary-aware way.
+            // Copy forwards a byte at a time, as movsb does, since the match
+            // can overlap the bytes it produces.  memcpy does not allow that.
             //
 
-            memcpy(OutputPos, MatchSrc, MatchLen);
-            OutputPos += MatchLen;
+            while (MatchLen != 0) {
+                *OutputPos++ = *MatchSrc++;
+                --MatchLen;
+            }
         }
     }
 
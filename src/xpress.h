@@ -30,6 +30,19 @@ typedef MI_Sint32 BOOL;
 #define STATUS_BUFFER_TOO_SMALL          ((MI_Uint32)0xC0000023L)
 #define STATUS_INVALID_USER_BUFFER       ((MI_Uint32)0xC00000E8L)
 #define STATUS_BAD_COMPRESSION_BUFFER    ((MI_Uint32)0xC0000242L)
+#define STATUS_INVALID_PARAMETER         ((MI_Uint32)0xC000000DL)
+
+/* Compression levels. Every level produces the same format so the receiver does not
+ * need to know which one was used.
+ *   XPRESS_LEVEL_DEFAULT - the original single-slot hash table match finder.
+ *   XPRESS_LEVEL_FAST    - greedy matching with one candidate per position, for
+ *                          latency sensitive interactive sessions.
+ *   XPRESS_LEVEL_HIGH    - hash chains with lazy matching, for slow links where
+ *                          ratio matters more than CPU.
+ */
+#define XPRESS_LEVEL_DEFAULT    0
+#define XPRESS_LEVEL_FAST       1
+#define XPRESS_LEVEL_HIGH       2
 
 
 typedef
@@ -48,6 +61,7 @@ CompressBufferProgress (
     _In_ MI_Uint32 CompressedBufferSize,
     _Out_ MI_Uint32* FinalCompressedSize,
     _In_ void * WorkSpace,
+    _In_ MI_Uint32 Level,
     _In_ PXPRESS_CALLBACK_FUNCTION Callback,
     _In_ void * CallbackContext,
     _In_ MI_Uint32 ProgressBytes
@@ -72,4 +86,11 @@ CompressWorkSpaceSizeXpressHuff (
     _Out_ MI_Uint32* DecompressBufferWorkSpaceSize
     );
 
+MI_Uint32
+CompressWorkSpaceSizeXpressHuffLevel (
+    _In_ MI_Uint32 Level,
+    _Out_ MI_Uint32* CompressBufferWorkSpaceSize,
+    _Out_ MI_Uint32* DecompressBufferWorkSpaceSize
+    );
+
 #endif